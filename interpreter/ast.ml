@@ -2,11 +2,46 @@
 
 open Types
 
+(* Frame layout the Resolver assigns to a function or lambda body *)
+type frame_layout = {
+  slot_names : string array;             (* slot index -> variable name *)
+  slot_index : (string, int) Hashtbl.t;  (* variable name -> slot index *)
+}
+
+(* Two-argument arithmetic / comparison builtins the Resolver inlines *)
+type arith_op =
+  | OpAdd | OpSub | OpMul | OpDiv | OpMod
+  | OpLt | OpLe | OpGt | OpGe | OpEq | OpNe
+
+(* Operands of an IntArith: frame slots and literals combined by add /
+   sub / mul / div / mod, evaluated on native ints *)
+type int_expr =
+  | IConst of int
+  | ISlot of int
+  | IOp of arith_op * int_expr * int_expr
+
+(* A fmt placeholder's format spec, parsed once by the Resolver:
+   [fill][align][0][width][.precision][type]. ' ' marks an absent align
+   or type, -1 an absent precision. *)
+type fmt_spec = {
+  fill : char;
+  align : char;
+  width : int;
+  precision : int;
+  ty : char;
+}
+
+(* A fmt template split into literal text and placeholders *)
+type fmt_piece =
+  | FmtText of string
+  | FmtNext of fmt_spec option  (* {} {:spec} %s ...: the next positional arg *)
+  | FmtName of string * fmt_spec option  (* {name} {name:spec}: a variable *)
+
 (* Expressions *)
 type expr =
   | LitInt of int64
   | LitFloat of float
-  | LitDecimal of string  (* Stored as normalized string *)
+  | LitDecimal of decimal  (* read once, by the parser *)
   | LitString of string
   | LitBool of bool
   | LitUnit
@@ -32,6 +67,34 @@ type expr =
   | LitArray of expr list  (* [1 2 3] *)
   | LitMap of (expr * expr) list  (* {"key" "value" "key2" "value2"} *)
   | Lambda of string list * expr list  (* \x body or \(x y) body — anonymous closure *)
+  (* Resolved locals — produced by Resolver, never by the parser *)
+  | Slot of int * string  (* frame slot index, original name *)
+  | SetSlot of int * string * type_kind option * expr  (* slot, name, type, value *)
+  | CallBuiltin of int * string * expr list  (* builtin table index, canonical name, args *)
+  | Closure of string list * expr list * frame_layout * (int * int) array
+      (* resolved Lambda: params, slot-resolved body, its frame layout, and
+         the captured free variables as (closure slot, enclosing slot or -1) *)
+  | Block of expr array * (string, int) Hashtbl.t
+      (* a body holding labels: its statements, label name -> index *)
+  | Arith of arith_op * int * string * expr * expr
+      (* two-arg call to an arith_op builtin: int operands are handled
+         inline, anything else goes to builtin [index] as usual *)
+  | IntArith of arith_op * int_expr * int_expr * expr
+      (* Arith over nested arithmetic on slots and literals: run on
+         native 63-bit ints with no intermediate boxes; a leaf that is
+         not an int, a zero divisor or an overflow runs the plain Arith
+         (last) instead *)
+  | ForSlot of int * string * expr * expr * expr list
+      (* For whose counter is frame slot [index] *)
+  | Fmt of string * fmt_piece array * expr list
+      (* (fmt "template" args...) with the template compiled *)
+  | AppendSlot of int * string * expr list * expr
+      (* (set s (add s piece ...)) on local slot [index]: the pieces, and
+         the plain SetSlot for when s doesn't hold a long string *)
+  | Fused of int * string * expr list
+      (* CallBuiltin to a terminal (sum, reduce, join, ...) with a
+         range / map_arr / filter / enumerate / zip call among its args,
+         which is streamed instead of built *)
 
 (* Function parameter *)
 type param = {
@@ -72,7 +135,7 @@ type module_def = {
 let rec string_of_expr = function
   | LitInt n -> Int64.to_string n
   | LitFloat f -> string_of_float f
-  | LitDecimal s -> s
+  | LitDecimal d -> string_of_decimal d
   | LitString s -> "\"" ^ String.escaped s ^ "\""
   | LitBool b -> if b then "true" else "false"
   | LitUnit -> "unit"
@@ -107,6 +170,9 @@ let rec string_of_expr = function
       "(set " ^ var ^ " " ^ string_of_type ty ^ " " ^ string_of_expr value ^ ")"
   | Set (var, None, value) ->
       "(set " ^ var ^ " " ^ string_of_expr value ^ ")"
+  | Slot (_, name) -> name
+  | SetSlot (_, var, ty, value) -> string_of_expr (Set (var, ty, value))
+  | CallBuiltin (_, func, args) -> string_of_expr (Call (func, args))
   | Return expr -> "(ret " ^ string_of_expr expr ^ ")"
   | Label name -> "(label " ^ name ^ ")"
   | Goto name -> "(goto " ^ name ^ ")"
@@ -133,3 +199,11 @@ let rec string_of_expr = function
         | many -> "(" ^ String.concat " " many ^ ")"
       in
       "(\\" ^ p ^ " " ^ body_str ^ ")"
+  | Closure (params, body, _, _) -> string_of_expr (Lambda (params, body))
+  | Block (stmts, _) -> String.concat " " (Array.to_list (Array.map string_of_expr stmts))
+  | Fmt (template, _, args) -> string_of_expr (Call ("fmt", LitString template :: args))
+  | AppendSlot (_, _, _, plain) -> string_of_expr plain
+  | Fused (_, func, args) -> string_of_expr (Call (func, args))
+  | Arith (_, _, func, a, b) -> string_of_expr (Call (func, [a; b]))
+  | IntArith (_, _, _, plain) -> string_of_expr plain
+  | ForSlot (_, var, start_e, end_e, body) -> string_of_expr (For (var, start_e, end_e, body))
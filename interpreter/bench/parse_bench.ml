@@ -0,0 +1,67 @@
+(* Parse-time benchmark: lexes and parses every .sigil file under the
+   given directories and reports lex / parse time per round.
+
+     dune exec bench/parse_bench.exe -- [-n ROUNDS] [DIR ...]
+
+   Directories default to ../tests and ../stdlib (run from interpreter/).
+   Files that fail to lex or parse are counted and skipped. *)
+
+let rec sigil_files dir =
+  match Sys.readdir dir with
+  | entries ->
+      Array.sort compare entries;
+      Array.fold_left (fun acc name ->
+        let path = Filename.concat dir name in
+        if Sys.is_directory path then acc @ sigil_files path
+        else if Filename.check_suffix name ".sigil" then acc @ [path]
+        else acc
+      ) [] entries
+  | exception Sys_error _ -> []
+
+let read_file path =
+  let ic = open_in_bin path in
+  let s = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  s
+
+let () =
+  let rounds = ref 5 in
+  let dirs = ref [] in
+  Arg.parse
+    [ "-n", Arg.Set_int rounds, "ROUNDS  timed rounds over the corpus (default 5)" ]
+    (fun d -> dirs := !dirs @ [d])
+    "parse_bench [-n ROUNDS] [DIR ...]";
+  let dirs = if !dirs = [] then ["../tests"; "../stdlib"] else !dirs in
+  let sources = List.map read_file (List.concat_map sigil_files dirs) in
+  let bytes = List.fold_left (fun n s -> n + String.length s) 0 sources in
+  (* Warm-up pass: drop sources that don't lex or parse so every timed
+     round does the same work. *)
+  let ok = List.filter_map (fun s ->
+    match Parser.parse (Lexer.tokenize s) with
+    | _ -> Some s
+    | exception (Lexer.LexError _ | Parser.ParseError _) -> None
+  ) sources in
+  let tokens = List.fold_left (fun n s -> n + Array.length (Lexer.tokenize s)) 0 ok in
+  Printf.printf "%d files (%d skipped), %d bytes, %d tokens\n"
+    (List.length sources) (List.length sources - List.length ok) bytes tokens;
+  let best_lex = ref infinity and best_parse = ref infinity in
+  for round = 1 to !rounds do
+    let lex_t = ref 0.0 and parse_t = ref 0.0 in
+    List.iter (fun s ->
+      let t0 = Unix.gettimeofday () in
+      let toks = Lexer.tokenize s in
+      let t1 = Unix.gettimeofday () in
+      ignore (Parser.parse toks);
+      let t2 = Unix.gettimeofday () in
+      lex_t := !lex_t +. (t1 -. t0);
+      parse_t := !parse_t +. (t2 -. t1)
+    ) ok;
+    best_lex := min !best_lex !lex_t;
+    best_parse := min !best_parse !parse_t;
+    Printf.printf "round %d: lex %.2f ms, parse %.2f ms\n"
+      round (!lex_t *. 1000.0) (!parse_t *. 1000.0)
+  done;
+  if !rounds > 0 then
+    Printf.printf "best: lex %.2f ms, parse %.2f ms (%.0f tokens/ms)\n"
+      (!best_lex *. 1000.0) (!best_parse *. 1000.0)
+      (float_of_int tokens /. ((!best_lex +. !best_parse) *. 1000.0))
@@ -0,0 +1,207 @@
+(* Interpreter throughput benchmark: runs each Sigil workload (default:
+   every .sigil file in bench/workloads) and reports wall time, ops/sec,
+   peak RSS and GC counts, optionally as JSON and against a baseline.
+
+     dune exec bench/run_bench.exe -- [-n ROUNDS] [-json FILE]
+         [-baseline FILE] [-threshold PCT] [WORKLOAD.sigil ...]
+
+   Run from interpreter/. Every round runs in a forked child, so each
+   starts from a fresh global env and heap and reports its own peak RSS
+   (VmHWM, Linux only; the runner's own few MB are included). The best
+   round by wall time is kept. A workload's op count comes from a
+   "bench-ops: N" meta-note. A workload that raises, exits nonzero or
+   does not report in any round has failed: it gets no timing, and the
+   exit code is 1.
+
+   -json writes the results; a file written that way is the -baseline
+   format. Against a baseline, a workload slower by more than PCT
+   (default 10) is flagged, and the exit code is 1. A baseline is a
+   measured run: generate it on the reference machine with -json, and
+   compare only against one from the same machine. *)
+
+type result = {
+  name : string;
+  ops : int;
+  wall : float;  (* seconds *)
+  minor_words : float;
+  major_words : float;
+  minor_gcs : int;
+  major_gcs : int;
+  peak_rss_kb : int;  (* -1 where /proc is not available *)
+  exit_code : int;
+}
+
+let read_file path =
+  let ic = open_in_bin path in
+  let s = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  s
+
+let workload_ops source =
+  match Interpreter.find_sub source "bench-ops: " 0 with
+  | -1 -> 1
+  | i -> Scanf.sscanf (String.sub source (i + 11) (String.length source - i - 11)) "%d" Fun.id
+
+let peak_rss_kb () =
+  match open_in "/proc/self/status" with
+  | exception Sys_error _ -> -1
+  | ic ->
+      let rec scan () =
+        match input_line ic with
+        | line when String.starts_with ~prefix:"VmHWM:" line ->
+            Scanf.sscanf line "VmHWM: %d" Fun.id
+        | _ -> scan ()
+        | exception End_of_file -> -1
+      in
+      let kb = scan () in
+      close_in ic;
+      kb
+
+(* One run, in the forked child: report over [fd] as one line and exit. *)
+let child_run path source fd =
+  let devnull = Unix.openfile "/dev/null" [Unix.O_WRONLY] 0 in
+  Unix.dup2 devnull Unix.stdout;
+  Unix.close devnull;
+  Atomic.set Interpreter.source_file_path path;
+  Interpreter.script_args := [];
+  let before = Gc.quick_stat () in
+  let t0 = Unix.gettimeofday () in
+  let code =
+    try Interpreter.execute_module (Parser.parse (Lexer.tokenize source))
+    with e -> prerr_endline ("run_bench: " ^ path ^ ": " ^ Printexc.to_string e); 1
+  in
+  Interpreter.flush_output ();
+  let wall = Unix.gettimeofday () -. t0 in
+  let after = Gc.quick_stat () in
+  let report = Printf.sprintf "%d %.9f %.0f %.0f %d %d %d\n" code wall
+    (after.Gc.minor_words -. before.Gc.minor_words)
+    (after.Gc.major_words -. before.Gc.major_words)
+    (after.Gc.minor_collections - before.Gc.minor_collections)
+    (after.Gc.major_collections - before.Gc.major_collections)
+    (peak_rss_kb ()) in
+  ignore (Unix.write_substring fd report 0 (String.length report));
+  Unix._exit 0
+
+let run_once path source =
+  let (r, w) = Unix.pipe () in
+  flush stdout;
+  match Unix.fork () with
+  | 0 -> Unix.close r; child_run path source w
+  | pid ->
+      Unix.close w;
+      let ic = Unix.in_channel_of_descr r in
+      let line = try input_line ic with End_of_file -> "" in
+      close_in ic;
+      ignore (Unix.waitpid [] pid);
+      (try
+         Scanf.sscanf line "%d %f %f %f %d %d %d"
+           (fun exit_code wall minor_words major_words minor_gcs major_gcs peak_rss_kb ->
+              Some { name = Filename.remove_extension (Filename.basename path);
+                     ops = workload_ops source; wall; minor_words; major_words;
+                     minor_gcs; major_gcs; peak_rss_kb; exit_code })
+       with Scanf.Scan_failure _ | End_of_file | Failure _ -> None)
+
+let ops_per_sec r = if r.wall > 0.0 then float_of_int r.ops /. r.wall else 0.0
+
+(* One workload per line, so a baseline can be read back line by line. *)
+let write_json path rounds results =
+  let oc = open_out path in
+  Printf.fprintf oc "{\n  \"rounds\": %d,\n  \"workloads\": [\n" rounds;
+  List.iteri (fun i r ->
+    Printf.fprintf oc
+      "    {\"name\": %S, \"ops\": %d, \"wall_ms\": %.3f, \"ops_per_sec\": %.1f, \
+       \"peak_rss_kb\": %d, \"minor_words\": %.0f, \"major_words\": %.0f, \
+       \"minor_gcs\": %d, \"major_gcs\": %d}%s\n"
+      r.name r.ops (r.wall *. 1000.0) (ops_per_sec r) r.peak_rss_kb
+      r.minor_words r.major_words r.minor_gcs r.major_gcs
+      (if i < List.length results - 1 then "," else "")
+  ) results;
+  Printf.fprintf oc "  ]\n}\n";
+  close_out oc
+
+(* (name, wall_ms) for each workload line of a file written by write_json. *)
+let read_baseline path =
+  let ic = open_in path in
+  let rec go acc =
+    match input_line ic with
+    | line ->
+        (match Scanf.sscanf line " {\"name\": %S, \"ops\": %d, \"wall_ms\": %f"
+                 (fun name _ wall_ms -> (name, wall_ms)) with
+         | entry -> go (entry :: acc)
+         | exception (Scanf.Scan_failure _ | End_of_file | Failure _) -> go acc)
+    | exception End_of_file -> close_in ic; List.rev acc
+  in
+  go []
+
+let () =
+  let rounds = ref 5 and json = ref "" and baseline = ref "" and threshold = ref 10.0 in
+  let files = ref [] in
+  Arg.parse
+    [ "-n", Arg.Set_int rounds, "ROUNDS  runs per workload, best kept (default 5)";
+      "-json", Arg.Set_string json, "FILE  write results as JSON";
+      "-baseline", Arg.Set_string baseline, "FILE  compare with results from -json";
+      "-threshold", Arg.Set_float threshold, "PCT  slowdown flagged as a regression (default 10)" ]
+    (fun f -> files := !files @ [f])
+    "run_bench [-n ROUNDS] [-json FILE] [-baseline FILE] [-threshold PCT] [WORKLOAD.sigil ...]";
+  let files =
+    if !files <> [] then !files
+    else
+      let dir = "bench/workloads" in
+      let names = try Sys.readdir dir with Sys_error _ -> [||] in
+      Array.sort compare names;
+      List.filter_map (fun n ->
+        if Filename.check_suffix n ".sigil" then Some (Filename.concat dir n) else None
+      ) (Array.to_list names)
+  in
+  if files = [] then begin
+    prerr_endline "run_bench: no workloads (run from interpreter/ or name .sigil files)";
+    exit 2
+  end;
+  Printf.printf "%-20s %8s %11s %12s %10s %12s %7s %7s\n"
+    "workload" "ops" "wall ms" "ops/sec" "rss KB" "minor words" "minor" "major";
+  let failures = ref 0 in
+  let results = List.filter_map (fun path ->
+    let source = read_file path in
+    let best = ref None and failed = ref None in
+    for _ = 1 to max 1 !rounds do
+      if !failed = None then
+        match run_once path source, !best with
+        | Some r, _ when r.exit_code <> 0 -> failed := Some (Printf.sprintf "exit %d" r.exit_code)
+        | Some r, Some b when r.wall >= b.wall -> ()
+        | Some r, _ -> best := Some r
+        | None, _ -> failed := Some "no report"
+    done;
+    match !failed, !best with
+    | None, Some r ->
+        Printf.printf "%-20s %8d %11.3f %12.0f %10d %12.0f %7d %7d\n%!"
+          r.name r.ops (r.wall *. 1000.0) (ops_per_sec r) r.peak_rss_kb
+          r.minor_words r.minor_gcs r.major_gcs;
+        Some r
+    | why, _ ->
+        Printf.printf "%-20s FAILED (%s)\n%!" path (Option.value why ~default:"no report");
+        incr failures;
+        None
+  ) files in
+  if !json <> "" then write_json !json !rounds results;
+  let regressions =
+    if !baseline = "" then 0
+    else begin
+      let base = read_baseline !baseline in
+      Printf.printf "\nagainst %s:\n" !baseline;
+      List.fold_left (fun n r ->
+        match List.assoc_opt r.name base with
+        | None -> Printf.printf "%-20s (not in baseline)\n" r.name; n
+        | Some base_ms when base_ms <= 0.0 ->
+            Printf.eprintf "run_bench: %s: %s has no measured time\n" !baseline r.name;
+            exit 2
+        | Some base_ms ->
+            let ms = r.wall *. 1000.0 in
+            let delta = 100.0 *. (ms -. base_ms) /. base_ms in
+            let slow = delta > !threshold in
+            Printf.printf "%-20s %11.3f -> %11.3f ms  %+6.1f%%%s\n"
+              r.name base_ms ms delta (if slow then "   REGRESSION" else "");
+            if slow then n + 1 else n
+      ) 0 results
+    end
+  in
+  exit (if regressions > 0 || !failures > 0 then 1 else 0)
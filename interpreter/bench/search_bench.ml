@@ -0,0 +1,113 @@
+(* Substring-search benchmark: times the interpreter's shared search
+   kernel against the per-position String.sub scan it replaced, on a
+   generated CSV-like haystack.
+
+     dune exec bench/search_bench.exe -- [-mb SIZE] [-n ROUNDS]
+
+   SIZE defaults to 100 (MB). For each needle it runs find-last (a miss
+   until the end), count, split and replace, and checks that both
+   implementations agree. *)
+
+(* The old scan, kept here as the baseline. *)
+let naive_find s sub from =
+  let n = String.length s and m = String.length sub in
+  let found = ref (-1) and i = ref from in
+  while !i <= n - m && !found = -1 do
+    if String.sub s !i m = sub then found := !i else incr i
+  done;
+  !found
+
+let naive_count s sub =
+  let n = String.length s and m = String.length sub in
+  let c = ref 0 and i = ref 0 in
+  while !i <= n - m do
+    if String.sub s !i m = sub then begin incr c; i := !i + m end else incr i
+  done;
+  !c
+
+let naive_split s sep =
+  let slen = String.length s and m = String.length sep in
+  let parts = ref [] and start = ref 0 and i = ref 0 in
+  while !i <= slen - m do
+    if String.sub s !i m = sep then begin
+      parts := String.sub s !start (!i - !start) :: !parts;
+      i := !i + m;
+      start := !i
+    end else incr i
+  done;
+  List.rev (String.sub s !start (slen - !start) :: !parts)
+
+let naive_replace s old_s new_s =
+  let buf = Buffer.create (String.length s) in
+  let slen = String.length s and m = String.length old_s in
+  let i = ref 0 in
+  while !i < slen do
+    if !i <= slen - m && String.sub s !i m = old_s then begin
+      Buffer.add_string buf new_s; i := !i + m
+    end else begin
+      Buffer.add_char buf s.[!i]; incr i
+    end
+  done;
+  Buffer.contents buf
+
+(* Lines of comma-separated fields, with "::" and "needle" sprinkled in. *)
+let haystack bytes =
+  let buf = Buffer.create (bytes + 128) in
+  let st = Random.State.make [| 42 |] in
+  while Buffer.length buf < bytes do
+    for f = 0 to 7 do
+      if f > 0 then Buffer.add_char buf ',';
+      for _ = 1 to 3 + Random.State.int st 10 do
+        Buffer.add_char buf (Char.chr (97 + Random.State.int st 26))
+      done;
+      if Random.State.int st 50 = 0 then Buffer.add_string buf "::";
+      if Random.State.int st 400 = 0 then Buffer.add_string buf "needle"
+    done;
+    Buffer.add_char buf '\n'
+  done;
+  Buffer.contents buf
+
+let time f =
+  let t0 = Unix.gettimeofday () in
+  let r = f () in
+  (r, Unix.gettimeofday () -. t0)
+
+let () =
+  let mb = ref 100 and rounds = ref 3 in
+  Arg.parse
+    [ "-mb", Arg.Set_int mb, "SIZE  haystack size in MB (default 100)";
+      "-n", Arg.Set_int rounds, "ROUNDS  timed rounds per case (default 3)" ]
+    (fun _ -> ())
+    "search_bench [-mb SIZE] [-n ROUNDS]";
+  let s = haystack (!mb * 1024 * 1024) in
+  Printf.printf "haystack: %d bytes\n%!" (String.length s);
+  let best f =
+    let r = ref None and t = ref infinity in
+    for _ = 1 to max 1 !rounds do
+      let (v, dt) = time f in
+      r := Some v; t := min !t dt
+    done;
+    (Option.get !r, !t)
+  in
+  let case name naive fast =
+    let (a, tn) = best naive in
+    let (b, tf) = best fast in
+    Printf.printf "%-24s naive %8.1f ms   kernel %8.1f ms   x%.1f%s\n%!"
+      name (tn *. 1000.0) (tf *. 1000.0) (tn /. tf)
+      (if a = b then "" else "   MISMATCH")
+  in
+  List.iter (fun needle ->
+    let q = Printf.sprintf "%S" needle in
+    case ("find-miss " ^ q)
+      (fun () -> naive_find s (needle ^ "#") 0)
+      (fun () -> Interpreter.find_sub s (needle ^ "#") 0);
+    case ("count " ^ q)
+      (fun () -> naive_count s needle)
+      (fun () -> Interpreter.count_sub s needle);
+    case ("split " ^ q)
+      (fun () -> List.length (naive_split s needle))
+      (fun () -> List.length (Interpreter.split_on_sub s needle));
+    case ("replace " ^ q)
+      (fun () -> Digest.string (naive_replace s needle "_"))
+      (fun () -> Digest.string (Interpreter.replace_sub s needle "_"))
+  ) [","; "::"; "needle"]
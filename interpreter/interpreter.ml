@@ -17,7 +17,65 @@ open Unix
    when input is in $0; program runs without producing output). To
    silence (e.g. in batch test runs that assert on stderr), set
    SIGIL_DIAGNOSE=0. *)
-let output_emitted = ref false
+let output_emitted = Atomic.make false
+
+(* Program output. print / println write into stdout's channel buffer
+   and never flush on their own; the buffer is flushed at exit, before
+   reading stdin, around subprocess interaction, and by (flush).
+   SIGIL_LINE_BUFFERED=1 flushes after every line instead, for
+   interactive use. *)
+let line_buffered =
+  match Sys.getenv_opt "SIGIL_LINE_BUFFERED" with
+  | Some "1" | Some "on" | Some "true" -> true
+  | _ -> false
+
+let flush_output () = flush stdout
+
+(* I/O accounting for sigil-run --stats: read / write calls and bytes,
+   split into files (including pipes and stdin) and sockets (plain, TLS
+   and WebSocket). Atomic, as pool workers do I/O too. Output through
+   print / println adds only to io_bytes_written, since stdout is
+   buffered and its writes are not one per call. *)
+let io_file_reads = Atomic.make 0
+let io_file_writes = Atomic.make 0
+let io_socket_reads = Atomic.make 0
+let io_socket_writes = Atomic.make 0
+let io_bytes_read = Atomic.make 0
+let io_bytes_written = Atomic.make 0
+
+let io_count calls bytes n =
+  Atomic.incr calls;
+  if n > 0 then ignore (Atomic.fetch_and_add bytes n);
+  n
+
+let file_read_fd fd buf off len = io_count io_file_reads io_bytes_read (Unix.read fd buf off len)
+let file_write_fd fd buf off len = io_count io_file_writes io_bytes_written (Unix.write fd buf off len)
+let file_write_fd_substring fd s off len =
+  io_count io_file_writes io_bytes_written (Unix.write_substring fd s off len)
+let socket_read_fd fd buf off len = io_count io_socket_reads io_bytes_read (Unix.read fd buf off len)
+let socket_write_fd_substring fd s off len =
+  io_count io_socket_writes io_bytes_written (Unix.write_substring fd s off len)
+let tls_read ssl buf off len = io_count io_socket_reads io_bytes_read (Ssl.read ssl buf off len)
+let tls_write_substring ssl s off len =
+  io_count io_socket_writes io_bytes_written (Ssl.write_substring ssl s off len)
+
+let out_string s =
+  Atomic.set output_emitted true;
+  ignore (Atomic.fetch_and_add io_bytes_written (String.length s));
+  output_string stdout s;
+  if line_buffered && String.contains s '\n' then flush stdout
+
+let out_line s =
+  Atomic.set output_emitted true;
+  ignore (Atomic.fetch_and_add io_bytes_written (String.length s + 1));
+  output_string stdout s;
+  output_char stdout '\n';
+  if line_buffered then flush stdout
+
+(* The script's own arguments ($0, $1, ... and (argv)): everything after
+   the program path on the command line. --serve sets it per request. *)
+let script_args =
+  ref (match Array.to_list Sys.argv with _ :: _ :: rest -> rest | _ -> [])
 
 let diagnose_enabled () =
   match Sys.getenv_opt "SIGIL_DIAGNOSE" with
@@ -28,28 +86,86 @@ let diagnose_enabled () =
 type value =
   | VInt of int64
   | VFloat of float
-  | VDecimal of string
+  | VDecimal of decimal  (* see Types.decimal *)
   | VString of string
   | VBool of bool
   | VUnit
-  | VArray of value array ref
-  | VMap of (string, value) Hashtbl.t * string list ref  (* hashtbl + insertion-ordered keys *)
-  | VFunction of string * param list * type_kind * expr list
-  | VClosure of string list * expr list * (string * value) list
-      (* params, body, captured-env snapshot (var name + value pairs) *)
+  | VArray of vec
+  | VMap of (string, value) Hashtbl.t * keyorder  (* hashtbl + insertion-ordered keys *)
+  | VFunction of string * param list * type_kind * expr list * Resolver.layout
+      (* name, params, return type, slot-resolved body, frame layout *)
+  | VClosure of string list * expr list * Resolver.layout * value array
+      (* params, slot-resolved body, frame layout, initial slots holding
+         the captured values (everything else unbound) *)
   | VBuiltin of string
       (* Reference to a builtin function by name — used when a builtin is
          passed as a first-class value to a higher-order function. *)
+  | VRegex of string * Re.re  (* source pattern, compiled matcher *)
+  | VSeq of seq  (* one-shot lazy stream: lines_stdin, lines_file, ... *)
   | VSocket of Unix.file_descr
   | VTlsSocket of Ssl.socket
   | VWsSocket of ws_transport
   | VChannel of Unix.file_descr * Unix.file_descr * int option  (* fd1, fd2, optional pid *)
   | VProcess of int  (* PID *)
+  | VPoller of poller  (* epoll / kqueue set, see poll_stubs.c *)
+  | VSqlite of Sqlite3.db
+  | VSqliteStmt of sqlite_stmt
+  | VBuilder of Buffer.t  (* string builder: sb_new / sb_append / sb_finish *)
+  | VRope of rope
 
 and ws_transport =
   | WsPlain of Unix.file_descr
   | WsTls of Ssl.socket
 
+(* A readiness poller: the kernel-side set, plus the socket value
+   registered under each fd so poll_wait can hand the values back. *)
+and poller = {
+  poll_fd : Unix.file_descr;
+  watched : (int, value) Hashtbl.t;
+  mutable poll_open : bool;
+}
+
+(* A prepared statement and the connection it belongs to (for errors). *)
+and sqlite_stmt = { stmt : Sqlite3.stmt; stmt_db : Sqlite3.db }
+
+(* A long string local grown by (set s (add s ...)) (see AppendSlot): the
+   text so far in a buffer, and its flattened string once read. It only
+   ever sits in a frame slot, and every read of a slot goes through
+   flat_value, so no other code sees one. *)
+and rope = { rope_buf : Buffer.t; mutable rope_flat : string option }
+
+(* Growable array backing VArray: [data] has capacity >= [len]; the
+   slots past [len] are spare and hold VUnit. *)
+and vec = { mutable data : value array; mutable len : int }
+
+(* A lazy stream: [next] yields elements until it returns None, and keeps
+   returning None after that. Draining it consumes it. [close] releases
+   what the source holds (fd, statement, connection) when a consumer
+   stops early; it may be called more than once, and pipeline stages
+   pass it on to their source. *)
+and seq = { next : unit -> value option; seq_kind : string; close : unit -> unit }
+
+(* Insertion order of a VMap's keys: [order.(0 .. used-1)] holds keys in
+   insertion order, None marking a deleted key; [kpos] maps a live key to
+   its index in [order]. *)
+and keyorder = {
+  mutable order : string option array;
+  mutable used : int;
+  kpos : (string, int) Hashtbl.t;
+}
+
+(* A slot's value as the program sees it: a rope reads as its string. *)
+let flat_value v =
+  match v with
+  | VRope r ->
+      (match r.rope_flat with
+       | Some s -> VString s
+       | None ->
+           let s = Buffer.contents r.rope_buf in
+           r.rope_flat <- Some s;
+           VString s)
+  | v -> v
+
 (* Exceptions *)
 exception Return of value
 exception Break
@@ -67,15 +183,19 @@ let type_matches (tk : type_kind) (v : value) : bool =
   | TBool, VBool _ -> true
   | TUnit, VUnit -> true
   | TArray _, VArray _ -> true
+  | TArray _, VSeq _ -> true  (* for-each / reduce / filter take streams too *)
   | TMap _, VMap _ -> true
   | TJson, _ -> true  (* JSON can hold any value *)
-  | TRegex, VString _ -> true  (* regex patterns stored as strings *)
+  | TRegex, VRegex _ -> true
+  | TRegex, VString _ -> true  (* plain pattern strings are still accepted *)
   | TProcess, VProcess _ -> true
   | TProcess, VChannel _ -> true  (* process_spawn returns VChannel *)
+  | TProcess, (VSqlite _ | VSqliteStmt _) -> true  (* the sqlite module's handles used to be processes *)
   | TSocket, VSocket _ -> true
   | TSocket, VTlsSocket _ -> true
   | TSocket, VWsSocket _ -> true
   | TSocket, VChannel _ -> true
+  | TSocket, VPoller _ -> true
   | TFunction _, VFunction _ -> true
   | TFunction _, VClosure _ -> true
   | TFunction _, VBuiltin _ -> true
@@ -92,9 +212,11 @@ let string_of_value_type = function
   | VInt _ -> "int" | VFloat _ -> "float" | VDecimal _ -> "decimal"
   | VString _ -> "string" | VBool _ -> "bool" | VUnit -> "unit"
   | VArray _ -> "array" | VMap _ -> "map" | VFunction _ -> "function"
-  | VClosure _ -> "function" | VBuiltin _ -> "function"
+  | VClosure _ -> "function" | VBuiltin _ -> "function" | VRegex _ -> "regex"
   | VSocket _ -> "socket" | VTlsSocket _ -> "socket" | VWsSocket _ -> "socket"
-  | VChannel _ -> "socket" | VProcess _ -> "process"
+  | VChannel _ -> "socket" | VProcess _ -> "process" | VSeq _ -> "seq"
+  | VPoller _ -> "poller" | VSqlite _ -> "sqlite" | VSqliteStmt _ -> "sqlite_stmt"
+  | VBuilder _ -> "string_builder" | VRope _ -> "string"
 
 (* Build a "(t1 t2 t3)" type-tuple string from a list of values. Used inside
    builtin error messages so a model that misuses an op gets the actual shape
@@ -103,23 +225,497 @@ let string_of_value_type = function
 let fmt_arg_types vs =
   "(" ^ String.concat " " (List.map string_of_value_type vs) ^ ")"
 
-(* Environment for variable bindings *)
-type env = (string, value) Hashtbl.t
+(* Environment for variable bindings.
+   Locals of the running function live in [slots], indexed by the layout
+   the Resolver computed for it (a closure's captures included); any
+   other names bound in this env live in [vars]. [globals] is the module-level
+   table holding every registered function; call frames link to it
+   rather than copying it, so lookup falls through
+   slots → vars → globals and a local still shadows a function.
+   By-name access (fmt's {name}, for/for-each iterators, catch vars) goes
+   through the layout so both views stay consistent. *)
+type env = {
+  vars : (string, value) Hashtbl.t;
+  slots : value array;
+  layout : Resolver.layout;
+  globals : (string, value) Hashtbl.t;
+}
+
+(* Marks a slot whose local hasn't been assigned yet. Compared physically. *)
+let unbound = VString "<unbound>"
+
+(* The module-level env: its by-name table is the global table. *)
+let env_create () =
+  let tbl = Hashtbl.create 32 in
+  { vars = tbl; slots = [||]; layout = Resolver.empty_layout; globals = tbl }
+
+(* Fresh frame for one call of a resolved function. *)
+let env_frame parent layout =
+  { vars = Hashtbl.create 4;
+    slots = Array.make (Resolver.slot_count layout) unbound;
+    layout;
+    globals = parent.globals }
+
+(* Frame for one closure invocation, starting from its captured slots. *)
+let env_closure parent layout slots =
+  { vars = Hashtbl.create 4; slots; layout; globals = parent.globals }
+
+(* Lookup past the frame: this env's own names, then the global table. *)
+let env_find_named env name =
+  match Hashtbl.find_opt env.vars name with
+  | Some v -> Some v
+  | None -> if env.globals == env.vars then None else Hashtbl.find_opt env.globals name
+
+let env_set env name value =
+  match Hashtbl.find_opt env.layout.Resolver.slot_index name with
+  | Some i -> env.slots.(i) <- value
+  | None -> Hashtbl.replace env.vars name value
+
+(* Raises Not_found; env_get is the user-facing variant. *)
+let env_find env name =
+  match Hashtbl.find_opt env.layout.Resolver.slot_index name with
+  | Some i when env.slots.(i) != unbound -> flat_value env.slots.(i)
+  | _ -> (match env_find_named env name with Some v -> v | None -> raise Not_found)
 
-let env_create () = Hashtbl.create 32
-let env_set env name value = Hashtbl.replace env name value
 let env_get env name =
-  try Hashtbl.find env name
+  try env_find env name
   with Not_found -> raise (RuntimeError ("Undefined variable: " ^ name))
 
-(* Ordered map helpers *)
-let make_vmap () = VMap (Hashtbl.create 16, ref [])
+(* Growable-array helpers. vec_push / vec_pop are amortized O(1). vget
+   returns the live elements as an exact-length array (trimming spare
+   capacity first, which is O(n) right after growth), for builtins that
+   sort in place or hand the array on. Read-only builtins walk [data]
+   up to [len] instead (vec_iter and friends below), so they can be
+   called between pushes without a copy each time. *)
+let vec_of_array a = { data = a; len = Array.length a }
+let vec_of_list l = vec_of_array (Array.of_list l)
+
+let vget v =
+  if Array.length v.data <> v.len then v.data <- Array.sub v.data 0 v.len;
+  v.data
+
+let vset v a =
+  v.data <- a;
+  v.len <- Array.length a
+
+let vec_push v x =
+  if v.len = Array.length v.data then begin
+    let grown = Array.make (max 8 (2 * v.len)) VUnit in
+    Array.blit v.data 0 grown 0 v.len;
+    v.data <- grown
+  end;
+  v.data.(v.len) <- x;
+  v.len <- v.len + 1
+
+(* Caller checks len > 0. *)
+let vec_pop v =
+  v.len <- v.len - 1;
+  let x = v.data.(v.len) in
+  v.data.(v.len) <- VUnit;
+  x
+
+(* Read-only walks over the live elements. Unlike vget they never trim,
+   so a builtin called between pushes (has, join, sum, ...) leaves the
+   spare capacity alone instead of copying the array each time. The
+   walk sees the elements present when it starts. *)
+let vec_iter f v =
+  let data = v.data and n = v.len in
+  for i = 0 to n - 1 do f data.(i) done
+
+let vec_fold f init v =
+  let data = v.data and n = v.len in
+  let acc = ref init in
+  for i = 0 to n - 1 do acc := f !acc data.(i) done;
+  !acc
+
+let vec_exists p v =
+  let data = v.data and n = v.len in
+  let rec go i = i < n && (p data.(i) || go (i + 1)) in
+  go 0
+
+let vec_for_all p v =
+  let data = v.data and n = v.len in
+  let rec go i = i >= n || (p data.(i) && go (i + 1)) in
+  go 0
+
+let vec_map f v =
+  let data = v.data in
+  Array.init v.len (fun i -> f data.(i))
+
+let vec_mapi f v =
+  let data = v.data in
+  Array.init v.len (fun i -> f i data.(i))
+
+let vec_to_list v =
+  let data = v.data in
+  let rec go i acc = if i < 0 then acc else go (i - 1) (data.(i) :: acc) in
+  go (v.len - 1) []
+
+(* Shared boxes for small ints and bools, so loop counters and the
+   results of inline arithmetic on them don't allocate. *)
+let small_int_min = -256 and small_int_max = 1023
+
+let small_ints =
+  Array.init (small_int_max - small_int_min + 1)
+    (fun i -> VInt (Int64.of_int (i + small_int_min)))
+
+let vint n =
+  if Int64.compare n (Int64.of_int small_int_min) >= 0
+     && Int64.compare n (Int64.of_int small_int_max) <= 0
+  then Array.unsafe_get small_ints (Int64.to_int n - small_int_min)
+  else VInt n
+
+let v_true = VBool true and v_false = VBool false
+let vbool b = if b then v_true else v_false
+
+(* True when [sub] occurs in [s] at [i]; compares in place, without
+   allocating the candidate substring. *)
+let matches_at s i sub =
+  let n = String.length sub in
+  if i < 0 || i + n > String.length s then false
+  else begin
+    let rec go k = k >= n || (String.unsafe_get s (i + k) = String.unsafe_get sub k && go (k + 1)) in
+    go 0
+  end
+
+(* [s] itself when the range covers all of it, else a copy of the range.
+   Strings are immutable, so handing back the same one is safe. *)
+let sub_or_self s pos len =
+  if pos = 0 && len = String.length s then s else String.sub s pos len
+
+(* Substring search, shared by split, string_find, index_of, contains,
+   string_replace, count and friends. [make_finder sub] returns a function
+   [find s from] giving the first index >= from where sub occurs in s, or
+   -1; build it once when searching the same needle repeatedly. Nothing is
+   allocated per candidate position:
+   - one byte: String.index_from, the stdlib's memchr;
+   - short needles: jump between occurrences of the first byte, then
+     compare in place;
+   - 4 bytes and up: Horspool, skipping up to the needle length per step. *)
+let horspool_min_needle = 4
+
+let first_byte_finder sub =
+  let m = String.length sub in
+  let c = sub.[0] in
+  fun s from ->
+    let last_start = String.length s - m in
+    let rec go i =
+      if i > last_start then -1
+      else match String.index_from_opt s i c with
+        | None -> -1
+        | Some j when j > last_start -> -1
+        | Some j -> if matches_at s j sub then j else go (j + 1)
+    in
+    if from < 0 then go 0 else go from
+
+let horspool_finder sub =
+  let m = String.length sub in
+  let skip = Array.make 256 m in
+  for k = 0 to m - 2 do
+    skip.(Char.code sub.[k]) <- m - 1 - k
+  done;
+  let last = sub.[m - 1] in
+  fun s from ->
+    let n = String.length s in
+    (* i is the haystack index under the needle's last byte *)
+    let rec go i =
+      if i >= n then -1
+      else begin
+        let c = String.unsafe_get s i in
+        if c = last && matches_at s (i - m + 1) sub then i - m + 1
+        else go (i + Array.unsafe_get skip (Char.code c))
+      end
+    in
+    go (max 0 from + m - 1)
+
+let make_finder sub =
+  let m = String.length sub in
+  if m = 0 then (fun s from -> if from <= String.length s then max 0 from else -1)
+  else if m = 1 then begin
+    let c = sub.[0] in
+    fun s from ->
+      if from >= String.length s then -1
+      else match String.index_from_opt s (max 0 from) c with
+        | Some i -> i
+        | None -> -1
+  end
+  else if m < horspool_min_needle then first_byte_finder sub
+  else horspool_finder sub
+
+(* One-shot search: skips building the Horspool table for short haystacks,
+   where it costs more than it saves. *)
+let find_sub s sub from =
+  let m = String.length sub in
+  if m >= horspool_min_needle && String.length s - from < 256 then
+    first_byte_finder sub s from
+  else make_finder sub s from
+
+(* Count non-overlapping occurrences, left to right. *)
+let count_sub s sub =
+  if sub = "" then 0
+  else begin
+    let find = make_finder sub and m = String.length sub in
+    let rec go from acc =
+      match find s from with
+      | -1 -> acc
+      | i -> go (i + m) (acc + 1)
+    in
+    go 0 0
+  end
+
+(* Split on every non-overlapping occurrence of a non-empty [sep]. *)
+let split_on_sub s sep =
+  let find = make_finder sep and m = String.length sep in
+  let rec go from acc =
+    match find s from with
+    | -1 -> List.rev (sub_or_self s from (String.length s - from) :: acc)
+    | i -> go (i + m) (String.sub s from (i - from) :: acc)
+  in
+  go 0 []
+
+(* Replace every non-overlapping occurrence of a non-empty [old_s]. *)
+let replace_sub s old_s new_s =
+  let find = make_finder old_s and m = String.length old_s in
+  match find s 0 with
+  | -1 -> s
+  | first ->
+      let buf = Buffer.create (String.length s) in
+      let rec go from i =
+        Buffer.add_substring buf s from (i - from);
+        Buffer.add_string buf new_s;
+        let from = i + m in
+        match find s from with
+        | -1 -> Buffer.add_substring buf s from (String.length s - from)
+        | j -> go from j
+      in
+      go 0 first;
+      Buffer.contents buf
+
+(* Lazy streams. Line and chunk streams read through a large buffer of
+   their own, so memory stays bounded by the longest line / the chunk
+   size whatever the input size. A stream is closed when drained, when
+   seq_iter / seq_fold leave it early (break, return or an error), or by
+   the GC if abandoned part way. *)
+let seq_iter f sq =
+  let rec go () =
+    match sq.next () with
+    | Some v -> f v; go ()
+    | None -> ()
+  in
+  Fun.protect ~finally:sq.close go
+
+let seq_fold f init sq =
+  let rec go acc =
+    match sq.next () with
+    | Some v -> go (f acc v)
+    | None -> acc
+  in
+  Fun.protect ~finally:sq.close (fun () -> go init)
+
+let stream_buffer_size = 1 lsl 20
+
+let make_seq kind close next =
+  let sq = { next; seq_kind = kind; close } in
+  Gc.finalise (fun _ -> close ()) sq;
+  sq
+
+(* Lines split on '\n' (a '\r' before it is kept, as with split); a last
+   line without a newline is still yielded. [read] has Unix.read's shape
+   and returns 0 at end of input. *)
+let line_seq kind read close =
+  let buf = Bytes.create stream_buffer_size in
+  let pos = ref 0 and lim = ref 0 and eof = ref false in
+  let closed = ref false in
+  let release () = if not !closed then begin closed := true; close () end in
+  let partial = Buffer.create 256 in
+  (* Closed by the consumer: what is still buffered is dropped too. *)
+  let close () = release (); eof := true; pos := !lim; Buffer.clear partial in
+  let take_partial () =
+    let s = Buffer.contents partial in
+    Buffer.clear partial;
+    s
+  in
+  let rec find_newline i =
+    if i >= !lim then -1
+    else if Bytes.unsafe_get buf i = '\n' then i
+    else find_newline (i + 1)
+  in
+  let rec next () =
+    if !pos >= !lim && not !eof then begin
+      let n = read buf 0 (Bytes.length buf) in
+      if n = 0 then begin eof := true; release () end
+      else begin pos := 0; lim := n end
+    end;
+    if !pos >= !lim then
+      (if Buffer.length partial > 0 then Some (VString (take_partial ())) else None)
+    else begin
+      let i = find_newline !pos in
+      if i < 0 then begin
+        Buffer.add_subbytes partial buf !pos (!lim - !pos);
+        pos := !lim;
+        next ()
+      end else begin
+        let line =
+          if Buffer.length partial = 0 then Bytes.sub_string buf !pos (i - !pos)
+          else begin
+            Buffer.add_subbytes partial buf !pos (i - !pos);
+            take_partial ()
+          end
+        in
+        pos := i + 1;
+        Some (VString line)
+      end
+    end
+  in
+  make_seq kind close next
+
+(* Fixed-size chunks; the last one may be shorter. *)
+let chunk_seq kind size read close =
+  let closed = ref false in
+  let close () = if not !closed then begin closed := true; close () end in
+  let next () =
+    if !closed then None
+    else begin
+      let buf = Bytes.create size in
+      let rec fill n =
+        if n >= size then n
+        else
+          let got = read buf n (size - n) in
+          if got = 0 then begin close (); n end else fill (n + got)
+      in
+      let n = fill 0 in
+      if n = 0 then None else Some (VString (Bytes.sub_string buf 0 n))
+    end
+  in
+  make_seq kind close next
+
+(* Pipeline stages (see stream_of): pure, so nothing to close of their
+   own; enumerate and zip close what they read from. *)
+let range_seq s e =
+  let i = ref s in
+  { seq_kind = "range";
+    next = (fun () ->
+      if !i >= e then None
+      else begin let v = vint (Int64.of_int !i) in incr i; Some v end);
+    close = ignore }
+
+(* Streams a copy, so a consumer that pushes to or sets the source sees
+   the same elements the built array would have held. *)
+let array_seq arr =
+  let data = Array.sub arr.data 0 arr.len and i = ref 0 in
+  { seq_kind = "array";
+    next = (fun () ->
+      if !i >= Array.length data then None
+      else begin let v = data.(!i) in incr i; Some v end);
+    close = ignore }
+
+let enumerate_seq sq =
+  let i = ref 0 in
+  { seq_kind = "enumerate";
+    next = (fun () ->
+      match sq.next () with
+      | Some v ->
+          let pair = VArray (vec_of_array [| VInt (Int64.of_int !i); v |]) in
+          incr i;
+          Some pair
+      | None -> None);
+    close = sq.close }
+
+(* zip's interleave: a0 b0 a1 b1 ..., then the rest of the longer one. *)
+let zip_seq a b =
+  let a_turn = ref true and a_done = ref false and b_done = ref false in
+  let rec next () =
+    if !a_done && !b_done then None
+    else if !a_turn && not !a_done then
+      (match a.next () with
+       | Some v -> if not !b_done then a_turn := false; Some v
+       | None -> a_done := true; a_turn := false; next ())
+    else
+      (match b.next () with
+       | Some v -> if not !a_done then a_turn := true; Some v
+       | None -> b_done := true; a_turn := true; next ())
+  in
+  { seq_kind = "zip"; next; close = (fun () -> a.close (); b.close ()) }
+
+let seq_to_array sq =
+  let out = vec_of_array [||] in
+  seq_iter (vec_push out) sq;
+  out
+
+let open_stream_file caller path =
+  try Unix.openfile path [Unix.O_RDONLY] 0
+  with Unix.Unix_error (e, _, _) ->
+    raise (RuntimeError (caller ^ ": cannot open " ^ path ^ ": " ^ Unix.error_message e))
+
+(* Ordered map helpers. Adding a key appends to the order array and
+   deleting one leaves a tombstone, both amortized O(1); the array is
+   compacted once tombstones outnumber live keys. Iteration walks the
+   array captured at its start, so keys added mid-iteration are not
+   visited. Growth or compaction replaces that array, so a key in it is
+   checked against kpos before it is visited: keys deleted mid-iteration
+   are skipped either way. *)
+let keys_create () = { order = [||]; used = 0; kpos = Hashtbl.create 8 }
+
+let keys_length ko = Hashtbl.length ko.kpos
+
+let keys_compact ko =
+  let live = Array.make (max 8 (2 * keys_length ko)) None in
+  let n = ref 0 in
+  for i = 0 to ko.used - 1 do
+    match ko.order.(i) with
+    | Some k as slot ->
+        live.(!n) <- slot;
+        Hashtbl.replace ko.kpos k !n;
+        incr n
+    | None -> ()
+  done;
+  ko.order <- live;
+  ko.used <- !n
+
+(* Caller checks k is not already present. *)
+let keys_add ko k =
+  if ko.used = Array.length ko.order then begin
+    let grown = Array.make (max 8 (2 * ko.used)) None in
+    Array.blit ko.order 0 grown 0 ko.used;
+    ko.order <- grown
+  end;
+  ko.order.(ko.used) <- Some k;
+  Hashtbl.replace ko.kpos k ko.used;
+  ko.used <- ko.used + 1
+
+let keys_remove ko k =
+  match Hashtbl.find_opt ko.kpos k with
+  | Some i ->
+      ko.order.(i) <- None;
+      Hashtbl.remove ko.kpos k;
+      if ko.used >= 16 && 2 * keys_length ko < ko.used then keys_compact ko
+  | None -> ()
+
+let keys_iter f ko =
+  let order = ko.order and used = ko.used in
+  for i = 0 to used - 1 do
+    match order.(i) with
+    | Some k when Hashtbl.mem ko.kpos k -> f k
+    | _ -> ()
+  done
+
+let keys_list ko =
+  let acc = ref [] in
+  for i = ko.used - 1 downto 0 do
+    match ko.order.(i) with Some k -> acc := k :: !acc | None -> ()
+  done;
+  !acc
+
+let keys_copy ko =
+  { order = Array.sub ko.order 0 ko.used; used = ko.used; kpos = Hashtbl.copy ko.kpos }
+
+let make_vmap () = VMap (Hashtbl.create 16, keys_create ())
 let vmap_set m keys k v =
-  if not (Hashtbl.mem m k) then keys := !keys @ [k];
+  if not (Hashtbl.mem m k) then keys_add keys k;
   Hashtbl.replace m k v
 let vmap_delete m keys k =
   Hashtbl.remove m k;
-  keys := List.filter (fun x -> x <> k) !keys
+  keys_remove keys k
 
 (* OCaml's Str library doesn't support brace quantifiers ({n}, {n,}, {n,m}).
    Expand them inline against the preceding atom (single char, escape sequence,
@@ -280,12 +876,12 @@ let json_step_into node seg =
       raise (RuntimeError ("Cannot index map with int segment " ^ seg_label seg))
   | VArray arr, VInt idx ->
       let i = Int64.to_int idx in
-      if i >= 0 && i < Array.length !arr then !arr.(i)
+      if i >= 0 && i < arr.len then arr.data.(i)
       else raise (RuntimeError ("JSON array index out of bounds: " ^ Int64.to_string idx))
   | VArray arr, VString s ->
       (try
         let i = int_of_string s in
-        if i >= 0 && i < Array.length !arr then !arr.(i)
+        if i >= 0 && i < arr.len then arr.data.(i)
         else raise (RuntimeError ("JSON array index out of bounds: " ^ s))
       with Failure _ ->
         raise (RuntimeError ("Cannot index array with non-integer segment: " ^ s)))
@@ -426,7 +1022,7 @@ let decimal_format neg int_part frac_part =
   else sign ^ int_part ^ "." ^ frac_part
 
 (* BigDecimal addition *)
-let bigdecimal_add a b =
+let bigdecimal_add_digits a b =
   let (neg_a, ia, fa) = decimal_parse a in
   let (neg_b, ib, fb) = decimal_parse b in
   match neg_a, neg_b with
@@ -454,14 +1050,14 @@ let bigdecimal_add a b =
         decimal_format false ri rf
 
 (* BigDecimal subtraction: a - b = a + (-b) *)
-let bigdecimal_sub a b =
+let bigdecimal_sub_digits a b =
   let (neg_b, ib, fb) = decimal_parse b in
   let neg_b' = not neg_b in
   let b' = decimal_format neg_b' ib fb in
-  bigdecimal_add a b'
+  bigdecimal_add_digits a b'
 
 (* BigDecimal multiplication *)
-let bigdecimal_mul a b =
+let bigdecimal_mul_digits a b =
   let (neg_a, ia, fa) = decimal_parse a in
   let (neg_b, ib, fb) = decimal_parse b in
   let frac_places = String.length fa + String.length fb in
@@ -504,8 +1100,19 @@ let bigdecimal_mul a b =
     let frac_part = String.sub digits (total_digits - frac_places) frac_places in
     decimal_format result_neg int_part frac_part
 
+(* Place the point [frac_digits] from the right of the quotient digits. *)
+let decimal_place_point result_neg q_str frac_digits =
+  let total_digits = String.length q_str in
+  if total_digits <= frac_digits then
+    let padded = String.make (frac_digits - total_digits) '0' ^ q_str in
+    decimal_format result_neg "0" padded
+  else
+    let int_part = String.sub q_str 0 (total_digits - frac_digits) in
+    let frac_part = String.sub q_str (total_digits - frac_digits) frac_digits in
+    decimal_format result_neg int_part frac_part
+
 (* BigDecimal division with specified precision *)
-let bigdecimal_div a b ?(precision=20) () =
+let bigdecimal_div_digits a b precision =
   let (neg_a, ia, fa) = decimal_parse a in
   let (neg_b, ib, fb) = decimal_parse b in
   (* Check for division by zero *)
@@ -585,30 +1192,22 @@ let bigdecimal_div a b ?(precision=20) () =
   (* The result has (precision + max(0, -scale_diff)) fractional digits *)
   (* But we also need to account for scale_diff *)
   let frac_digits = precision + (if scale_diff > 0 then scale_diff else 0) in
-  let total_digits = String.length q_str in
-  let result_neg = neg_a <> neg_b in
-  if total_digits <= frac_digits then
-    let padded = String.make (frac_digits - total_digits) '0' ^ q_str in
-    decimal_format result_neg "0" padded
-  else
-    let int_part = String.sub q_str 0 (total_digits - frac_digits) in
-    let frac_part = String.sub q_str (total_digits - frac_digits) frac_digits in
-    decimal_format result_neg int_part frac_part
+  decimal_place_point (neg_a <> neg_b) q_str frac_digits
 
 (* BigDecimal negation *)
-let bigdecimal_neg a =
+let bigdecimal_neg_digits a =
   let (neg, i, f) = decimal_parse a in
   let is_zero = strip_leading_zeros i = "0" && strip_trailing_zeros f = "" in
   if is_zero then a
   else decimal_format (not neg) i f
 
 (* BigDecimal absolute value *)
-let bigdecimal_abs a =
+let bigdecimal_abs_digits a =
   let (_, i, f) = decimal_parse a in
   decimal_format false i f
 
 (* BigDecimal comparison: returns -1, 0, 1 *)
-let bigdecimal_compare a b =
+let bigdecimal_compare_digits a b =
   let (neg_a, ia, fa) = decimal_parse a in
   let (neg_b, ib, fb) = decimal_parse b in
   let a_zero = strip_leading_zeros ia = "0" && strip_trailing_zeros fa = "" in
@@ -620,6 +1219,101 @@ let bigdecimal_compare a b =
   | false, false -> decimal_compare_abs ia fa ib fb
   | true, true -> -(decimal_compare_abs ia fa ib fb)
 
+(* Arithmetic on decimal values (Types.decimal). Two DSmall operands
+   are worked on as scaled ints, with no string in between; a DBig
+   operand, or a result that could overflow, goes through the
+   digit-string code above. Results are trimmed of trailing fractional
+   zeros either way, as decimal_format does. *)
+
+(* The DSmall for m / 10^k, trailing zeros trimmed, or its DBig when the
+   spelling is too long to be read back as a DSmall. *)
+let decimal_result m k =
+  let rec trim m k = if k > 0 && m mod 10 = 0 then trim (m / 10) (k - 1) else (m, k) in
+  let (m, k) = trim m k in
+  let rec ndigits n d = if n < 10 then d else ndigits (n / 10) (d + 1) in
+  if m <> min_int && max (ndigits (abs m) 1) (k + 1) <= decimal_small_digits
+  then DSmall (m, k)
+  else DBig (decimal_spell m k)
+
+let decimal_digits f a b = decimal_of_string (f (string_of_decimal a) (string_of_decimal b))
+
+(* m * 10^d, if that leaves room for one more addition without overflow. *)
+let decimal_scale_up m d =
+  if d > decimal_small_digits || abs m > (max_int / 2) / pow10.(d) then None
+  else Some (m * pow10.(d))
+
+let decimal_small_aligned a b f =
+  match a, b with
+  | DSmall (ma, ka), DSmall (mb, kb) ->
+      let k = max ka kb in
+      (match decimal_scale_up ma (k - ka), decimal_scale_up mb (k - kb) with
+       | Some x, Some y -> Some (f x y k)
+       | _ -> None)
+  | _ -> None
+
+let bigdecimal_add a b =
+  match decimal_small_aligned a b (fun x y k -> decimal_result (x + y) k) with
+  | Some r -> r
+  | None -> decimal_digits bigdecimal_add_digits a b
+
+let bigdecimal_sub a b =
+  match decimal_small_aligned a b (fun x y k -> decimal_result (x - y) k) with
+  | Some r -> r
+  | None -> decimal_digits bigdecimal_sub_digits a b
+
+let bigdecimal_compare a b =
+  match decimal_small_aligned a b (fun x y _ -> compare x y) with
+  | Some c -> c
+  | None -> bigdecimal_compare_digits (string_of_decimal a) (string_of_decimal b)
+
+let bigdecimal_mul a b =
+  match a, b with
+  | DSmall (ma, ka), DSmall (mb, kb) when ma = 0 || abs mb <= max_int / abs ma ->
+      decimal_result (ma * mb) (ka + kb)
+  | _ -> decimal_digits bigdecimal_mul_digits a b
+
+(* Trimmed like the digit-string versions; neg returns a zero as it was. *)
+let bigdecimal_neg = function
+  | DSmall (0, _) as a -> a
+  | DSmall (m, k) -> decimal_result (- m) k
+  | DBig s -> decimal_of_string (bigdecimal_neg_digits s)
+
+let bigdecimal_abs = function
+  | DSmall (m, k) -> decimal_result (abs m) k
+  | DBig s -> decimal_of_string (bigdecimal_abs_digits s)
+
+(* Trailing fractional zeros dropped, as decimal_normalize does. *)
+let decimal_trim = function
+  | DSmall (m, k) -> decimal_result m k
+  | DBig s -> decimal_of_string (decimal_normalize s)
+
+(* Same truncating long division as bigdecimal_div_digits, done on ints:
+   the remainder stays below the divisor, so rem * 10 cannot overflow.
+   The quotient carries [precision] fractional digits, more than a DSmall
+   holds, so it is built as a string. *)
+let bigdecimal_div a b ?(precision=20) () =
+  match a, b with
+  | DSmall _, DSmall (0, _) -> raise (RuntimeError "Division by zero")
+  | DSmall (ma, ka), DSmall (mb, kb) when abs mb <= max_int / 10 ->
+      let scale_diff = ka - kb in
+      let extra = precision + (if scale_diff < 0 then - scale_diff else 0) in
+      let num = abs ma and den = abs mb in
+      let buf = Buffer.create 48 in
+      Buffer.add_string buf (string_of_int (num / den));
+      let rem = ref (num mod den) in
+      for _ = 1 to extra do
+        let r = !rem * 10 in
+        Buffer.add_char buf (Char.chr (48 + r / den));
+        rem := r mod den
+      done;
+      let frac_digits = precision + (if scale_diff > 0 then scale_diff else 0) in
+      decimal_of_string
+        (decimal_place_point ((ma < 0) <> (mb < 0)) (strip_leading_zeros (Buffer.contents buf))
+           frac_digits)
+  | _ ->
+      decimal_of_string
+        (bigdecimal_div_digits (string_of_decimal a) (string_of_decimal b) precision)
+
 (* Helper to format decimal values - now just normalizes *)
 let format_decimal f =
   let s = string_of_float f in
@@ -733,8 +1427,8 @@ let ws_read_exact transport n =
   let pos = ref 0 in
   while !pos < n do
     let got = match transport with
-      | WsPlain fd -> Unix.read fd buf !pos (n - !pos)
-      | WsTls ssl -> Ssl.read ssl buf !pos (n - !pos)
+      | WsPlain fd -> socket_read_fd fd buf !pos (n - !pos)
+      | WsTls ssl -> tls_read ssl buf !pos (n - !pos)
     in
     if got = 0 then raise (RuntimeError "WebSocket: connection closed");
     pos := !pos + got
@@ -744,10 +1438,52 @@ let ws_read_exact transport n =
 let ws_write transport data =
   let len = String.length data in
   let _ = match transport with
-    | WsPlain fd -> Unix.write_substring fd data 0 len
-    | WsTls ssl -> Ssl.write_substring ssl data 0 len
+    | WsPlain fd -> socket_write_fd_substring fd data 0 len
+    | WsTls ssl -> tls_write_substring ssl data 0 len
   in ()
 
+(* ---- Readiness polling (poll_stubs.c) ---- *)
+external poller_create : unit -> Unix.file_descr = "sigil_poller_create"
+external poller_ctl : Unix.file_descr -> int -> Unix.file_descr -> int -> unit = "sigil_poller_ctl"
+external poller_wait : Unix.file_descr -> int -> int -> int array = "sigil_poller_wait"
+external fd_to_int : Unix.file_descr -> int = "%identity"
+
+let poll_read = 1 and poll_write = 2
+let poll_op_add = 0 and poll_op_modify = 1 and poll_op_remove = 2
+
+(* The fd a socket value is polled on. *)
+let socket_fd caller = function
+  | VSocket fd | VWsSocket (WsPlain fd) -> fd
+  | VTlsSocket ssl | VWsSocket (WsTls ssl) -> Ssl.file_descr_of_socket ssl
+  | v -> raise (RuntimeError (caller ^ ": expected a socket, got " ^ string_of_value_type v))
+
+let poll_events_of_string caller = function
+  | "r" -> poll_read
+  | "w" -> poll_write
+  | "rw" | "wr" -> poll_read lor poll_write
+  | s -> raise (RuntimeError (caller ^ ": events must be \"r\", \"w\" or \"rw\", got " ^ s))
+
+let string_of_poll_events mask =
+  if mask = poll_read lor poll_write then "rw"
+  else if mask = poll_write then "w"
+  else "r"
+
+let open_poller caller p =
+  if not p.poll_open then raise (RuntimeError (caller ^ ": poller is closed"));
+  p.poll_fd
+
+(* The stubs report failures as Failure "<op>: <strerror>". *)
+let poll_call f = try f () with Failure msg -> raise (RuntimeError msg)
+
+(* Reads and writes on a socket put in non-blocking mode: None when the
+   call would block, for TLS also when the record layer needs more
+   input or output first. *)
+let unless_would_block f =
+  try Some (f ()) with
+  | Unix.Unix_error ((Unix.EAGAIN | Unix.EWOULDBLOCK), _, _)
+  | Ssl.Read_error (Ssl.Error_want_read | Ssl.Error_want_write)
+  | Ssl.Write_error (Ssl.Error_want_read | Ssl.Error_want_write) -> None
+
 (* Server-side handshake: read HTTP request, extract key, send response *)
 let ws_server_handshake transport =
   (* Read HTTP upgrade request *)
@@ -882,24 +1618,1055 @@ let ws_send_close transport ~masked =
   ws_write transport (Buffer.contents buf)
 
 
+(* Compiled-regex cache. Every regex_* builtin that receives a pattern
+   string goes through here, so a (regex_match pat line) inside a loop
+   compiles once and then reuses the same matcher (and the DFA states Re
+   builds lazily on it). Bounded LRU: when full, the least recently used
+   pattern is evicted. Re grows those DFA states as it matches, so each
+   domain keeps a cache (and matchers) of its own. *)
+let regex_cache_capacity = 128
+
+type regex_cache = {
+  compiled : (string, Re.re * int ref) Hashtbl.t;
+  mutable clock : int;
+}
+
+let regex_cache_key =
+  Domain.DLS.new_key (fun () ->
+    { compiled = Hashtbl.create regex_cache_capacity; clock = 0 })
+
+let regex_compile_cached pattern =
+  let cache = Domain.DLS.get regex_cache_key in
+  cache.clock <- cache.clock + 1;
+  match Hashtbl.find_opt cache.compiled pattern with
+  | Some (re, stamp) ->
+      stamp := cache.clock;
+      re
+  | None ->
+      let re =
+        try Re.Perl.compile_pat ~opts:[`Multiline] pattern
+        with Re.Perl.Parse_error -> raise (RuntimeError ("Invalid regex pattern: " ^ pattern))
+           | Re.Perl.Not_supported -> raise (RuntimeError ("Regex feature not supported: " ^ pattern))
+      in
+      if Hashtbl.length cache.compiled >= regex_cache_capacity then begin
+        let victim = Hashtbl.fold (fun k (_, stamp) acc ->
+          match acc with
+          | Some (_, oldest) when oldest <= !stamp -> acc
+          | _ -> Some (k, !stamp)
+        ) cache.compiled None in
+        match victim with
+        | Some (k, _) -> Hashtbl.remove cache.compiled k
+        | None -> ()
+      end;
+      Hashtbl.replace cache.compiled pattern (re, ref cache.clock);
+      re
+
+(* Matcher for a regex_* argument: a compiled VRegex, or a pattern string.
+   A VRegex's matcher belongs to the main domain; workers use their own. *)
+let regex_of_value caller = function
+  | VRegex (_, re) when Domain.is_main_domain () -> re
+  | VRegex (pattern, _) -> regex_compile_cached pattern
+  | VString pattern -> regex_compile_cached pattern
+  | v -> raise (RuntimeError (caller ^ ": expected regex or pattern string, got " ^ string_of_value_type v))
+
 (* String representation of values *)
 let rec string_of_value = function
   | VInt n -> Int64.to_string n
   | VFloat f -> format_float_string f
-  | VDecimal s -> s
+  | VDecimal d -> string_of_decimal d
   | VString s -> s
   | VBool b -> string_of_bool b
    | VUnit -> "unit"
    | VArray arr ->
-       let vals = Array.to_list !arr in
+       let vals = Array.to_list (vget arr) in
        "[" ^ String.concat ", " (List.map string_of_value vals) ^ "]"
    | VMap _ -> "<map>"
-   | VFunction (name, _, _, _) -> "<function:" ^ name ^ ">"
+   | VRegex (pattern, _) -> pattern
+   | VFunction (name, _, _, _, _) -> "<function:" ^ name ^ ">"
    | VSocket _ -> "<socket>"
    | VTlsSocket _ -> "<tls_socket>"
    | VWsSocket _ -> "<ws_socket>"
    | VChannel _ -> "<channel>"
    | VProcess pid -> "<process:" ^ string_of_int pid ^ ">"
+   | VPoller _ -> "<poller>"
+   | VSqlite _ -> "<sqlite>"
+   | VSqliteStmt _ -> "<sqlite_stmt>"
+   | VBuilder b -> Buffer.contents b
+   | VRope _ as v -> string_of_value (flat_value v)
+   | VSeq sq -> "<seq:" ^ sq.seq_kind ^ ">"
+
+(* ===== JSON engine ===== *)
+
+(* Single pass over the source with a moving cursor: scalars and keys are
+   cut out of the input once, with no intermediate substrings. Keys go
+   through [intern], so for an NDJSON stream sharing one reader table the
+   records share one copy of each key string. *)
+type json_reader = {
+  src : string;
+  mutable at : int;
+  intern : (string, string) Hashtbl.t;
+}
+
+(* Projection: object members not named are skipped unparsed. At an
+   object a key is looked up, then "*"; at an array element i, "i" then
+   "*". An array level no path names (no index key there) passes the
+   projection through to every element. Where paths do name indices, an
+   element none of them selects is skipped unparsed and read as null, so
+   the kept elements stay at their indices. *)
+type json_proj = Keep_all | Keep_keys of (string, json_proj) Hashtbl.t
+
+let json_intern_limit = 4096  (* stop interning keys that look like data *)
+
+let json_reader ?(intern = Hashtbl.create 64) src = { src; at = 0; intern }
+
+let rec json_skip_ws r =
+  if r.at < String.length r.src then
+    match String.unsafe_get r.src r.at with
+    | ' ' | '\t' | '\n' | '\r' -> r.at <- r.at + 1; json_skip_ws r
+    | _ -> ()
+
+let json_hex4 s i =
+  if i + 4 > String.length s then -1
+  else begin
+    let digit c = match c with
+      | '0'..'9' -> Char.code c - 48
+      | 'a'..'f' -> Char.code c - 87
+      | 'A'..'F' -> Char.code c - 55
+      | _ -> -1 in
+    let rec go k acc =
+      if k = 4 then acc
+      else match digit s.[i + k] with
+        | -1 -> -1
+        | d -> go (k + 1) (acc * 16 + d)
+    in
+    go 0 0
+  end
+
+let json_add_code buf code =
+  let u = if Uchar.is_valid code then Uchar.of_int code else Uchar.rep in
+  Buffer.add_utf_8_uchar buf u
+
+(* Body of a string literal; r.at is just past the opening quote. An
+   unterminated literal runs to the end of input. *)
+let json_read_string r =
+  let s = r.src and n = String.length r.src in
+  let start = r.at in
+  let rec plain i =
+    if i >= n then i
+    else match String.unsafe_get s i with
+      | '"' | '\\' -> i
+      | _ -> plain (i + 1)
+  in
+  let i = plain start in
+  if i >= n || String.unsafe_get s i = '"' then begin
+    r.at <- min n (i + 1);
+    String.sub s start (i - start)
+  end else begin
+    let buf = Buffer.create (i - start + 16) in
+    Buffer.add_substring buf s start (i - start);
+    let rec loop i =
+      if i >= n then i
+      else match String.unsafe_get s i with
+        | '"' -> i + 1
+        | '\\' when i + 1 < n ->
+            (match s.[i + 1] with
+             | 'n' -> Buffer.add_char buf '\n'; loop (i + 2)
+             | 't' -> Buffer.add_char buf '\t'; loop (i + 2)
+             | 'r' -> Buffer.add_char buf '\r'; loop (i + 2)
+             | 'b' -> Buffer.add_char buf '\b'; loop (i + 2)
+             | 'f' -> Buffer.add_char buf '\012'; loop (i + 2)
+             | 'u' when json_hex4 s (i + 2) >= 0 ->
+                 let hi = json_hex4 s (i + 2) in
+                 let lo =
+                   if hi >= 0xD800 && hi <= 0xDBFF && matches_at s (i + 6) "\\u"
+                   then json_hex4 s (i + 8) else -1 in
+                 if lo >= 0xDC00 && lo <= 0xDFFF then begin
+                   json_add_code buf (0x10000 + ((hi - 0xD800) lsl 10) + (lo - 0xDC00));
+                   loop (i + 12)
+                 end else begin
+                   json_add_code buf hi;
+                   loop (i + 6)
+                 end
+             | c -> Buffer.add_char buf c; loop (i + 2))
+        | c -> Buffer.add_char buf c; loop (i + 1)
+    in
+    r.at <- loop i;
+    Buffer.contents buf
+  end
+
+let json_read_key r =
+  let k = json_read_string r in
+  match Hashtbl.find_opt r.intern k with
+  | Some shared -> shared
+  | None ->
+      if Hashtbl.length r.intern < json_intern_limit then Hashtbl.add r.intern k k;
+      k
+
+(* Ints of up to 18 digits are accumulated in place; longer ones and
+   floats go through the stdlib parsers. *)
+let json_read_number r =
+  let s = r.src and n = String.length r.src in
+  let start = r.at in
+  let is_float = ref false in
+  let rec scan i =
+    if i >= n then i
+    else match String.unsafe_get s i with
+      | '0'..'9' | '-' -> scan (i + 1)
+      | '.' | 'e' | 'E' | '+' -> is_float := true; scan (i + 1)
+      | _ -> i
+  in
+  let stop = scan start in
+  r.at <- stop;
+  let text () = String.sub s start (stop - start) in
+  let invalid () = raise (RuntimeError ("Invalid JSON number: " ^ text ())) in
+  if !is_float then
+    (match float_of_string_opt (text ()) with
+     | Some f -> VFloat f
+     | None -> invalid ())
+  else begin
+    let neg = String.unsafe_get s start = '-' in
+    let first = if neg then start + 1 else start in
+    let rec digits i acc =
+      if i >= stop then acc
+      else match String.unsafe_get s i with
+        | '0'..'9' as c -> digits (i + 1) (acc * 10 + Char.code c - 48)
+        | _ -> -1
+    in
+    let v = if stop - first >= 1 && stop - first <= 18 then digits first 0 else -1 in
+    if v >= 0 then VInt (Int64.of_int (if neg then - v else v))
+    else match Int64.of_string_opt (text ()) with
+      | Some x -> VInt x
+      | None -> invalid ()
+  end
+
+(* Step over one value without building it. Not validated. *)
+let json_skip_value r =
+  json_skip_ws r;
+  let s = r.src and n = String.length r.src in
+  let rec str i =
+    if i >= n then n
+    else match String.unsafe_get s i with
+      | '"' -> i + 1
+      | '\\' -> str (i + 2)
+      | _ -> str (i + 1)
+  in
+  let rec nested i depth =
+    if i >= n then n
+    else match String.unsafe_get s i with
+      | '"' -> nested (str (i + 1)) depth
+      | '{' | '[' -> nested (i + 1) (depth + 1)
+      | '}' | ']' -> if depth = 1 then i + 1 else nested (i + 1) (depth - 1)
+      | _ -> nested (i + 1) depth
+  in
+  let rec scalar i =
+    if i >= n then n
+    else match String.unsafe_get s i with
+      | ',' | '}' | ']' | ' ' | '\t' | '\n' | '\r' -> i
+      | _ -> scalar (i + 1)
+  in
+  if r.at < n then
+    r.at <- (match String.unsafe_get s r.at with
+             | '"' -> str (r.at + 1)
+             | '{' | '[' -> nested r.at 0
+             | _ -> scalar r.at)
+
+let json_sub_proj wanted key =
+  match Hashtbl.find_opt wanted key with
+  | Some _ as sub -> sub
+  | None -> Hashtbl.find_opt wanted "*"
+
+(* Lenient like the parser it replaces: stray commas are skipped, a missing
+   ':' is tolerated, and an unterminated object or array ends at EOF. *)
+let rec json_read_value r proj =
+  json_skip_ws r;
+  let s = r.src in
+  if r.at >= String.length s then raise (RuntimeError "Unexpected end of JSON input")
+  else match String.unsafe_get s r.at with
+    | '{' -> r.at <- r.at + 1; json_read_object r proj
+    | '[' -> r.at <- r.at + 1; json_read_array r proj
+    | '"' -> r.at <- r.at + 1; VString (json_read_string r)
+    | 't' when matches_at s r.at "true" -> r.at <- r.at + 4; VBool true
+    | 'f' when matches_at s r.at "false" -> r.at <- r.at + 5; VBool false
+    | 'n' when matches_at s r.at "null" -> r.at <- r.at + 4; VUnit
+    | '-' | '0'..'9' -> json_read_number r
+    | c -> raise (RuntimeError (Printf.sprintf
+             "Unexpected character '%c' at position %d in JSON" c r.at))
+
+and json_read_object r proj =
+  let m = Hashtbl.create 8 and keys = keys_create () in
+  let s = r.src and n = String.length r.src in
+  let rec loop () =
+    json_skip_ws r;
+    if r.at < n then
+      match String.unsafe_get s r.at with
+      | '}' -> r.at <- r.at + 1
+      | ',' -> r.at <- r.at + 1; loop ()
+      | '"' ->
+          r.at <- r.at + 1;
+          let key = json_read_key r in
+          json_skip_ws r;
+          if r.at < n && String.unsafe_get s r.at = ':' then r.at <- r.at + 1;
+          (match proj with
+           | Keep_all -> vmap_set m keys key (json_read_value r Keep_all)
+           | Keep_keys wanted ->
+               (match json_sub_proj wanted key with
+                | Some sub -> vmap_set m keys key (json_read_value r sub)
+                | None -> json_skip_value r));
+          loop ()
+      | _ -> ()
+  in
+  loop ();
+  VMap (m, keys)
+
+and json_read_array r proj =
+  let items = vec_of_array [||] in
+  (* Some key here is not an index: a path that left this level out. *)
+  let passes_through = lazy (match proj with
+    | Keep_all -> true
+    | Keep_keys wanted ->
+        Hashtbl.fold (fun k _ acc ->
+          acc || (k <> "*" && int_of_string_opt k = None)) wanted false) in
+  let s = r.src and n = String.length r.src in
+  let rec loop () =
+    json_skip_ws r;
+    if r.at < n then
+      match String.unsafe_get s r.at with
+      | ']' -> r.at <- r.at + 1
+      | ',' -> r.at <- r.at + 1; loop ()
+      | _ ->
+          (match proj with
+           | Keep_all -> vec_push items (json_read_value r Keep_all)
+           | Keep_keys wanted ->
+               (match json_sub_proj wanted (string_of_int items.len) with
+                | Some sub -> vec_push items (json_read_value r sub)
+                | None when Lazy.force passes_through -> vec_push items (json_read_value r proj)
+                | None -> json_skip_value r; vec_push items VUnit));
+          loop ()
+  in
+  loop ();
+  VArray items
+
+(* Build a projection from key paths, each an array of segments as taken
+   by json_get (strings; ints index arrays; "*" matches anything) or a
+   dotted string. An empty path keeps the whole document. *)
+let json_projection paths =
+  let root = Hashtbl.create 8 in
+  let whole = ref false in
+  let rec add tbl = function
+    | [] -> ()
+    | [k] -> Hashtbl.replace tbl k Keep_all
+    | k :: rest ->
+        (match Hashtbl.find_opt tbl k with
+         | Some Keep_all -> ()
+         | Some (Keep_keys sub) -> add sub rest
+         | None ->
+             let sub = Hashtbl.create 4 in
+             Hashtbl.replace tbl k (Keep_keys sub);
+             add sub rest)
+  in
+  let segment = function
+    | VString k -> k
+    | VInt i -> Int64.to_string i
+    | v -> raise (RuntimeError ("json path segment must be string or int, got "
+                                ^ string_of_value_type v))
+  in
+  Array.iter (fun path ->
+    let segs = match path with
+      | VArray a -> List.map segment (Array.to_list (vget a))
+      | VString p -> String.split_on_char '.' p
+      | v -> raise (RuntimeError ("json path must be an array or dotted string, got "
+                                  ^ string_of_value_type v))
+    in
+    if segs = [] then whole := true else add root segs
+  ) paths;
+  if !whole then Keep_all else Keep_keys root
+
+let json_parse_string ?intern ?(proj = Keep_all) s =
+  json_read_value (json_reader ?intern s) proj
+
+let json_escape_into buf str =
+  Buffer.add_char buf '"';
+  let n = String.length str in
+  let from = ref 0 in
+  for i = 0 to n - 1 do
+    let c = String.unsafe_get str i in
+    if c = '"' || c = '\\' || c < ' ' then begin
+      Buffer.add_substring buf str !from (i - !from);
+      (match c with
+       | '"' -> Buffer.add_string buf "\\\""
+       | '\\' -> Buffer.add_string buf "\\\\"
+       | '\n' -> Buffer.add_string buf "\\n"
+       | '\r' -> Buffer.add_string buf "\\r"
+       | '\t' -> Buffer.add_string buf "\\t"
+       | '\b' -> Buffer.add_string buf "\\b"
+       | '\012' -> Buffer.add_string buf "\\f"
+       | c -> Buffer.add_string buf (Printf.sprintf "\\u%04x" (Char.code c)));
+      from := i + 1
+    end
+  done;
+  Buffer.add_substring buf str !from (n - !from);
+  Buffer.add_char buf '"'
+
+let rec json_write buf v =
+  match v with
+  | VMap (m, keys) ->
+      Buffer.add_char buf '{';
+      let first = ref true in
+      keys_iter (fun k ->
+        match Hashtbl.find_opt m k with
+        | Some v ->
+            if not !first then Buffer.add_char buf ',';
+            first := false;
+            json_escape_into buf k;
+            Buffer.add_char buf ':';
+            json_write buf v
+        | None -> ()
+      ) keys;
+      Buffer.add_char buf '}'
+  | VArray arr ->
+      Buffer.add_char buf '[';
+      for i = 0 to arr.len - 1 do
+        if i > 0 then Buffer.add_char buf ',';
+        json_write buf arr.data.(i)
+      done;
+      Buffer.add_char buf ']'
+  | VString s -> json_escape_into buf s
+  | VInt n -> Buffer.add_string buf (Int64.to_string n)
+  | VFloat f -> Buffer.add_string buf (string_of_float f)
+  | VBool b -> Buffer.add_string buf (string_of_bool b)
+  | VUnit -> Buffer.add_string buf "null"
+  | v -> Buffer.add_string buf (string_of_value v)
+
+let json_stringify_value v =
+  let buf = Buffer.create 256 in
+  json_write buf v;
+  Buffer.contents buf
+
+(* NDJSON over a stream of lines: blank lines are skipped, all records
+   share one key-intern table, and errors name the line. *)
+let ndjson_seq lines proj =
+  let intern = Hashtbl.create 64 in
+  let line_no = ref 0 in
+  let rec next () =
+    match lines.next () with
+    | None -> None
+    | Some (VString line) ->
+        incr line_no;
+        let r = json_reader ~intern line in
+        json_skip_ws r;
+        if r.at >= String.length line then next ()
+        else (try Some (json_read_value r proj)
+              with RuntimeError msg ->
+                raise (RuntimeError (Printf.sprintf "ndjson_lines: line %d: %s" !line_no msg)))
+    | Some v ->
+        raise (RuntimeError ("ndjson_lines: expected string lines, got " ^ string_of_value_type v))
+  in
+  { next; seq_kind = "ndjson_lines"; close = lines.close }
+
+(* ===== Channel wire format ===== *)
+
+(* One message is a u32 LE payload length, then one encoded value:
+     'i' int64 LE | 'f' float bits, int64 LE | 'T' / 'F' bool | 'u' unit
+     's' / 'd' / 'r' u32 length + bytes (string, decimal, regex source)
+     'a' u32 count + values | 'm' u32 count + (u32 key length, key, value)*
+   Maps keep their key order; a regex is recompiled on receipt. *)
+let wire_add_u32 buf n =
+  Buffer.add_int32_le buf (Int32.of_int n)
+
+let wire_add_bytes buf tag s =
+  Buffer.add_char buf tag;
+  wire_add_u32 buf (String.length s);
+  Buffer.add_string buf s
+
+let rec wire_encode buf v =
+  match v with
+  | VInt n -> Buffer.add_char buf 'i'; Buffer.add_int64_le buf n
+  | VFloat f -> Buffer.add_char buf 'f'; Buffer.add_int64_le buf (Int64.bits_of_float f)
+  | VBool b -> Buffer.add_char buf (if b then 'T' else 'F')
+  | VUnit -> Buffer.add_char buf 'u'
+  | VString s -> wire_add_bytes buf 's' s
+  | VDecimal d -> wire_add_bytes buf 'd' (string_of_decimal d)
+  | VRegex (src, _) -> wire_add_bytes buf 'r' src
+  | VArray arr ->
+      Buffer.add_char buf 'a';
+      wire_add_u32 buf arr.len;
+      for i = 0 to arr.len - 1 do wire_encode buf arr.data.(i) done
+  | VMap (m, keys) ->
+      Buffer.add_char buf 'm';
+      wire_add_u32 buf (Hashtbl.length m);
+      keys_iter (fun k ->
+        wire_add_u32 buf (String.length k);
+        Buffer.add_string buf k;
+        wire_encode buf (Hashtbl.find m k)) keys
+  | _ -> raise (RuntimeError ("channel_send: cannot send a " ^ string_of_value_type v))
+
+(* The whole message (length header included) as one string, so it goes
+   out in a single write where the pipe allows. *)
+let wire_message v =
+  let buf = Buffer.create 64 in
+  wire_add_u32 buf 0;
+  wire_encode buf v;
+  let msg = Buffer.to_bytes buf in
+  Bytes.set_int32_le msg 0 (Int32.of_int (Bytes.length msg - 4));
+  Bytes.unsafe_to_string msg
+
+(* Every length and count comes from the peer, so each is checked
+   against the bytes left before anything is allocated for it: an array
+   element takes at least 1 byte (its tag), a map entry at least 5 (key
+   length and value tag). *)
+let wire_decode s =
+  let pos = ref 0 in
+  let need n =
+    if n < 0 || n > String.length s - !pos then raise (RuntimeError "channel_recv: malformed message")
+  in
+  let u32 () =
+    need 4;
+    let n = Int32.to_int (String.get_int32_le s !pos) land 0xFFFFFFFF in
+    pos := !pos + 4;
+    n
+  in
+  let count min_bytes =
+    let n = u32 () in
+    need (n * min_bytes);
+    n
+  in
+  let i64 () =
+    need 8;
+    let n = String.get_int64_le s !pos in
+    pos := !pos + 8;
+    n
+  in
+  let bytes () =
+    let n = u32 () in
+    need n;
+    let b = String.sub s !pos n in
+    pos := !pos + n;
+    b
+  in
+  let rec value () =
+    need 1;
+    let tag = s.[!pos] in
+    incr pos;
+    match tag with
+    | 'i' -> VInt (i64 ())
+    | 'f' -> VFloat (Int64.float_of_bits (i64 ()))
+    | 'T' -> VBool true
+    | 'F' -> VBool false
+    | 'u' -> VUnit
+    | 's' -> VString (bytes ())
+    | 'd' -> VDecimal (decimal_of_string (bytes ()))
+    | 'r' -> let src = bytes () in VRegex (src, regex_compile_cached src)
+    | 'a' ->
+        let n = count 1 in
+        let v = vec_of_array (Array.make n VUnit) in
+        for i = 0 to n - 1 do v.data.(i) <- value () done;
+        VArray v
+    | 'm' ->
+        let n = count 5 in
+        let m = Hashtbl.create (max 8 n) and keys = keys_create () in
+        for _ = 1 to n do
+          let k = bytes () in
+          vmap_set m keys k (value ())
+        done;
+        VMap (m, keys)
+    | c -> raise (RuntimeError (Printf.sprintf "channel_recv: bad value tag %C" c))
+  in
+  let v = value () in
+  if !pos <> String.length s then raise (RuntimeError "channel_recv: trailing bytes in message");
+  v
+
+let rec write_all fd s off len =
+  if len > 0 then begin
+    let n = file_write_fd_substring fd s off len in
+    write_all fd s (off + n) (len - n)
+  end
+
+(* Read-ahead buffer per channel read end, so a stream of small messages
+   costs one read per buffer rather than two per message. Kept per domain
+   by fd number, and dropped at end of stream or when the fd is closed
+   (channel_forget), so a later channel reusing the number starts empty. *)
+type channel_reader = {
+  rbuf : Bytes.t;
+  mutable rpos : int;
+  mutable rlim : int;
+}
+
+let channel_readers_key : (int, channel_reader) Hashtbl.t Domain.DLS.key =
+  Domain.DLS.new_key (fun () -> Hashtbl.create 8)
+
+let channel_reader fd =
+  let readers = Domain.DLS.get channel_readers_key in
+  match Hashtbl.find_opt readers (fd_to_int fd) with
+  | Some r -> r
+  | None ->
+      let r = { rbuf = Bytes.create 65536; rpos = 0; rlim = 0 } in
+      Hashtbl.replace readers (fd_to_int fd) r;
+      r
+
+let channel_forget fd =
+  Hashtbl.remove (Domain.DLS.get channel_readers_key) (fd_to_int fd)
+
+(* Fill [dst] exactly from the channel; false if the stream ends first. *)
+let channel_read_exact fd r dst =
+  let n = Bytes.length dst in
+  let rec go got =
+    if got >= n then true
+    else if r.rpos < r.rlim then begin
+      let k = min (n - got) (r.rlim - r.rpos) in
+      Bytes.blit r.rbuf r.rpos dst got k;
+      r.rpos <- r.rpos + k;
+      go (got + k)
+    end
+    else if n - got >= Bytes.length r.rbuf then begin
+      (* Large remainder: read straight into place. *)
+      let k = file_read_fd fd dst got (n - got) in
+      if k = 0 then false else go (got + k)
+    end
+    else begin
+      let k = file_read_fd fd r.rbuf 0 (Bytes.length r.rbuf) in
+      r.rpos <- 0;
+      r.rlim <- k;
+      if k = 0 then false else go got
+    end
+  in
+  go 0
+
+(* Next message, or None at end of stream before a message starts. *)
+let channel_read_message fd =
+  let r = channel_reader fd in
+  let header = Bytes.create 4 in
+  if not (channel_read_exact fd r header) then begin channel_forget fd; None end
+  else begin
+    let len = Int32.to_int (Bytes.get_int32_le header 0) land 0xFFFFFFFF in
+    let payload = Bytes.create len in
+    if not (channel_read_exact fd r payload) then begin
+      channel_forget fd;
+      raise (RuntimeError "channel_recv: stream ended inside a message")
+    end;
+    Some (wire_decode (Bytes.unsafe_to_string payload))
+  end
+
+(* ===== SQLite ===== *)
+
+(* Errors from the binding come back as RuntimeError "<caller>: <sqlite
+   message>". Every Sqlite3 call runs under sqlite_guard, which also
+   covers a finalized statement and a column or parameter index out of
+   range. *)
+let sqlite_fail caller db =
+  raise (RuntimeError (caller ^ ": " ^ Sqlite3.errmsg db))
+
+let sqlite_guard caller f =
+  try f () with
+  | Sqlite3.Error msg -> raise (RuntimeError (caller ^ ": " ^ msg))
+  | Sqlite3.RangeError (i, n) ->
+      raise (RuntimeError (Printf.sprintf "%s: index %d out of range (0..%d)" caller i (n - 1)))
+
+let sqlite_check caller db rc =
+  match rc with
+  | Sqlite3.Rc.OK | Sqlite3.Rc.DONE | Sqlite3.Rc.ROW -> ()
+  | _ -> sqlite_fail caller db
+
+let sqlite_data_of_value caller = function
+  | VInt n -> Sqlite3.Data.INT n
+  | VFloat f -> Sqlite3.Data.FLOAT f
+  | VString s -> Sqlite3.Data.TEXT s
+  | VDecimal d -> Sqlite3.Data.TEXT (string_of_decimal d)  (* as text, so no digits are lost *)
+  | VBool b -> Sqlite3.Data.INT (if b then 1L else 0L)
+  | VUnit -> Sqlite3.Data.NULL
+  | v -> raise (RuntimeError (caller ^ ": cannot bind a " ^ string_of_value_type v))
+
+let value_of_sqlite_data = function
+  | Sqlite3.Data.INT n -> VInt n
+  | Sqlite3.Data.FLOAT f -> VFloat f
+  | Sqlite3.Data.TEXT s | Sqlite3.Data.BLOB s -> VString s
+  | Sqlite3.Data.NULL | Sqlite3.Data.NONE -> VUnit
+
+(* reset repeats the last step's error, which was already reported. *)
+let sqlite_reset caller st =
+  sqlite_guard caller (fun () -> ignore (Sqlite3.reset st.stmt))
+
+(* Rebind a statement from scratch: an array binds ?1.. in order, a map
+   binds named parameters (":name" when the key has no prefix). *)
+let sqlite_bind_params caller st params =
+  sqlite_guard caller (fun () ->
+  let db = st.stmt_db in
+  sqlite_reset caller st;
+  sqlite_check caller db (Sqlite3.clear_bindings st.stmt);
+  match params with
+  | VArray arr ->
+      for i = 0 to arr.len - 1 do
+        sqlite_check caller db
+          (Sqlite3.bind st.stmt (i + 1) (sqlite_data_of_value caller arr.data.(i)))
+      done
+  | VMap (m, keys) ->
+      keys_iter (fun k ->
+        let name = match k.[0] with ':' | '@' | '$' -> k | _ -> ":" ^ k | exception _ -> k in
+        match Sqlite3.bind_parameter_index st.stmt name with
+        | 0 -> raise (RuntimeError (caller ^ ": no parameter " ^ name))
+        | i -> sqlite_check caller db
+                 (Sqlite3.bind st.stmt i (sqlite_data_of_value caller (Hashtbl.find m k)))
+      ) keys
+  | VUnit -> ()
+  | v -> raise (RuntimeError (caller ^ ": parameters must be an array or map, got "
+                              ^ string_of_value_type v)))
+
+(* Next row as an array of column values, or None when done. *)
+let sqlite_next_row caller st =
+  sqlite_guard caller (fun () ->
+  match Sqlite3.step st.stmt with
+  | Sqlite3.Rc.ROW ->
+      let n = Sqlite3.column_count st.stmt in
+      Some (VArray (vec_of_array (Array.init n (fun i ->
+        value_of_sqlite_data (Sqlite3.column st.stmt i)))))
+  | Sqlite3.Rc.DONE -> None
+  | _ -> sqlite_fail caller st.stmt_db)
+
+(* Run a bound statement to completion, ignoring any rows. *)
+let sqlite_run caller st =
+  let rec go () = match sqlite_next_row caller st with Some _ -> go () | None -> () in
+  go ()
+
+let sqlite_prepare caller db sql =
+  sqlite_guard caller (fun () -> { stmt = Sqlite3.prepare db sql; stmt_db = db })
+
+let sqlite_finalize caller st =
+  sqlite_guard caller (fun () -> ignore (Sqlite3.finalize st.stmt))
+
+(* ===== HTTP client ===== *)
+
+(* HTTP/1.1 over plain TCP or the Ssl binding. Idle connections are kept
+   per scheme://host:port and reused while the server allows it, so a
+   run of requests to one host pays for one TCP (and TLS) handshake.
+   The pool is shared by all domains, under its lock. *)
+type http_conn = {
+  conn_fd : Unix.file_descr;
+  conn_tls : Ssl.socket option;
+  conn_buf : Bytes.t;
+  mutable conn_pos : int;
+  mutable conn_lim : int;
+}
+
+type http_framing = Http_fixed of int | Http_chunked | Http_until_close
+
+let http_idle_per_host = 8
+let http_pool : (string, http_conn list) Hashtbl.t = Hashtbl.create 16
+let http_pool_lock = Mutex.create ()
+let http_tls_ctx = ref None  (* under http_pool_lock *)
+
+let with_http_pool f =
+  Mutex.lock http_pool_lock;
+  Fun.protect ~finally:(fun () -> Mutex.unlock http_pool_lock) f
+
+let http_tls_context () =
+  with_http_pool (fun () ->
+    match !http_tls_ctx with
+    | Some ctx -> ctx
+    | None ->
+        (* Verify the peer's chain against the system roots; the host
+           name is checked per connection in http_connect. *)
+        Ssl.init ();
+        let ctx = Ssl.create_context Ssl.TLSv1_2 Ssl.Client_context in
+        ignore (Ssl.set_default_verify_paths ctx);
+        Ssl.set_verify ctx [Ssl.Verify_peer] None;
+        http_tls_ctx := Some ctx;
+        ctx)
+
+let http_close conn =
+  (match conn.conn_tls with
+   | Some ssl -> (try Ssl.shutdown ssl with _ -> ())
+   | None -> ());
+  (try Unix.close conn.conn_fd with Unix.Unix_error _ -> ())
+
+let http_connect scheme host port =
+  let addr =
+    try (Unix.gethostbyname host).Unix.h_addr_list.(0)
+    with Not_found -> raise (RuntimeError ("http: cannot resolve " ^ host))
+  in
+  let fd = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  (try
+     Unix.connect fd (Unix.ADDR_INET (addr, port));
+     Unix.setsockopt fd Unix.TCP_NODELAY true
+   with e -> Unix.close fd; raise e);
+  let tls =
+    if scheme <> "https" then None
+    else begin
+      let ssl = Ssl.embed_socket fd (http_tls_context ()) in
+      (try
+         Ssl.set_client_SNI_hostname ssl host;
+         Ssl.set_host ssl host;
+         Ssl.connect ssl
+       with e -> Unix.close fd; raise e);
+      Some ssl
+    end
+  in
+  { conn_fd = fd; conn_tls = tls; conn_buf = Bytes.create 16384; conn_pos = 0; conn_lim = 0 }
+
+let http_take key =
+  with_http_pool (fun () ->
+    match Hashtbl.find_opt http_pool key with
+    | Some (conn :: rest) -> Hashtbl.replace http_pool key rest; Some conn
+    | _ -> None)
+
+let http_release key conn =
+  let kept = with_http_pool (fun () ->
+    let idle = Option.value (Hashtbl.find_opt http_pool key) ~default:[] in
+    List.length idle < http_idle_per_host
+    && (Hashtbl.replace http_pool key (conn :: idle); true))
+  in
+  if not kept then http_close conn
+
+let http_write conn s =
+  let len = String.length s in
+  let rec go off =
+    if off < len then begin
+      let n = match conn.conn_tls with
+        | Some ssl -> tls_write_substring ssl s off (len - off)
+        | None -> socket_write_fd_substring conn.conn_fd s off (len - off)
+      in
+      go (off + n)
+    end
+  in
+  go 0
+
+(* Refill the read buffer; false at end of stream. *)
+let http_fill conn =
+  let buf = conn.conn_buf in
+  let n = match conn.conn_tls with
+    | Some ssl ->
+        (try tls_read ssl buf 0 (Bytes.length buf)
+         with Ssl.Read_error Ssl.Error_zero_return -> 0)
+    | None -> socket_read_fd conn.conn_fd buf 0 (Bytes.length buf)
+  in
+  conn.conn_pos <- 0;
+  conn.conn_lim <- n;
+  n > 0
+
+(* One header-section line, without its CRLF (or bare LF). *)
+let http_read_line conn =
+  let line = Buffer.create 64 in
+  let rec go () =
+    if conn.conn_pos >= conn.conn_lim && not (http_fill conn) then
+      raise (RuntimeError "http: connection closed mid-response");
+    match Bytes.index_from_opt conn.conn_buf conn.conn_pos '\n' with
+    | Some i when i < conn.conn_lim ->
+        Buffer.add_subbytes line conn.conn_buf conn.conn_pos (i - conn.conn_pos);
+        conn.conn_pos <- i + 1
+    | _ ->
+        Buffer.add_subbytes line conn.conn_buf conn.conn_pos (conn.conn_lim - conn.conn_pos);
+        conn.conn_pos <- conn.conn_lim;
+        go ()
+  in
+  go ();
+  let n = Buffer.length line in
+  if n > 0 && Buffer.nth line (n - 1) = '\r' then Buffer.sub line 0 (n - 1)
+  else Buffer.contents line
+
+(* Up to [n] bytes, buffered ones first; "" at end of stream. *)
+let http_read_some conn n =
+  if conn.conn_pos >= conn.conn_lim && not (http_fill conn) then ""
+  else begin
+    let k = min n (conn.conn_lim - conn.conn_pos) in
+    let s = Bytes.sub_string conn.conn_buf conn.conn_pos k in
+    conn.conn_pos <- conn.conn_pos + k;
+    s
+  end
+
+(* Status line and headers, skipping interim 1xx responses. Header names
+   are lowercased and kept in order. *)
+let rec http_read_head conn =
+  let line = http_read_line conn in
+  match String.split_on_char ' ' line with
+  | version :: code :: _ when String.length version > 5 && String.sub version 0 5 = "HTTP/" ->
+      let status = match int_of_string_opt code with
+        | Some c -> c
+        | None -> raise (RuntimeError ("http: bad status line: " ^ line))
+      in
+      let rec headers acc =
+        match http_read_line conn with
+        | "" -> List.rev acc
+        | h ->
+            (match String.index_opt h ':' with
+             | Some i ->
+                 let name = String.lowercase_ascii (String.trim (String.sub h 0 i)) in
+                 let value = String.trim (String.sub h (i + 1) (String.length h - i - 1)) in
+                 headers ((name, value) :: acc)
+             | None -> headers acc)
+      in
+      let hs = headers [] in
+      if status >= 100 && status < 200 && status <> 101 then http_read_head conn
+      else (version, status, hs)
+  | _ -> raise (RuntimeError ("http: bad status line: " ^ line))
+
+let http_framing meth status headers =
+  if meth = "HEAD" || status = 204 || status = 304 then Http_fixed 0
+  else match List.assoc_opt "transfer-encoding" headers with
+    | Some te when find_sub (String.lowercase_ascii te) "chunked" 0 >= 0 -> Http_chunked
+    | _ ->
+        match List.assoc_opt "content-length" headers with
+        | Some n ->
+            (match int_of_string_opt (String.trim n) with
+             | Some n when n >= 0 -> Http_fixed n
+             | _ -> raise (RuntimeError ("http: bad content-length: " ^ n)))
+        | None -> Http_until_close
+
+let http_keep_alive version headers =
+  match List.assoc_opt "connection" headers with
+  | Some c ->
+      let c = String.lowercase_ascii c in
+      find_sub c "close" 0 < 0 && (version = "HTTP/1.1" || find_sub c "keep-alive" 0 >= 0)
+  | None -> version = "HTTP/1.1"
+
+(* The decoded body as a chunk generator, None at its end, and an abort
+   for a body left unread. [on_end] runs once, told whether the body was
+   read cleanly to its end (and so the connection can serve another
+   request). *)
+let http_body_reader conn framing on_end =
+  let remaining = ref (match framing with Http_fixed n -> n | _ -> 0) in
+  let finished = ref false in
+  let finish clean = if not !finished then begin finished := true; on_end clean end in
+  let piece () =
+    match http_read_some conn (min !remaining 65536) with
+    | "" -> finish false; raise (RuntimeError "http: connection closed mid-body")
+    | s -> remaining := !remaining - String.length s; s
+  in
+  let rec next () =
+    if !finished then None
+    else match framing with
+      | Http_fixed _ -> if !remaining = 0 then (finish true; None) else Some (piece ())
+      | Http_until_close ->
+          (match http_read_some conn 65536 with
+           | "" -> finish false; None
+           | s -> Some s)
+      | Http_chunked when !remaining > 0 ->
+          let s = piece () in
+          if !remaining = 0 then ignore (http_read_line conn);  (* CRLF after the data *)
+          Some s
+      | Http_chunked ->
+          let line = http_read_line conn in
+          let size = match String.index_opt line ';' with
+            | Some i -> String.sub line 0 i
+            | None -> line
+          in
+          (match int_of_string_opt ("0x" ^ String.trim size) with
+           | Some 0 ->
+               let rec trailers () = if http_read_line conn <> "" then trailers () in
+               trailers ();
+               finish true;
+               None
+           | Some n when n > 0 -> remaining := n; next ()
+           | _ -> finish false; raise (RuntimeError ("http: bad chunk size: " ^ line)))
+  in
+  (next, fun () -> finish false)
+
+let http_parse_url url =
+  let scheme, rest =
+    if String.starts_with ~prefix:"https://" url then "https", String.sub url 8 (String.length url - 8)
+    else if String.starts_with ~prefix:"http://" url then "http", String.sub url 7 (String.length url - 7)
+    else raise (RuntimeError ("http: URL must start with http:// or https://: " ^ url))
+  in
+  let cut = match String.index_opt rest '/', String.index_opt rest '?' with
+    | Some a, Some b -> min a b
+    | Some a, None | None, Some a -> a
+    | None, None -> String.length rest
+  in
+  let hostport = String.sub rest 0 cut in
+  let path = String.sub rest cut (String.length rest - cut) in
+  let path = if path = "" then "/" else if path.[0] = '?' then "/" ^ path else path in
+  let default_port = if scheme = "https" then 443 else 80 in
+  let host, port = match String.rindex_opt hostport ':' with
+    | Some i ->
+        (match int_of_string_opt (String.sub hostport (i + 1) (String.length hostport - i - 1)) with
+         | Some p -> String.sub hostport 0 i, p
+         | None -> raise (RuntimeError ("http: bad port in " ^ url)))
+    | None -> hostport, default_port
+  in
+  if host = "" then raise (RuntimeError ("http: no host in " ^ url));
+  (scheme, host, port, path, port = default_port)
+
+let http_guard f =
+  try f () with
+  | Unix.Unix_error (e, _, _) -> raise (RuntimeError ("http: " ^ Unix.error_message e))
+  | Ssl.Connection_error _ | Ssl.Read_error _ | Ssl.Write_error _ ->
+      raise (RuntimeError ("http: TLS error: " ^ Ssl.get_error_string ()))
+
+(* Send one request and read the response head, leaving the body on the
+   wire for the returned reader: (status, headers, (next, abort)). A reused
+   connection the server has meanwhile closed is retried once on a fresh
+   one, for methods that are safe to repeat. *)
+let http_exchange meth url headers body =
+  let scheme, host, port, path, default_port = http_parse_url url in
+  let key = scheme ^ "://" ^ host ^ ":" ^ string_of_int port in
+  let req = Buffer.create 256 in
+  Printf.bprintf req "%s %s HTTP/1.1\r\nHost: %s\r\n" meth path
+    (if default_port then host else host ^ ":" ^ string_of_int port);
+  let given name = List.exists (fun (k, _) -> String.lowercase_ascii k = name) headers in
+  List.iter (fun (k, v) -> Printf.bprintf req "%s: %s\r\n" k v) headers;
+  if not (given "user-agent") then Buffer.add_string req "User-Agent: sigil\r\n";
+  if (body <> "" || List.mem meth ["POST"; "PUT"; "PATCH"]) && not (given "content-length") then
+    Printf.bprintf req "Content-Length: %d\r\n" (String.length body);
+  Buffer.add_string req "\r\n";
+  Buffer.add_string req body;
+  let req = Buffer.contents req in
+  let repeatable = List.mem meth ["GET"; "HEAD"; "OPTIONS"; "PUT"; "DELETE"] in
+  let rec go fresh_only =
+    let pooled = if fresh_only then None else http_take key in
+    let conn = match pooled with
+      | Some conn -> conn
+      | None -> http_guard (fun () -> http_connect scheme host port)
+    in
+    match http_guard (fun () -> http_write conn req; http_read_head conn) with
+    | (version, status, hs) ->
+        let reusable = http_keep_alive version hs in
+        let on_end clean =
+          if clean && reusable && conn.conn_pos >= conn.conn_lim then http_release key conn
+          else http_close conn
+        in
+        (status, hs, http_body_reader conn (http_framing meth status hs) on_end)
+    | exception e ->
+        http_close conn;
+        if Option.is_some pooled && repeatable then go true else raise e
+  in
+  go false
+
+(* Response map: status, headers (lowercased names, repeats joined with
+   ", "), and the body as given. *)
+let http_response status headers body =
+  let hm = Hashtbl.create 16 and hkeys = keys_create () in
+  List.iter (fun (k, v) ->
+    match Hashtbl.find_opt hm k with
+    | Some (VString prev) -> Hashtbl.replace hm k (VString (prev ^ ", " ^ v))
+    | _ -> vmap_set hm hkeys k (VString v)
+  ) headers;
+  let m = Hashtbl.create 4 and keys = keys_create () in
+  vmap_set m keys "status" (VInt (Int64.of_int status));
+  vmap_set m keys "headers" (VMap (hm, hkeys));
+  vmap_set m keys "body" body;
+  VMap (m, keys)
+
+(* Whole-body request. *)
+let http_fetch meth url headers body =
+  let status, hs, (next, abort) = http_exchange meth url headers body in
+  let buf = Buffer.create 4096 in
+  let rec drain () =
+    match http_guard next with
+    | Some s -> Buffer.add_string buf s; drain ()
+    | None -> ()
+  in
+  (try drain () with e -> abort (); raise e);
+  http_response status hs (VString (Buffer.contents buf))
+
+let http_headers_of_value caller = function
+  | VMap (m, keys) ->
+      List.map (fun k -> (k, string_of_value (Hashtbl.find m k))) (keys_list keys)
+  | VUnit -> []
+  | v -> raise (RuntimeError (caller ^ ": headers must be a map, got " ^ string_of_value_type v))
+
+(* Optional trailing (headers [, body]) arguments. *)
+let http_options caller = function
+  | [] -> [], ""
+  | [h] -> http_headers_of_value caller h, ""
+  | [h; VString body] -> http_headers_of_value caller h, body
+  | _ -> raise (RuntimeError (caller ^ " takes (method, url [, headers [, body]]) with a string body"))
 
 (* Recursive structural equality for all value types *)
 let rec values_equal v1 v2 =
@@ -910,42 +2677,625 @@ let rec values_equal v1 v2 =
   | VString a, VString b -> a = b
   | VBool a, VBool b -> a = b
   | VUnit, VUnit -> true
+  | VRegex (a, _), VRegex (b, _) -> a = b
+  | VRegex (a, _), VString b | VString b, VRegex (a, _) -> a = b  (* compiled vs source *)
   | VArray a, VArray b ->
-      let a' = !a and b' = !b in
+      let a' = (vget a) and b' = (vget b) in
       Array.length a' = Array.length b' &&
       let rec check i =
         if i >= Array.length a' then true
         else values_equal a'.(i) b'.(i) && check (i + 1)
       in check 0
   | VMap (m1, keys1), VMap (m2, keys2) ->
-      let k1 = !keys1 and k2 = !keys2 in
-      List.length k1 = List.length k2 &&
+      keys_length keys1 = keys_length keys2 &&
       List.for_all (fun k ->
         Hashtbl.mem m2 k &&
         values_equal (Hashtbl.find m1 k) (Hashtbl.find m2 k)
-      ) k1 &&
-      List.for_all (fun k -> Hashtbl.mem m1 k) k2
+      ) (keys_list keys1)
   | _ -> false
 
 (* Deep copy a value (recursive for arrays and maps) *)
 let rec deep_copy_value v =
   match v with
   | VArray arr ->
-      VArray (ref (Array.map deep_copy_value !arr))
+      VArray (vec_of_array (Array.map deep_copy_value (vget arr)))
   | VMap (m, keys) ->
       let new_m = Hashtbl.create (Hashtbl.length m) in
-      List.iter (fun k ->
+      keys_iter (fun k ->
         Hashtbl.replace new_m k (deep_copy_value (Hashtbl.find m k))
-      ) !keys;
-      VMap (new_m, ref (List.map Fun.id !keys))
+      ) keys;
+      VMap (new_m, keys_copy keys)
   | _ -> v  (* Primitives are immutable, no need to copy *)
 
+let type_of_value v = match v with
+  | VInt _ -> TInt | VFloat _ -> TFloat | VDecimal _ -> TDecimal
+  | VString _ -> TString | VBool _ -> TBool | VUnit -> TUnit
+  | VArray _ -> TArray TUnit | VMap _ -> TMap (TUnit, TUnit)
+  | VFunction _ | VClosure _ | VBuiltin _ -> TFunction ([], TUnit)
+  | VRegex _ -> TRegex
+  | VSocket _ | VTlsSocket _ | VWsSocket _ -> TSocket
+  | VChannel _ -> TSocket | VProcess _ -> TProcess | VPoller _ -> TSocket
+  | VSqlite _ | VSqliteStmt _ -> TProcess
+  | VSeq _ -> TArray TUnit
+  | VBuilder _ -> TJson
+  | VRope _ -> TString
+
+(* Worker domains for bulk builtins: SIGIL_THREADS if set, else what the
+   runtime recommends, counting the calling domain. *)
+let worker_count =
+  lazy (
+    let n = match Option.bind (Sys.getenv_opt "SIGIL_THREADS") int_of_string_opt with
+      | Some n when n > 0 -> n
+      | _ -> Domain.recommended_domain_count ()
+    in
+    min n 64)
+
+(* Domain pool. A job is a number of chunks; the submitting domain and
+   every idle worker claim the next unclaimed chunk with one atomic
+   increment until none are left, so a slow chunk never holds back the
+   others and a job submitted from inside a chunk (a nested parallel
+   builtin) is drained by its own submitter if everyone else is busy.
+   The workers are spawned on first use and live for the process. *)
+type pool_job = {
+  job_chunks : int;
+  job_run : int -> unit;            (* must not raise *)
+  job_next : int Atomic.t;          (* next chunk to claim *)
+  job_pending : int Atomic.t;       (* chunks not finished yet *)
+  job_lock : Mutex.t;
+  job_done : Condition.t;
+}
+
+let pool_lock = Mutex.create ()
+let pool_wake = Condition.create ()
+let pool_jobs : pool_job Queue.t = Queue.create ()
+let pool_started = ref false        (* under pool_lock *)
+
+let drain_job job =
+  let rec go () =
+    let i = Atomic.fetch_and_add job.job_next 1 in
+    if i < job.job_chunks then begin
+      job.job_run i;
+      if Atomic.fetch_and_add job.job_pending (-1) = 1 then begin
+        Mutex.lock job.job_lock;
+        Condition.broadcast job.job_done;
+        Mutex.unlock job.job_lock
+      end;
+      go ()
+    end
+  in
+  go ()
+
+let rec pool_worker () =
+  Mutex.lock pool_lock;
+  let rec next_job () =
+    match Queue.peek_opt pool_jobs with
+    | None -> Condition.wait pool_wake pool_lock; next_job ()
+    | Some job when Atomic.get job.job_next >= job.job_chunks ->
+        ignore (Queue.pop pool_jobs); next_job ()
+    | Some job -> job
+  in
+  let job = next_job () in
+  Mutex.unlock pool_lock;
+  drain_job job;
+  pool_worker ()
+
+(* Run [run 0] .. [run (chunks - 1)] across the pool and wait for all of
+   them. If any raise, the exception of the lowest such chunk is
+   re-raised, as a sequential loop would have. *)
+let run_chunks chunks run =
+  let workers = Lazy.force worker_count in
+  if chunks <= 1 || workers <= 1 then
+    for i = 0 to chunks - 1 do run i done
+  else begin
+    let failures = Array.make chunks None in
+    let job = {
+      job_chunks = chunks;
+      job_run = (fun i -> try run i with e -> failures.(i) <- Some e);
+      job_next = Atomic.make 0;
+      job_pending = Atomic.make chunks;
+      job_lock = Mutex.create ();
+      job_done = Condition.create ();
+    } in
+    Mutex.lock pool_lock;
+    if not !pool_started then begin
+      pool_started := true;
+      for _ = 2 to workers do ignore (Domain.spawn pool_worker) done
+    end;
+    Queue.push job pool_jobs;
+    Condition.broadcast pool_wake;
+    Mutex.unlock pool_lock;
+    drain_job job;
+    Mutex.lock job.job_lock;
+    while Atomic.get job.job_pending > 0 do
+      Condition.wait job.job_done job.job_lock
+    done;
+    Mutex.unlock job.job_lock;
+    Array.iter (function Some e -> raise e | None -> ()) failures
+  end
+
+(* Apply [f] to every element across the pool, one chunk per element. *)
+let parallel_map f xs =
+  let results = Array.make (Array.length xs) None in
+  run_chunks (Array.length xs) (fun i -> results.(i) <- Some (f xs.(i)));
+  Array.map (function Some v -> v | None -> assert false) results
+
+(* A top-level env of its own for one chunk of a parallel builtin: a
+   name the callee (set)s outside any frame lands in this copy of the
+   globals, never in the caller's or another chunk's. *)
+let worker_env env =
+  let globals = Hashtbl.copy env.globals in
+  { vars = globals; slots = [||]; layout = Resolver.empty_layout; globals }
+
+(* Split [n] elements into (chunk count, chunk size), a few chunks per
+   worker so the claim loop evens out uneven per-element cost. *)
+let parallel_chunks n =
+  let target = 4 * Lazy.force worker_count in
+  let size = max 1 ((n + target - 1) / target) in
+  ((n + size - 1) / size, size)
+
+(* Below this many elements a sort stays on one domain. *)
+let parallel_sort_threshold = 100_000
+
+let merge_sorted cmp a b =
+  let la = Array.length a and lb = Array.length b in
+  if la = 0 then b
+  else if lb = 0 then a
+  else begin
+    let dst = Array.make (la + lb) a.(0) in
+    let i = ref 0 and j = ref 0 in
+    for k = 0 to la + lb - 1 do
+      if !j >= lb || (!i < la && cmp a.(!i) b.(!j) <= 0) then begin
+        dst.(k) <- a.(!i); incr i
+      end else begin
+        dst.(k) <- b.(!j); incr j
+      end
+    done;
+    dst
+  end
+
+(* Stable merge sort, returning a new array. Large inputs are cut into
+   one run per worker, the runs sorted in parallel, then merged pairwise
+   (left run first on ties, so the result is still stable). *)
+let stable_sort cmp a =
+  let n = Array.length a in
+  let workers = Lazy.force worker_count in
+  if n < parallel_sort_threshold || workers <= 1 then begin
+    let a = Array.copy a in
+    Array.stable_sort cmp a;
+    a
+  end else begin
+    let chunk = (n + workers - 1) / workers in
+    let runs = Array.init ((n + chunk - 1) / chunk) (fun r ->
+      let from = r * chunk in
+      Array.sub a from (min chunk (n - from))) in
+    let runs = parallel_map (fun run -> Array.stable_sort cmp run; run) runs in
+    let rec merge_all runs =
+      let m = Array.length runs in
+      if m = 1 then runs.(0)
+      else
+        merge_all (parallel_map (fun i ->
+          if 2 * i + 1 < m then merge_sorted cmp runs.(2 * i) runs.(2 * i + 1)
+          else runs.(2 * i)
+        ) (Array.init ((m + 1) / 2) (fun i -> i)))
+    in
+    merge_all runs
+  end
+
+(* Sort keys packed by type, so the comparator a sort runs O(n log n)
+   times is a plain int / float / string comparison on an unboxed array
+   rather than a match over two values. *)
+type packed_keys =
+  | Int_keys of int array
+  | Int64_keys of int64 array
+  | Float_keys of float array
+  | String_keys of string array
+  | Value_keys of value array
+
+let pack_keys keys =
+  let all p = Array.length keys > 0 && Array.for_all p keys in
+  if all (function VInt _ -> true | _ -> false) then begin
+    let k = Array.map (function VInt x -> x | _ -> 0L) keys in
+    if Array.for_all (fun x -> Int64.of_int (Int64.to_int x) = x) k
+    then Int_keys (Array.map Int64.to_int k)
+    else Int64_keys k
+  end
+  else if all (function VFloat _ -> true | _ -> false) then
+    Float_keys (Array.map (function VFloat x -> x | _ -> 0.0) keys)
+  else if all (function VString _ -> true | _ -> false) then
+    String_keys (Array.map (function VString x -> x | _ -> "") keys)
+  else Value_keys keys
+
+(* Ordering of mixed keys: numbers and strings by value, arrays
+   element-wise, anything else structurally. *)
+let compare_sort_keys a b =
+  match a, b with
+  | VInt x, VInt y -> Int64.compare x y
+  | VFloat x, VFloat y -> compare x y
+  | VString x, VString y -> compare x y
+  | VArray ax, VArray ay ->
+      (* Not vget: workers must not trim a shared vec. *)
+      compare (Array.to_list (Array.sub ax.data 0 ax.len))
+        (Array.to_list (Array.sub ay.data 0 ay.len))
+  | _ -> compare a b
+
+(* Stable ascending permutation of [n] packed keys: sorted position ->
+   index. *)
+let packed_permutation n packed =
+  let idx = Array.init n (fun i -> i) in
+  match packed with
+  | Int_keys k -> stable_sort (fun i j -> Int.compare k.(i) k.(j)) idx
+  | Int64_keys k -> stable_sort (fun i j -> Int64.compare k.(i) k.(j)) idx
+  | Float_keys k -> stable_sort (fun i j -> Float.compare k.(i) k.(j)) idx
+  | String_keys k -> stable_sort (fun i j -> String.compare k.(i) k.(j)) idx
+  | Value_keys k -> stable_sort (fun i j -> compare_sort_keys k.(i) k.(j)) idx
+
+let sort_permutation keys = packed_permutation (Array.length keys) (pack_keys keys)
+
+(* Type-check a (set) and return the value to store. The variable's type
+   is the declared one, else the existing binding's, else the new value's. *)
+let check_binding var_name var_type_opt existing value =
+  let var_type = match var_type_opt, existing with
+    | Some t, _ -> t
+    | None, Some v -> type_of_value v
+    | None, None -> type_of_value value
+  in
+  if type_matches var_type value then value
+  else
+    (* Numeric widening: int → float → decimal is automatic on rebind.
+       This addresses the common "declared as int but got float" trip
+       where a model accumulates numeric updates. Non-numeric types
+       keep their lock. *)
+    match var_type, value with
+    | TFloat, VInt n -> VFloat (Int64.to_float n)
+    | TDecimal, VInt n -> VDecimal (decimal_of_string (Int64.to_string n))
+    | TDecimal, VFloat f -> VDecimal (decimal_of_string (format_float_string f))
+    | _ ->
+        raise (RuntimeError (
+          "Type mismatch: variable '" ^ var_name ^
+          "' declared as " ^ string_of_type_kind var_type ^
+          " but got " ^ string_of_value_type value))
+
+(* Alias normalization — accept common Lisp/Clojure/Python synonyms so
+   models don't need to memorize Sigil-specific names. Canonical names are
+   what the rest of the interpreter implements; aliases map to them here. *)
+let builtin_alias func_name =
+  match func_name with
+  | "map"      -> "map_arr"      (* Clojure/Python *)
+  | "head"     -> "first"        (* Haskell *)
+  | "car"      -> "first"        (* Lisp *)
+  | "tail"     -> "rest"         (* Haskell *)
+  | "cdr"      -> "rest"         (* Lisp *)
+  | "string_length" -> "len"     (* Python str-len reach *)
+  | "parse_float"   -> "float"   (* parallels parse_int — Phase 25 meet-halfway *)
+  | "to_int"        -> "parse_int" (* Python `int()` reach for string→int *)
+  | "first_index_of" -> "index_of"
+  | "regex_replace_all" -> "regex_replace" (* already replaces all *)
+  | "contains" -> "has"          (* Python 'x in y' semantics *)
+  | "size"     -> "len"          (* Ruby/JS *)
+  | "length"   -> "len"
+  | "count_el" -> "count"        (* disambiguate *)
+  | "concat"   -> "add"          (* string/array concatenation *)
+  | "upcase"   -> "upper"        (* Ruby *)
+  | "downcase" -> "lower"        (* Ruby *)
+  | "swap"     -> "swapcase"
+  | "abs_val"  -> "abs"
+  | "keys"     -> "map_keys"     (* Python/Ruby/JS *)
+  | "values"   -> "map_values"   (* Python/Ruby/JS *)
+  (* Bit-op aliases — covers names the model reaches for *)
+  | "band" | "bitand" | "bit_and_op" -> "bit_and"
+  | "bor"  | "bitor"  | "bit_or_op"  -> "bit_or"
+  | "bxor" | "bitxor" | "xor" | "bit_xor_op" -> "bit_xor"
+  | "bnot" | "bitnot" -> "bit_not"
+  | "shl"  | "lsh" | "lshift" | "bit_shl" -> "bit_shift_left"
+  | "shr"  | "rsh" | "rshift" | "bit_shr" -> "bit_shift_right"
+  (* Arithmetic operator aliases — common in Lisp/Clojure/Scheme *)
+  | "+"        -> "add"
+  | "-"        -> "sub"
+  | "*"        -> "mul"
+  | "/"        -> "div"
+  | "%"        -> "mod"
+  | "<"        -> "lt"
+  | ">"        -> "gt"
+  | "<="       -> "le"
+  | ">="       -> "ge"
+  | "="        -> "eq"
+  | "=="       -> "eq"
+  | "!="       -> "ne"
+  | n -> n
+
+(* Builtin dispatch table, filled by the registrations that follow eval.
+   builtin_index maps a canonical name to its slot in builtin_fns. *)
+let builtin_index : (string, int) Hashtbl.t = Hashtbl.create 512
+let builtin_fns : (env -> string -> value list -> value) array ref = ref [||]
+
+let register_builtin (names, f) =
+  let id = Array.length !builtin_fns in
+  builtin_fns := Array.append !builtin_fns [| f |];
+  List.iter (fun n ->
+    if not (Hashtbl.mem builtin_index n) then Hashtbl.replace builtin_index n id
+  ) names
+
+(* Resolve a call target to its builtin slot (after aliasing), if any.
+   Builtins take precedence over user functions of the same name. *)
+let resolve_builtin name =
+  let canonical = builtin_alias name in
+  match Hashtbl.find_opt builtin_index canonical with
+  | Some id -> Some (id, canonical)
+  | None -> None
+
+(* ===== Profiler (sigil-run --profile) ===== *)
+
+(* Counting profiler: when on, every user function, closure and builtin
+   call on the main domain is timed (wall clock) and charged the words it
+   allocated. Inclusive figures count a function once however deeply it
+   recurses; exclusive ones subtract its callees. Calls made on worker
+   domains (pmap and friends) are charged to the builtin that started
+   them. Integer arithmetic the evaluator inlines (Arith) is interpreter
+   time, not a builtin call, and is charged to the caller. *)
+type profile_entry = {
+  mutable calls : int;
+  mutable incl_time : float;
+  mutable excl_time : float;
+  mutable incl_words : float;
+  mutable excl_words : float;
+  mutable depth : int;  (* activations on the stack, for recursion *)
+  is_builtin : bool;
+}
+
+type profile_frame = {
+  name : string;
+  entry : profile_entry;
+  path : int;  (* interned call stack, for the collapsed-stack output *)
+  start_time : float;
+  start_words : float;
+  mutable child_time : float;
+  mutable child_words : float;
+}
+
+let profiling = ref false
+let profile_table : (string, profile_entry) Hashtbl.t = Hashtbl.create 256
+let profile_stack : profile_frame list ref = ref []
+(* Stack interning: (parent path, name) -> path id, and per path its
+   printable stack and accumulated exclusive microseconds. Path 0 is the
+   empty stack. Direct self-recursion stays on one path, so a deep
+   recursion folds into a single stack line. *)
+let profile_paths : (int * string, int) Hashtbl.t = Hashtbl.create 1024
+let profile_path_count = ref 1
+let profile_path_names : string array ref = ref (Array.make 256 "")
+let profile_path_self : float array ref = ref (Array.make 256 0.0)
+
+let words_allocated () =
+  let minor, promoted, major = Gc.counters () in
+  minor +. major -. promoted
+
+let profile_path parent name =
+  match Hashtbl.find_opt profile_paths (parent, name) with
+  | Some id -> id
+  | None ->
+      let id = !profile_path_count in
+      if id = Array.length !profile_path_names then begin
+        let grow a fill = Array.append a (Array.make (Array.length a) fill) in
+        profile_path_names := grow !profile_path_names "";
+        profile_path_self := grow !profile_path_self 0.0
+      end;
+      !profile_path_names.(id) <-
+        (if parent = 0 then name else !profile_path_names.(parent) ^ ";" ^ name);
+      incr profile_path_count;
+      Hashtbl.replace profile_paths (parent, name) id;
+      id
+
+let profile_enter name is_builtin =
+  let entry = match Hashtbl.find_opt profile_table name with
+    | Some e -> e
+    | None ->
+        let e = { calls = 0; incl_time = 0.0; excl_time = 0.0; incl_words = 0.0;
+                  excl_words = 0.0; depth = 0; is_builtin } in
+        Hashtbl.replace profile_table name e;
+        e
+  in
+  entry.calls <- entry.calls + 1;
+  entry.depth <- entry.depth + 1;
+  let path = match !profile_stack with
+    | f :: _ when f.name = name -> f.path
+    | f :: _ -> profile_path f.path name
+    | [] -> profile_path 0 name
+  in
+  let frame = { name; entry; path;
+                start_time = Unix.gettimeofday (); start_words = words_allocated ();
+                child_time = 0.0; child_words = 0.0 } in
+  profile_stack := frame :: !profile_stack;
+  frame
+
+let profile_exit frame =
+  let elapsed = Unix.gettimeofday () -. frame.start_time in
+  let words = words_allocated () -. frame.start_words in
+  let e = frame.entry in
+  e.depth <- e.depth - 1;
+  if e.depth = 0 then begin
+    e.incl_time <- e.incl_time +. elapsed;
+    e.incl_words <- e.incl_words +. words
+  end;
+  e.excl_time <- e.excl_time +. elapsed -. frame.child_time;
+  e.excl_words <- e.excl_words +. words -. frame.child_words;
+  let self = !profile_path_self in
+  self.(frame.path) <- self.(frame.path) +. (elapsed -. frame.child_time) *. 1e6;
+  (match !profile_stack with
+   | _ :: (parent :: _ as rest) ->
+       parent.child_time <- parent.child_time +. elapsed;
+       parent.child_words <- parent.child_words +. words;
+       profile_stack := rest
+   | _ -> profile_stack := [])
+
+(* Run [f] as one call of [name] when profiling, else just run it. *)
+let profiled name is_builtin f =
+  if not !profiling || not (Domain.is_main_domain ()) then f ()
+  else begin
+    let frame = profile_enter name is_builtin in
+    match f () with
+    | v -> profile_exit frame; v
+    | exception e -> profile_exit frame; raise e
+  end
+
+(* Turn profiling on: wraps every registered builtin, so calls bound at
+   load time (CallBuiltin) are counted as well as by-name ones. *)
+let enable_profiler () =
+  if not !profiling then begin
+    profiling := true;
+    builtin_fns := Array.map (fun f ->
+      fun env func_name arg_vals ->
+        profiled func_name true (fun () -> f env func_name arg_vals)
+    ) !builtin_fns
+  end
+
+(* Table sorted by exclusive time, to [oc]; the collapsed stacks (one
+   "a;b;c <microseconds>" line per distinct stack, for flamegraph.pl and
+   speedscope) to [folded_path]. *)
+let write_profile oc folded_path =
+  let rows = Hashtbl.fold (fun name e acc -> (name, e) :: acc) profile_table [] in
+  let rows = List.sort (fun (_, a) (_, b) -> compare b.excl_time a.excl_time) rows in
+  let total = List.fold_left (fun acc (_, e) -> acc +. e.excl_time) 0.0 rows in
+  Printf.fprintf oc "\n%-32s %-7s %10s %11s %11s %6s %12s %12s\n"
+    "function" "kind" "calls" "incl ms" "excl ms" "excl%" "incl words" "excl words";
+  List.iter (fun (name, e) ->
+    Printf.fprintf oc "%-32s %-7s %10d %11.3f %11.3f %5.1f%% %12.0f %12.0f\n"
+      name (if e.is_builtin then "builtin" else "user") e.calls
+      (e.incl_time *. 1000.0) (e.excl_time *. 1000.0)
+      (if total > 0.0 then 100.0 *. e.excl_time /. total else 0.0)
+      e.incl_words e.excl_words
+  ) rows;
+  let folded = open_out folded_path in
+  for id = 1 to !profile_path_count - 1 do
+    let us = !profile_path_self.(id) in
+    if us >= 0.5 then Printf.fprintf folded "%s %.0f\n" !profile_path_names.(id) us
+  done;
+  close_out folded;
+  Printf.fprintf oc "collapsed stacks: %s\n" folded_path
+
+(* A string local starts appending into a rope (AppendSlot) from here. *)
+let rope_min_length = 1024
+
+(* How add turns a piece into text when it concatenates strings. *)
+let concat_piece v =
+  match v with
+  | VInt n -> Int64.to_string n
+  | VFloat f -> format_float_string f
+  | VBool b -> if b then "true" else "false"
+  | VDecimal d -> string_of_decimal d
+  | VString s -> s
+  | other -> string_of_value other
+
+(* One fmt placeholder's text: string_of_value, or shaped by its spec. *)
+let format_value spec v =
+  match spec with
+  | None -> string_of_value v
+  | Some { fill; align; width; precision; ty } ->
+      let body = match ty, v with
+        | 'f', VFloat f -> Printf.sprintf "%.*f" (max 0 (if precision >= 0 then precision else 6)) f
+        | 'f', VInt n  -> Printf.sprintf "%.*f" (max 0 (if precision >= 0 then precision else 6)) (Int64.to_float n)
+        | 'd', VInt n  -> Int64.to_string n
+        | 'd', VFloat f -> Int64.to_string (Int64.of_float f)
+        | 'x', VInt n  -> Printf.sprintf "%Lx" n
+        | 'X', VInt n  -> Printf.sprintf "%LX" n
+        | 'o', VInt n  -> Printf.sprintf "%Lo" n
+        | 'b', VInt n  -> let rec b acc x = if x = 0L then (if acc = "" then "0" else acc) else b ((if Int64.rem x 2L = 0L then "0" else "1") ^ acc) (Int64.div x 2L) in b "" n
+        | 's', _ -> string_of_value v
+        | ' ', VFloat f when precision >= 0 -> Printf.sprintf "%.*f" precision f
+        | ' ', VInt n when precision >= 0 -> Printf.sprintf "%.*f" precision (Int64.to_float n)
+        | _, _ -> string_of_value v
+      in
+      let l = String.length body in
+      if l >= width then body
+      else begin
+        let pad = width - l in
+        match align with
+        | '<' -> body ^ String.make pad fill
+        | '^' -> String.make (pad / 2) fill ^ body ^ String.make (pad - pad / 2) fill
+        | _ (* '>' default *) -> String.make pad fill ^ body
+      end
+
+(* Detect in-body mutation of a for iterator. Silent rebinding surprises
+   models from C/Python where (set i ...) inside for would alter
+   iteration. We raise a clear error so the validator-in-loop can hint
+   toward (while) for variable-stride / skip loops. *)
+let check_for_counter var_name current expected =
+  match current with
+  | VInt v when Int64.compare v expected <> 0 ->
+      raise (RuntimeError
+        ("for-loop iterator '" ^ var_name ^
+         "' was mutated inside the body (set to " ^
+         Int64.to_string v ^ ", expected " ^
+         Int64.to_string expected ^
+         "). Use (while) for variable-stride or skip loops."))
+  | _ -> ()
+
+(* The statements after (label target) in a body, for goto; the last
+   label of that name wins. *)
+let after_label target body =
+  let rec scan found = function
+    | [] -> found
+    | Label name :: rest when name = target -> scan (Some rest) rest
+    | _ :: rest -> scan found rest
+  in
+  match scan None body with
+  | Some rest -> rest
+  | None -> raise (RuntimeError ("Label not found: " ^ target))
+
+(* One test-spec case as execute_tests ran it. *)
+type test_outcome = {
+  outcome_test : string;    (* function under test *)
+  outcome_case : string;    (* case description *)
+  outcome_passed : bool;
+  outcome_detail : string;  (* expected / got, or the error; "" on a pass *)
+  outcome_seconds : float;
+}
+
+(* Told of each case as it finishes (sigil-run --test). *)
+let test_observer : (test_outcome -> unit) ref = ref ignore
+
+(* IntArith (see Ast.int_expr): native 63-bit ints, checked so that any
+   result they give is the one the int64 path gives. A leaf that is not
+   such an int, a zero divisor or an overflow raises Not_native, and the
+   node's plain Arith runs instead; its leaves are slots and literals,
+   so running them twice is harmless. *)
+exception Not_native
+
+let native_min = Int64.of_int min_int
+let native_max = Int64.of_int max_int
+
+let native_op op x y =
+  match op with
+  | OpAdd ->
+      let r = x + y in
+      if (x lxor r) land (y lxor r) < 0 then raise_notrace Not_native else r
+  | OpSub ->
+      let r = x - y in
+      if (x lxor y) land (x lxor r) < 0 then raise_notrace Not_native else r
+  | OpMul ->
+      if x = 0 then 0
+      else
+        let r = x * y in
+        if r / x <> y || (x = -1 && y = min_int) then raise_notrace Not_native else r
+  | OpDiv -> if y = 0 || (x = min_int && y = -1) then raise_notrace Not_native else x / y
+  | OpMod -> if y = 0 then raise_notrace Not_native else x mod y
+  | _ -> raise_notrace Not_native
+
+let rec native_eval env = function
+  | IConst n -> n
+  | ISlot slot ->
+      (match env.slots.(slot) with
+       | VInt n when Int64.compare n native_min >= 0 && Int64.compare n native_max <= 0 ->
+           Int64.to_int n
+       | _ -> raise_notrace Not_native)
+  | IOp (op, a, b) ->
+      let x = native_eval env a in
+      native_op op x (native_eval env b)
+
 (* Evaluate expression *)
 let rec eval env expr =
   match expr with
   | LitInt n -> VInt n
   | LitFloat f -> VFloat f
-  | LitDecimal s -> VDecimal s
+  | LitDecimal d -> VDecimal d
   | LitString s -> VString s
    | LitBool b -> VBool b
    | LitUnit -> VUnit
@@ -958,197 +3308,149 @@ let rec eval env expr =
              called. This lets `(reduce + 0 xs)` or `(map_arr xs int)` work. *)
           VBuiltin name)
 
-  | Call ("fmt", fmt_args) when (match fmt_args with LitString _ :: _ -> true | _ -> false) ->
-      (* Special form: scan template for {var} (scope lookup) and {} (positional from args).
-         First arg is the template, remaining args fill {} placeholders in order.
-         Also accepts Python-style format specs: {:.3f} {:>5} {:0>5} {:<10} {:^6}
-         {:b} {:x} — alignment, width, precision, type. The full grammar:
+  | Slot (slot, name) ->
+      let v = env.slots.(slot) in
+      if v != unbound then flat_value v
+      else
+        (* Local not assigned yet on this path — same fallback as Var *)
+        (match env_find_named env name with Some v -> v | None -> VBuiltin name)
+
+  | Call ("fmt", LitString template :: args) ->
+      (* Not seen by the Resolver (e.g. a test-spec input): compile here. *)
+      eval env (Fmt (template, Resolver.compile_fmt template, args))
+
+  | Fmt (_, pieces, args) ->
+      (* Special form: {name} reads a variable in scope, {} takes the next
+         positional arg. Python-style specs are accepted too: {:.3f} {:>5}
+         {:0>5} {:<10} {:^6} {:b} {:x}. The full grammar:
             [name][:[fill][align][0][width][.precision][type]]
-         Examples: {:.3f}, {x:>5}, {:0>4d}, {name}, {}. *)
-      let (template, extra_args) = match fmt_args with
-        | LitString t :: rest -> (t, List.map (eval env) rest)
-        | _ -> assert false
-      in
-      let buf = Buffer.create (String.length template) in
-      let len = String.length template in
-      let i = ref 0 in
-      let positional = ref extra_args in
-      (* Parse a Python-shaped format spec (the part after the colon). *)
-      let parse_spec spec =
-        let n = String.length spec in
-        let p = ref 0 in
-        let fill = ref ' ' and align = ref ' ' in
-        if n >= 2 && (spec.[1] = '<' || spec.[1] = '>' || spec.[1] = '^') then begin
-          fill := spec.[0]; align := spec.[1]; p := 2
-        end else if n >= 1 && (spec.[0] = '<' || spec.[0] = '>' || spec.[0] = '^') then begin
-          align := spec.[0]; p := 1
-        end;
-        if !p < n && spec.[!p] = '0' && !align = ' ' then begin
-          fill := '0'; align := '>'; incr p
-        end;
-        let ws = !p in
-        while !p < n && spec.[!p] >= '0' && spec.[!p] <= '9' do incr p done;
-        let width = if !p > ws then int_of_string (String.sub spec ws (!p - ws)) else 0 in
-        let precision = ref (-1) in
-        if !p < n && spec.[!p] = '.' then begin
-          incr p;
-          let ps = !p in
-          while !p < n && spec.[!p] >= '0' && spec.[!p] <= '9' do incr p done;
-          if !p > ps then precision := int_of_string (String.sub spec ps (!p - ps))
-        end;
-        let ty = if !p < n then spec.[!p] else ' ' in
-        (!fill, !align, width, !precision, ty)
-      in
-      let pad_to fill align width s =
-        let l = String.length s in
-        if l >= width then s
-        else
-          let pad = String.make (width - l) fill in
-          (match align with
-           | '<' -> s ^ pad
-           | '^' ->
-               let left = (width - l) / 2 in
-               let right = (width - l) - left in
-               String.make left fill ^ s ^ String.make right fill
-           | _ (* '>' default *) -> pad ^ s)
-      in
-      let format_with_spec v spec =
-        let (fill, align, width, precision, ty) = parse_spec spec in
-        let body = match ty, v with
-          | 'f', VFloat f -> Printf.sprintf "%.*f" (max 0 (if precision >= 0 then precision else 6)) f
-          | 'f', VInt n  -> Printf.sprintf "%.*f" (max 0 (if precision >= 0 then precision else 6)) (Int64.to_float n)
-          | 'd', VInt n  -> Int64.to_string n
-          | 'd', VFloat f -> Int64.to_string (Int64.of_float f)
-          | 'x', VInt n  -> Printf.sprintf "%Lx" n
-          | 'X', VInt n  -> Printf.sprintf "%LX" n
-          | 'o', VInt n  -> Printf.sprintf "%Lo" n
-          | 'b', VInt n  -> let rec b acc x = if x = 0L then (if acc = "" then "0" else acc) else b ((if Int64.rem x 2L = 0L then "0" else "1") ^ acc) (Int64.div x 2L) in b "" n
-          | 's', _ -> string_of_value v
-          | ' ', VFloat f when precision >= 0 -> Printf.sprintf "%.*f" precision f
-          | ' ', VInt n when precision >= 0 -> Printf.sprintf "%.*f" precision (Int64.to_float n)
-          | _, _ -> string_of_value v
-        in
-        let align' = if align = ' ' then '>' else align in
-        pad_to fill align' width body
-      in
-      let consume_positional ?(spec="") () =
-        match !positional with
-        | v :: rest ->
-            Buffer.add_string buf (if spec = "" then string_of_value v else format_with_spec v spec);
-            positional := rest
-        | [] -> Buffer.add_string buf "{}"  (* lenient: leave a marker *)
-      in
-      let _ = consume_positional in  (* suppress unused warning if any branch doesn't use *)
-      while !i < len do
-        let c = template.[!i] in
-        if c = '{' && !i + 1 < len && template.[!i + 1] = '{' then begin
-          Buffer.add_char buf '{';
-          i := !i + 2
-        end else if c = '}' && !i + 1 < len && template.[!i + 1] = '}' then begin
-          Buffer.add_char buf '}';
-          i := !i + 2
-        end else if c = '%' && !i + 1 < len && template.[!i + 1] = '%' then begin
-          (* Escaped literal percent: %% → % *)
-          Buffer.add_char buf '%';
-          i := !i + 2
-        end else if c = '%' && !i + 1 < len &&
-                    (let n = template.[!i + 1] in
-                     n = 's' || n = 'd' || n = 'i' || n = 'f' || n = 'g' ||
-                     n = 'x' || n = 'o' || n = 'b' || n = 'v') then begin
-          (* Printf-style positional placeholder: %s %d %f ... — all behave
-             the same in Sigil (string-of-value of the next arg). Accepted as
-             a Python/C ergonomics alias since LLMs trained on those reach
-             for printf style by default. *)
-          consume_positional ();
-          i := !i + 2
-        end else if c = '{' then begin
-          let close = try String.index_from template (!i + 1) '}' with Not_found -> -1 in
-          if close = -1 then begin
-            Buffer.add_char buf c;
-            incr i
-          end else begin
-            let body = String.sub template (!i + 1) (close - !i - 1) in
-            (* Split on first ':' to separate name from format spec *)
-            let (name, spec) =
-              try
-                let colon = String.index body ':' in
-                (String.sub body 0 colon,
-                 String.sub body (colon + 1) (String.length body - colon - 1))
-              with Not_found -> (body, "")
-            in
-            if name = "" then consume_positional ~spec ()
-            else begin
-              let v = env_get env name in
-              Buffer.add_string buf
-                (if spec = "" then string_of_value v else format_with_spec v spec)
-            end;
-            i := close + 1
-          end
-        end else begin
-          Buffer.add_char buf c;
-          incr i
-        end
-      done;
+         Examples: {:.3f}, {x:>5}, {:0>4d}, {name}, {}. The template was
+         split into pieces once, by the Resolver (see compile_fmt). *)
+      let positional = ref (List.map (eval env) args) in
+      let buf = Buffer.create 64 in
+      Array.iter (function
+        | FmtText s -> Buffer.add_string buf s
+        | FmtNext spec ->
+            (match !positional with
+             | v :: rest -> Buffer.add_string buf (format_value spec v); positional := rest
+             | [] -> Buffer.add_string buf "{}"  (* lenient: leave a marker *))
+        | FmtName (name, spec) -> Buffer.add_string buf (format_value spec (env_get env name))
+      ) pieces;
       VString (Buffer.contents buf)
 
+  | CallBuiltin (id, func_name, args) ->
+      (!builtin_fns).(id) env func_name (List.map (eval env) args)
+
+  | Fused (id, func_name, args) ->
+      (!builtin_fns).(id) env func_name (List.map (stream_arg env) args)
+
+  | Arith (op, id, func_name, a, b) ->
+      let va = eval env a in
+      let vb = eval env b in
+      (match va, vb with
+       | VInt x, VInt y ->
+           (match op with
+            | OpAdd -> vint (Int64.add x y)
+            | OpSub -> vint (Int64.sub x y)
+            | OpMul -> vint (Int64.mul x y)
+            | OpDiv when y <> 0L -> vint (Int64.div x y)
+            | OpMod when y <> 0L -> vint (Int64.rem x y)
+            | OpDiv | OpMod -> (!builtin_fns).(id) env func_name [va; vb]
+            | OpLt -> vbool (Int64.compare x y < 0)
+            | OpLe -> vbool (Int64.compare x y <= 0)
+            | OpGt -> vbool (Int64.compare x y > 0)
+            | OpGe -> vbool (Int64.compare x y >= 0)
+            | OpEq -> vbool (Int64.equal x y)
+            | OpNe -> vbool (not (Int64.equal x y)))
+       | _ -> (!builtin_fns).(id) env func_name [va; vb])
+
+  | IntArith (op, a, b, plain) ->
+      (match
+         let x = native_eval env a in
+         let y = native_eval env b in
+         (match op with
+          | OpLt -> vbool (x < y)
+          | OpLe -> vbool (x <= y)
+          | OpGt -> vbool (x > y)
+          | OpGe -> vbool (x >= y)
+          | OpEq -> vbool (x = y)
+          | OpNe -> vbool (x <> y)
+          | _ -> vint (Int64.of_int (native_op op x y)))
+       with
+       | v -> v
+       | exception Not_native -> eval env plain)
+
+  | Block (stmts, labels) ->
+      let len = Array.length stmts in
+      let result = ref VUnit in
+      let pc = ref 0 in
+      while !pc < len do
+        match eval env stmts.(!pc) with
+        | v -> result := v; incr pc
+        | exception GotoLabel target ->
+            (match Hashtbl.find_opt labels target with
+             | Some i -> pc := i + 1
+             | None -> raise (RuntimeError ("Label not found: " ^ target)))
+      done;
+      !result
+
   | Call (func_name, args) ->
       eval_call env func_name args
   
   | Set (var_name, var_type_opt, value_expr) ->
       let value = eval env value_expr in
-      let type_of_value v = match v with
-        | VInt _ -> TInt | VFloat _ -> TFloat | VDecimal _ -> TDecimal
-        | VString _ -> TString | VBool _ -> TBool | VUnit -> TUnit
-        | VArray _ -> TArray TUnit | VMap _ -> TMap (TUnit, TUnit)
-        | VFunction _ | VClosure _ | VBuiltin _ -> TFunction ([], TUnit)
-        | VSocket _ | VTlsSocket _ | VWsSocket _ -> TSocket
-        | VChannel _ -> TSocket | VProcess _ -> TProcess
+      (* Reassignment keeps the existing variable's type *)
+      let existing = try Some (env_find env var_name) with Not_found -> None in
+      env_set env var_name (check_binding var_name var_type_opt existing value);
+      VUnit
+
+  | SetSlot (slot, var_name, var_type_opt, value_expr) ->
+      let value = eval env value_expr in
+      let current = env.slots.(slot) in
+      let existing =
+        if current != unbound then Some current
+        else env_find_named env var_name
       in
-      let var_type = match var_type_opt with
-        | Some t -> t
-        | None ->
-            (* Try reassignment first (use existing variable's type) *)
-            (try
-              let existing = env_get env var_name in
-              type_of_value existing
-            with RuntimeError _ ->
-              (* New declaration: infer from the value itself *)
-              type_of_value value)
+      env.slots.(slot) <- check_binding var_name var_type_opt existing value;
+      VUnit
+
+  | AppendSlot (slot, var_name, args, plain) ->
+      (* (set s (add s piece ...)) once s is long: append the pieces to
+         the slot's rope instead of copying s each time. *)
+      let current = env.slots.(slot) in
+      let long = match current with
+        | VRope _ -> true
+        | VString s -> String.length s >= rope_min_length
+        | _ -> false
       in
-      if not (type_matches var_type value) then begin
-        (* Numeric widening: int → float → decimal is automatic on rebind.
-           This addresses the common "declared as int but got float" trip
-           where a model accumulates numeric updates. Non-numeric types
-           keep their lock. *)
-        let widened = match var_type, value with
-          | TFloat, VInt n -> Some (VFloat (Int64.to_float n))
-          | TDecimal, VInt n -> Some (VDecimal (Int64.to_string n))
-          | TDecimal, VFloat f -> Some (VDecimal (format_float_string f))
-          | _ -> None
-        in
-        match widened with
-        | Some v ->
-            env_set env var_name v;
-            VUnit
-        | None ->
-            raise (RuntimeError (
-              "Type mismatch: variable '" ^ var_name ^
-              "' declared as " ^ string_of_type_kind var_type ^
-              " but got " ^ string_of_value_type value))
-      end
+      if not long then eval env plain
       else begin
-        env_set env var_name value;
+        let pieces = List.map (fun a -> concat_piece (eval env a)) args in
+        let r = match current with
+          | VRope r when env.slots.(slot) == current -> r
+          | _ ->
+              (* First append, or the pieces rebound s: start from the
+                 value s had before them, as add would. *)
+              let s = match flat_value current with VString s -> s | _ -> "" in
+              let b = Buffer.create (2 * String.length s) in
+              Buffer.add_string b s;
+              { rope_buf = b; rope_flat = None }
+        in
+        List.iter (Buffer.add_string r.rope_buf) pieces;
+        r.rope_flat <- None;
+        env.slots.(slot) <- VRope r;
         VUnit
       end
-  
-  | Return expr -> raise (Return (eval env expr))
-  | Break -> raise Break
-  | Continue -> raise Continue
+
+  (* Control flow exceptions never need a backtrace. *)
+  | Return expr -> raise_notrace (Return (eval env expr))
+  | Break -> raise_notrace Break
+  | Continue -> raise_notrace Continue
   | Label _ -> VUnit
-  | Goto label_name -> raise (GotoLabel label_name)
+  | Goto label_name -> raise_notrace (GotoLabel label_name)
   | IfNot (cond, label_name) ->
       (match eval env cond with
-       | VBool false -> raise (GotoLabel label_name)
+       | VBool false -> raise_notrace (GotoLabel label_name)
        | VBool true -> VUnit
        | _ -> raise (RuntimeError "IfNot condition must be boolean"))
   
@@ -1174,31 +3476,39 @@ let rec eval env expr =
 
   | LitArray elems ->
       let vals = List.map (eval env) elems in
-      VArray (ref (Array.of_list vals))
+      VArray (vec_of_array (Array.of_list vals))
 
   | LitMap pairs ->
       let tbl = Hashtbl.create (List.length pairs) in
-      let keys = ref [] in
+      let keys = keys_create () in
       List.iter (fun (k_expr, v_expr) ->
         let key = match eval env k_expr with
           | VString s -> s
           | _ -> raise (RuntimeError "Map literal keys must be strings")
         in
-        Hashtbl.replace tbl key (eval env v_expr);
-        if not (List.mem key !keys) then
-          keys := !keys @ [key]
+        vmap_set tbl keys key (eval env v_expr)
       ) pairs;
       VMap (tbl, keys)
 
+  | Closure (params, body, layout, captures) ->
+      (* Copy only the free names the body uses. Names bound nowhere but
+         the global table are left unbound: the closure's frame falls
+         through to globals for them anyway. *)
+      let slots = Array.make (Resolver.slot_count layout) unbound in
+      Array.iter (fun (i, j) ->
+        if j >= 0 && j < Array.length env.slots && env.slots.(j) != unbound then
+          slots.(i) <- flat_value env.slots.(j)
+        else if env.vars != env.globals then
+          (match Hashtbl.find_opt env.vars layout.Resolver.slot_names.(i) with
+           | Some v -> slots.(i) <- v
+           | None -> ())
+      ) captures;
+      VClosure (params, body, layout, slots)
+
   | Lambda (params, body) ->
-      (* Capture the current env as a snapshot. We copy non-function bindings only —
-         functions are global and don't need closure semantics. *)
-      let snapshot = Hashtbl.fold (fun k v acc ->
-        match v with
-        | VFunction _ -> acc  (* skip — already accessible *)
-        | _ -> (k, v) :: acc
-      ) env [] in
-      VClosure (params, body, snapshot)
+      (* Not seen by the Resolver (runtime-built code): resolve it now
+         against this env's layout. *)
+      eval env (Resolver.resolve_lambda resolve_builtin env.layout params body)
 
   | And (left, right) ->
       (match eval env left with
@@ -1219,14 +3529,15 @@ let rec eval env expr =
        | _ -> raise (RuntimeError "Invalid left operand for or: expected bool"))
   
   | While (cond, body) ->
+      (* match-with-exception keeps loop () a tail call: the handler
+         covers only the body. *)
       let rec loop () =
         match eval env cond with
         | VBool true ->
-            (try 
-              let _ = eval_block env body in
-              loop ()
-            with Break -> VUnit
-               | Continue -> loop ())
+            (match eval_block env body with
+             | _ -> loop ()
+             | exception Break -> VUnit
+             | exception Continue -> loop ())
         | VBool false -> VUnit
         | _ -> raise (RuntimeError "While condition must be boolean")
       in
@@ -1234,11 +3545,10 @@ let rec eval env expr =
   
   | Loop body ->
       let rec loop () =
-        try
-          let _ = eval_block env body in
-          loop ()
-        with Break -> VUnit
-           | Continue -> loop ()
+        match eval_block env body with
+        | _ -> loop ()
+        | exception Break -> VUnit
+        | exception Continue -> loop ()
       in
       loop ()
 
@@ -1255,20 +3565,31 @@ let rec eval env expr =
                (try
                  let _ = eval_block env body in ()
                with Continue -> ());
-               (* Detect in-body mutation of the iterator. Silent rebinding
-                  surprises models from C/Python where (set i ...) inside
-                  for would alter iteration. We raise a clear error so the
-                  validator-in-loop can hint toward (while) for variable-
-                  stride / skip loops. *)
-               (match env_get env var_name with
-                | VInt v when Int64.compare v !i <> 0 ->
-                    raise (RuntimeError
-                      ("for-loop iterator '" ^ var_name ^
-                       "' was mutated inside the body (set to " ^
-                       Int64.to_string v ^ ", expected " ^
-                       Int64.to_string !i ^
-                       "). Use (while) for variable-stride or skip loops."))
-                | _ -> ());
+               check_for_counter var_name (env_get env var_name) !i;
+               i := Int64.add !i 1L
+             done;
+             VUnit
+           with Break -> VUnit)
+       | _ -> raise (RuntimeError "for loop start and end must be integers"))
+
+  | ForSlot (slot, var_name, start_expr, end_expr, body) ->
+      let start_val = eval env start_expr in
+      let end_val = eval env end_expr in
+      (match start_val, end_val with
+       | VInt s, VInt e ->
+           let slots = env.slots in
+           slots.(slot) <- vint s;
+           let i = ref s in
+           (try
+             while Int64.compare !i e < 0 do
+               let counter = vint !i in
+               slots.(slot) <- counter;
+               (try
+                 let _ = eval_block env body in ()
+               with Continue -> ());
+               (* Only a body that stored something else needs a look. *)
+               if slots.(slot) != counter then
+                 check_for_counter var_name slots.(slot) !i;
                i := Int64.add !i 1L
              done;
              VUnit
@@ -1276,16 +3597,17 @@ let rec eval env expr =
        | _ -> raise (RuntimeError "for loop start and end must be integers"))
 
   | ForEach (var_name, var_type, collection_expr, body) ->
-      let coll = eval env collection_expr in
+      let coll = stream_arg env collection_expr in
       (* TUnit means "no type annotation given" — skip the element type check *)
       let skip_check = (var_type = TUnit) in
       (match coll with
        | VArray arr ->
-           let len = Array.length !arr in
+           let len = arr.len in
            let i = ref 0 in
            (try
-             while !i < len do
-               let elem = !arr.(!i) in
+             (* Stop early if the body shrinks the array under us. *)
+             while !i < len && !i < arr.len do
+               let elem = arr.data.(!i) in
                if (not skip_check) && not (type_matches var_type elem) then
                  raise (RuntimeError (
                    "Type mismatch in for-each: variable '" ^ var_name ^
@@ -1301,7 +3623,7 @@ let rec eval env expr =
            with Break -> VUnit)
        | VMap (_, keys) ->
            (try
-             List.iter (fun k ->
+             keys_iter (fun k ->
                let key_val = VString k in
                if not (type_matches var_type key_val) then
                  raise (RuntimeError (
@@ -1312,7 +3634,22 @@ let rec eval env expr =
                (try
                  let _ = eval_block env body in ()
                with Continue -> ())
-             ) !keys;
+             ) keys;
+             VUnit
+           with Break -> VUnit)
+       | VSeq sq ->
+           (try
+             seq_iter (fun elem ->
+               if (not skip_check) && not (type_matches var_type elem) then
+                 raise (RuntimeError (
+                   "Type mismatch in for-each: variable '" ^ var_name ^
+                   "' declared as " ^ string_of_type_kind var_type ^
+                   " but got " ^ string_of_value_type elem));
+               env_set env var_name elem;
+               (try
+                 let _ = eval_block env body in ()
+               with Continue -> ())
+             ) sq;
              VUnit
            with Break -> VUnit)
        | VString s ->
@@ -1347,43 +3684,99 @@ let rec eval env expr =
         env_set env catch_var (VString msg);
         eval_block env catch_body)
 
-and eval_block env exprs =
-  let arr = Array.of_list exprs in
-  let len = Array.length arr in
-  let result = ref VUnit in
-  let pc = ref 0 in
-  while !pc < len do
-    (try
-      result := eval env arr.(!pc);
-      pc := !pc + 1
-    with GotoLabel target ->
-      (* Find label in the expression list *)
-      let found = ref false in
-      for i = 0 to len - 1 do
-        match arr.(i) with
-        | Label name when name = target ->
-            pc := i + 1;
-            found := true
-        | _ -> ()
-      done;
-      if not !found then
-        raise (RuntimeError ("Label not found: " ^ target)))
-  done;
-  !result
+(* Bodies walk their expr list directly. The Resolver turns a body that
+   holds labels into a single Block with a label table; a goto anywhere
+   else only lands here for code the Resolver never saw, and re-enters
+   the list just after the label. *)
+and eval_block env exprs = run_block env exprs VUnit exprs
+
+and run_block env all result rest =
+  match rest with
+  | [] -> result
+  | e :: rest ->
+      (match eval env e with
+       | v -> run_block env all v rest
+       | exception GotoLabel target ->
+           run_block env all result (after_label target all))
+
+(* A range / map_arr / filter / enumerate / zip call consumed by a
+   terminal (Fused) or a for-each runs as a VSeq stage over a snapshot of
+   its source, so no intermediate array is built. Map and filter
+   functions are then called as the consumer pulls each element, which
+   is why only pure lambdas are streamed (Resolver.is_stream_stage).
+   Arguments the stages don't cover go to the builtin as usual, with any
+   inner stage materialized first. *)
+and stream_arg env e =
+  if not (Resolver.is_stream_stage e) then eval env e
+  else match e with
+    | CallBuiltin (id, name, args) ->
+        let vals = List.map (stream_arg env) args in
+        let seq_of = function
+          | VArray a -> Some (array_seq a)
+          | VSeq sq -> Some sq
+          | _ -> None
+        in
+        let staged = match name, vals with
+          | "range", [VInt hi] -> Some (range_seq 0 (Int64.to_int hi))
+          | "range", [VInt lo; VInt hi] -> Some (range_seq (Int64.to_int lo) (Int64.to_int hi))
+          | "enumerate", [src] -> Option.map enumerate_seq (seq_of src)
+          | "zip", [a; b] ->
+              (match seq_of a, seq_of b with
+               | Some sa, Some sb -> Some (zip_seq sa sb)
+               | _ -> None)
+          | ("map_arr" | "filter"), [a; b] ->
+              let src, fn = match seq_of a with
+                | Some sq -> Some sq, b
+                | None -> seq_of b, a
+              in
+              Option.map (fun sq ->
+                if name = "map_arr" then map_seq env fn sq else filter_seq env fn sq) src
+          | _ -> None
+        in
+        (match staged with
+         | Some sq -> VSeq sq
+         | None ->
+             let vals = List.map2 (fun a v ->
+               match v with
+               | VSeq sq when Resolver.is_stream_stage a -> VArray (seq_to_array sq)
+               | _ -> v
+             ) args vals in
+             (!builtin_fns).(id) env name vals)
+    | _ -> eval env e
+
+and map_seq env fn sq =
+  { seq_kind = "map_arr";
+    next = (fun () ->
+      match sq.next () with
+      | Some v -> Some (invoke_callable env fn [v] "map_arr")
+      | None -> None);
+    close = sq.close }
+
+and filter_seq env pred sq =
+  let rec next () =
+    match sq.next () with
+    | Some v ->
+        (match invoke_callable env pred [v] "filter" with
+         | VBool true -> Some v
+         | _ -> next ())
+    | None -> None
+  in
+  { seq_kind = "filter"; next; close = sq.close }
 
 and invoke_callable env callable args caller =
   (* Invoke either a VFunction (named) or VClosure (anonymous lambda). *)
   match callable with
-  | VFunction (_name, params, _ret_type, body) ->
+  | VFunction (name, params, _ret_type, body, layout) ->
       let n_expected = List.length params in
       let n_given = List.length args in
       if n_given <> n_expected then
         raise (RuntimeError (caller ^ ": function expects " ^ string_of_int n_expected ^ " args, got " ^ string_of_int n_given));
-      let func_env = env_create () in
-      Hashtbl.iter (fun k v -> match v with VFunction _ -> env_set func_env k v | _ -> ()) env;
+      let func_env = env_frame env layout in
       List.iter2 (fun param a -> env_set func_env param.param_name a) params args;
-      (try eval_block func_env body with Return v -> v)
-  | VClosure (params, body, snapshot) ->
+      if !profiling then
+        profiled name false (fun () -> try eval_block func_env body with Return v -> v)
+      else (try eval_block func_env body with Return v -> v)
+  | VClosure (params, body, layout, captured) ->
       let n_expected = List.length params in
       let n_given = List.length args in
       (* Auto-destructuring: when an N-param lambda is invoked with exactly
@@ -1392,97 +3785,122 @@ and invoke_callable env callable args caller =
       let final_args =
         if n_given = 1 && n_expected >= 2 then
           match args with
-          | [VArray arr] when Array.length !arr = n_expected ->
-              Array.to_list !arr
+          | [VArray arr] when arr.len = n_expected ->
+              Array.to_list (vget arr)
           | _ -> args
         else args
       in
       let n_final = List.length final_args in
       if n_final <> n_expected then
         raise (RuntimeError (caller ^ ": closure expects " ^ string_of_int n_expected ^ " args, got " ^ string_of_int n_given));
-      let func_env = env_create () in
-      Hashtbl.iter (fun k v -> match v with VFunction _ -> env_set func_env k v | _ -> ()) env;
-      List.iter (fun (k, v) -> env_set func_env k v) snapshot;
+      let func_env = env_closure env layout (Array.copy captured) in
       List.iter2 (fun pname a -> env_set func_env pname a) params final_args;
-      (try eval_block func_env body with Return v -> v)
+      if !profiling then
+        profiled ("lambda@" ^ caller) false (fun () -> try eval_block func_env body with Return v -> v)
+      else (try eval_block func_env body with Return v -> v)
   | VBuiltin name ->
-      (* Reference to a builtin — bind args to temporary names, then
-         re-dispatch through eval_call. *)
-      let tmp_env = env_create () in
-      Hashtbl.iter (fun k v -> env_set tmp_env k v) env;
-      let tmp_names = List.mapi (fun i _ -> "__hof_arg_" ^ string_of_int i) args in
-      List.iter2 (fun n v -> env_set tmp_env n v) tmp_names args;
-      let var_args = List.map (fun n -> Var n) tmp_names in
-      eval_call tmp_env name var_args
+      (* Reference to a builtin — the args are already values, so dispatch
+         straight into apply_call. *)
+      apply_call env name args
   | _ ->
       raise (RuntimeError (caller ^ ": expected function or closure, got " ^ string_of_value_type callable))
 
 and eval_call env func_name args =
-  let arg_vals = List.map (eval env) args in
-
-  (* Alias normalization — accept common Lisp/Clojure/Python synonyms so
-     models don't need to memorize Sigil-specific names. Canonical names are
-     what the rest of the interpreter implements; aliases map to them here. *)
-  let func_name = match func_name with
-    | "map"      -> "map_arr"      (* Clojure/Python *)
-    | "head"     -> "first"        (* Haskell *)
-    | "car"      -> "first"        (* Lisp *)
-    | "tail"     -> "rest"         (* Haskell *)
-    | "cdr"      -> "rest"         (* Lisp *)
-    | "string_length" -> "len"     (* Python str-len reach *)
-    | "parse_float"   -> "float"   (* parallels parse_int — Phase 25 meet-halfway *)
-    | "to_int"        -> "parse_int" (* Python `int()` reach for string→int *)
-    | "first_index_of" -> "index_of"
-    | "regex_replace_all" -> "regex_replace" (* already replaces all *)
-    | "contains" -> "has"          (* Python 'x in y' semantics *)
-    | "size"     -> "len"          (* Ruby/JS *)
-    | "length"   -> "len"
-    | "count_el" -> "count"        (* disambiguate *)
-    | "concat"   -> "add"          (* string/array concatenation *)
-    | "upcase"   -> "upper"        (* Ruby *)
-    | "downcase" -> "lower"        (* Ruby *)
-    | "swap"     -> "swapcase"
-    | "abs_val"  -> "abs"
-    | "keys"     -> "map_keys"     (* Python/Ruby/JS *)
-    | "values"   -> "map_values"   (* Python/Ruby/JS *)
-    (* Bit-op aliases — covers names the model reaches for *)
-    | "band" | "bitand" | "bit_and_op" -> "bit_and"
-    | "bor"  | "bitor"  | "bit_or_op"  -> "bit_or"
-    | "bxor" | "bitxor" | "xor" | "bit_xor_op" -> "bit_xor"
-    | "bnot" | "bitnot" -> "bit_not"
-    | "shl"  | "lsh" | "lshift" | "bit_shl" -> "bit_shift_left"
-    | "shr"  | "rsh" | "rshift" | "bit_shr" -> "bit_shift_right"
-    (* Arithmetic operator aliases — common in Lisp/Clojure/Scheme *)
-    | "+"        -> "add"
-    | "-"        -> "sub"
-    | "*"        -> "mul"
-    | "/"        -> "div"
-    | "%"        -> "mod"
-    | "<"        -> "lt"
-    | ">"        -> "gt"
-    | "<="       -> "le"
-    | ">="       -> "ge"
-    | "="        -> "eq"
-    | "=="       -> "eq"
-    | "!="       -> "ne"
-    | n -> n
-  in
+  apply_call env func_name (List.map (eval env) args)
+
+(* Call a builtin or user function on already-evaluated arguments. *)
+and apply_call env func_name arg_vals =
+  let func_name = builtin_alias func_name in
+  match Hashtbl.find_opt builtin_index func_name with
+  | Some id -> (!builtin_fns).(id) env func_name arg_vals
+  (* User-defined functions *)
+  | None ->
+       (try
+         let func_val = env_get env func_name in
+         match func_val with
+         | VFunction (_name, params, _ret_type, body, layout) ->
+             let func_env = env_frame env layout in
+             (* Add local parameters *)
+             List.iter2 (fun param arg_val ->
+               env_set func_env param.param_name arg_val
+             ) params arg_vals;
+             (* main: implicit (ret 0); other functions: implicit return of last expression value *)
+             if !profiling then
+               profiled func_name false (fun () ->
+                 try
+                   let last_result = eval_block func_env body in
+                   if func_name = "main" then VInt 0L else last_result
+                 with Return v -> v)
+             else
+               (try
+                  let last_result = eval_block func_env body in
+                  if func_name = "main" then VInt 0L else last_result
+                with Return v -> v)
+          | _ -> raise (RuntimeError (func_name ^ " is not a function"))
+        with Not_found ->
+          raise (RuntimeError ("Unknown function: " ^ func_name)))
+
+(* Execute tests *)
+and execute_tests env tests =
+  let passed = ref 0 in
+  let failed = ref 0 in
+  List.iter (fun test ->
+    Printf.printf "Test: %s\n" test.test_func_name;
+    List.iter (fun case ->
+      let start = Unix.gettimeofday () in
+      let report ok detail =
+        if ok then incr passed else incr failed;
+        !test_observer { outcome_test = test.test_func_name;
+                         outcome_case = case.test_description;
+                         outcome_passed = ok; outcome_detail = detail;
+                         outcome_seconds = Unix.gettimeofday () -. start }
+      in
+      try
+        let func_val = env_get env test.test_func_name in
+        match func_val with
+         | VFunction (_name, params, _ret_type, body, layout) ->
+             let func_env = env_frame env layout in
+             let arg_vals = List.map (eval env) case.test_inputs in
+             List.iter2 (fun param arg_val ->
+               env_set func_env param.param_name arg_val
+             ) params arg_vals;
+            let result =
+              try eval_block func_env body
+              with Return v -> v
+            in
+             let expected = eval env case.test_expected in
+             if values_equal result expected then (
+               Printf.printf "  ✓ %s\n" case.test_description;
+               report true ""
+             ) else (
+               Printf.printf "  ✗ %s\n" case.test_description;
+               Printf.printf "    Expected: %s\n" (string_of_value expected);
+               Printf.printf "    Got: %s\n" (string_of_value result);
+               report false (Printf.sprintf "expected %s, got %s"
+                               (string_of_value expected) (string_of_value result))
+             )
+        | _ -> ()
+      with e ->
+        Printf.printf "  ✗ %s (Error: %s)\n" case.test_description (Printexc.to_string e);
+        report false ("error: " ^ Printexc.to_string e)
+    ) test.test_cases
+  ) tests;
+  Printf.printf "\n%d passed, %d failed\n" !passed !failed;
+  if !failed > 0 then 1 else 0
 
-  match func_name with
+(* Builtin implementations. Each entry lists the canonical name(s) it
+   answers to and is registered once into builtin_fns; aliases resolve
+   through builtin_alias first. The Resolver binds calls to these indices
+   at load time, so a hot loop calling add / lt / array_get dispatches
+   with an array access instead of string comparisons. All entries see the
+   already-evaluated [arg_vals] and the canonical [func_name]. *)
+let () = List.iter register_builtin [
   (* Arithmetic / concat — N-ary, dispatches on first arg type.
      - int/float/decimal: sum
      - string: concat (each arg coerced)
      - array: concatenate elements
      - map: shallow merge (later wins) *)
-   | "add" ->
-       let coerce_str v = match v with
-         | VInt n -> Int64.to_string n
-         | VFloat f -> format_float_string f
-         | VBool b -> if b then "true" else "false"
-         | VDecimal s -> s
-         | VString s -> s
-         | other -> string_of_value other
-       in
+  ["add"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [] -> raise (RuntimeError "add: requires at least 2 arguments")
         | [_] -> raise (RuntimeError "add: requires at least 2 arguments")
@@ -1510,32 +3928,31 @@ and eval_call env func_name args =
                    first (List.tl arg_vals)
              | VString _ ->
                  (* Any-typed string concat: coerce non-string args. *)
-                 VString (String.concat "" (List.map coerce_str arg_vals))
+                 VString (String.concat "" (List.map concat_piece arg_vals))
              | VArray _ ->
-                 let buf = ref [||] in
+                 let buf = vec_of_array [||] in
                  List.iter (fun v -> match v with
-                   | VArray a -> buf := Array.append !buf !a
-                   | other -> buf := Array.append !buf [|other|]
+                   | VArray a -> for i = 0 to a.len - 1 do vec_push buf a.data.(i) done
+                   | other -> vec_push buf other
                  ) arg_vals;
-                 VArray (ref !buf)
+                 VArray buf
              | VMap _ ->
                  (* Shallow merge; later values win on collision. Insertion order
                     preserved: keys from the first map come first, then any new
                     keys from later maps in order. *)
                  let merged = Hashtbl.create 16 in
-                 let order = ref [] in
+                 let order = keys_create () in
                  List.iter (fun v -> match v with
                    | VMap (m, keys) ->
-                       List.iter (fun k ->
-                         if not (Hashtbl.mem merged k) then order := k :: !order;
-                         Hashtbl.replace merged k (Hashtbl.find m k)
-                       ) !keys
+                       keys_iter (fun k ->
+                         vmap_set merged order k (Hashtbl.find m k)
+                       ) keys
                    | _ -> raise (RuntimeError "add: cannot mix map with non-map")
                  ) arg_vals;
-                 VMap (merged, ref (List.rev !order))
-             | _ -> raise (RuntimeError "Invalid arguments to add")))
+                 VMap (merged, order)
+             | _ -> raise (RuntimeError "Invalid arguments to add"))));
 
-   | "sub" ->
+  ["sub"], (fun env func_name arg_vals ->
        (* Variadic left-fold like add: `(- a b c d)` = a - b - c - d.
           Unary form `(- x)` = negation (standard Lisp/Scheme convention).
           Models writing `(sub len_a i 1)` expecting "len_a - i - 1" used
@@ -1577,9 +3994,9 @@ and eval_call env func_name args =
                         ^ fmt_arg_types arg_vals)))
                    first (List.tl arg_vals)
              | _ -> raise (RuntimeError
-                 ("sub: numeric expected, got " ^ fmt_arg_types arg_vals))))
+                 ("sub: numeric expected, got " ^ fmt_arg_types arg_vals)))));
 
-   | "mul" ->
+  ["mul"], (fun env func_name arg_vals ->
        (* Variadic left-fold like add/sub: a*b*c... *)
        (match arg_vals with
         | [] | [_] -> raise (RuntimeError
@@ -1617,9 +4034,9 @@ and eval_call env func_name args =
                         ^ fmt_arg_types arg_vals)))
                    first (List.tl arg_vals)
              | _ -> raise (RuntimeError
-                 ("mul: numeric expected, got " ^ fmt_arg_types arg_vals))))
+                 ("mul: numeric expected, got " ^ fmt_arg_types arg_vals)))));
 
-   | "div" ->
+  ["div"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] ->
             if b = 0L then raise (RuntimeError "Division by zero")
@@ -1631,91 +4048,91 @@ and eval_call env func_name args =
              VDecimal (bigdecimal_div a b ~precision:20 ())
          | _ -> raise (RuntimeError
              ("div takes (int int), (float float), or (decimal decimal); got "
-              ^ fmt_arg_types arg_vals)))
+              ^ fmt_arg_types arg_vals))));
 
-  | "mod" ->
+  ["mod"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] ->
            if b = 0L then raise (RuntimeError "Division by zero")
            else VInt (Int64.rem a b)
        | _ -> raise (RuntimeError
-           ("mod takes (int int), got " ^ fmt_arg_types arg_vals)))
-  
+           ("mod takes (int int), got " ^ fmt_arg_types arg_vals))));
+
    (* Bitwise operations - int only *)
-   | "bit_and" ->
+  ["bit_and"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VInt (Int64.logand a b)
-        | _ -> raise (RuntimeError "Invalid arguments to bit_and"))
+        | _ -> raise (RuntimeError "Invalid arguments to bit_and")));
 
-   | "bit_or" ->
+  ["bit_or"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VInt (Int64.logor a b)
-        | _ -> raise (RuntimeError "Invalid arguments to bit_or"))
+        | _ -> raise (RuntimeError "Invalid arguments to bit_or")));
 
-   | "bit_xor" ->
+  ["bit_xor"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VInt (Int64.logxor a b)
-        | _ -> raise (RuntimeError "Invalid arguments to bit_xor"))
+        | _ -> raise (RuntimeError "Invalid arguments to bit_xor")));
 
-   | "bit_not" ->
+  ["bit_not"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a] -> VInt (Int64.lognot a)
-        | _ -> raise (RuntimeError "Invalid arguments to bit_not"))
+        | _ -> raise (RuntimeError "Invalid arguments to bit_not")));
 
-   | "bit_shift_left" ->
+  ["bit_shift_left"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VInt (Int64.shift_left a (Int64.to_int b))
-        | _ -> raise (RuntimeError "Invalid arguments to bit_shift_left"))
+        | _ -> raise (RuntimeError "Invalid arguments to bit_shift_left")));
 
-   | "bit_shift_right" ->
+  ["bit_shift_right"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VInt (Int64.shift_right_logical a (Int64.to_int b))
-        | _ -> raise (RuntimeError "Invalid arguments to bit_shift_right"))
+        | _ -> raise (RuntimeError "Invalid arguments to bit_shift_right")));
 
-   | "neg" ->
+  ["neg"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a] -> VInt (Int64.neg a)
         | [VFloat a] -> VFloat (a *. -1.0)
         | [VDecimal a] ->
              VDecimal (bigdecimal_neg a)
-         | _ -> raise (RuntimeError "Invalid arguments to neg"))
+         | _ -> raise (RuntimeError "Invalid arguments to neg")));
 
-  | "abs" ->
+  ["abs"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a] -> VInt (if a < 0L then Int64.neg a else a)
        | [VFloat a] -> VFloat (abs_float a)
        | [VDecimal a] ->
             VDecimal (bigdecimal_abs a)
        | _ -> raise (RuntimeError
-           ("abs takes (int), (float), or (decimal); got " ^ fmt_arg_types arg_vals)))
+           ("abs takes (int), (float), or (decimal); got " ^ fmt_arg_types arg_vals))));
 
-  | "min" ->
+  ["min"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] -> VInt (if a < b then a else b)
        | [VFloat a; VFloat b] -> VFloat (min a b)
        | [VDecimal a; VDecimal b] ->
-            if bigdecimal_compare a b <= 0 then VDecimal (decimal_normalize a) else VDecimal (decimal_normalize b)
+            if bigdecimal_compare a b <= 0 then VDecimal (decimal_trim a) else VDecimal (decimal_trim b)
        | _ -> raise (RuntimeError
            ("min takes (int int), (float float), or (decimal decimal); for arrays use min_of; got "
-            ^ fmt_arg_types arg_vals)))
+            ^ fmt_arg_types arg_vals))));
 
-  | "max" ->
+  ["max"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] -> VInt (if a > b then a else b)
        | [VFloat a; VFloat b] -> VFloat (max a b)
        | [VDecimal a; VDecimal b] ->
-            if bigdecimal_compare a b >= 0 then VDecimal (decimal_normalize a) else VDecimal (decimal_normalize b)
+            if bigdecimal_compare a b >= 0 then VDecimal (decimal_trim a) else VDecimal (decimal_trim b)
        | _ -> raise (RuntimeError
            ("max takes (int int), (float float), or (decimal decimal); for arrays use max_of; got "
-            ^ fmt_arg_types arg_vals)))
+            ^ fmt_arg_types arg_vals))));
 
-  | "sqrt" ->
+  ["sqrt"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VFloat a] -> VFloat (sqrt a)
        | [VInt a] -> VFloat (sqrt (Int64.to_float a))
-       | _ -> raise (RuntimeError "sqrt takes (int) or (float)"))
+       | _ -> raise (RuntimeError "sqrt takes (int) or (float)")));
 
-   | "pow" ->
+  ["pow"], (fun env func_name arg_vals ->
       (* Polymorphic on int/float to match what models reach for: (pow 2 16),
          (pow 2.0 0.5). Returns int when both args are int, else float. *)
       (match arg_vals with
@@ -1731,25 +4148,25 @@ and eval_call env func_name args =
        | [VFloat a; VFloat b] -> VFloat (a ** b)
        | [VInt a; VFloat b] -> VFloat ((Int64.to_float a) ** b)
        | [VFloat a; VInt b] -> VFloat (a ** (Int64.to_float b))
-       | _ -> raise (RuntimeError "pow takes (int, int) or (float, float)"))
+       | _ -> raise (RuntimeError "pow takes (int, int) or (float, float)")));
 
-  | "floor" ->
+  ["floor"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VFloat f] -> VInt (Int64.of_float (floor f))
-       | _ -> raise (RuntimeError "Invalid arguments to floor: expects (float) -> int"))
+       | _ -> raise (RuntimeError "Invalid arguments to floor: expects (float) -> int")));
 
-  | "ceil" ->
+  ["ceil"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VFloat f] -> VInt (Int64.of_float (ceil f))
-       | _ -> raise (RuntimeError "Invalid arguments to ceil: expects (float) -> int"))
+       | _ -> raise (RuntimeError "Invalid arguments to ceil: expects (float) -> int")));
 
-  | "round" ->
+  ["round"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VFloat f] -> VInt (Int64.of_float (Float.round f))
-       | _ -> raise (RuntimeError "Invalid arguments to round: expects (float) -> int"))
+       | _ -> raise (RuntimeError "Invalid arguments to round: expects (float) -> int")));
 
   (* Comparisons *)
-   | "eq" ->
+  ["eq"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VBool (a = b)
         | [VFloat a; VFloat b] -> VBool (a = b)
@@ -1761,9 +4178,9 @@ and eval_call env func_name args =
          | [VMap _ as a; VMap _ as b] -> VBool (values_equal a b)
          | [a; b] -> raise (RuntimeError ("eq requires arguments of the same type, got " ^ string_of_value_type a ^ " and " ^ string_of_value_type b))
          | _ -> raise (RuntimeError
-             ("eq takes 2 args of the same type, got " ^ fmt_arg_types arg_vals)))
-  
-   | "ne" ->
+             ("eq takes 2 args of the same type, got " ^ fmt_arg_types arg_vals))));
+
+  ["ne"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt a; VInt b] -> VBool (a <> b)
         | [VFloat a; VFloat b] -> VBool (a <> b)
@@ -1775,137 +4192,164 @@ and eval_call env func_name args =
          | [VMap _ as a; VMap _ as b] -> VBool (not (values_equal a b))
          | [a; b] -> raise (RuntimeError ("ne requires arguments of the same type, got " ^ string_of_value_type a ^ " and " ^ string_of_value_type b))
          | _ -> raise (RuntimeError
-             ("ne takes 2 args of the same type, got " ^ fmt_arg_types arg_vals)))
-  
-  | "lt" ->
+             ("ne takes 2 args of the same type, got " ^ fmt_arg_types arg_vals))));
+
+  ["lt"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] -> VBool (a < b)
        | [VFloat a; VFloat b] -> VBool (a < b)
        | [VString a; VString b] -> VBool (a < b)
        | [VDecimal a; VDecimal b] -> VBool (bigdecimal_compare a b < 0)
        | _ -> raise (RuntimeError
-           ("lt takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals)))
+           ("lt takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals))));
 
-  | "gt" ->
+  ["gt"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] -> VBool (a > b)
        | [VFloat a; VFloat b] -> VBool (a > b)
        | [VString a; VString b] -> VBool (a > b)
        | [VDecimal a; VDecimal b] -> VBool (bigdecimal_compare a b > 0)
        | _ -> raise (RuntimeError
-           ("gt takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals)))
+           ("gt takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals))));
 
-  | "le" ->
+  ["le"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] -> VBool (a <= b)
        | [VFloat a; VFloat b] -> VBool (a <= b)
        | [VString a; VString b] -> VBool (a <= b)
        | [VDecimal a; VDecimal b] -> VBool (bigdecimal_compare a b <= 0)
        | _ -> raise (RuntimeError
-           ("le takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals)))
+           ("le takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals))));
 
-  | "ge" ->
+  ["ge"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a; VInt b] -> VBool (a >= b)
        | [VFloat a; VFloat b] -> VBool (a >= b)
        | [VString a; VString b] -> VBool (a >= b)
        | [VDecimal a; VDecimal b] -> VBool (bigdecimal_compare a b >= 0)
        | _ -> raise (RuntimeError
-           ("ge takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals)))
+           ("ge takes 2 numeric or 2 string args, got " ^ fmt_arg_types arg_vals))));
 
   (* Logical operations *)
-  | "not" ->
+  ["not"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VBool a] -> VBool (not a)
        | _ -> raise (RuntimeError
-           ("not takes 1 bool, got " ^ fmt_arg_types arg_vals)))
+           ("not takes 1 bool, got " ^ fmt_arg_types arg_vals))));
 
   (* Type conversions *)
-  | "cast_int_float" ->
+  ["cast_int_float"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a] -> VFloat (Int64.to_float a)
-       | _ -> raise (RuntimeError "Invalid arguments to cast_int_float"))
+       | _ -> raise (RuntimeError "Invalid arguments to cast_int_float")));
 
-   | "cast_float_int" ->
+  ["cast_float_int"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VFloat a] -> VInt (Int64.of_float a)
-        | _ -> raise (RuntimeError "Invalid arguments to cast_float_int"))
+        | _ -> raise (RuntimeError "Invalid arguments to cast_float_int")));
 
-   | "cast_int_decimal" ->
+  ["cast_int_decimal"], (fun env func_name arg_vals ->
        (match arg_vals with
-        | [VInt a] -> VDecimal (Int64.to_string a)
-        | _ -> raise (RuntimeError "Invalid arguments to cast_int_decimal"))
+        | [VInt a] -> VDecimal (decimal_of_string (Int64.to_string a))
+        | _ -> raise (RuntimeError "Invalid arguments to cast_int_decimal")));
 
-    | "cast_decimal_int" ->
+  ["cast_decimal_int"], (fun env func_name arg_vals ->
         (match arg_vals with
-         | [VDecimal s] ->
+         | [VDecimal (DSmall (m, k))] -> VInt (Int64.of_int (m / pow10.(k)))
+         | [VDecimal (DBig s)] ->
              (* Handle fractional decimals by truncating toward zero *)
              let (neg, int_part, _) = decimal_parse s in
              let int_part = strip_leading_zeros int_part in
              let n = Int64.of_string int_part in
              if neg then VInt (Int64.neg n) else VInt n
-         | _ -> raise (RuntimeError "Invalid arguments to cast_decimal_int: expected decimal"))
+         | _ -> raise (RuntimeError "Invalid arguments to cast_decimal_int: expected decimal")));
 
-   | "string_from_int" ->
+  ["string_from_int"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt a] -> VString (Int64.to_string a)
-       | _ -> raise (RuntimeError "Invalid arguments to string_from_int"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_from_int")));
 
-   | "string_to_int" ->
+  ["string_to_int"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] ->
            (try VInt (Int64.of_string (String.trim s))
             with Failure _ -> raise (RuntimeError ("Cannot convert to int: " ^ s)))
-       | _ -> raise (RuntimeError "Invalid arguments to string_to_int"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_to_int")));
 
-  | "string_from_float" ->
+  ["string_from_float"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VFloat a] -> VString (format_float_string a)
-       | _ -> raise (RuntimeError "Invalid arguments to string_from_float"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_from_float")));
 
-  | "string_to_float" ->
+  ["string_to_float"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] ->
            (try VFloat (float_of_string (String.trim s))
             with Failure _ -> raise (RuntimeError ("Cannot convert to float: " ^ s)))
-       | _ -> raise (RuntimeError "Invalid arguments to string_to_float"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_to_float")));
 
-  | "string_from_bool" ->
+  ["string_from_bool"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VBool a] -> VString (string_of_bool a)
-       | _ -> raise (RuntimeError "Invalid arguments to string_from_bool"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_from_bool")));
 
   (* String operations *)
-   | "string_length" ->
+  ["string_length"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] -> VInt (Int64.of_int (String.length s))
-        | _ -> raise (RuntimeError "Invalid arguments to string_length: expected string"))
+        | _ -> raise (RuntimeError "Invalid arguments to string_length: expected string")));
 
-  | "string_concat" ->
+  ["string_concat"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString a; VString b] -> VString (a ^ b)
-       | _ -> raise (RuntimeError "Invalid arguments to string_concat"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_concat")));
+
+  ["sb_new"], (fun env func_name arg_vals ->
+      (* String builder for output built piece by piece: appends are
+         amortized O(1) where (set out (add out piece)) copies out.
+         (sb_new) or (sb_new initial). *)
+      (match arg_vals with
+       | [] -> VBuilder (Buffer.create 256)
+       | [v] ->
+           let b = Buffer.create 256 in
+           Buffer.add_string b (concat_piece v);
+           VBuilder b
+       | _ -> raise (RuntimeError "sb_new takes () or (initial)")));
+
+  ["sb_append"], (fun env func_name arg_vals ->
+      (* (sb_append sb piece ...) — pieces become text as with add; returns sb. *)
+      (match arg_vals with
+       | (VBuilder b as sb) :: pieces ->
+           List.iter (fun v -> Buffer.add_string b (concat_piece v)) pieces;
+           sb
+       | _ -> raise (RuntimeError ("sb_append takes (builder, piece ...), got " ^ fmt_arg_types arg_vals))));
+
+  ["sb_finish"], (fun env func_name arg_vals ->
+      (* The text so far; the builder stays usable. *)
+      (match arg_vals with
+       | [VBuilder b] -> VString (Buffer.contents b)
+       | _ -> raise (RuntimeError "sb_finish takes (builder)")));
 
-  | "string_equals" ->
+  ["string_equals"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString a; VString b] -> VBool (a = b)
-       | _ -> raise (RuntimeError "Invalid arguments to string_equals"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_equals")));
 
-  | "string_slice" ->
+  ["string_slice"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s; VInt start; VInt len] ->
            let s_len = String.length s in
            let s_i = Int64.to_int start in
            let s_len' = Int64.to_int len in
            if s_i >= 0 && s_i + s_len' <= s_len then
-             VString (String.sub s s_i s_len')
+             VString (sub_or_self s s_i s_len')
            else if s_i < s_len then
-             VString (String.sub s s_i (s_len - s_i))
+             VString (sub_or_self s s_i (s_len - s_i))
            else
              VString ""
-       | _ -> raise (RuntimeError "Invalid arguments to string_slice"))
+       | _ -> raise (RuntimeError "Invalid arguments to string_slice")));
 
-    | "string_get" ->
+  ["string_get"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s; VInt idx] ->
             let i = Int64.to_int idx in
@@ -1913,9 +4357,9 @@ and eval_call env func_name args =
               VInt (Int64.of_int (Char.code s.[i]))
             else
               raise (RuntimeError ("String index out of bounds: " ^ Int64.to_string idx))
-        | _ -> raise (RuntimeError "Invalid arguments to string_get"))
+        | _ -> raise (RuntimeError "Invalid arguments to string_get")));
 
-   | "string_format" ->
+  ["string_format"], (fun env func_name arg_vals ->
        (match arg_vals with
         | VString template :: format_args ->
             let buf = Buffer.create (String.length template) in
@@ -1936,81 +4380,41 @@ and eval_call env func_name args =
               end
             done;
             VString (Buffer.contents buf)
-        | _ -> raise (RuntimeError "string_format requires a template string"))
+        | _ -> raise (RuntimeError "string_format requires a template string")));
 
-   | "string_find" ->
+  ["string_find"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString haystack; VString needle] ->
-            let h_len = String.length haystack in
-            let n_len = String.length needle in
-            if n_len = 0 then VInt 0L
-            else if n_len > h_len then VInt (-1L)
-            else begin
-              let found = ref (-1) in
-              let i = ref 0 in
-              while !i <= h_len - n_len && !found = -1 do
-                if String.sub haystack !i n_len = needle then
-                  found := !i
-                else
-                  i := !i + 1
-              done;
-              VInt (Int64.of_int !found)
-            end
-        | _ -> raise (RuntimeError "Invalid arguments to string_find"))
+            VInt (Int64.of_int (find_sub haystack needle 0))
+        | _ -> raise (RuntimeError "Invalid arguments to string_find")));
 
-   | "string_to_upper" ->
+  ["string_to_upper"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] -> VString (String.uppercase_ascii s)
-        | _ -> raise (RuntimeError "Invalid arguments to string_to_upper"))
+        | _ -> raise (RuntimeError "Invalid arguments to string_to_upper")));
 
-   | "string_to_lower" ->
+  ["string_to_lower"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] -> VString (String.lowercase_ascii s)
-        | _ -> raise (RuntimeError "Invalid arguments to string_to_lower"))
+        | _ -> raise (RuntimeError "Invalid arguments to string_to_lower")));
 
-   | "string_split" ->
+  ["string_split"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s; VString delim] ->
             if String.length delim = 0 then
-              VArray (ref (Array.of_list (List.map (fun c -> VString (String.make 1 c)) (List.of_seq (String.to_seq s)))))
+              VArray (vec_of_array (Array.of_list (List.map (fun c -> VString (String.make 1 c)) (List.of_seq (String.to_seq s)))))
             else
-              let parts = String.split_on_char delim.[0] s in
-              if String.length delim = 1 then
-                VArray (ref (Array.of_list (List.map (fun p -> VString p) parts)))
-              else begin
-                let results = ref [] in
-                let remaining = ref s in
-                let dlen = String.length delim in
-                let continue_loop = ref true in
-                while !continue_loop do
-                  match String.split_on_char delim.[0] !remaining with
-                  | [] -> continue_loop := false
-                  | _ ->
-                    let pos = ref (-1) in
-                    let rlen = String.length !remaining in
-                    let i = ref 0 in
-                    while !i <= rlen - dlen && !pos = -1 do
-                      if String.sub !remaining !i dlen = delim then
-                        pos := !i
-                      else
-                        i := !i + 1
-                    done;
-                    if !pos = -1 then begin
-                      results := VString !remaining :: !results;
-                      continue_loop := false
-                    end else begin
-                      results := VString (String.sub !remaining 0 !pos) :: !results;
-                      remaining := String.sub !remaining (!pos + dlen) (rlen - !pos - dlen)
-                    end
-                done;
-                VArray (ref (Array.of_list (List.rev !results)))
-              end
-        | _ -> raise (RuntimeError "Invalid arguments to string_split"))
+              let parts =
+                if String.length delim = 1 then String.split_on_char delim.[0] s
+                else split_on_sub s delim
+              in
+              VArray (vec_of_list (List.map (fun p -> VString p) parts))
+        | _ -> raise (RuntimeError "Invalid arguments to string_split")));
 
-   | "string_join" ->
+  ["string_join"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr; VString delim] ->
-            let parts = Array.to_list !arr |> List.map (fun v ->
+            let parts = vec_to_list arr |> List.map (fun v ->
               match v with
               | VString s -> s
               | VInt n -> Int64.to_string n
@@ -2019,90 +4423,52 @@ and eval_call env func_name args =
               | _ -> raise (RuntimeError "string_join: array contains non-stringifiable value")
             ) in
             VString (String.concat delim parts)
-         | _ -> raise (RuntimeError "Invalid arguments to string_join"))
+         | _ -> raise (RuntimeError "Invalid arguments to string_join")));
 
-   | "string_starts_with" ->
+  ["string_starts_with"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s; VString prefix] ->
             let plen = String.length prefix in
             VBool (String.length s >= plen && String.sub s 0 plen = prefix)
-        | _ -> raise (RuntimeError "Invalid arguments to string_starts_with: expects (string, string) -> bool"))
+        | _ -> raise (RuntimeError "Invalid arguments to string_starts_with: expects (string, string) -> bool")));
 
-   | "string_ends_with" ->
+  ["string_ends_with"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s; VString suffix] ->
             let slen = String.length s in
             let xlen = String.length suffix in
             VBool (slen >= xlen && String.sub s (slen - xlen) xlen = suffix)
-        | _ -> raise (RuntimeError "Invalid arguments to string_ends_with: expects (string, string) -> bool"))
+        | _ -> raise (RuntimeError "Invalid arguments to string_ends_with: expects (string, string) -> bool")));
 
-   | "string_contains" ->
+  ["string_contains"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString haystack; VString needle] ->
-            let hlen = String.length haystack in
-            let nlen = String.length needle in
-            if nlen = 0 then VBool true
-            else if nlen > hlen then VBool false
-            else begin
-              let found = ref false in
-              let i = ref 0 in
-              while !i <= hlen - nlen && not !found do
-                if String.sub haystack !i nlen = needle then
-                  found := true
-                else
-                  i := !i + 1
-              done;
-              VBool !found
-            end
-        | _ -> raise (RuntimeError "Invalid arguments to string_contains: expects (string, string) -> bool"))
+            VBool (find_sub haystack needle 0 >= 0)
+        | _ -> raise (RuntimeError "Invalid arguments to string_contains: expects (string, string) -> bool")));
 
-   | "in" ->
+  ["in"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString needle; VString haystack] ->
-            let hlen = String.length haystack in
-            let nlen = String.length needle in
-            if nlen = 0 then VBool true
-            else if nlen > hlen then VBool false
-            else begin
-              let found = ref false in
-              let i = ref 0 in
-              while not !found && !i <= hlen - nlen do
-                if String.sub haystack !i nlen = needle then found := true
-                else i := !i + 1
-              done;
-              VBool !found
-            end
+            VBool (find_sub haystack needle 0 >= 0)
         | [v; VArray arr] ->
-            VBool (Array.exists (fun x -> values_equal x v) !arr)
+            VBool (vec_exists (fun x -> values_equal x v) arr)
         | [VString key; VMap (m, _)] ->
             VBool (Hashtbl.mem m key)
-        | _ -> raise (RuntimeError "in: expects (string, string) for substring, (value, array) for element, or (key, map)"))
+        | _ -> raise (RuntimeError "in: expects (string, string) for substring, (value, array) for element, or (key, map)")));
 
-   | "has" ->
+  ["has"], (fun env func_name arg_vals ->
        (* Reverse-arg synonym for `in`: (has coll x) == (in x coll).
           Models often reach for "collection.has(x)" shape. *)
        (match arg_vals with
         | [VString haystack; VString needle] ->
-            let hlen = String.length haystack in
-            let nlen = String.length needle in
-            if nlen = 0 then VBool true
-            else if nlen > hlen then VBool false
-            else begin
-              let found = ref false in
-              let i = ref 0 in
-              while not !found && !i <= hlen - nlen do
-                if String.sub haystack !i nlen = needle then found := true
-                else i := !i + 1
-              done;
-              VBool !found
-            end
+            VBool (find_sub haystack needle 0 >= 0)
         | [VArray arr; v] ->
-            VBool (Array.exists (fun x -> values_equal x v) !arr)
+            VBool (vec_exists (fun x -> values_equal x v) arr)
         | [VMap (m, _); VString key] ->
             VBool (Hashtbl.mem m key)
-        | _ -> raise (RuntimeError "has: expects (coll, element) — reverse of `in`"))
+        | _ -> raise (RuntimeError "has: expects (coll, element) — reverse of `in`")));
 
-   | "string_trim" ->
+  ["string_trim"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] ->
             let len = String.length s in
@@ -2115,67 +4481,51 @@ and eval_call env func_name args =
               j := !j - 1
             done;
             if !i > !j then VString ""
-            else VString (String.sub s !i (!j - !i + 1))
-        | _ -> raise (RuntimeError "Invalid arguments to string_trim: expects (string) -> string"))
+            else VString (sub_or_self s !i (!j - !i + 1))
+        | _ -> raise (RuntimeError "Invalid arguments to string_trim: expects (string) -> string")));
 
-   | "string_replace" ->
+  ["string_replace"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s; VString old_s; VString new_s] ->
-            let olen = String.length old_s in
-            if olen = 0 then VString s
-            else begin
-              let buf = Buffer.create (String.length s) in
-              let slen = String.length s in
-              let i = ref 0 in
-              while !i < slen do
-                if !i <= slen - olen && String.sub s !i olen = old_s then begin
-                  Buffer.add_string buf new_s;
-                  i := !i + olen
-                end else begin
-                  Buffer.add_char buf s.[!i];
-                  i := !i + 1
-                end
-              done;
-              VString (Buffer.contents buf)
-            end
-        | _ -> raise (RuntimeError "Invalid arguments to string_replace: expects (string, string, string) -> string"))
+            if old_s = "" then VString s
+            else VString (replace_sub s old_s new_s)
+        | _ -> raise (RuntimeError "Invalid arguments to string_replace: expects (string, string, string) -> string")));
 
   (* Array operations *)
-  | "array_new" ->
-      VArray (ref [||])
-  
-  | "array_push" ->
+  ["array_new"], (fun env func_name arg_vals ->
+      VArray (vec_of_array [||]));
+
+  ["array_push"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr; v] ->
-           let new_arr = Array.append !arr (Array.make 1 v) in
-           arr := new_arr;
+           vec_push arr v;
            VArray arr
-       | _ -> raise (RuntimeError "Invalid arguments to array_push"))
+       | _ -> raise (RuntimeError "Invalid arguments to array_push")));
 
-  | "array_get" ->
+  ["array_get"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr; VInt idx] ->
-           let n = Array.length !arr in
+           let n = arr.len in
            let i = Int64.to_int idx in
            let actual = if i < 0 then n + i else i in  (* negative indexing from end *)
            if actual >= 0 && actual < n then
-             !arr.(actual)
+             arr.data.(actual)
            else
              raise (RuntimeError ("Array index out of bounds: " ^ Int64.to_string idx))
-       | _ -> raise (RuntimeError "Invalid arguments to array_get"))
+       | _ -> raise (RuntimeError "Invalid arguments to array_get")));
 
   (* Polymorphic strict access — same concept across collection types:
      "give me the element at this position/key, raise if absent."
      - get_or stays the explicit safe form (default on miss)
      - json_get stays the explicit deep-traversal form
      This fills the same-concept gap matching Clojure/Python `dict[k]`. *)
-  | "get" ->
+  ["get"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr; VInt idx] ->
-           let n = Array.length !arr in
+           let n = arr.len in
            let i = Int64.to_int idx in
            let actual = if i < 0 then n + i else i in
-           if actual >= 0 && actual < n then !arr.(actual)
+           if actual >= 0 && actual < n then arr.data.(actual)
            else raise (RuntimeError ("get: array index out of bounds: " ^ Int64.to_string idx))
        | [VString s; VInt idx] ->
            let n = String.length s in
@@ -2186,97 +4536,97 @@ and eval_call env func_name args =
        | [VMap (m, _); VString k] ->
            (try Hashtbl.find m k
             with Not_found -> raise (RuntimeError ("get: key not found in map: " ^ k)))
-       | _ -> raise (RuntimeError "get takes (array|string, int) or (map, string) — for JSON deep traversal use json_get; for default-on-miss use get_or"))
+       | _ -> raise (RuntimeError "get takes (array|string, int) or (map, string) — for JSON deep traversal use json_get; for default-on-miss use get_or")));
 
-  | "first" ->
+  ["first"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr] ->
-           if Array.length !arr = 0 then
+           if arr.len = 0 then
              raise (RuntimeError "first: empty array")
-           else !arr.(0)
+           else arr.data.(0)
        | [VString s] ->
            if String.length s = 0 then
              raise (RuntimeError "first: empty string")
            else VString (String.make 1 s.[0])
-       | _ -> raise (RuntimeError "first takes (array) or (string)"))
+       | _ -> raise (RuntimeError "first takes (array) or (string)")));
 
-  | "second" ->
+  ["second"], (fun env func_name arg_vals ->
       (* Common LLM reach (Clojure/Lisp); equivalent to (get x 1). Returns the
          second element of an array or 1-char string at index 1. *)
       (match arg_vals with
        | [VArray arr] ->
-           if Array.length !arr < 2 then
+           if arr.len < 2 then
              raise (RuntimeError "second: array has fewer than 2 elements")
-           else !arr.(1)
+           else arr.data.(1)
        | [VString s] ->
            if String.length s < 2 then
              raise (RuntimeError "second: string has fewer than 2 characters")
            else VString (String.make 1 s.[1])
-       | _ -> raise (RuntimeError "second takes (array) or (string)"))
+       | _ -> raise (RuntimeError "second takes (array) or (string)")));
 
-  | "third" ->
+  ["third"], (fun env func_name arg_vals ->
       (* Common LLM reach (Clojure/Lisp); equivalent to (get x 2). *)
       (match arg_vals with
        | [VArray arr] ->
-           if Array.length !arr < 3 then
+           if arr.len < 3 then
              raise (RuntimeError "third: array has fewer than 3 elements")
-           else !arr.(2)
+           else arr.data.(2)
        | [VString s] ->
            if String.length s < 3 then
              raise (RuntimeError "third: string has fewer than 3 characters")
            else VString (String.make 1 s.[2])
-       | _ -> raise (RuntimeError "third takes (array) or (string)"))
+       | _ -> raise (RuntimeError "third takes (array) or (string)")));
 
-  | "last" ->
+  ["last"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr] ->
-           let n = Array.length !arr in
+           let n = arr.len in
            if n = 0 then
              raise (RuntimeError "last: empty array")
-           else !arr.(n - 1)
+           else arr.data.(n - 1)
        | [VString s] ->
            let n = String.length s in
            if n = 0 then
              raise (RuntimeError "last: empty string")
            else VString (String.make 1 s.[n - 1])
-       | _ -> raise (RuntimeError "last takes (array) or (string)"))
+       | _ -> raise (RuntimeError "last takes (array) or (string)")));
 
-  | "rest" ->
+  ["rest"], (fun env func_name arg_vals ->
       (* Haskell/Lisp tail: everything except the first element.
          Empty input returns empty. *)
       (match arg_vals with
        | [VArray arr] ->
-           let n = Array.length !arr in
-           if n <= 1 then VArray (ref [||])
-           else VArray (ref (Array.sub !arr 1 (n - 1)))
+           let n = arr.len in
+           if n <= 1 then VArray (vec_of_array [||])
+           else VArray (vec_of_array (Array.sub (vget arr) 1 (n - 1)))
        | [VString s] ->
            let n = String.length s in
            if n <= 1 then VString ""
            else VString (String.sub s 1 (n - 1))
-       | _ -> raise (RuntimeError "rest takes (array) or (string)"))
+       | _ -> raise (RuntimeError "rest takes (array) or (string)")));
 
-  | "array_set" ->
+  ["array_set"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr; VInt idx; v] ->
            let i = Int64.to_int idx in
-           if i >= 0 && i < Array.length !arr then
-             (!arr).(i) <- v
+           if i >= 0 && i < arr.len then
+             arr.data.(i) <- v
            else
              raise (RuntimeError ("Array index out of bounds: " ^ Int64.to_string idx));
            VArray arr
-       | _ -> raise (RuntimeError "Invalid arguments to array_set"))
+       | _ -> raise (RuntimeError "Invalid arguments to array_set")));
 
-   | "array_length" ->
+  ["array_length"], (fun env func_name arg_vals ->
        (match arg_vals with
-        | [VArray arr] -> VInt (Int64.of_int (Array.length !arr))
-        | _ -> raise (RuntimeError "Invalid arguments to array_length"))
+        | [VArray arr] -> VInt (Int64.of_int (arr.len))
+        | _ -> raise (RuntimeError "Invalid arguments to array_length")));
 
-   | "array_copy" ->
+  ["array_copy"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray _ as v] -> deep_copy_value v
-        | _ -> raise (RuntimeError "Invalid arguments to array_copy"))
+        | _ -> raise (RuntimeError "Invalid arguments to array_copy")));
 
-   | "array_sort" ->
+  ["array_sort"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr] ->
             let compare_values a b =
@@ -2288,18 +4638,24 @@ and eval_call env func_name args =
               | VBool x, VBool y -> compare x y
               | _ -> raise (RuntimeError "array_sort: cannot compare mixed types")
             in
-            let sorted = Array.copy !arr in
-            Array.sort compare_values sorted;
-            arr := sorted;
+            let data = vget arr in
+            (match pack_keys data with
+             | Value_keys _ ->
+                 let sorted = Array.copy data in
+                 Array.sort compare_values sorted;
+                 vset arr sorted
+             | packed ->
+                 let order = packed_permutation (Array.length data) packed in
+                 vset arr (Array.map (fun i -> data.(i)) order));
             VArray arr
-        | _ -> raise (RuntimeError "Invalid arguments to array_sort"))
+        | _ -> raise (RuntimeError "Invalid arguments to array_sort")));
 
-   | "array_reverse" | "rev" ->
+  ["array_reverse"; "rev"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr] ->
-            let len = Array.length !arr in
-            let reversed = Array.init len (fun i -> !arr.(len - 1 - i)) in
-            arr := reversed;
+            let len = arr.len in
+            let reversed = Array.init len (fun i -> arr.data.(len - 1 - i)) in
+            vset arr reversed;
             VArray arr
         | [VString s] ->
             let len = String.length s in
@@ -2308,136 +4664,122 @@ and eval_call env func_name args =
               Bytes.set buf i s.[len - 1 - i]
             done;
             VString (Bytes.to_string buf)
-        | _ -> raise (RuntimeError "rev takes array or string"))
+        | _ -> raise (RuntimeError "rev takes array or string")));
 
-   | "array_contains" ->
+  ["array_contains"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr; v] ->
-            VBool (Array.exists (fun elem -> values_equal elem v) !arr)
-        | _ -> raise (RuntimeError "Invalid arguments to array_contains"))
+            VBool (vec_exists (fun elem -> values_equal elem v) arr)
+        | _ -> raise (RuntimeError "Invalid arguments to array_contains")));
 
-   | "array_index_of" ->
+  ["array_index_of"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr; v] ->
-            let len = Array.length !arr in
+            let len = arr.len in
             let found = ref (-1) in
             let i = ref 0 in
             while !i < len && !found = -1 do
-              if values_equal !arr.(!i) v then found := !i;
+              if values_equal arr.data.(!i) v then found := !i;
               i := !i + 1
             done;
             VInt (Int64.of_int !found)
-        | _ -> raise (RuntimeError "Invalid arguments to array_index_of"))
+        | _ -> raise (RuntimeError "Invalid arguments to array_index_of")));
 
    (* Polymorphic alias used by most LLMs — dispatches by first arg type *)
-   | "index_of" ->
+  ["index_of"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString haystack; VString needle] ->
-            let h_len = String.length haystack in
-            let n_len = String.length needle in
-            if n_len = 0 then VInt 0L
-            else if n_len > h_len then VInt (-1L)
-            else begin
-              let found = ref (-1) in
-              let i = ref 0 in
-              while !i <= h_len - n_len && !found = -1 do
-                if String.sub haystack !i n_len = needle then found := !i
-                else i := !i + 1
-              done;
-              VInt (Int64.of_int !found)
-            end
+            VInt (Int64.of_int (find_sub haystack needle 0))
         | [VArray arr; v] ->
-            let len = Array.length !arr in
+            let len = arr.len in
             let found = ref (-1) in
             let i = ref 0 in
             while !i < len && !found = -1 do
-              if values_equal !arr.(!i) v then found := !i;
+              if values_equal arr.data.(!i) v then found := !i;
               i := !i + 1
             done;
             VInt (Int64.of_int !found)
         | _ -> raise (RuntimeError
             ("index_of takes (string, string) or (array, value), got "
-             ^ fmt_arg_types arg_vals)))
+             ^ fmt_arg_types arg_vals))));
 
-   | "pop" ->
+  ["pop"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr] ->
-            let n = Array.length !arr in
+            let n = arr.len in
             if n = 0 then raise (RuntimeError "pop on empty array")
             else begin
-              let last = !arr.(n - 1) in
-              arr := Array.sub !arr 0 (n - 1);
-              last
+              vec_pop arr
             end
-        | _ -> raise (RuntimeError "pop takes (array)"))
+        | _ -> raise (RuntimeError "pop takes (array)")));
 
    (* Map operations *)
-  | "map_new" ->
-      make_vmap ()
-  
-  | "map_set" ->
+  ["map_new"], (fun env func_name arg_vals ->
+      make_vmap ());
+
+  ["map_set"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VMap (m, keys); VString k; v] ->
            vmap_set m keys k v;
            VMap (m, keys)
-       | _ -> raise (RuntimeError "Invalid arguments to map_set"))
+       | _ -> raise (RuntimeError "Invalid arguments to map_set")));
 
-   | "map_get" ->
+  ["map_get"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap (m, _); VString k] ->
             (try Hashtbl.find m k
              with Not_found -> raise (RuntimeError ("Key not found in map: " ^ k)))
-        | _ -> raise (RuntimeError "Invalid arguments to map_get"))
+        | _ -> raise (RuntimeError "Invalid arguments to map_get")));
 
-  | "map_has" ->
+  ["map_has"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VMap (m, _); VString k] -> VBool (Hashtbl.mem m k)
-       | _ -> raise (RuntimeError "Invalid arguments to map_has"))
+       | _ -> raise (RuntimeError "Invalid arguments to map_has")));
 
-  | "map_delete" ->
+  ["map_delete"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VMap (m, keys); VString k] ->
            vmap_delete m keys k;
            VMap (m, keys)
-       | _ -> raise (RuntimeError "Invalid arguments to map_delete"))
+       | _ -> raise (RuntimeError "Invalid arguments to map_delete")));
 
-   | "map_keys" ->
+  ["map_keys"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap (_, keys)] ->
-            VArray (ref (Array.of_list (List.map (fun k -> VString k) !keys)))
-        | _ -> raise (RuntimeError "Invalid arguments to map_keys"))
+            VArray (vec_of_list (List.map (fun k -> VString k) (keys_list keys)))
+        | _ -> raise (RuntimeError "Invalid arguments to map_keys")));
 
-   | "map_copy" ->
+  ["map_copy"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap _ as v] -> deep_copy_value v
-        | _ -> raise (RuntimeError "Invalid arguments to map_copy"))
+        | _ -> raise (RuntimeError "Invalid arguments to map_copy")));
 
-   | "map_entries" ->
+  ["map_entries"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap (m, keys)] ->
             let entries = List.map (fun k ->
               let v = Hashtbl.find m k in
               let entry = Hashtbl.create 2 in
-              let entry_keys = ref [] in
+              let entry_keys = keys_create () in
               vmap_set entry entry_keys "key" (VString k);
               vmap_set entry entry_keys "value" v;
               VMap (entry, entry_keys)
-            ) !keys in
-            VArray (ref (Array.of_list entries))
-        | _ -> raise (RuntimeError "Invalid arguments to map_entries"))
+            ) (keys_list keys) in
+            VArray (vec_of_array (Array.of_list entries))
+        | _ -> raise (RuntimeError "Invalid arguments to map_entries")));
 
-   | "entries" ->
+  ["entries"], (fun env func_name arg_vals ->
        (* Python .items() style: array of [key, value] pairs. *)
        (match arg_vals with
         | [VMap (m, keys)] ->
             let pairs = List.map (fun k ->
-              VArray (ref [| VString k; Hashtbl.find m k |])
-            ) !keys in
-            VArray (ref (Array.of_list pairs))
-        | _ -> raise (RuntimeError "entries takes 1 map"))
+              VArray (vec_of_array [| VString k; Hashtbl.find m k |])
+            ) (keys_list keys) in
+            VArray (vec_of_array (Array.of_list pairs))
+        | _ -> raise (RuntimeError "entries takes 1 map")));
 
    (* Helper: read entire file *)
-   | "file_read" ->
+  ["file_read"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString path] ->
             try
@@ -2446,37 +4788,39 @@ and eval_call env func_name args =
               let _ = Unix.lseek fd 0 Unix.SEEK_SET in
               let buf = Bytes.create len in
               let rec read_all offset remaining =
-                if remaining <= 0 then ()
+                if remaining <= 0 then offset
                 else
-                  let n = Unix.read fd buf offset remaining in
-                  if n = 0 then ()
+                  let n = file_read_fd fd buf offset remaining in
+                  if n = 0 then offset
                   else read_all (offset + n) (remaining - n)
               in
-              read_all 0 len;
+              let got = read_all 0 len in
               Unix.close fd;
-              VString (Bytes.to_string buf)
+              (* buf is never touched again, so it becomes the string as is. *)
+              if got = len then VString (Bytes.unsafe_to_string buf)
+              else VString (Bytes.sub_string buf 0 got)
             with Unix.Unix_error _ ->
               raise (RuntimeError ("Could not read file: " ^ path))
-        | _ -> raise (RuntimeError "Invalid arguments to file_read"))
+        | _ -> raise (RuntimeError "Invalid arguments to file_read")));
 
-   | "file_write" ->
+  ["file_write"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString path; VString content] ->
             try
               let fd = Unix.openfile path [Unix.O_WRONLY; Unix.O_CREAT; Unix.O_TRUNC] 0o644 in
-              let _ = Unix.write fd (Bytes.of_string content) 0 (String.length content) in
+              let _ = file_write_fd_substring fd content 0 (String.length content) in
               Unix.close fd;
               VBool true
             with Unix.Unix_error _ ->
               raise (RuntimeError ("Could not write file: " ^ path))
-        | _ -> raise (RuntimeError "Invalid arguments to file_write"))
+        | _ -> raise (RuntimeError "Invalid arguments to file_write")));
 
-   | "file_exists" ->
+  ["file_exists"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString path] -> VBool (Sys.file_exists path)
-        | _ -> raise (RuntimeError "Invalid arguments to file_exists"))
+        | _ -> raise (RuntimeError "Invalid arguments to file_exists")));
 
-   | "file_size" ->
+  ["file_size"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString path] ->
             (try
@@ -2484,9 +4828,9 @@ and eval_call env func_name args =
               VInt (Int64.of_int stats.Unix.st_size)
             with Unix.Unix_error _ ->
               raise (RuntimeError ("Could not stat file: " ^ path)))
-        | _ -> raise (RuntimeError "Invalid arguments to file_size"))
+        | _ -> raise (RuntimeError "Invalid arguments to file_size")));
 
-   | "file_delete" ->
+  ["file_delete"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString path] ->
             try
@@ -2494,7 +4838,7 @@ and eval_call env func_name args =
               VBool true
             with Unix.Unix_error _ ->
               VBool false
-         | _ -> raise (RuntimeError "Invalid arguments to file_delete"))
+         | _ -> raise (RuntimeError "Invalid arguments to file_delete")));
 
    (* Command-line arguments.
 
@@ -2511,11 +4855,8 @@ and eval_call env func_name args =
       with no auto-splitting. The blast radius for this change is small:
       the corpus has 0 (argv) entries, the test suite uses (argv) only
       with no args (length=0, unaffected), and Stream C uses $0 directly. *)
-   | "argv" ->
-       let args = Array.to_list Sys.argv in
-       let script_args = match args with
-         | _ :: _ :: rest -> rest
-         | _ -> [] in
+  ["argv"], (fun env func_name arg_vals ->
+       let script_args = !script_args in
        let result_strs = match script_args with
          | [single] when String.contains single '\n' ->
              (* Strip trailing empty line if input ends with \n (common
@@ -2526,22 +4867,19 @@ and eval_call env func_name args =
               | _ -> parts)
          | _ -> script_args
        in
-       VArray (ref (Array.of_list (List.map (fun s -> VString s) result_strs)))
+       VArray (vec_of_array (Array.of_list (List.map (fun s -> VString s) result_strs))));
 
-   | "argv_raw" ->
+  ["argv_raw"], (fun env func_name arg_vals ->
        (* Literal CLI argv vector, no auto-splitting. Use this when you
           need to know "did the user pass exactly N arguments". *)
-       let args = Array.to_list Sys.argv in
-       let script_args = match args with
-         | _ :: _ :: rest -> rest
-         | _ -> [] in
-       VArray (ref (Array.of_list (List.map (fun s -> VString s) script_args)))
+       let script_args = !script_args in
+       VArray (vec_of_array (Array.of_list (List.map (fun s -> VString s) script_args))));
 
-   | "argv_count" ->
-       let count = max 0 (Array.length Sys.argv - 2) in
-       VInt (Int64.of_int count)
+  ["argv_count"], (fun env func_name arg_vals ->
+       let count = List.length !script_args in
+       VInt (Int64.of_int count));
 
-   | "arg_int" | "argv_int" ->
+  ["arg_int"; "argv_int"], (fun env func_name arg_vals ->
        (* argv_int is the canonical name (matches argv/argv_count/arg_str family).
           arg_int is kept as legacy alias because the model frequently reaches for
           it. NOTE: this fetches CLI argv[i] parsed as int. To parse a STRING into
@@ -2550,9 +4888,7 @@ and eval_call env func_name args =
        (match arg_vals with
         | [VInt n] ->
             let i = Int64.to_int n in
-            let args = Array.to_list Sys.argv in
-            let script_args = (match args with _ :: _ :: rest -> rest | _ -> []) in
-            let arr = Array.of_list script_args in
+            let arr = Array.of_list !script_args in
             if i < 0 || i >= Array.length arr then
               raise (RuntimeError (func_name ^ ": index " ^ string_of_int i ^ " out of bounds"))
             else VInt (Int64.of_string arr.(i))
@@ -2560,63 +4896,61 @@ and eval_call env func_name args =
             raise (RuntimeError
               (func_name ^ ": takes an int CLI-arg index, not a string. " ^
                "To parse a string into int, use parse_int instead."))
-        | _ -> raise (RuntimeError (func_name ^ " takes 1 int argument (CLI arg index)")))
+        | _ -> raise (RuntimeError (func_name ^ " takes 1 int argument (CLI arg index)"))));
 
-   | "arg_str" ->
+  ["arg_str"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt n] ->
             let i = Int64.to_int n in
-            let args = Array.to_list Sys.argv in
-            let script_args = (match args with _ :: _ :: rest -> rest | _ -> []) in
-            let arr = Array.of_list script_args in
+            let arr = Array.of_list !script_args in
             if i < 0 || i >= Array.length arr then
               raise (RuntimeError ("arg_str: index " ^ string_of_int i ^ " out of bounds"))
             else VString arr.(i)
-        | _ -> raise (RuntimeError "arg_str takes 1 int argument"))
+        | _ -> raise (RuntimeError "arg_str takes 1 int argument")));
 
-   | "arg_float" ->
+  ["arg_float"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt n] ->
             let i = Int64.to_int n in
-            let args = Array.to_list Sys.argv in
-            let script_args = (match args with _ :: _ :: rest -> rest | _ -> []) in
-            let arr = Array.of_list script_args in
+            let arr = Array.of_list !script_args in
             if i < 0 || i >= Array.length arr then
               raise (RuntimeError ("arg_float: index " ^ string_of_int i ^ " out of bounds"))
             else VFloat (float_of_string arr.(i))
-        | _ -> raise (RuntimeError "arg_float takes 1 int argument"))
+        | _ -> raise (RuntimeError "arg_float takes 1 int argument")));
 
-   | "str" ->
+  ["str"], (fun env func_name arg_vals ->
        (* 1-arg: coerce to string. 2+ args: coerce each and concatenate.
           Matches the Python str()/JS String() + concat muscle memory. *)
        let coerce v = match v with
          | VInt n -> Int64.to_string n
          | VFloat f -> format_float_string f
          | VBool b -> if b then "true" else "false"
-         | VDecimal s -> s
+         | VDecimal d -> string_of_decimal d
          | VString s -> s
          | other -> string_of_value other
        in
        (match arg_vals with
         | [] -> raise (RuntimeError "str requires at least 1 argument")
-        | _ -> VString (String.concat "" (List.map coerce arg_vals)))
+        | _ -> VString (String.concat "" (List.map coerce arg_vals))));
 
-   | "len" ->
+  ["len"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] -> VInt (Int64.of_int (String.length s))
-        | [VArray arr] -> VInt (Int64.of_int (Array.length !arr))
+        | [VArray arr] -> VInt (Int64.of_int (arr.len))
         | [VMap (m, _)] -> VInt (Int64.of_int (Hashtbl.length m))
-        | _ -> raise (RuntimeError "len takes 1 argument (string, array, or map)"))
+        | [VBuilder b] -> VInt (Int64.of_int (Buffer.length b))
+        | [VSeq sq] -> VInt (Int64.of_int (seq_fold (fun n _ -> n + 1) 0 sq))
+        | _ -> raise (RuntimeError "len takes 1 argument (string, array, map or string builder)")));
 
-   | "string_chars" ->
+  ["string_chars"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] ->
             let n = String.length s in
             let chars = List.init n (fun i -> VString (String.make 1 s.[i])) in
-            VArray (ref (Array.of_list chars))
-        | _ -> raise (RuntimeError "string_chars takes 1 string argument"))
+            VArray (vec_of_array (Array.of_list chars))
+        | _ -> raise (RuntimeError "string_chars takes 1 string argument")));
 
-   | "is_digit" ->
+  ["is_digit"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2624,9 +4958,9 @@ and eval_call env func_name args =
         | [VString s] when String.length s = 1 ->
             let c = Char.code s.[0] in
             VBool (c >= 48 && c <= 57)
-        | _ -> raise (RuntimeError "is_digit takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "is_digit takes 1 argument (int char code or single-char string)")));
 
-   | "is_alpha" ->
+  ["is_alpha"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2634,9 +4968,9 @@ and eval_call env func_name args =
         | [VString s] when String.length s = 1 ->
             let c = Char.code s.[0] in
             VBool ((c >= 65 && c <= 90) || (c >= 97 && c <= 122))
-        | _ -> raise (RuntimeError "is_alpha takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "is_alpha takes 1 argument (int char code or single-char string)")));
 
-   | "is_upper" ->
+  ["is_upper"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2644,9 +4978,9 @@ and eval_call env func_name args =
         | [VString s] when String.length s = 1 ->
             let c = Char.code s.[0] in
             VBool (c >= 65 && c <= 90)
-        | _ -> raise (RuntimeError "is_upper takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "is_upper takes 1 argument (int char code or single-char string)")));
 
-   | "is_lower" ->
+  ["is_lower"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2654,9 +4988,9 @@ and eval_call env func_name args =
         | [VString s] when String.length s = 1 ->
             let c = Char.code s.[0] in
             VBool (c >= 97 && c <= 122)
-        | _ -> raise (RuntimeError "is_lower takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "is_lower takes 1 argument (int char code or single-char string)")));
 
-   | "is_whitespace" ->
+  ["is_whitespace"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2664,9 +4998,9 @@ and eval_call env func_name args =
         | [VString s] when String.length s = 1 ->
             let c = Char.code s.[0] in
             VBool (c = 9 || c = 10 || c = 13 || c = 32)
-        | _ -> raise (RuntimeError "is_whitespace takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "is_whitespace takes 1 argument (int char code or single-char string)")));
 
-   | "to_upper_char" ->
+  ["to_upper_char"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2676,9 +5010,9 @@ and eval_call env func_name args =
             let c = Char.code s.[0] in
             if c >= 97 && c <= 122 then VString (String.make 1 (Char.chr (c - 32)))
             else VString s
-        | _ -> raise (RuntimeError "to_upper_char takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "to_upper_char takes 1 argument (int char code or single-char string)")));
 
-   | "to_lower_char" ->
+  ["to_lower_char"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] ->
             let c = Int64.to_int code in
@@ -2688,43 +5022,78 @@ and eval_call env func_name args =
             let c = Char.code s.[0] in
             if c >= 65 && c <= 90 then VString (String.make 1 (Char.chr (c + 32)))
             else VString s
-        | _ -> raise (RuntimeError "to_lower_char takes 1 argument (int char code or single-char string)"))
+        | _ -> raise (RuntimeError "to_lower_char takes 1 argument (int char code or single-char string)")));
 
    (* I/O *)
-   | "print" ->
-       output_emitted := true;
+  ["print"], (fun env func_name arg_vals ->
+       Atomic.set output_emitted true;
        (* Variadic: multiple args joined with space *)
        (match arg_vals with
         | [] -> VUnit
-        | [v] -> print_string (string_of_value v); VUnit
+        | [v] -> out_string (string_of_value v); VUnit
         | vs ->
             let strs = List.map string_of_value vs in
-            print_string (String.concat " " strs);
-            VUnit)
+            out_string (String.concat " " strs);
+            VUnit));
 
-  | "println" ->
-      output_emitted := true;
+  ["println"], (fun env func_name arg_vals ->
+      Atomic.set output_emitted true;
       (* Variadic: multiple args joined with space, trailing newline.
          Tolerant of a trailing \n in the string (common model habit):
-         if the last arg already ends with \n, use print_string instead to
+         if the last arg already ends with \n, write it as-is to
          avoid doubling. *)
       let print_tolerant s =
         let n = String.length s in
-        if n > 0 && s.[n-1] = '\n' then print_string s
-        else print_endline s
+        if n > 0 && s.[n-1] = '\n' then out_string s
+        else out_line s
       in
       (match arg_vals with
-       | [] -> print_newline (); VUnit
+       | [] -> out_line ""; VUnit
        | [v] -> print_tolerant (string_of_value v); VUnit
        | vs ->
            let strs = List.map string_of_value vs in
            print_tolerant (String.concat " " strs);
-           VUnit)
+           VUnit));
+
+  ["read_line"], (fun env func_name arg_vals ->
+      (* Stdlib.read_line flushes stdout first. *)
+      let line = read_line () in
+      ignore (io_count io_file_reads io_bytes_read (String.length line + 1));
+      VString line);
+
+  ["flush"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [] -> flush_output (); VUnit
+       | _ -> raise (RuntimeError "flush takes no arguments")));
 
-  | "read_line" ->
-      VString (read_line ())
+  ["lines_stdin"], (fun env func_name arg_vals ->
+      (* Lazy: (for-each line (lines_stdin) ...) reads one buffer at a time.
+         Goes through the stdin channel, so it composes with read_line. *)
+      (match arg_vals with
+       | [] ->
+           flush_output ();
+           VSeq (line_seq "lines_stdin"
+                   (fun b o n -> io_count io_file_reads io_bytes_read (input stdin b o n))
+                   (fun () -> ()))
+       | _ -> raise (RuntimeError "lines_stdin takes no arguments")));
+
+  ["lines_file"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VString path] ->
+           let fd = open_stream_file "lines_file" path in
+           VSeq (line_seq "lines_file" (file_read_fd fd) (fun () -> Unix.close fd))
+       | _ -> raise (RuntimeError "lines_file takes (path)")));
 
-   | "stdin_read_all" ->
+  ["chunks_file"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VString path; VInt size] when size > 0L ->
+           let fd = open_stream_file "chunks_file" path in
+           VSeq (chunk_seq "chunks_file" (Int64.to_int size) (file_read_fd fd)
+                   (fun () -> Unix.close fd))
+       | _ -> raise (RuntimeError "chunks_file takes (path, size > 0)")));
+
+  ["stdin_read_all"], (fun env func_name arg_vals ->
+       flush_output ();
        let buf = Buffer.create 4096 in
        (try
          while true do
@@ -2734,94 +5103,102 @@ and eval_call env func_name args =
          done;
          VString (Buffer.contents buf)
        with End_of_file ->
-         VString (Buffer.contents buf))
+         ignore (io_count io_file_reads io_bytes_read (Buffer.length buf));
+         VString (Buffer.contents buf)));
 
   (* ===== Short aliases for verbose builtins ===== *)
-  | "split" ->
+  ["split"], (fun env func_name arg_vals ->
       (* Multi-char separator split. Accepts either (str, sep) or (sep, str)
          since LLMs frequently swap the order. *)
       let do_split s sep =
-        if sep = "" then VArray (ref [|VString s|])
-        else begin
-          let slen = String.length s in
-          let seplen = String.length sep in
-          let parts = ref [] in
-          let start = ref 0 in
-          let i = ref 0 in
-          while !i <= slen - seplen do
-            if String.sub s !i seplen = sep then begin
-              parts := String.sub s !start (!i - !start) :: !parts;
-              i := !i + seplen;
-              start := !i
-            end else
-              i := !i + 1
-          done;
-          parts := String.sub s !start (slen - !start) :: !parts;
-          VArray (ref (Array.of_list (List.rev_map (fun p -> VString p) !parts)))
-        end
+        if sep = "" then VArray (vec_of_array [|VString s|])
+        else VArray (vec_of_list (List.map (fun p -> VString p) (split_on_sub s sep)))
       in
       (match arg_vals with
        | [VString s; VString sep] -> do_split s sep
-       | _ -> raise (RuntimeError "split takes (string, string)"))
+       | _ -> raise (RuntimeError "split takes (string, string)")));
+
+  ["split_nth"], (fun env func_name arg_vals ->
+      (* (split_nth s sep n) = (get (split s sep) n), but only field n is
+         copied out; no array or other fields are built. "" when s has
+         fewer fields. For pulling one column out of each line. *)
+      (match arg_vals with
+       | [VString s; VString sep; VInt n] when sep <> "" ->
+           let find = make_finder sep and m = String.length sep in
+           let rec field_start from k =
+             if k = 0 then from
+             else match find s from with
+               | -1 -> -1
+               | i -> field_start (i + m) (k - 1)
+           in
+           let start = if n < 0L then -1 else field_start 0 (Int64.to_int n) in
+           if start < 0 then VString ""
+           else begin
+             let stop = match find s start with -1 -> String.length s | i -> i in
+             VString (sub_or_self s start (stop - start))
+           end
+       | _ -> raise (RuntimeError "split_nth takes (string, non-empty separator, int)")));
 
-  | "join" ->
+  ["join"], (fun env func_name arg_vals ->
       (* Accept (array, sep) or (sep, array) — LLMs often swap. *)
       let do_join arr sep =
-        let strs = Array.to_list arr |> List.map (fun v ->
+        let strs = vec_to_list arr |> List.map (fun v ->
           match v with VString s -> s | _ -> string_of_value v) in
         VString (String.concat sep strs)
       in
       (match arg_vals with
-       | [VArray arr; VString sep] -> do_join !arr sep
-       | [VString sep; VArray arr] -> do_join !arr sep
-       | _ -> raise (RuntimeError "join takes (array, string)"))
+       | [VArray arr; VString sep] -> do_join arr sep
+       | [VString sep; VArray arr] -> do_join arr sep
+       | [VSeq sq; VString sep] | [VString sep; VSeq sq] ->
+           let buf = Buffer.create 256 in
+           let first = ref true in
+           seq_iter (fun v ->
+             if not !first then Buffer.add_string buf sep;
+             first := false;
+             Buffer.add_string buf (match v with VString s -> s | _ -> string_of_value v)
+           ) sq;
+           VString (Buffer.contents buf)
+       | _ -> raise (RuntimeError "join takes (array, string)")));
 
-  | "push" ->
+  ["push"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr; v] ->
-           arr := Array.append !arr [|v|];
+           vec_push arr v;
            VArray arr
-       | _ -> raise (RuntimeError "push takes (array, value)"))
+       | _ -> raise (RuntimeError "push takes (array, value)")));
 
-  | "chars" ->
+  ["chars"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] ->
            let n = String.length s in
            let chars = List.init n (fun i -> VString (String.make 1 s.[i])) in
-           VArray (ref (Array.of_list chars))
-       | _ -> raise (RuntimeError "chars takes 1 string"))
+           VArray (vec_of_array (Array.of_list chars))
+       | _ -> raise (RuntimeError "chars takes 1 string")));
 
-  | "sort" ->
+  ["sort"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VArray arr] ->
-           let sorted = Array.copy !arr in
-           Array.sort (fun a b ->
-             match a, b with
-             | VInt x, VInt y -> Int64.compare x y
-             | VFloat x, VFloat y -> compare x y
-             | VString x, VString y -> compare x y
-             | _ -> compare a b
-           ) sorted;
-           arr := sorted;
+           let data = vget arr in
+           vset arr (Array.map (fun i -> data.(i)) (sort_permutation data));
            VArray arr
-       | _ -> raise (RuntimeError "sort takes 1 array"))
+       | _ -> raise (RuntimeError "sort takes 1 array")));
 
-  | "lower" ->
+  ["lower"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] -> VString (String.lowercase_ascii s)
-       | _ -> raise (RuntimeError "lower takes 1 string"))
+       | _ -> raise (RuntimeError "lower takes 1 string")));
 
-  | "upper" ->
+  ["upper"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] -> VString (String.uppercase_ascii s)
-       | _ -> raise (RuntimeError "upper takes 1 string"))
+       | _ -> raise (RuntimeError "upper takes 1 string")));
 
-  | "trim" ->
+  ["trim"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] -> VString (String.trim s)
-       | _ -> raise (RuntimeError "trim takes 1 string"))
+       | _ -> raise (RuntimeError "trim takes 1 string")));
 
-  | "string_repeat" | "repeat" ->
+  ["string_repeat"; "repeat"], (fun env func_name arg_vals ->
       (* (string_repeat s n) -> s concatenated n times. (repeat s n) is the
          short alias. n must be a non-negative int. *)
       (match arg_vals with
@@ -2833,9 +5210,9 @@ and eval_call env func_name args =
              let buf = Buffer.create (String.length s * n) in
              for _ = 1 to n do Buffer.add_string buf s done;
              VString (Buffer.contents buf)
-       | _ -> raise (RuntimeError "string_repeat takes (string, int)"))
+       | _ -> raise (RuntimeError "string_repeat takes (string, int)")));
 
-  | "string_at" | "char_at" ->
+  ["string_at"; "char_at"], (fun env func_name arg_vals ->
       (* (string_at s i) -> the 1-character string at index i. Distinct from
          string_get which returns the int char code. Models reach for "get me
          the i-th character as a string I can compare to other strings"; this
@@ -2848,9 +5225,9 @@ and eval_call env func_name args =
              raise (RuntimeError (Printf.sprintf
                "string_at: index %d out of bounds (length %d)" i n))
            else VString (String.make 1 s.[i])
-       | _ -> raise (RuntimeError "string_at takes (string, int)"))
+       | _ -> raise (RuntimeError "string_at takes (string, int)")));
 
-  | "repeat_each" ->
+  ["repeat_each"], (fun env func_name arg_vals ->
       (* (repeat_each coll n) -> each element of coll repeated n times in
          place. (repeat_each "abc" 3) -> "aaabbbccc".
          (repeat_each [1 2 3] 2) -> [1 1 2 2 3 3]. Saves the model from
@@ -2866,16 +5243,16 @@ and eval_call env func_name args =
              VString (Buffer.contents buf)
        | [VArray arr; VInt n] ->
            let n = Int64.to_int n in
-           if n <= 0 then VArray (ref [||])
+           if n <= 0 then VArray (vec_of_array [||])
            else
-             let src = !arr in
+             let src = (vget arr) in
              let out = Array.make (Array.length src * n) VUnit in
              Array.iteri (fun i v ->
                for j = 0 to n - 1 do out.(i * n + j) <- v done) src;
-             VArray (ref out)
-       | _ -> raise (RuntimeError "repeat_each takes (string|array, int)"))
+             VArray (vec_of_array out)
+       | _ -> raise (RuntimeError "repeat_each takes (string|array, int)")));
 
-  | "zip" ->
+  ["zip"], (fun env func_name arg_vals ->
       (* (zip a b) -> position-wise interleave of two collections. The
          tail of the longer one is appended after the interleaved prefix.
          Output is an array of strings (string args) or array of values
@@ -2896,22 +5273,22 @@ and eval_call env func_name args =
       (match arg_vals with
        | [VString sa; VString sb] -> VString (interleave_strs sa sb)
        | [VArray a; VArray b] ->
-           let la = Array.length !a and lb = Array.length !b in
+           let la = a.len and lb = b.len in
            let mn = min la lb in
            let out = Array.make (la + lb) VUnit in
            let pos = ref 0 in
            for i = 0 to mn - 1 do
-             out.(!pos) <- !a.(i); incr pos;
-             out.(!pos) <- !b.(i); incr pos
+             out.(!pos) <- a.data.(i); incr pos;
+             out.(!pos) <- b.data.(i); incr pos
            done;
            if la > lb then
-             for i = mn to la - 1 do out.(!pos) <- !a.(i); incr pos done
+             for i = mn to la - 1 do out.(!pos) <- a.data.(i); incr pos done
            else
-             for i = mn to lb - 1 do out.(!pos) <- !b.(i); incr pos done;
-           VArray (ref out)
-       | _ -> raise (RuntimeError "zip takes (string,string) or (array,array)"))
+             for i = mn to lb - 1 do out.(!pos) <- b.data.(i); incr pos done;
+           VArray (vec_of_array out)
+       | _ -> raise (RuntimeError "zip takes (string,string) or (array,array)")));
 
-  | "common_prefix" ->
+  ["common_prefix"], (fun env func_name arg_vals ->
       (* Longest common prefix of two strings. Returns the prefix as a string.
          Saves the model from manual char-walk loops with off-by-one bugs. *)
       (match arg_vals with
@@ -2921,9 +5298,9 @@ and eval_call env func_name args =
            while !i < n && a.[!i] = b.[!i] do incr i done;
            VString (String.sub a 0 !i)
        | _ -> raise (RuntimeError
-           ("common_prefix takes (string, string), got " ^ fmt_arg_types arg_vals)))
+           ("common_prefix takes (string, string), got " ^ fmt_arg_types arg_vals))));
 
-  | "common_suffix" ->
+  ["common_suffix"], (fun env func_name arg_vals ->
       (* Longest common suffix of two strings. Returns the suffix as a string.
          The reverse-index loop is exactly where the model trips on
          (sub len_a i 1) arity confusion — this absorbs the failure shape. *)
@@ -2935,9 +5312,9 @@ and eval_call env func_name args =
            while !i < n && a.[na - 1 - !i] = b.[nb - 1 - !i] do incr i done;
            VString (String.sub a (na - !i) !i)
        | _ -> raise (RuntimeError
-           ("common_suffix takes (string, string), got " ^ fmt_arg_types arg_vals)))
+           ("common_suffix takes (string, string), got " ^ fmt_arg_types arg_vals))));
 
-  | "is_subseq" ->
+  ["is_subseq"], (fun env func_name arg_vals ->
       (* (is_subseq haystack needle) -> bool. True if needle's characters
          appear in haystack in the same order (not necessarily contiguous).
          Two-pointer walk; the model kept failing this in synthesis because
@@ -2955,7 +5332,7 @@ and eval_call env func_name args =
              VBool (!j = nn)
            end
        | [VArray haystack; VArray needle] ->
-           let nh = Array.length !haystack and nn = Array.length !needle in
+           let nh = haystack.len and nn = needle.len in
            if nn = 0 then VBool true
            else begin
              let i = ref 0 and j = ref 0 in
@@ -2967,16 +5344,16 @@ and eval_call env func_name args =
                | _ -> a = b
              in
              while !i < nh && !j < nn do
-               if value_eq (!haystack).(!i) (!needle).(!j) then incr j;
+               if value_eq haystack.data.(!i) needle.data.(!j) then incr j;
                incr i
              done;
              VBool (!j = nn)
            end
        | _ -> raise (RuntimeError
            ("is_subseq takes (string, string) or (array, array), got "
-            ^ fmt_arg_types arg_vals)))
+            ^ fmt_arg_types arg_vals))));
 
-  | "is_rotation" ->
+  ["is_rotation"], (fun env func_name arg_vals ->
       (* (is_rotation a b) -> bool. True if b is a rotation of a (same
          length, b is a substring of a ++ a). Standard trick — the model
          knows it but reaches for it inconsistently. *)
@@ -2985,20 +5362,11 @@ and eval_call env func_name args =
            if String.length a <> String.length b then VBool false
            else if String.length a = 0 then VBool true
            else
-             let doubled = a ^ a in
-             let nb = String.length b in
-             let nd = String.length doubled in
-             let found = ref false in
-             let i = ref 0 in
-             while not !found && !i <= nd - nb do
-               if String.sub doubled !i nb = b then found := true;
-               incr i
-             done;
-             VBool !found
+             VBool (find_sub (a ^ a) b 0 >= 0)
        | _ -> raise (RuntimeError
-           ("is_rotation takes (string, string), got " ^ fmt_arg_types arg_vals)))
+           ("is_rotation takes (string, string), got " ^ fmt_arg_types arg_vals))));
 
-  | "edit_distance" | "levenshtein" ->
+  ["edit_distance"; "levenshtein"], (fun env func_name arg_vals ->
       (* (edit_distance a b) -> int Levenshtein distance. Insertions,
          deletions, substitutions all cost 1. Two-row DP, O(min(na,nb))
          memory. Frequently needed; manual synthesis is fragile. *)
@@ -3025,9 +5393,9 @@ and eval_call env func_name args =
              VInt (Int64.of_int prev.(nb))
            end
        | _ -> raise (RuntimeError
-           ("edit_distance takes (string, string), got " ^ fmt_arg_types arg_vals)))
+           ("edit_distance takes (string, string), got " ^ fmt_arg_types arg_vals))));
 
-  | "common_chars" ->
+  ["common_chars"], (fun env func_name arg_vals ->
       (* (common_chars a b) -> string containing the multiset intersection
          of characters from a and b, in the order they appear in a (each
          char emitted at most as many times as it occurs in b).
@@ -3048,9 +5416,9 @@ and eval_call env func_name args =
            ) a;
            VString (Buffer.contents buf)
        | _ -> raise (RuntimeError
-           ("common_chars takes (string, string), got " ^ fmt_arg_types arg_vals)))
+           ("common_chars takes (string, string), got " ^ fmt_arg_types arg_vals))));
 
-  | "swapcase" ->
+  ["swapcase"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] ->
            let buf = Bytes.of_string s in
@@ -3062,9 +5430,9 @@ and eval_call env func_name args =
                Bytes.set buf i (Char.chr (Char.code c + 32))
            done;
            VString (Bytes.to_string buf)
-       | _ -> raise (RuntimeError "swapcase takes 1 string"))
+       | _ -> raise (RuntimeError "swapcase takes 1 string")));
 
-  | "title" ->
+  ["title"], (fun env func_name arg_vals ->
       (* Capitalize first letter of each whitespace-separated word. *)
       (match arg_vals with
        | [VString s] ->
@@ -3083,51 +5451,67 @@ and eval_call env func_name args =
              end
            done;
            VString (Bytes.to_string buf)
-       | _ -> raise (RuntimeError "title takes 1 string"))
+       | _ -> raise (RuntimeError "title takes 1 string")));
 
-  | "uniq" ->
+  ["uniq"], (fun env func_name arg_vals ->
       (* Dedupe array preserving order of first occurrence. *)
       (match arg_vals with
        | [VArray arr] ->
-           let seen = ref [] in
-           let keep = ref [] in
-           Array.iter (fun v ->
-             if not (List.exists (fun x -> values_equal x v) !seen) then begin
-               seen := v :: !seen;
-               keep := v :: !keep
-             end
-           ) !arr;
-           VArray (ref (Array.of_list (List.rev !keep)))
-       | _ -> raise (RuntimeError "uniq takes 1 array"))
-
-  | "parse_pairs" ->
+           (* Scalars are deduped through a hash table (a regex by its
+              source, as values_equal treats it); other values, and NaN
+              which equals nothing, through a scan of those kept so far. *)
+           let hashed = Hashtbl.create 64 in
+           let others = ref [] in
+           let keep = vec_of_array [||] in
+           vec_iter (fun v ->
+             let hash_key = match v with
+               | VInt _ | VString _ | VBool _ -> Some v
+               | VFloat f when not (Float.is_nan f) -> Some v
+               | VRegex (src, _) -> Some (VString src)
+               | _ -> None
+             in
+             match hash_key with
+             | Some k ->
+                 if not (Hashtbl.mem hashed k) then begin
+                   Hashtbl.replace hashed k ();
+                   vec_push keep v
+                 end
+             | None ->
+                 if not (List.exists (fun x -> values_equal x v) !others) then begin
+                   others := v :: !others;
+                   vec_push keep v
+                 end
+           ) arr;
+           VArray keep
+       | _ -> raise (RuntimeError "uniq takes 1 array")));
+
+  ["parse_pairs"], (fun env func_name arg_vals ->
       (* Parse "a=1,b=2" style into map. (parse_pairs str outer inner) *)
       (match arg_vals with
        | [VString s; VString outer; VString inner] when outer <> "" && inner <> "" ->
            let pairs = String.split_on_char outer.[0] s in
            let tbl = Hashtbl.create (List.length pairs) in
-           let keys = ref [] in
+           let keys = keys_create () in
            List.iter (fun p ->
              match String.split_on_char inner.[0] p with
              | k :: rest when rest <> [] ->
                  let v = String.concat (String.make 1 inner.[0]) rest in
-                 if not (Hashtbl.mem tbl k) then keys := k :: !keys;
-                 Hashtbl.replace tbl k (VString v)
+                 vmap_set tbl keys k (VString v)
              | _ -> ()
            ) pairs;
-           VMap (tbl, ref (List.rev !keys))
-       | _ -> raise (RuntimeError "parse_pairs takes (string, outer:string, inner:string)"))
+           VMap (tbl, keys)
+       | _ -> raise (RuntimeError "parse_pairs takes (string, outer:string, inner:string)")));
 
-  | "int" ->
+  ["int"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString s] ->
            (try VInt (Int64.of_string (String.trim s))
             with Failure _ -> raise (RuntimeError ("int: cannot parse: " ^ s)))
        | [VFloat f] -> VInt (Int64.of_float f)
        | [VInt n] -> VInt n
-       | _ -> raise (RuntimeError "int takes 1 string/float/int"))
+       | _ -> raise (RuntimeError "int takes 1 string/float/int")));
 
-  | "float" ->
+  ["float"], (fun env func_name arg_vals ->
       (* Note: parse_float, to_int, etc. are aliased to canonical names in
          the symbol-rewrite table at line ~1426 (eval_call). No separate
          pattern needed here. *)
@@ -3137,9 +5521,9 @@ and eval_call env func_name args =
             with Failure _ -> raise (RuntimeError ("float: cannot parse: " ^ s)))
        | [VInt n] -> VFloat (Int64.to_float n)
        | [VFloat f] -> VFloat f
-       | _ -> raise (RuntimeError "float takes 1 string/int/float"))
+       | _ -> raise (RuntimeError "float takes 1 string/int/float")));
 
-  | "parse_ints" ->
+  ["parse_ints"], (fun env func_name arg_vals ->
       (* Split string by separator and parse each piece as int, in one step.
          Common pattern: "1 2 3 4 5" -> [1 2 3 4 5]. *)
       (match arg_vals with
@@ -3152,7 +5536,7 @@ and eval_call env func_name args =
              else try Some (VInt (Int64.of_string p))
                   with Failure _ -> raise (RuntimeError ("parse_ints: cannot parse: " ^ p))
            ) parts in
-           VArray (ref (Array.of_list ints))
+           VArray (vec_of_array (Array.of_list ints))
        | [VString s] ->
            (* Default separator: any whitespace *)
            let parts = String.split_on_char ' ' s in
@@ -3162,10 +5546,10 @@ and eval_call env func_name args =
              else try Some (VInt (Int64.of_string p))
                   with Failure _ -> raise (RuntimeError ("parse_ints: cannot parse: " ^ p))
            ) parts in
-           VArray (ref (Array.of_list ints))
-       | _ -> raise (RuntimeError "parse_ints takes (string) or (string, separator)"))
+           VArray (vec_of_array (Array.of_list ints))
+       | _ -> raise (RuntimeError "parse_ints takes (string) or (string, separator)")));
 
-  | "parse_int" | "str->int" ->
+  ["parse_int"; "str->int"], (fun env func_name arg_vals ->
       (* Singular form. Accepts string or numeric value. Trims whitespace. *)
       (match arg_vals with
        | [VString s] ->
@@ -3173,54 +5557,48 @@ and eval_call env func_name args =
             with Failure _ -> raise (RuntimeError ("parse_int: cannot parse: " ^ s)))
        | [VInt n] -> VInt n
        | [VFloat f] -> VInt (Int64.of_float f)
-       | _ -> raise (RuntimeError "parse_int takes (string) or numeric value"))
+       | _ -> raise (RuntimeError "parse_int takes (string) or numeric value")));
 
-  | "count" ->
+  ["count"], (fun env func_name arg_vals ->
       (* (count haystack needle) — Python str.count / list.count semantics. *)
       (match arg_vals with
        | [VString s; VString sub] ->
-           if sub = "" then VInt 0L
-           else begin
-             let n = String.length s and m = String.length sub in
-             let c = ref 0 and i = ref 0 in
-             while !i <= n - m do
-               if String.sub s !i m = sub then begin
-                 incr c; i := !i + m
-               end else incr i
-             done;
-             VInt (Int64.of_int !c)
-           end
+           VInt (Int64.of_int (count_sub s sub))
        | [VArray arr; v] ->
-           let c = Array.fold_left (fun acc e ->
-             if values_equal e v then acc + 1 else acc) 0 !arr in
+           let c = vec_fold (fun acc e ->
+             if values_equal e v then acc + 1 else acc) 0 arr in
            VInt (Int64.of_int c)
-       | _ -> raise (RuntimeError "count takes (string, string) or (array, value)"))
+       | [VSeq sq; v] ->
+           VInt (Int64.of_int (seq_fold (fun acc e ->
+             if values_equal e v then acc + 1 else acc) 0 sq))
+       | _ -> raise (RuntimeError "count takes (string, string) or (array, value)")));
 
-  | "enumerate" ->
+  ["enumerate"], (fun env func_name arg_vals ->
       (* (enumerate arr) — Python enumerate(): array of [index, value] pairs. *)
       (match arg_vals with
        | [VArray arr] ->
-           let pairs = Array.mapi (fun i v ->
-             VArray (ref [| VInt (Int64.of_int i); v |])
-           ) !arr in
-           VArray (ref pairs)
-       | _ -> raise (RuntimeError "enumerate takes 1 array"))
-
-  | "scan" ->
+           let pairs = vec_mapi (fun i v ->
+             VArray (vec_of_array [| VInt (Int64.of_int i); v |])
+           ) arr in
+           VArray (vec_of_array pairs)
+       | [VSeq sq] -> VArray (seq_to_array (enumerate_seq sq))
+       | _ -> raise (RuntimeError "enumerate takes 1 array")));
+
+  ["scan"], (fun env func_name arg_vals ->
       (* (scan arr fn init) — Haskell scanl / Python itertools.accumulate.
          Returns an array of accumulator states AFTER each step.
          Output length = input length. Init is the seed (not prepended). *)
       (match arg_vals with
        | [VArray arr; fn; init] ->
            let acc = ref init in
-           let out = Array.map (fun elem ->
+           let out = vec_map (fun elem ->
              acc := invoke_callable env fn [!acc; elem] "scan";
              !acc
-           ) !arr in
-           VArray (ref out)
-       | _ -> raise (RuntimeError "scan takes (array, function, init)"))
+           ) arr in
+           VArray (vec_of_array out)
+       | _ -> raise (RuntimeError "scan takes (array, function, init)")));
 
-  | "map_kv" ->
+  ["map_kv"], (fun env func_name arg_vals ->
       (* (map_kv m fn) — Python [fn(k, v) for k, v in m.items()].
          fn is called with (key, value) as two positional args, so a
          2-arg closure (\\(k v) body) destructures naturally without array_get.
@@ -3228,67 +5606,67 @@ and eval_call env func_name args =
       let do_map_kv m keys fn =
         let out = List.map (fun k ->
           invoke_callable env fn [VString k; Hashtbl.find m k] "map_kv"
-        ) !keys in
-        VArray (ref (Array.of_list out))
+        ) (keys_list keys) in
+        VArray (vec_of_array (Array.of_list out))
       in
       (match arg_vals with
        | [VMap (m, keys); fn] -> do_map_kv m keys fn
        | [fn; VMap (m, keys)] -> do_map_kv m keys fn
-       | _ -> raise (RuntimeError ("map_kv takes (map, function) or (function, map), got " ^ fmt_arg_types arg_vals)))
+       | _ -> raise (RuntimeError ("map_kv takes (map, function) or (function, map), got " ^ fmt_arg_types arg_vals))));
 
-  | "map_pairs" ->
+  ["map_pairs"], (fun env func_name arg_vals ->
       (* (map_pairs arr fn) — map over array of 2-element pair arrays,
          calling fn with the two elements as positional args. Natural fit
          for the output of enumerate / entries / zip. A 2-arg closure
          (\\(a b) body) destructures without array_get. *)
       (match arg_vals with
        | [VArray arr; fn] ->
-           let out = Array.map (fun v ->
+           let out = vec_map (fun v ->
              match v with
-             | VArray p when Array.length !p = 2 ->
-                 invoke_callable env fn [!p.(0); !p.(1)] "map_pairs"
+             | VArray p when p.len = 2 ->
+                 invoke_callable env fn [p.data.(0); p.data.(1)] "map_pairs"
              | _ -> raise (RuntimeError
                  "map_pairs: every element must be a 2-element array")
-           ) !arr in
-           VArray (ref out)
-       | _ -> raise (RuntimeError "map_pairs takes (array-of-pairs, function)"))
+           ) arr in
+           VArray (vec_of_array out)
+       | _ -> raise (RuntimeError "map_pairs takes (array-of-pairs, function)")));
 
-  | "diff" ->
+  ["diff"], (fun env func_name arg_vals ->
       (* (diff a b) — elements in a not in b, preserving order of a. *)
       (match arg_vals with
        | [VArray a; VArray b] ->
            let kept = ref [] in
-           Array.iter (fun v ->
-             if not (Array.exists (fun x -> values_equal x v) !b) then
-               kept := v :: !kept) !a;
-           VArray (ref (Array.of_list (List.rev !kept)))
-       | _ -> raise (RuntimeError "diff takes (array, array)"))
+           vec_iter (fun v ->
+             if not (vec_exists (fun x -> values_equal x v) b) then
+               kept := v :: !kept) a;
+           VArray (vec_of_array (Array.of_list (List.rev !kept)))
+       | _ -> raise (RuntimeError "diff takes (array, array)")));
 
-  | "inter" ->
+  ["inter"], (fun env func_name arg_vals ->
       (* (inter a b) — elements in both a and b, preserving order of a, deduped. *)
       (match arg_vals with
        | [VArray a; VArray b] ->
            let kept = ref [] in
-           Array.iter (fun v ->
-             if Array.exists (fun x -> values_equal x v) !b &&
+           vec_iter (fun v ->
+             if vec_exists (fun x -> values_equal x v) b &&
                 not (List.exists (fun x -> values_equal x v) !kept) then
-               kept := v :: !kept) !a;
-           VArray (ref (Array.of_list (List.rev !kept)))
-       | _ -> raise (RuntimeError "inter takes (array, array)"))
+               kept := v :: !kept) a;
+           VArray (vec_of_array (Array.of_list (List.rev !kept)))
+       | _ -> raise (RuntimeError "inter takes (array, array)")));
 
-  | "union" ->
+  ["union"], (fun env func_name arg_vals ->
       (* (union a b) — elements from a then b, deduped, order preserved. *)
       (match arg_vals with
        | [VArray a; VArray b] ->
            let kept = ref [] in
            let add v = if not (List.exists (fun x -> values_equal x v) !kept) then
              kept := v :: !kept in
-           Array.iter add !a;
-           Array.iter add !b;
-           VArray (ref (Array.of_list (List.rev !kept)))
-       | _ -> raise (RuntimeError "union takes (array, array)"))
+           vec_iter add a;
+           vec_iter add b;
+           VArray (vec_of_array (Array.of_list (List.rev !kept)))
+       | _ -> raise (RuntimeError "union takes (array, array)")));
 
-  | "fmt_float" ->
+  ["fmt_float"], (fun env func_name arg_vals ->
       (* (fmt_float x prec) — format number with `prec` decimal places.
          Accepts int, float, or decimal input. *)
       (match arg_vals with
@@ -3297,11 +5675,11 @@ and eval_call env func_name args =
        | [VInt x; VInt p] ->
            VString (Printf.sprintf "%.*f" (Int64.to_int p) (Int64.to_float x))
        | [VDecimal d; VInt p] ->
-           let f = float_of_string d in
+           let f = float_of_string (string_of_decimal d) in
            VString (Printf.sprintf "%.*f" (Int64.to_int p) f)
-       | _ -> raise (RuntimeError "fmt_float takes (number, int-precision)"))
+       | _ -> raise (RuntimeError "fmt_float takes (number, int-precision)")));
 
-  | "slice" ->
+  ["slice"], (fun env func_name arg_vals ->
       (* (slice coll start end) — Python-style half-open slice on string or
          array. Negative start/end count from the right. If end is omitted
          (only 2 args), slice to the end. *)
@@ -3310,76 +5688,78 @@ and eval_call env func_name args =
         (norm s, norm e) in
       (match arg_vals with
        | [VArray arr; VInt s; VInt e] ->
-           let len = Array.length !arr in
+           let len = arr.len in
            let (s, e) = resolve_bounds len (Int64.to_int s) (Int64.to_int e) in
-           if e <= s then VArray (ref [||])
-           else VArray (ref (Array.sub !arr s (e - s)))
+           if e <= s then VArray (vec_of_array [||])
+           else VArray (vec_of_array (Array.sub (vget arr) s (e - s)))
        | [VArray arr; VInt s] ->
-           let len = Array.length !arr in
+           let len = arr.len in
            let (s, _) = resolve_bounds len (Int64.to_int s) len in
-           if len <= s then VArray (ref [||])
-           else VArray (ref (Array.sub !arr s (len - s)))
+           if len <= s then VArray (vec_of_array [||])
+           else VArray (vec_of_array (Array.sub (vget arr) s (len - s)))
        | [VString str; VInt s; VInt e] ->
            let len = String.length str in
            let (s, e) = resolve_bounds len (Int64.to_int s) (Int64.to_int e) in
-           if e <= s then VString "" else VString (String.sub str s (e - s))
+           if e <= s then VString "" else VString (sub_or_self str s (e - s))
        | [VString str; VInt s] ->
            let len = String.length str in
            let (s, _) = resolve_bounds len (Int64.to_int s) len in
-           if len <= s then VString "" else VString (String.sub str s (len - s))
+           if len <= s then VString "" else VString (sub_or_self str s (len - s))
        | _ -> raise (RuntimeError
            ("slice takes (string|array, int-start) or (string|array, int-start, int-end), got "
-            ^ fmt_arg_types arg_vals)))
+            ^ fmt_arg_types arg_vals))));
 
-  | "merge" ->
+  ["merge"], (fun env func_name arg_vals ->
       (* (merge m1 m2 ...) — rightmost key wins; order = keys of m1 then new
          keys from later maps. *)
       (match arg_vals with
        | [] -> raise (RuntimeError "merge takes at least 1 map")
        | maps ->
            let tbl = Hashtbl.create 16 in
-           let keys = ref [] in
+           let keys = keys_create () in
            List.iter (fun v ->
              match v with
              | VMap (src, src_keys) ->
-                 List.iter (fun k ->
-                   if not (Hashtbl.mem tbl k) then keys := k :: !keys;
-                   Hashtbl.replace tbl k (Hashtbl.find src k)) !src_keys
+                 keys_iter (fun k ->
+                   vmap_set tbl keys k (Hashtbl.find src k)) src_keys
              | _ -> raise (RuntimeError "merge takes maps")) maps;
-           VMap (tbl, ref (List.rev !keys)))
+           VMap (tbl, keys)));
 
-  | "range" ->
+  ["range"], (fun env func_name arg_vals ->
       (* (range end) or (range start end) — int array [start, end). *)
       (match arg_vals with
        | [VInt e] ->
            let e = Int64.to_int e in
-           VArray (ref (Array.init (max 0 e) (fun i -> VInt (Int64.of_int i))))
+           VArray (vec_of_array (Array.init (max 0 e) (fun i -> VInt (Int64.of_int i))))
        | [VInt s; VInt e] ->
            let s = Int64.to_int s and e = Int64.to_int e in
            let n = max 0 (e - s) in
-           VArray (ref (Array.init n (fun i -> VInt (Int64.of_int (s + i)))))
-       | _ -> raise (RuntimeError "range takes (end) or (start, end)"))
+           VArray (vec_of_array (Array.init n (fun i -> VInt (Int64.of_int (s + i)))))
+       | _ -> raise (RuntimeError "range takes (end) or (start, end)")));
 
-  | "counter" ->
+  ["counter"], (fun env func_name arg_vals ->
       (* (counter arr) — Python Counter. Returns map of string→int count.
          Keys are stringified via str conversion. *)
+      let count_values size iter =
+        let tbl = Hashtbl.create size in
+        let keys = keys_create () in
+        iter (fun v ->
+          let k = match v with
+            | VString s -> s
+            | VInt n -> Int64.to_string n
+            | _ -> string_of_value v in
+          let cur = try (match Hashtbl.find tbl k with VInt n -> n | _ -> 0L) with Not_found -> 0L in
+          vmap_set tbl keys k (VInt (Int64.add cur 1L)));
+        VMap (tbl, keys)
+      in
       (match arg_vals with
        | [VArray arr] ->
-           let tbl = Hashtbl.create (Array.length !arr) in
-           let keys = ref [] in
-           Array.iter (fun v ->
-             let k = match v with
-               | VString s -> s
-               | VInt n -> Int64.to_string n
-               | _ -> string_of_value v in
-             let cur = try (match Hashtbl.find tbl k with VInt n -> n | _ -> 0L) with Not_found -> 0L in
-             if not (Hashtbl.mem tbl k) then keys := k :: !keys;
-             Hashtbl.replace tbl k (VInt (Int64.add cur 1L))
-           ) !arr;
-           VMap (tbl, ref (List.rev !keys))
-       | _ -> raise (RuntimeError "counter takes 1 array"))
-
-  | "sort_by" ->
+           count_values arr.len (fun f ->
+             for i = 0 to arr.len - 1 do f arr.data.(i) done)
+       | [VSeq sq] -> count_values 64 (fun f -> seq_iter f sq)
+       | _ -> raise (RuntimeError "counter takes 1 array or seq")));
+
+  ["sort_by"], (fun env func_name arg_vals ->
       (* (sort_by arr fn) — stable sort of arr.
          If fn takes 1 arg: it's a key function; sort ascending by key.
            For descending, negate the key: (sort_by arr (\x (neg (fn x)))).
@@ -3388,20 +5768,20 @@ and eval_call env func_name args =
          Mutates the input ref AND returns it (same shape as `sort`), so
          both `(sort_by arr fn)` and `(set sorted (sort_by arr fn))` work. *)
       let arity_of v = match v with
-        | VFunction (_, params, _, _) -> Some (List.length params)
-        | VClosure (params, _, _) -> Some (List.length params)
+        | VFunction (_, params, _, _, _) -> Some (List.length params)
+        | VClosure (params, _, _, _) -> Some (List.length params)
         | _ -> None
       in
       (match arg_vals with
        | [VArray arr; fn] ->
-           let n = Array.length !arr in
+           let n = arr.len in
            (* Pair detection: if every array element is itself a 2-array
               and the lambda has 2 params, treat as a key function over
               pairs (auto-destructured) rather than a comparator. This is
               the dominant `(\(k v) ...)` intent over `(entries m)`. *)
            let all_pairs () =
              n > 0 &&
-             Array.for_all (function VArray a -> Array.length !a = 2 | _ -> false) !arr
+             Array.for_all (function VArray a -> a.len = 2 | _ -> false) (vget arr)
            in
            let effective_arity = match arity_of fn with
              | Some 2 when all_pairs () -> Some 1  (* treat as key fn over pairs *)
@@ -3409,7 +5789,7 @@ and eval_call env func_name args =
            in
            let sorted = match effective_arity with
             | Some 2 ->
-                let indexed = Array.init n (fun i -> (i, !arr.(i))) in
+                let indexed = Array.init n (fun i -> (i, arr.data.(i))) in
                 Array.sort (fun (ia, va) (ib, vb) ->
                   let r = invoke_callable env fn [va; vb] "sort_by" in
                   let c = match r with
@@ -3426,33 +5806,23 @@ and eval_call env func_name args =
                 ) indexed;
                 Array.map snd indexed
             | _ ->
-                let keyed = Array.init n (fun i ->
-                  (i, !arr.(i), invoke_callable env fn [!arr.(i)] "sort_by")
-                ) in
-                let cmp a b = match a, b with
-                  | VInt x, VInt y -> Int64.compare x y
-                  | VFloat x, VFloat y -> compare x y
-                  | VString x, VString y -> compare x y
-                  | VArray ax, VArray ay ->
-                      let la = Array.to_list !ax and lb = Array.to_list !ay in
-                      compare la lb
-                  | _ -> compare a b in
-                Array.sort (fun (ia, _, ka) (ib, _, kb) ->
-                  let c = cmp ka kb in if c <> 0 then c else compare ia ib) keyed;
-                Array.map (fun (_, v, _) -> v) keyed
+                (* One key call per element, then a key-only sort. *)
+                let data = vget arr in
+                let keys = Array.map (fun v -> invoke_callable env fn [v] "sort_by") data in
+                Array.map (fun i -> data.(i)) (sort_permutation keys)
            in
-           arr := sorted;
+           vset arr sorted;
            VArray arr
-       | _ -> raise (RuntimeError "sort_by takes (array, function)"))
+       | _ -> raise (RuntimeError "sort_by takes (array, function)")));
 
-  | "group_by" ->
+  ["group_by"], (fun env func_name arg_vals ->
       (* (group_by arr fn) — returns map from key (stringified) to array of
          elements that fn mapped there. *)
       (match arg_vals with
        | [VArray arr; fn] ->
            let tbl = Hashtbl.create 16 in
-           let keys = ref [] in
-           Array.iter (fun v ->
+           let keys = keys_create () in
+           vec_iter (fun v ->
              let k_val = invoke_callable env fn [v] "group_by" in
              let k = match k_val with
                | VString s -> s
@@ -3460,70 +5830,80 @@ and eval_call env func_name args =
                | _ -> string_of_value k_val in
              let cur = match Hashtbl.find_opt tbl k with
                | Some (VArray r) -> r
-               | _ -> let r = ref [||] in
-                      keys := k :: !keys;
-                      Hashtbl.add tbl k (VArray r); r in
-             cur := Array.append !cur [|v|]
-           ) !arr;
-           VMap (tbl, ref (List.rev !keys))
-       | _ -> raise (RuntimeError "group_by takes (array, function)"))
-
-  | "transpose" ->
+               | _ -> let r = vec_of_array [||] in
+                      vmap_set tbl keys k (VArray r); r in
+             vec_push cur v
+           ) arr;
+           VMap (tbl, keys)
+       | _ -> raise (RuntimeError "group_by takes (array, function)")));
+
+  ["transpose"], (fun env func_name arg_vals ->
       (* (transpose rows) — matrix transpose. rows is an array of arrays.
          Shorter rows produce a rectangular transpose up to min length. *)
       (match arg_vals with
        | [VArray rows] ->
            let row_arrs = Array.map (fun v ->
              match v with VArray r -> r
-                       | _ -> raise (RuntimeError "transpose: not a matrix")) !rows in
+                       | _ -> raise (RuntimeError "transpose: not a matrix")) (vget rows) in
            let n_rows = Array.length row_arrs in
-           if n_rows = 0 then VArray (ref [||])
+           if n_rows = 0 then VArray (vec_of_array [||])
            else begin
-             let n_cols = Array.fold_left (fun acc r -> min acc (Array.length !r))
-                            (Array.length !(row_arrs.(0))) row_arrs in
+             let n_cols = Array.fold_left (fun acc r -> min acc (r.len))
+                            row_arrs.(0).len row_arrs in
              let cols = Array.init n_cols (fun c ->
-               VArray (ref (Array.init n_rows (fun r -> !(row_arrs.(r)).(c))))
+               VArray (vec_of_array (Array.init n_rows (fun r -> row_arrs.(r).data.(c))))
              ) in
-             VArray (ref cols)
+             VArray (vec_of_array cols)
            end
-       | _ -> raise (RuntimeError "transpose takes (array of arrays)"))
+       | _ -> raise (RuntimeError "transpose takes (array of arrays)")));
 
-  | "max_by" | "min_by" ->
+  ["max_by"; "min_by"], (fun env func_name arg_vals ->
       (* (max_by arr fn) — element of arr maximising fn; ties keep first.
          (min_by arr fn) — same but minimising. *)
+      let compare_keys a b = match a, b with
+        | VInt x, VInt y -> Int64.compare x y
+        | VFloat x, VFloat y -> compare x y
+        | VString x, VString y -> compare x y
+        | _ -> compare a b in
       (match arg_vals with
        | [VArray arr; fn] ->
-           let n = Array.length !arr in
+           let n = arr.len in
            if n = 0 then raise (RuntimeError (func_name ^ ": empty array"))
            else begin
-             let cmp a b = match a, b with
-               | VInt x, VInt y -> Int64.compare x y
-               | VFloat x, VFloat y -> compare x y
-               | VString x, VString y -> compare x y
-               | _ -> compare a b in
+             let cmp = compare_keys in
              let pick = if func_name = "max_by" then (>) else (<) in
              let best_idx = ref 0 in
-             let best_key = ref (invoke_callable env fn [!arr.(0)] func_name) in
+             let best_key = ref (invoke_callable env fn [arr.data.(0)] func_name) in
              for i = 1 to n - 1 do
-               let k = invoke_callable env fn [!arr.(i)] func_name in
+               let k = invoke_callable env fn [arr.data.(i)] func_name in
                if pick (cmp k !best_key) 0 then begin
                  best_idx := i; best_key := k
                end
              done;
-             !arr.(!best_idx)
+             arr.data.(!best_idx)
            end
-       | _ -> raise (RuntimeError (func_name ^ " takes (array, function)")))
-
-  | "digits" ->
+       | [VSeq sq; fn] ->
+           let pick = if func_name = "max_by" then (>) else (<) in
+           let best = seq_fold (fun best v ->
+             let k = invoke_callable env fn [v] func_name in
+             match best with
+             | Some (_, bk) when not (pick (compare_keys k bk) 0) -> best
+             | _ -> Some (v, k)
+           ) None sq in
+           (match best with
+            | Some (v, _) -> v
+            | None -> raise (RuntimeError (func_name ^ ": empty array")))
+
+  ["digits"], (fun env func_name arg_vals ->
       (* Digit array of a non-negative int, or of the digit chars of a string. *)
       (match arg_vals with
        | [VInt n] ->
            let n = Int64.to_int n in
            if n < 0 then raise (RuntimeError "digits: negative int")
-           else if n = 0 then VArray (ref [| VInt 0L |])
+           else if n = 0 then VArray (vec_of_array [| VInt 0L |])
            else begin
              let rec loop m acc = if m = 0 then acc else loop (m / 10) (VInt (Int64.of_int (m mod 10)) :: acc) in
-             VArray (ref (Array.of_list (loop n [])))
+             VArray (vec_of_array (Array.of_list (loop n [])))
            end
        | [VString s] ->
            let arr = ref [] in
@@ -3531,85 +5911,171 @@ and eval_call env func_name args =
              if c >= '0' && c <= '9' then
                arr := VInt (Int64.of_int (Char.code c - Char.code '0')) :: !arr
            ) s;
-           VArray (ref (Array.of_list (List.rev !arr)))
-       | _ -> raise (RuntimeError "digits takes 1 int or string"))
+           VArray (vec_of_array (Array.of_list (List.rev !arr)))
+       | _ -> raise (RuntimeError "digits takes 1 int or string")));
 
-  | "sum" ->
+  ["sum"], (fun env func_name arg_vals ->
       (* Sum an array of ints or floats *)
       (match arg_vals with
        | [VArray arr] ->
-           if Array.length !arr = 0 then VInt 0L
+           if arr.len = 0 then VInt 0L
            else begin
-             let all_int = Array.for_all (fun v -> match v with VInt _ -> true | _ -> false) !arr in
-             let all_float = Array.for_all (fun v -> match v with VFloat _ -> true | _ -> false) !arr in
+             let all_int = vec_for_all (fun v -> match v with VInt _ -> true | _ -> false) arr in
+             let all_float = vec_for_all (fun v -> match v with VFloat _ -> true | _ -> false) arr in
              if all_int then
-               VInt (Array.fold_left (fun acc v -> match v with VInt n -> Int64.add acc n | _ -> acc) 0L !arr)
+               VInt (vec_fold (fun acc v -> match v with VInt n -> Int64.add acc n | _ -> acc) 0L arr)
              else if all_float then
-               VFloat (Array.fold_left (fun acc v -> match v with VFloat f -> acc +. f | _ -> acc) 0.0 !arr)
+               VFloat (vec_fold (fun acc v -> match v with VFloat f -> acc +. f | _ -> acc) 0.0 arr)
              else raise (RuntimeError "sum: array must be homogeneous int or float")
            end
-       | _ -> raise (RuntimeError "sum takes 1 array"))
-
-  | "filter" ->
+       | [VSeq sq] ->
+           (* The first element fixes int or float, as for an array. *)
+           let mixed () = raise (RuntimeError "sum: array must be homogeneous int or float") in
+           seq_fold (fun acc v ->
+             match acc, v with
+             | VUnit, (VInt _ | VFloat _) -> v
+             | VInt a, VInt b -> VInt (Int64.add a b)
+             | VFloat a, VFloat b -> VFloat (a +. b)
+             | _ -> mixed ()
+           ) VUnit sq
+           |> (function VUnit -> VInt 0L | v -> v)
+
+  ["filter"], (fun env func_name arg_vals ->
       (* (filter arr fn-or-closure) OR (filter fn-or-closure arr). Array-first
          is canonical Sigil; function-first is what Clojure/Python models reach
          for. Accept both. *)
       (match arg_vals with
        | [VArray arr; pred] | [pred; VArray arr] ->
            let kept = ref [] in
-           Array.iter (fun elem ->
+           vec_iter (fun elem ->
              let result = invoke_callable env pred [elem] "filter" in
              match result with
              | VBool true -> kept := elem :: !kept
              | _ -> ()
-           ) !arr;
-           VArray (ref (Array.of_list (List.rev !kept)))
-       | _ -> raise (RuntimeError "filter takes (array, function) or (function, array)"))
+           ) arr;
+           VArray (vec_of_array (Array.of_list (List.rev !kept)))
+       | [VSeq sq; pred] | [pred; VSeq sq] ->
+           (* Only the kept elements are held in memory. *)
+           let kept = vec_of_array [||] in
+           seq_iter (fun elem ->
+             match invoke_callable env pred [elem] "filter" with
+             | VBool true -> vec_push kept elem
+             | _ -> ()
+           ) sq;
+           VArray kept
+       | _ -> raise (RuntimeError "filter takes (array, function) or (function, array)")));
 
-  | "map_arr" ->
+  ["map_arr"], (fun env func_name arg_vals ->
       (* (map_arr arr fn) OR (map_arr fn arr) — array-first canonical,
          function-first accepted for model ergonomics. *)
       (match arg_vals with
        | [VArray arr; fn] | [fn; VArray arr] ->
-           let mapped = Array.map (fun elem ->
+           let mapped = vec_map (fun elem ->
              invoke_callable env fn [elem] "map_arr"
-           ) !arr in
-           VArray (ref mapped)
-       | _ -> raise (RuntimeError "map_arr takes (array, function) or (function, array)"))
+           ) arr in
+           VArray (vec_of_array mapped)
+       | [VSeq sq; fn] | [fn; VSeq sq] -> VArray (seq_to_array (map_seq env fn sq))
+       | _ -> raise (RuntimeError "map_arr takes (array, function) or (function, array)")));
 
-  | "reduce" ->
+  ["reduce"], (fun env func_name arg_vals ->
       (* (reduce arr fn init) OR (reduce fn init arr) — both orders accepted.
          The latter is Clojure/Haskell style. *)
       (match arg_vals with
        | [VArray arr; fn; init] ->
-           Array.fold_left (fun acc elem ->
+           vec_fold (fun acc elem ->
              invoke_callable env fn [acc; elem] "reduce"
-           ) init !arr
+           ) init arr
        | [fn; init; VArray arr] ->
-           Array.fold_left (fun acc elem ->
+           vec_fold (fun acc elem ->
              invoke_callable env fn [acc; elem] "reduce"
-           ) init !arr
-       | _ -> raise (RuntimeError "reduce takes (array, function, init) or (function, init, array)"))
+           ) init arr
+       | [VSeq sq; fn; init] | [fn; init; VSeq sq] ->
+           seq_fold (fun acc elem ->
+             invoke_callable env fn [acc; elem] "reduce"
+           ) init sq
+       | _ -> raise (RuntimeError "reduce takes (array, function, init) or (function, init, array)")));
+
+  ["pmap"], (fun env func_name arg_vals ->
+      (* (pmap arr fn) — map_arr across the domain pool, results in input
+         order. Each chunk calls fn in an env of its own, but elements and
+         anything fn captures are shared, so fn should not mutate them. *)
+      (match arg_vals with
+       | [VArray arr; fn] | [fn; VArray arr] ->
+           let data = vget arr in
+           let n = Array.length data in
+           let results = Array.make n VUnit in
+           let chunks, size = parallel_chunks n in
+           run_chunks chunks (fun c ->
+             let wenv = worker_env env in
+             for i = c * size to min n ((c + 1) * size) - 1 do
+               results.(i) <- invoke_callable wenv fn [data.(i)] func_name
+             done);
+           VArray (vec_of_array results)
+       | _ -> raise (RuntimeError "pmap takes (array, function) or (function, array)")));
+
+  ["pfilter"], (fun env func_name arg_vals ->
+      (* (pfilter arr pred) — filter across the domain pool; kept elements
+         stay in input order. Same sharing rules as pmap. *)
+      (match arg_vals with
+       | [VArray arr; pred] | [pred; VArray arr] ->
+           let data = vget arr in
+           let n = Array.length data in
+           let chunks, size = parallel_chunks n in
+           let kept = Array.make chunks [] in
+           run_chunks chunks (fun c ->
+             let wenv = worker_env env in
+             let acc = ref [] in
+             for i = c * size to min n ((c + 1) * size) - 1 do
+               match invoke_callable wenv pred [data.(i)] func_name with
+               | VBool true -> acc := data.(i) :: !acc
+               | _ -> ()
+             done;
+             kept.(c) <- List.rev !acc);
+           VArray (vec_of_list (List.concat (Array.to_list kept)))
+       | _ -> raise (RuntimeError "pfilter takes (array, function) or (function, array)")));
+
+  ["preduce"], (fun env func_name arg_vals ->
+      (* (preduce arr fn init) — reduce with an associative fn: each chunk
+         is folded from its first element across the pool, then init and
+         the chunk results are folded left to right on the caller. Equals
+         reduce whenever fn is associative; init need not be an identity. *)
+      (match arg_vals with
+       | [VArray arr; fn; init] | [fn; init; VArray arr] ->
+           let data = vget arr in
+           let n = Array.length data in
+           let chunks, size = parallel_chunks n in
+           let partial = Array.make chunks VUnit in
+           run_chunks chunks (fun c ->
+             let wenv = worker_env env in
+             let acc = ref data.(c * size) in
+             for i = c * size + 1 to min n ((c + 1) * size) - 1 do
+               acc := invoke_callable wenv fn [!acc; data.(i)] func_name
+             done;
+             partial.(c) <- !acc);
+           Array.fold_left (fun acc v -> invoke_callable env fn [acc; v] func_name) init partial
+       | _ -> raise (RuntimeError "preduce takes (array, function, init) or (function, init, array)")));
 
-  | "count_in" ->
+  ["count_in"], (fun env func_name arg_vals ->
       (* Count chars in string s that appear in string charset, or elements of array1 in array2 *)
       (match arg_vals with
        | [VString s; VString charset] ->
+           let member = Bytes.make 256 '\000' in
+           String.iter (fun c -> Bytes.unsafe_set member (Char.code c) '\001') charset;
            let count = ref 0 in
            String.iter (fun c ->
-             if String.contains charset c then incr count
+             if Bytes.unsafe_get member (Char.code c) <> '\000' then incr count
            ) s;
            VInt (Int64.of_int !count)
        | [VArray needles; VArray haystack] ->
-           let hs = !haystack in
+           let hs = (vget haystack) in
            let count = ref 0 in
            Array.iter (fun n ->
              if Array.exists (fun h -> values_equal n h) hs then incr count
-           ) !needles;
+           ) (vget needles);
            VInt (Int64.of_int !count)
-       | _ -> raise (RuntimeError "count_in takes (string, charset) or (array, array)"))
+       | _ -> raise (RuntimeError "count_in takes (string, charset) or (array, array)")));
 
-  | "map_inc" ->
+  ["map_inc"], (fun env func_name arg_vals ->
       (* (map_inc m k) increments the int at key k, setting to 1 if missing *)
       (match arg_vals with
        | [VMap (m, keys); VString k] ->
@@ -3617,50 +6083,51 @@ and eval_call env func_name args =
            (match cur with
             | VInt n ->
                 let next = VInt (Int64.add n 1L) in
-                if not (Hashtbl.mem m k) then keys := !keys @ [k];
-                Hashtbl.replace m k next;
+                vmap_set m keys k next;
                 next
             | _ -> raise (RuntimeError "map_inc: existing value at key is not int"))
-       | _ -> raise (RuntimeError "map_inc takes (map, string)"))
+       | _ -> raise (RuntimeError "map_inc takes (map, string)")));
 
-  | "get_or" ->
+  ["get_or"], (fun env func_name arg_vals ->
       (* (get_or coll key_or_idx default) — get with fallback *)
       (match arg_vals with
        | [VMap (m, _); VString k; default] ->
            (try Hashtbl.find m k with Not_found -> default)
        | [VArray arr; VInt i; default] ->
            let idx = Int64.to_int i in
-           if idx < 0 || idx >= Array.length !arr then default
-           else !arr.(idx)
-       | _ -> raise (RuntimeError "get_or takes (map, string, default) or (array, int, default)"))
+           if idx < 0 || idx >= arr.len then default
+           else arr.data.(idx)
+       | _ -> raise (RuntimeError "get_or takes (map, string, default) or (array, int, default)")));
 
   (* Time operations *)
-  | "time_now" ->
-      VInt (Int64.of_float (Unix.time ()))
+  ["time_now"], (fun env func_name arg_vals ->
+      VInt (Int64.of_float (Unix.time ())));
 
-  | "sleep" ->
+  ["sleep"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VInt ms] -> Unix.sleepf (Int64.to_float ms /. 1000.0); VUnit
-       | _ -> raise (RuntimeError "Invalid arguments to sleep"))
+       | _ -> raise (RuntimeError "Invalid arguments to sleep")));
 
    (* Process operations - stores (pid, stdin_fd, stdout_fd) *)
-   | "process_spawn" ->
+  ["process_spawn"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString cmd; VArray args_ref] ->
-            let args = Array.of_list (List.map string_of_value (Array.to_list !args_ref)) in
+            let args = Array.of_list (List.map string_of_value (Array.to_list (vget args_ref))) in
             let argv = Array.concat [[|cmd|]; args] in
             let stdin_read, stdin_write = Unix.pipe () in
             let stdout_read, stdout_write = Unix.pipe () in
+            flush_output ();
             let _pid = Unix.create_process cmd argv stdin_read stdout_write Unix.stderr in
             Unix.close stdin_read;
             Unix.close stdout_write;
             VChannel (stdin_write, stdout_read, Some _pid)
         | [VString cmd] ->
+            flush_output ();
             let pid = Unix.create_process cmd [|cmd|] Unix.stdin Unix.stdout Unix.stderr in
             VProcess pid
-        | _ -> raise (RuntimeError "Invalid arguments to process_spawn"))
+        | _ -> raise (RuntimeError "Invalid arguments to process_spawn")));
 
-   | "process_wait" ->
+  ["process_wait"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VProcess pid] ->
             let _, status = Unix.waitpid [] pid in
@@ -3670,32 +6137,35 @@ and eval_call env func_name args =
         | [VChannel (stdin_write, stdout_read, pid_opt)] ->
             (* Close stdin so child process knows input is done, then wait *)
             (try Unix.close stdin_write with Unix.Unix_error _ -> ());
+            channel_forget stdout_read;
             (try Unix.close stdout_read with Unix.Unix_error _ -> ());
             let wait_pid = match pid_opt with Some p -> p | None -> -1 in
             let _, status = Unix.waitpid [] wait_pid in
             (match status with
              | Unix.WEXITED code -> VInt (Int64.of_int code)
              | _ -> VInt 0L)
-        | _ -> raise (RuntimeError "Invalid arguments to process_wait"))
+        | _ -> raise (RuntimeError "Invalid arguments to process_wait")));
 
-   | "process_write" ->
+  ["process_write"], (fun env func_name arg_vals ->
        (match arg_vals with
          | [VChannel (stdin_write, _, _); VString data] ->
+            flush_output ();
             let bytes = Bytes.of_string data in
-            let written = Unix.write stdin_write bytes 0 (Bytes.length bytes) in
+            let written = file_write_fd stdin_write bytes 0 (Bytes.length bytes) in
             VBool (written > 0)
-        | _ -> raise (RuntimeError "Invalid arguments to process_write"))
+        | _ -> raise (RuntimeError "Invalid arguments to process_write")));
 
-   | "process_read" ->
+  ["process_read"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VChannel (_, stdout_read, _)] ->
+            flush_output ();
             let ready, _, _ = Unix.select [stdout_read] [] [] 0.05 in
             if ready = [] then VString ""
             else begin
               Unix.set_nonblock stdout_read;
               let result = (try
                 let buf = Bytes.create 4096 in
-                let received = Unix.read stdout_read buf 0 4096 in
+                let received = file_read_fd stdout_read buf 0 4096 in
                 if received > 0 then
                   Bytes.to_string (Bytes.sub buf 0 received)
                 else ""
@@ -3705,183 +6175,510 @@ and eval_call env func_name args =
             end
         | [VProcess _pid] ->
             raise (RuntimeError "process_read requires a VChannel from process_spawn with pipes, not a bare PID")
-        | _ -> raise (RuntimeError "Invalid arguments to process_read"))
+        | _ -> raise (RuntimeError "Invalid arguments to process_read")));
 
-   | "process_kill" ->
+  ["process_kill"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VProcess pid; VInt sig_num] ->
             Unix.kill pid (Int64.to_int sig_num);
             VBool true
-        | _ -> raise (RuntimeError "Invalid arguments to process_kill"))
+        | _ -> raise (RuntimeError "Invalid arguments to process_kill")));
 
-  | "process_exec" ->
+  ["process_exec"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString cmd] ->
+           flush_output ();
            let _, status = Unix.waitpid [] (Unix.create_process cmd [|cmd|] Unix.stdin Unix.stdout Unix.stderr) in
            (match status with
             | Unix.WEXITED code -> VInt (Int64.of_int code)
             | Unix.WSIGNALED _ -> VInt (-1L)
             | Unix.WSTOPPED _ -> VInt (-1L))
-       | _ -> raise (RuntimeError "Invalid arguments to process_exec"))
+       | _ -> raise (RuntimeError "Invalid arguments to process_exec")));
 
   (* TCP operations *)
-   | "tcp_listen" ->
+  ["tcp_listen"], (fun env func_name arg_vals ->
+       (* (tcp_listen port [backlog]) — backlog defaults to 128. *)
+       let listen port backlog =
+         let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+         Unix.setsockopt sock Unix.SO_REUSEADDR true;
+         Unix.bind sock (Unix.ADDR_INET (Unix.inet_addr_any, Int64.to_int port));
+         Unix.listen sock backlog;
+         VSocket sock
+       in
        (match arg_vals with
-        | [VInt port] ->
-            let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
-            Unix.setsockopt sock Unix.SO_REUSEADDR true;
-            Unix.bind sock (Unix.ADDR_INET (Unix.inet_addr_any, Int64.to_int port));
-            Unix.listen sock 5;
-            VSocket sock
-        | _ -> raise (RuntimeError "Invalid arguments to tcp_listen"))
+        | [VInt port] -> listen port 128
+        | [VInt port; VInt backlog] when backlog > 0L -> listen port (Int64.to_int backlog)
+        | _ -> raise (RuntimeError "Invalid arguments to tcp_listen")));
 
-  | "tcp_accept" ->
+  ["tcp_accept"], (fun env func_name arg_vals ->
+      (* unit when a non-blocking listener has no connection waiting. *)
       (match arg_vals with
        | [VSocket sock] ->
-           let client_sock, _ = Unix.accept sock in
-           VSocket client_sock
-       | _ -> raise (RuntimeError "Invalid arguments to tcp_accept"))
+           (match unless_would_block (fun () -> Unix.accept sock) with
+            | Some (client_sock, _) -> VSocket client_sock
+            | None -> VUnit)
+       | _ -> raise (RuntimeError "Invalid arguments to tcp_accept")));
 
-   | "tcp_connect" ->
+  ["tcp_connect"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString host; VInt port] ->
             let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
             let host_addr = (Unix.gethostbyname host).Unix.h_addr_list.(0) in
             Unix.connect sock (Unix.ADDR_INET (host_addr, Int64.to_int port));
             VSocket sock
-        | _ -> raise (RuntimeError "Invalid arguments to tcp_connect"))
+        | _ -> raise (RuntimeError "Invalid arguments to tcp_connect")));
 
-  | "tcp_send" ->
+  ["tcp_send"], (fun env func_name arg_vals ->
       (match arg_vals with
+       (* Bytes sent; 0 when a non-blocking socket can't take any yet (a
+          TLS send must then be retried with the same data). *)
        | [VSocket sock; VString data] ->
-           let bytes = Bytes.of_string data in
-           let sent = Unix.write sock bytes 0 (String.length data) in
-           VInt (Int64.of_int sent)
+           let sent = unless_would_block (fun () ->
+             socket_write_fd_substring sock data 0 (String.length data)) in
+           VInt (Int64.of_int (Option.value sent ~default:0))
        | [VTlsSocket ssl_sock; VString data] ->
-           let sent = Ssl.write_substring ssl_sock data 0 (String.length data) in
-           VInt (Int64.of_int sent)
-       | _ -> raise (RuntimeError "Invalid arguments to tcp_send"))
-
-   | "tcp_receive" ->
+           let sent = unless_would_block (fun () ->
+             tls_write_substring ssl_sock data 0 (String.length data)) in
+           VInt (Int64.of_int (Option.value sent ~default:0))
+       | _ -> raise (RuntimeError "Invalid arguments to tcp_send")));
+
+  ["tcp_receive"], (fun env func_name arg_vals ->
+       (* "" at end of stream; unit when a non-blocking socket has
+          nothing to read yet. *)
+       let receive max_bytes read =
+         let buf = Bytes.create max_bytes in
+         match unless_would_block (fun () -> read buf 0 max_bytes) with
+         | Some received when received > 0 -> VString (Bytes.sub_string buf 0 received)
+         | Some _ -> VString ""
+         | None -> VUnit
+       in
        (match arg_vals with
-        | [VSocket sock; VInt max_bytes] ->
-            let buf = Bytes.create (Int64.to_int max_bytes) in
-            let received = Unix.read sock buf 0 (Int64.to_int max_bytes) in
-            if received > 0 then
-              VString (Bytes.sub_string buf 0 received)
-            else
-              VString ""
-        | [VSocket sock] ->
-            let buf = Bytes.create 4096 in
-            let received = Unix.read sock buf 0 4096 in
-            if received > 0 then
-              VString (Bytes.sub_string buf 0 received)
-            else
-              VString ""
-        | [VTlsSocket ssl_sock; VInt max_bytes] ->
-            let buf = Bytes.create (Int64.to_int max_bytes) in
-            let received = Ssl.read ssl_sock buf 0 (Int64.to_int max_bytes) in
-            if received > 0 then
-              VString (Bytes.sub_string buf 0 received)
-            else
-              VString ""
-        | [VTlsSocket ssl_sock] ->
-            let buf = Bytes.create 4096 in
-            let received = Ssl.read ssl_sock buf 0 4096 in
-            if received > 0 then
-              VString (Bytes.sub_string buf 0 received)
-            else
-              VString ""
-        | _ -> raise (RuntimeError "Invalid arguments to tcp_receive"))
+        | [VSocket sock; VInt max_bytes] -> receive (Int64.to_int max_bytes) (socket_read_fd sock)
+        | [VSocket sock] -> receive 4096 (socket_read_fd sock)
+        | [VTlsSocket ssl_sock; VInt max_bytes] -> receive (Int64.to_int max_bytes) (tls_read ssl_sock)
+        | [VTlsSocket ssl_sock] -> receive 4096 (tls_read ssl_sock)
+        | _ -> raise (RuntimeError "Invalid arguments to tcp_receive")));
 
-  | "tcp_close" ->
+  ["tcp_close"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VSocket sock] -> Unix.close sock; VUnit
        | [VTlsSocket ssl_sock] ->
            (try Ssl.shutdown ssl_sock with _ -> ());
            VUnit
-       | _ -> raise (RuntimeError "Invalid arguments to tcp_close"))
-
-   | "socket_select" ->
+       | _ -> raise (RuntimeError "Invalid arguments to tcp_close")));
+
+  ["socket_select"], (fun env func_name arg_vals ->
+       (* (socket_select socks [timeout_ms]) — indices of the readable
+          sockets, ascending. Timeout defaults to 10ms; negative waits
+          until one is readable. Limited to FD_SETSIZE fds by select(2);
+          use a poller past a few hundred sockets. *)
+       let select inputs_ref timeout =
+         let valid_fds = ref [] in
+         Array.iteri (fun i v ->
+           match v with
+           | VSocket _ | VTlsSocket _ | VWsSocket _ ->
+               valid_fds := (i, socket_fd func_name v) :: !valid_fds
+           | _ -> ()
+         ) (vget inputs_ref);
+         let valid_fds = List.rev !valid_fds in
+         let readable, _, _ = Unix.select (List.map snd valid_fds) [] [] timeout in
+         let ready = Hashtbl.create 16 in
+         List.iter (fun fd -> Hashtbl.replace ready fd ()) readable;
+         let result = vec_of_array [||] in
+         List.iter (fun (idx, fd) ->
+           if Hashtbl.mem ready fd then vec_push result (VInt (Int64.of_int idx))
+         ) valid_fds;
+         VArray result
+       in
        (match arg_vals with
-        | [VArray inputs_ref] ->
-            let inputs = Array.to_list !inputs_ref in
-            let fds = List.mapi (fun i v ->
-              match v with
-              | VSocket fd -> Some (i, fd)
-              | VWsSocket (WsPlain fd) -> Some (i, fd)
-              | VWsSocket (WsTls ssl) -> Some (i, Ssl.file_descr_of_socket ssl)
-              | _ -> None
-            ) inputs in
-            let valid_fds = List.filter_map (fun x -> x) fds in
-            let fd_list = List.map snd valid_fds in
-            let readable, _, _ = Unix.select fd_list [] [] 0.01 in
-            let result = ref [||] in
-            List.iter (fun (idx, fd) ->
-              if List.mem fd readable then begin
-                let new_result = Array.make (Array.length !result + 1) (VInt 0L) in
-                Array.blit !result 0 new_result 0 (Array.length !result);
-                new_result.(Array.length !result) <- VInt (Int64.of_int idx);
-                result := new_result
-              end
-            ) valid_fds;
-            VArray result
-         | _ -> raise (RuntimeError "Invalid arguments to socket_select"))
+        | [VArray inputs_ref] -> select inputs_ref 0.01
+        | [VArray inputs_ref; VInt ms] ->
+            select inputs_ref (if ms < 0L then -1.0 else Int64.to_float ms /. 1000.0)
+         | _ -> raise (RuntimeError "Invalid arguments to socket_select")));
+
+  ["socket_set_nonblocking"], (fun env func_name arg_vals ->
+      (* Non-blocking tcp_accept / tcp_receive / tcp_send return unit /
+         unit / 0 instead of waiting. WebSocket sockets should stay
+         blocking: a frame is read whole once the poller reports it. *)
+      (match arg_vals with
+       | [sock; VBool on] ->
+           let fd = socket_fd func_name sock in
+           if on then Unix.set_nonblock fd else Unix.clear_nonblock fd;
+           VUnit
+       | _ -> raise (RuntimeError "socket_set_nonblocking takes (socket, bool)")));
+
+  ["poll_new"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [] ->
+           let fd = poll_call poller_create in
+           VPoller { poll_fd = fd; watched = Hashtbl.create 64; poll_open = true }
+       | _ -> raise (RuntimeError "poll_new takes no arguments")));
+
+  ["poll_add"; "poll_modify"], (fun env func_name arg_vals ->
+      (* (poll_add p sock [events]) registers sock; (poll_modify p sock
+         events) changes what a registered sock is watched for. events is
+         "r" (default), "w" or "rw". *)
+      let register p sock events =
+        let pfd = open_poller func_name p in
+        let fd = socket_fd func_name sock in
+        let op = if func_name = "poll_add" then poll_op_add else poll_op_modify in
+        poll_call (fun () -> poller_ctl pfd op fd (poll_events_of_string func_name events));
+        Hashtbl.replace p.watched (fd_to_int fd) sock;
+        VUnit
+      in
+      (match arg_vals with
+       | [VPoller p; sock] when func_name = "poll_add" -> register p sock "r"
+       | [VPoller p; sock; VString events] -> register p sock events
+       | _ -> raise (RuntimeError (func_name ^ " takes (poller, socket, events)"))));
+
+  ["poll_remove"], (fun env func_name arg_vals ->
+      (* Call before closing a registered socket. *)
+      (match arg_vals with
+       | [VPoller p; sock] ->
+           let pfd = open_poller func_name p in
+           let fd = socket_fd func_name sock in
+           poll_call (fun () -> poller_ctl pfd poll_op_remove fd 0);
+           Hashtbl.remove p.watched (fd_to_int fd);
+           VUnit
+       | _ -> raise (RuntimeError "poll_remove takes (poller, socket)")));
+
+  ["poll_wait"], (fun env func_name arg_vals ->
+      (* (poll_wait p timeout_ms) — [sock events] pairs for the registered
+         sockets that are ready, events "r", "w" or "rw"; [] on timeout.
+         Negative timeout waits indefinitely. A hang-up or error counts as
+         readable, so the next read reports it. *)
+      (match arg_vals with
+       | [VPoller p; VInt ms] ->
+           let pfd = open_poller func_name p in
+           let timeout = if ms < 0L then -1 else Int64.to_int (Int64.min ms 2_000_000_000L) in
+           let max_events = max 64 (min 4096 (Hashtbl.length p.watched)) in
+           flush_output ();
+           let raw = poll_call (fun () -> poller_wait pfd max_events timeout) in
+           (* kqueue reports each direction separately: fold them per fd. *)
+           let masks = Hashtbl.create 16 and order = ref [] in
+           for i = 0 to Array.length raw / 2 - 1 do
+             let fd = raw.(2 * i) and mask = raw.(2 * i + 1) in
+             match Hashtbl.find_opt masks fd with
+             | Some m -> Hashtbl.replace masks fd (m lor mask)
+             | None -> Hashtbl.replace masks fd mask; order := fd :: !order
+           done;
+           let result = vec_of_array [||] in
+           List.iter (fun fd ->
+             match Hashtbl.find_opt p.watched fd with
+             | Some sock ->
+                 let events = VString (string_of_poll_events (Hashtbl.find masks fd)) in
+                 vec_push result (VArray (vec_of_array [| sock; events |]))
+             | None -> ()
+           ) (List.rev !order);
+           VArray result
+       | _ -> raise (RuntimeError "poll_wait takes (poller, timeout_ms)")));
+
+  ["poll_close"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VPoller p] ->
+           if p.poll_open then begin
+             p.poll_open <- false;
+             Hashtbl.reset p.watched;
+             Unix.close p.poll_fd
+           end;
+           VUnit
+       | _ -> raise (RuntimeError "poll_close takes (poller)")));
 
   (* Channel operations *)
-  | "channel_new" ->
+  ["channel_new"], (fun env func_name arg_vals ->
       let read_fd, write_fd = Unix.pipe () in
-      VChannel (read_fd, write_fd, None)
+      VChannel (read_fd, write_fd, None));
 
-   | "channel_send" ->
+  ["channel_send"], (fun env func_name arg_vals ->
+       (* Any plain value: scalars, decimals, regexes, and arrays / maps
+          nested to any depth. See the wire format above. A process_spawn
+          channel sends to the child's stdin. *)
        (match arg_vals with
-        | [VChannel (_, write_fd, _); v] ->
-            (* Tagged serialization: prepend type tag for channel_recv *)
-            let tagged_data = match v with
-              | VInt n -> "i" ^ Int64.to_string n
-              | VFloat f -> "f" ^ string_of_float f
-              | VBool b -> "b" ^ (if b then "true" else "false")
-              | VString s -> "s" ^ s
-              | _ -> "s" ^ string_of_value v
-            in
-            let len = String.length tagged_data in
-            let len_bytes = Bytes.create 4 in
-            Bytes.set_int32_le len_bytes 0 (Int32.of_int len);
-            ignore (Unix.write write_fd len_bytes 0 4);
-            let bytes = Bytes.of_string tagged_data in
-            ignore (Unix.write write_fd bytes 0 len);
+        | [VChannel (_, write_fd, None); v] | [VChannel (write_fd, _, Some _); v] ->
+            let msg = wire_message v in
+            if write_fd = Unix.stdout then flush_output ();
+            write_all write_fd msg 0 (String.length msg);
             VUnit
-        | _ -> raise (RuntimeError "Invalid arguments to channel_send"))
-
-  | "channel_recv" ->
-      (match arg_vals with
-       | [VChannel (read_fd, _, _)] ->
-           let len_bytes = Bytes.create 4 in
-           let _ = Unix.read read_fd len_bytes 0 4 in
-           let len = Int32.to_int (Bytes.get_int32_le len_bytes 0) in
-           let buf = Bytes.create len in
-           let received = Unix.read read_fd buf 0 len in
-           if received > 0 then
-             let s = Bytes.sub_string buf 0 received in
-             (* Tagged deserialization: first char is type tag *)
-             if String.length s >= 2 then
-               let tag = s.[0] in
-               let payload = String.sub s 1 (String.length s - 1) in
-               match tag with
-               | 'i' -> (try VInt (Int64.of_string payload)
-                         with _ -> VString s)
-               | 'f' -> (try VFloat (float_of_string payload)
-                         with _ -> VString s)
-               | 'b' -> if payload = "true" then VBool true
-                        else if payload = "false" then VBool false
-                        else VString s
-               | 's' -> VString payload
-               | _ -> VString s  (* Unknown tag, return raw *)
-             else
-               VString s
-           else
-             VUnit
-       | _ -> raise (RuntimeError "Invalid arguments to channel_recv"))
+        | _ -> raise (RuntimeError "Invalid arguments to channel_send")));
+
+  ["channel_recv"], (fun env func_name arg_vals ->
+      (* Next value sent, or once the sending side has closed, unit or
+         the given end-of-stream value: a sent unit and the end of the
+         stream only differ with one. A process_spawn channel receives
+         from the child's stdout. *)
+      let recv read_fd at_end =
+        flush_output ();
+        match channel_read_message read_fd with
+        | Some v -> v
+        | None -> at_end
+      in
+      (match arg_vals with
+       | [VChannel (read_fd, _, None)] | [VChannel (_, read_fd, Some _)] -> recv read_fd VUnit
+       | [VChannel (read_fd, _, None); at_end] | [VChannel (_, read_fd, Some _); at_end] ->
+           recv read_fd at_end
+       | _ -> raise (RuntimeError "channel_recv takes (channel) or (channel, end_value)")));
+
+  ["channel_close"], (fun env func_name arg_vals ->
+      (* Close the sending side of a channel_new channel: the receiver
+         drains what was sent, then sees the end of the stream. A
+         process_spawn channel's ends are closed by process_wait. *)
+      (match arg_vals with
+       | [VChannel (_, write_fd, None)] ->
+           (try Unix.close write_fd with Unix.Unix_error _ -> ());
+           VUnit
+       | _ -> raise (RuntimeError "channel_close takes (channel)")));
+
+  ["channel_stdio"], (fun env func_name arg_vals ->
+      (* The worker's end of a process_spawn channel: receives from stdin,
+         sends to stdout. Don't print in a worker that uses it. *)
+      (match arg_vals with
+       | [] -> VChannel (Unix.stdin, Unix.stdout, None)
+       | _ -> raise (RuntimeError "channel_stdio takes no arguments")));
+
+  (* SQLite, in process. Rows are arrays of typed column values: int,
+     float, string (text and blobs) or unit (NULL). Parameters are an
+     array for ?-placeholders or a map for :name ones. *)
+  ["sqlite_open"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VString path] -> VSqlite (sqlite_guard func_name (fun () -> Sqlite3.db_open path))
+       | _ -> raise (RuntimeError "sqlite_open takes (path)")));
+
+  ["sqlite_close"], (fun env func_name arg_vals ->
+      (* false while statements are still open on the connection. *)
+      (match arg_vals with
+       | [VSqlite db] -> VBool (sqlite_guard func_name (fun () -> Sqlite3.db_close db))
+       | _ -> raise (RuntimeError "sqlite_close takes (db)")));
+
+  ["sqlite_exec"], (fun env func_name arg_vals ->
+      (* (sqlite_exec db sql) runs one or more statements; (sqlite_exec db
+         sql params) runs one with parameters. Returns rows changed. *)
+      (match arg_vals with
+       | [VSqlite db; VString sql] ->
+           sqlite_guard func_name (fun () ->
+             sqlite_check func_name db (Sqlite3.exec db sql);
+             VInt (Int64.of_int (Sqlite3.changes db)))
+       | [VSqlite db; VString sql; params] ->
+           let st = sqlite_prepare func_name db sql in
+           Fun.protect ~finally:(fun () -> sqlite_finalize func_name st) (fun () ->
+             sqlite_bind_params func_name st params;
+             sqlite_run func_name st);
+           VInt (Int64.of_int (sqlite_guard func_name (fun () -> Sqlite3.changes db)))
+       | _ -> raise (RuntimeError "sqlite_exec takes (db, sql) or (db, sql, params)")));
+
+  ["sqlite_exec_many"], (fun env func_name arg_vals ->
+      (* (sqlite_exec_many db sql rows) — one prepared statement run once
+         per parameter row, all inside one savepoint (so it nests in an
+         open transaction). Any failure rolls the whole batch back.
+         Returns the total rows changed. *)
+      (match arg_vals with
+       | [VSqlite db; VString sql; VArray rows] ->
+           let st = sqlite_prepare func_name db sql in
+           let total = ref 0 in
+           (* The statement is finalized before RELEASE, so a failed
+              RELEASE must not finalize it a second time. *)
+           let finalized = ref false in
+           let finalize () =
+             if not !finalized then begin finalized := true; sqlite_finalize func_name st end
+           in
+           (try sqlite_guard func_name (fun () ->
+              sqlite_check func_name db (Sqlite3.exec db "SAVEPOINT sigil_exec_many"))
+            with e -> finalize (); raise e);
+           (try
+              for i = 0 to rows.len - 1 do
+                sqlite_bind_params func_name st rows.data.(i);
+                sqlite_run func_name st;
+                total := !total + sqlite_guard func_name (fun () -> Sqlite3.changes db)
+              done;
+              finalize ();
+              sqlite_guard func_name (fun () ->
+                sqlite_check func_name db (Sqlite3.exec db "RELEASE sigil_exec_many"))
+            with e ->
+              (try finalize () with RuntimeError _ -> ());
+              (try
+                 ignore (Sqlite3.exec db "ROLLBACK TO sigil_exec_many");
+                 ignore (Sqlite3.exec db "RELEASE sigil_exec_many")
+               with Sqlite3.Error _ -> ());
+              raise e);
+           VInt (Int64.of_int !total)
+       | _ -> raise (RuntimeError "sqlite_exec_many takes (db, sql, array of params)")));
+
+  ["sqlite_query"], (fun env func_name arg_vals ->
+      (* (sqlite_query db sql [params]) — every row, as an array of rows. *)
+      (match arg_vals with
+       | VSqlite db :: VString sql :: rest when List.length rest <= 1 ->
+           let st = sqlite_prepare func_name db sql in
+           let rows = vec_of_array [||] in
+           Fun.protect ~finally:(fun () -> sqlite_finalize func_name st) (fun () ->
+             sqlite_bind_params func_name st (match rest with [p] -> p | _ -> VUnit);
+             let rec go () =
+               match sqlite_next_row func_name st with
+               | Some row -> vec_push rows row; go ()
+               | None -> ()
+             in
+             go ());
+           VArray rows
+       | _ -> raise (RuntimeError "sqlite_query takes (db, sql) or (db, sql, params)")));
+
+  ["sqlite_rows"], (fun env func_name arg_vals ->
+      (* Row-at-a-time cursor (a seq) for for-each, filter and reduce:
+         (sqlite_rows db sql [params]) prepares its own statement and
+         finalizes it when drained; (sqlite_rows stmt [params]) rebinds
+         a prepared one and leaves it open. *)
+      let cursor st close =
+        let closed = ref false in
+        let close () = if not !closed then begin closed := true; close () end in
+        make_seq func_name close (fun () ->
+          if !closed then None
+          else match sqlite_next_row func_name st with
+            | Some row -> Some row
+            | None -> close (); None)
+      in
+      (match arg_vals with
+       | VSqlite db :: VString sql :: rest when List.length rest <= 1 ->
+           let st = sqlite_prepare func_name db sql in
+           (try sqlite_bind_params func_name st (match rest with [p] -> p | _ -> VUnit)
+            with e -> sqlite_finalize func_name st; raise e);
+           VSeq (cursor st (fun () -> sqlite_finalize func_name st))
+       | [VSqliteStmt st] ->
+           sqlite_reset func_name st;
+           VSeq (cursor st (fun () -> sqlite_reset func_name st))
+       | [VSqliteStmt st; params] ->
+           sqlite_bind_params func_name st params;
+           VSeq (cursor st (fun () -> sqlite_reset func_name st))
+       | _ -> raise (RuntimeError "sqlite_rows takes (db, sql [, params]) or (stmt [, params])")));
+
+  ["sqlite_prepare"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VSqlite db; VString sql] -> VSqliteStmt (sqlite_prepare func_name db sql)
+       | _ -> raise (RuntimeError "sqlite_prepare takes (db, sql)")));
+
+  ["sqlite_bind"], (fun env func_name arg_vals ->
+      (* Resets the statement and replaces all its bindings. *)
+      (match arg_vals with
+       | [VSqliteStmt st as stmt; params] -> sqlite_bind_params func_name st params; stmt
+       | _ -> raise (RuntimeError "sqlite_bind takes (stmt, params)")));
+
+  ["sqlite_step"], (fun env func_name arg_vals ->
+      (* Next row, or unit once the statement is done. *)
+      (match arg_vals with
+       | [VSqliteStmt st] ->
+           (match sqlite_next_row func_name st with Some row -> row | None -> VUnit)
+       | _ -> raise (RuntimeError "sqlite_step takes (stmt)")));
+
+  ["sqlite_reset"], (fun env func_name arg_vals ->
+      (* Rewind to run again with the same bindings. *)
+      (match arg_vals with
+       | [VSqliteStmt st as stmt] -> sqlite_reset func_name st; stmt
+       | _ -> raise (RuntimeError "sqlite_reset takes (stmt)")));
+
+  ["sqlite_columns"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VSqliteStmt st] ->
+           sqlite_guard func_name (fun () ->
+             VArray (vec_of_array (Array.init (Sqlite3.column_count st.stmt) (fun i ->
+               VString (Sqlite3.column_name st.stmt i)))))
+       | _ -> raise (RuntimeError "sqlite_columns takes (stmt)")));
+
+  ["sqlite_finalize"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VSqliteStmt st] -> sqlite_finalize func_name st; VUnit
+       | _ -> raise (RuntimeError "sqlite_finalize takes (stmt)")));
+
+  ["sqlite_last_insert_id"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VSqlite db] -> VInt (sqlite_guard func_name (fun () -> Sqlite3.last_insert_rowid db))
+       | _ -> raise (RuntimeError "sqlite_last_insert_id takes (db)")));
+
+  ["sqlite_changes"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VSqlite db] -> VInt (Int64.of_int (sqlite_guard func_name (fun () -> Sqlite3.changes db)))
+       | _ -> raise (RuntimeError "sqlite_changes takes (db)")));
+
+  ["sqlite_error"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VSqlite db] -> VString (sqlite_guard func_name (fun () -> Sqlite3.errmsg db))
+       | _ -> raise (RuntimeError "sqlite_error takes (db)")));
+
+  ["http_request"], (fun env func_name arg_vals ->
+      (* (http_request method url [headers] [body]) — one HTTP/1.1 request
+         over a pooled keep-alive connection (https via Ssl). Returns a map
+         of status, headers (lowercased names) and the whole body. *)
+      (match arg_vals with
+       | VString meth :: VString url :: rest ->
+           let headers, body = http_options func_name rest in
+           http_fetch (String.uppercase_ascii meth) url headers body
+       | _ -> raise (RuntimeError "http_request takes (method, url [, headers [, body]])")));
+
+  ["http_get"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VString url] -> http_fetch "GET" url [] ""
+       | [VString url; h] -> http_fetch "GET" url (http_headers_of_value func_name h) ""
+       | _ -> raise (RuntimeError "http_get takes (url [, headers])")));
+
+  ["http_post"], (fun env func_name arg_vals ->
+      (match arg_vals with
+       | [VString url; VString body] -> http_fetch "POST" url [] body
+       | [VString url; VString body; h] -> http_fetch "POST" url (http_headers_of_value func_name h) body
+       | _ -> raise (RuntimeError "http_post takes (url, body [, headers])")));
+
+  ["http_stream"], (fun env func_name arg_vals ->
+      (* Same arguments as http_request, but "body" is a seq of string
+         chunks read off the wire as it is drained, with chunked transfer
+         encoding already decoded. The connection goes back to the pool
+         once the body has been read to its end. *)
+      (match arg_vals with
+       | VString meth :: VString url :: rest ->
+           let headers, body = http_options func_name rest in
+           let status, hs, (next, abort) =
+             http_exchange (String.uppercase_ascii meth) url headers body in
+           let chunks = make_seq func_name abort (fun () ->
+             match http_guard next with
+             | Some s -> Some (VString s)
+             | None -> None)
+           in
+           http_response status hs (VSeq chunks)
+       | _ -> raise (RuntimeError "http_stream takes (method, url [, headers [, body]])")));
+
+  ["http_batch"], (fun env func_name arg_vals ->
+      (* (http_batch requests) — run requests concurrently on the domain
+         pool, each on its own pooled connection. A request is a url or a
+         map of method (default GET), url, headers and body. Responses
+         come back in request order; a failed request gives a map with
+         status 0 and its error instead of failing the batch. *)
+      (match arg_vals with
+       | [VArray reqs] ->
+           let reqs = vget reqs in
+           let results = Array.make (Array.length reqs) VUnit in
+           let field m k = Hashtbl.find_opt m k in
+           let run i =
+             match reqs.(i) with
+             | VString url -> http_fetch "GET" url [] ""
+             | VMap (m, _) ->
+                 let meth = match field m "method" with
+                   | Some (VString s) -> String.uppercase_ascii s
+                   | _ -> "GET" in
+                 let url = match field m "url" with
+                   | Some (VString s) -> s
+                   | _ -> raise (RuntimeError "http_batch: request map needs a url") in
+                 let headers = match field m "headers" with
+                   | Some h -> http_headers_of_value func_name h
+                   | None -> [] in
+                 let body = match field m "body" with
+                   | Some (VString s) -> s
+                   | Some v -> string_of_value v
+                   | None -> "" in
+                 http_fetch meth url headers body
+             | v -> raise (RuntimeError ("http_batch: a request is a url or a map, got " ^ string_of_value_type v))
+           in
+           run_chunks (Array.length reqs) (fun i ->
+             results.(i) <-
+               (try run i with RuntimeError msg ->
+                  let m = Hashtbl.create 2 and keys = keys_create () in
+                  vmap_set m keys "status" (VInt 0L);
+                  vmap_set m keys "error" (VString msg);
+                  VMap (m, keys)));
+           VArray (vec_of_array results)
+       | _ -> raise (RuntimeError "http_batch takes an array of requests")));
 
   (* Regex operations — backed by the Re library (Perl-compatible).
      Re.Perl.compile_pat handles \b, \d, \w, \s, non-greedy *? +?, named
@@ -3896,68 +6693,53 @@ and eval_call env func_name args =
      the first match in a multi-line input. The few existing tests that use
      ^ and $ all run on single-line strings, so multiline-on doesn't change
      their behavior. *)
-  | "regex_compile" ->
+  ["regex_compile"], (fun env func_name arg_vals ->
       (match arg_vals with
-       | [VString pattern] -> VString pattern  (* Store pattern as string; compiled at use site *)
-       | _ -> raise (RuntimeError "Invalid arguments to regex_compile"))
+       | [VString pattern] -> VRegex (pattern, regex_compile_cached pattern)
+       | [VRegex _ as re] -> re
+       | _ -> raise (RuntimeError "Invalid arguments to regex_compile")));
 
-  | "regex_match" ->
+  ["regex_match"], (fun env func_name arg_vals ->
       (match arg_vals with
-       | [VString pattern; VString text] ->
-           (try
-             let re = Re.Perl.compile_pat ~opts:[`Multiline] pattern in
-             VBool (Re.execp re text)
-           with Re.Perl.Parse_error -> raise (RuntimeError ("Invalid regex pattern: " ^ pattern))
-              | Re.Perl.Not_supported -> raise (RuntimeError ("Regex feature not supported: " ^ pattern)))
-       | _ -> raise (RuntimeError "Invalid arguments to regex_match"))
+       | [(VString _ | VRegex _) as pat; VString text] ->
+           VBool (Re.execp (regex_of_value func_name pat) text)
+       | _ -> raise (RuntimeError "Invalid arguments to regex_match")));
 
-  | "regex_find" ->
+  ["regex_find"], (fun env func_name arg_vals ->
       (match arg_vals with
-       | [VString pattern; VString text] ->
-           (try
-             let re = Re.Perl.compile_pat ~opts:[`Multiline] pattern in
-             match Re.exec_opt re text with
-             | Some g -> VString (Re.Group.get g 0)
-             | None -> VString ""
-           with Re.Perl.Parse_error -> raise (RuntimeError ("Invalid regex pattern: " ^ pattern))
-              | Re.Perl.Not_supported -> raise (RuntimeError ("Regex feature not supported: " ^ pattern)))
-       | _ -> raise (RuntimeError "Invalid arguments to regex_find"))
+       | [(VString _ | VRegex _) as pat; VString text] ->
+           (match Re.exec_opt (regex_of_value func_name pat) text with
+            | Some g -> VString (Re.Group.get g 0)
+            | None -> VString "")
+       | _ -> raise (RuntimeError "Invalid arguments to regex_find")));
 
-  | "regex_find_all" ->
+  ["regex_find_all"], (fun env func_name arg_vals ->
       (match arg_vals with
-       | [VString pattern; VString text] ->
-           (try
-             let re = Re.Perl.compile_pat ~opts:[`Multiline] pattern in
-             let matches = Re.all re text in
-             let results = List.map (fun g -> VString (Re.Group.get g 0)) matches in
-             VArray (ref (Array.of_list results))
-           with Re.Perl.Parse_error -> raise (RuntimeError ("Invalid regex pattern: " ^ pattern))
-              | Re.Perl.Not_supported -> raise (RuntimeError ("Regex feature not supported: " ^ pattern)))
-       | _ -> raise (RuntimeError "Invalid arguments to regex_find_all"))
-
-   | "regex_replace" ->
+       | [(VString _ | VRegex _) as pat; VString text] ->
+           let matches = Re.all (regex_of_value func_name pat) text in
+           let results = List.map (fun g -> VString (Re.Group.get g 0)) matches in
+           VArray (vec_of_array (Array.of_list results))
+       | _ -> raise (RuntimeError "Invalid arguments to regex_find_all")));
+
+  ["regex_replace"], (fun env func_name arg_vals ->
        (match arg_vals with
-        | [VString pattern; VString text; VString replacement] ->
-            (try
-              let re = Re.Perl.compile_pat ~opts:[`Multiline] pattern in
-              VString (Re.replace re ~f:(fun _ -> replacement) text)
-            with Re.Perl.Parse_error -> raise (RuntimeError ("Invalid regex pattern: " ^ pattern))
-               | Re.Perl.Not_supported -> raise (RuntimeError ("Regex feature not supported: " ^ pattern)))
-        | _ -> raise (RuntimeError "Invalid arguments to regex_replace"))
+        | [(VString _ | VRegex _) as pat; VString text; VString replacement] ->
+            VString (Re.replace (regex_of_value func_name pat) ~f:(fun _ -> replacement) text)
+        | _ -> raise (RuntimeError "Invalid arguments to regex_replace")));
 
   (* Directory operations *)
-  | "dir_list" ->
+  ["dir_list"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString path] ->
            try
              let entries = Sys.readdir path in
              let arr = Array.map (fun f -> VString f) entries in
-             VArray (ref arr)
+             VArray (vec_of_array arr)
            with Sys_error _ ->
-             VArray (ref [||])
-       | _ -> raise (RuntimeError "Invalid arguments to dir_list"))
+             VArray (vec_of_array [||])
+       | _ -> raise (RuntimeError "Invalid arguments to dir_list")));
 
-  | "dir_create" ->
+  ["dir_create"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString path] ->
            (try
@@ -3965,9 +6747,9 @@ and eval_call env func_name args =
              VBool true
            with Unix.Unix_error (e, _, _) ->
              raise (RuntimeError ("dir_create failed: " ^ Unix.error_message e)))
-       | _ -> raise (RuntimeError "Invalid arguments to dir_create"))
+       | _ -> raise (RuntimeError "Invalid arguments to dir_create")));
 
-  | "dir_delete" ->
+  ["dir_delete"], (fun env func_name arg_vals ->
       (match arg_vals with
        | [VString path] ->
            (try
@@ -3975,161 +6757,71 @@ and eval_call env func_name args =
              VBool true
            with Unix.Unix_error (e, _, _) ->
              raise (RuntimeError ("dir_delete failed: " ^ Unix.error_message e)))
-       | _ -> raise (RuntimeError "Invalid arguments to dir_delete"))
+       | _ -> raise (RuntimeError "Invalid arguments to dir_delete")));
 
    (* JSON operations - implemented using maps and arrays *)
-   | "json_new_object" ->
-       make_vmap ()
+  ["json_new_object"], (fun env func_name arg_vals ->
+       make_vmap ());
 
-   | "json_new_array" ->
-       VArray (ref [||])
+  ["json_new_array"], (fun env func_name arg_vals ->
+       VArray (vec_of_array [||]));
 
-   | "json_parse" ->
+  ["json_parse"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString s] ->
-            (* Simple JSON parser: handles objects, arrays, strings, numbers, booleans *)
-            let s = String.trim s in
-            let rec parse_json_value str pos =
-              let pos = skip_whitespace str pos in
-              if pos >= String.length str then raise (RuntimeError "Unexpected end of JSON input")
-              else match str.[pos] with
-              | '{' -> parse_json_object str (pos + 1)
-              | '[' -> parse_json_array str (pos + 1)
-              | '"' -> parse_json_string str (pos + 1)
-              | 't' when pos + 3 < String.length str && String.sub str pos 4 = "true" ->
-                  (VBool true, pos + 4)
-              | 'f' when pos + 4 < String.length str && String.sub str pos 5 = "false" ->
-                  (VBool false, pos + 5)
-              | 'n' when pos + 3 < String.length str && String.sub str pos 4 = "null" ->
-                  (VUnit, pos + 4)
-              | c when c = '-' || (c >= '0' && c <= '9') -> parse_json_number str pos
-              | _ -> raise (RuntimeError (Printf.sprintf "Unexpected character '%c' at position %d in JSON" str.[pos] pos))
-            and skip_whitespace str pos =
-              if pos >= String.length str then pos
-              else match str.[pos] with
-              | ' ' | '\t' | '\n' | '\r' -> skip_whitespace str (pos + 1)
-              | _ -> pos
-            and parse_json_string str pos =
-              let buf = Buffer.create 64 in
-              let rec loop i =
-                if i >= String.length str then (VString (Buffer.contents buf), i)
-                else match str.[i] with
-                | '"' -> (VString (Buffer.contents buf), i + 1)
-                | '\\' when i + 1 < String.length str ->
-                    (match str.[i+1] with
-                     | '"' -> Buffer.add_char buf '"'; loop (i + 2)
-                     | '\\' -> Buffer.add_char buf '\\'; loop (i + 2)
-                     | 'n' -> Buffer.add_char buf '\n'; loop (i + 2)
-                     | 't' -> Buffer.add_char buf '\t'; loop (i + 2)
-                     | '/' -> Buffer.add_char buf '/'; loop (i + 2)
-                     | _ -> Buffer.add_char buf str.[i+1]; loop (i + 2))
-                | c -> Buffer.add_char buf c; loop (i + 1)
-              in
-              loop pos
-            and parse_json_number str pos =
-              let start = pos in
-              let is_float = ref false in
-              let rec loop i =
-                if i >= String.length str then i
-                else match str.[i] with
-                | '0'..'9' | '-' -> loop (i + 1)
-                | '.' | 'e' | 'E' | '+' -> is_float := true; loop (i + 1)
-                | _ -> i
-              in
-              let end_pos = loop pos in
-              let num_str = String.sub str start (end_pos - start) in
-              if !is_float then
-                (try (VFloat (float_of_string num_str), end_pos)
-                 with _ -> raise (RuntimeError ("Invalid JSON number: " ^ num_str)))
-              else
-                (try (VInt (Int64.of_string num_str), end_pos)
-                 with _ -> raise (RuntimeError ("Invalid JSON number: " ^ num_str)))
-            and parse_json_object str pos =
-              let m = Hashtbl.create 16 in
-              let keys = ref [] in
-              let rec loop pos =
-                let pos = skip_whitespace str pos in
-                if pos >= String.length str then (VMap (m, keys), pos)
-                else match str.[pos] with
-                | '}' -> (VMap (m, keys), pos + 1)
-                | ',' -> loop (pos + 1)
-                | '"' ->
-                    let (key, pos) = parse_json_string str (pos + 1) in
-                    let key_str = match key with VString s -> s | _ -> "" in
-                    let pos = skip_whitespace str pos in
-                    let pos = if pos < String.length str && str.[pos] = ':' then pos + 1 else pos in
-                    let (value, pos) = parse_json_value str pos in
-                    vmap_set m keys key_str value;
-                    loop pos
-                | _ -> (VMap (m, keys), pos)
-              in
-              loop pos
-            and parse_json_array str pos =
-              let items = ref [||] in
-              let rec loop pos =
-                let pos = skip_whitespace str pos in
-                if pos >= String.length str then (VArray (ref !items), pos)
-                else match str.[pos] with
-                | ']' -> (VArray (ref !items), pos + 1)
-                | ',' -> loop (pos + 1)
-                | _ ->
-                    let (value, pos) = parse_json_value str pos in
-                    items := Array.append !items [|value|];
-                    loop pos
-              in
-              loop pos
-            in
-            let (result, _) = parse_json_value s 0 in
-            result
-        | _ -> raise (RuntimeError "Invalid arguments to json_parse"))
+            json_parse_string s
+        | [VString s; VArray paths] ->
+            (* Projection: members outside the given paths are skipped. *)
+            json_parse_string ~proj:(json_projection (vget paths)) s
+        | _ -> raise (RuntimeError "Invalid arguments to json_parse")));
+
+  ["ndjson_lines"], (fun env func_name arg_vals ->
+      (* (ndjson_lines path [paths]) or (ndjson_lines seq [paths]): a lazy
+         stream of one parsed value per non-blank line. *)
+      let lines_of = function
+        | VString path ->
+            let fd = open_stream_file "ndjson_lines" path in
+            line_seq "ndjson_lines" (file_read_fd fd) (fun () -> Unix.close fd)
+        | VSeq sq -> sq
+        | v -> raise (RuntimeError ("ndjson_lines takes a path or a seq of lines, got "
+                                    ^ string_of_value_type v))
+      in
+      (match arg_vals with
+       | [src] -> VSeq (ndjson_seq (lines_of src) Keep_all)
+       | [src; VArray paths] ->
+           let proj = json_projection (vget paths) in
+           VSeq (ndjson_seq (lines_of src) proj)
+       | _ -> raise (RuntimeError "ndjson_lines takes (path-or-seq) or (path-or-seq, paths)")));
 
-   | "json_stringify" ->
+  ["json_stringify"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [v] ->
-            let rec stringify = function
-              | VMap (m, keys) ->
-                  let pairs = List.filter_map (fun k ->
-                    match Hashtbl.find_opt m k with
-                    | Some v -> Some (Printf.sprintf "\"%s\":%s" (String.escaped k) (stringify v))
-                    | None -> None
-                  ) !keys in
-                  "{" ^ String.concat "," pairs ^ "}"
-              | VArray arr ->
-                  let items = Array.to_list !arr in
-                  "[" ^ String.concat "," (List.map stringify items) ^ "]"
-              | VString s -> Printf.sprintf "\"%s\"" (String.escaped s)
-              | VInt n -> Int64.to_string n
-              | VFloat f -> string_of_float f
-              | VBool b -> string_of_bool b
-              | VUnit -> "null"
-              | v -> string_of_value v
-            in
-            VString (stringify v)
-        | _ -> raise (RuntimeError "Invalid arguments to json_stringify"))
+            VString (json_stringify_value v)
+        | _ -> raise (RuntimeError "Invalid arguments to json_stringify")));
 
-    | "json_get" ->
+  ["json_get"], (fun env func_name arg_vals ->
         (* Array-of-keys (Clojure get-in style): (json_get j ["users" 0 "name"]).
            Each key is a string (map lookup) or int (array index). String keys
            that parse as int also work for arrays so `(json_get j (split p "."))`
            on a path-from-string works without manual int conversion.
            Empty array returns the node unchanged. *)
         (match arg_vals with
-         | [node; VArray keys] -> json_walk_keys node !keys
+         | [node; VArray keys] -> json_walk_keys node (vget keys)
          | [VMap (m, _); VString k] ->
              (try Hashtbl.find m k
               with Not_found -> raise (RuntimeError ("Key not found in JSON object: " ^ k)))
          | [VArray arr; VInt idx] ->
              let i = Int64.to_int idx in
-             if i >= 0 && i < Array.length !arr then !arr.(i)
+             if i >= 0 && i < arr.len then arr.data.(i)
              else raise (RuntimeError ("JSON array index out of bounds: " ^ Int64.to_string idx))
-         | _ -> raise (RuntimeError "Invalid arguments to json_get"))
+         | _ -> raise (RuntimeError "Invalid arguments to json_get")));
 
-    | "json_set" ->
+  ["json_set"], (fun env func_name arg_vals ->
         (* Array-of-keys: (json_set j ["users" 0 "name"] v) walks to parent then
            sets the final segment. Mutates in place; returns the root node. *)
         (match arg_vals with
          | [root; VArray keys; v] ->
-             let ks = !keys in
+             let ks = (vget keys) in
              if Array.length ks = 0 then
                raise (RuntimeError "json_set: empty key array")
              else begin
@@ -4138,12 +6830,12 @@ and eval_call env func_name args =
                 | VMap (m, ks_ref), VString k -> vmap_set m ks_ref k v
                 | VArray arr, VInt idx ->
                     let i = Int64.to_int idx in
-                    if i >= 0 && i < Array.length !arr then (!arr).(i) <- v
+                    if i >= 0 && i < arr.len then arr.data.(i) <- v
                     else raise (RuntimeError ("JSON array index out of bounds: " ^ Int64.to_string idx))
                 | VArray arr, VString s ->
                     (try
                       let i = int_of_string s in
-                      if i >= 0 && i < Array.length !arr then (!arr).(i) <- v
+                      if i >= 0 && i < arr.len then arr.data.(i) <- v
                       else raise (RuntimeError ("JSON array index out of bounds: " ^ s))
                     with Failure _ ->
                       raise (RuntimeError ("Cannot set array with non-integer segment: " ^ s)))
@@ -4155,30 +6847,30 @@ and eval_call env func_name args =
              VMap (m, keys)
          | [VArray arr; VInt idx; v] ->
              let i = Int64.to_int idx in
-             if i >= 0 && i < Array.length !arr then begin
-               (!arr).(i) <- v;
+             if i >= 0 && i < arr.len then begin
+               arr.data.(i) <- v;
                VArray arr
              end else
                raise (RuntimeError ("JSON array index out of bounds: " ^ Int64.to_string idx))
-         | _ -> raise (RuntimeError "Invalid arguments to json_set"))
+         | _ -> raise (RuntimeError "Invalid arguments to json_set")));
 
-   | "json_has" ->
+  ["json_has"], (fun env func_name arg_vals ->
        (* (json_has node key) — single key membership.
           (json_has node ["a" 0 "b"]) — array-of-keys; safe walk, returns false
           on any missing segment instead of raising. *)
        (match arg_vals with
         | [node; VArray keys] ->
-            (try let _ = json_walk_keys node !keys in VBool true
+            (try let _ = json_walk_keys node (vget keys) in VBool true
              with RuntimeError _ -> VBool false)
         | [VMap (m, _); VString k] -> VBool (Hashtbl.mem m k)
-        | _ -> raise (RuntimeError "Invalid arguments to json_has"))
+        | _ -> raise (RuntimeError "Invalid arguments to json_has")));
 
-   | "json_delete" ->
+  ["json_delete"], (fun env func_name arg_vals ->
        (* (json_delete node ["a" "b"]) walks to parent then removes leaf key.
           Map parents only — array element deletion would shift indices. *)
        (match arg_vals with
         | [root; VArray keys] ->
-            let ks = !keys in
+            let ks = (vget keys) in
             if Array.length ks = 0 then
               raise (RuntimeError "json_delete: empty key array")
             else begin
@@ -4191,22 +6883,22 @@ and eval_call env func_name args =
         | [VMap (m, keys); VString k] ->
             vmap_delete m keys k;
             VMap (m, keys)
-        | _ -> raise (RuntimeError "Invalid arguments to json_delete"))
+        | _ -> raise (RuntimeError "Invalid arguments to json_delete")));
 
-   | "json_push" ->
+  ["json_push"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr; v] ->
-            arr := Array.append !arr [|v|];
+            vec_push arr v;
             VArray arr
-        | _ -> raise (RuntimeError "Invalid arguments to json_push"))
+        | _ -> raise (RuntimeError "Invalid arguments to json_push")));
 
-   | "json_length" ->
+  ["json_length"], (fun env func_name arg_vals ->
        (match arg_vals with
-        | [VArray arr] -> VInt (Int64.of_int (Array.length !arr))
+        | [VArray arr] -> VInt (Int64.of_int (arr.len))
         | [VMap (m, _)] -> VInt (Int64.of_int (Hashtbl.length m))
-        | _ -> raise (RuntimeError "Invalid arguments to json_length"))
+        | _ -> raise (RuntimeError "Invalid arguments to json_length")));
 
-   | "json_type" ->
+  ["json_type"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap _] -> VString "object"
         | [VArray _] -> VString "array"
@@ -4215,100 +6907,96 @@ and eval_call env func_name args =
         | [VFloat _] -> VString "number"
         | [VBool _] -> VString "boolean"
         | [VUnit] -> VString "null"
-        | _ -> VString "unknown")
+        | _ -> VString "unknown"));
 
    (* Map operations - additional *)
-   | "map_length" ->
+  ["map_length"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap (m, _)] -> VInt (Int64.of_int (Hashtbl.length m))
-        | _ -> raise (RuntimeError "Invalid arguments to map_length"))
+        | _ -> raise (RuntimeError "Invalid arguments to map_length")));
 
-   | "map_values" ->
+  ["map_values"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap (m, keys)] ->
-            let values = List.filter_map (fun k -> Hashtbl.find_opt m k) !keys in
-            VArray (ref (Array.of_list values))
-        | _ -> raise (RuntimeError "Invalid arguments to map_values"))
+            let values = List.filter_map (fun k -> Hashtbl.find_opt m k) (keys_list keys) in
+            VArray (vec_of_array (Array.of_list values))
+        | _ -> raise (RuntimeError "Invalid arguments to map_values")));
 
    (* Additional type conversions *)
-   | "cast_float_decimal" ->
+  ["cast_float_decimal"], (fun env func_name arg_vals ->
        (match arg_vals with
-        | [VFloat f] -> VDecimal (format_decimal f)
-        | _ -> raise (RuntimeError "Invalid arguments to cast_float_decimal"))
+        | [VFloat f] -> VDecimal (decimal_of_string (format_decimal f))
+        | _ -> raise (RuntimeError "Invalid arguments to cast_float_decimal")));
 
-   | "cast_decimal_float" ->
+  ["cast_decimal_float"], (fun env func_name arg_vals ->
        (match arg_vals with
-        | [VDecimal s] -> VFloat (float_of_string s)
-        | _ -> raise (RuntimeError "Invalid arguments to cast_decimal_float"))
+        | [VDecimal d] -> VFloat (float_of_string (string_of_decimal d))
+        | _ -> raise (RuntimeError "Invalid arguments to cast_decimal_float")));
 
    (* char_from_code: convert integer char code to single-character string *)
-   | "char_from_code" ->
+  ["char_from_code"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt n] -> VString (String.make 1 (Char.chr (Int64.to_int n)))
-        | _ -> raise (RuntimeError "Invalid arguments to char_from_code"))
+        | _ -> raise (RuntimeError "Invalid arguments to char_from_code")));
 
    (* Array additional ops *)
-   | "array_pop" ->
+  ["array_pop"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr] ->
-            let len = Array.length !arr in
+            let len = arr.len in
             if len = 0 then VUnit
             else begin
-              let last = !arr.(len - 1) in
-              arr := Array.sub !arr 0 (len - 1);
-              last
+              vec_pop arr
             end
-        | _ -> raise (RuntimeError "Invalid arguments to array_pop"))
+        | _ -> raise (RuntimeError "Invalid arguments to array_pop")));
 
-   | "array_remove" ->
+  ["array_remove"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr; VInt idx] ->
             let i = Int64.to_int idx in
-            let len = Array.length !arr in
+            let len = arr.len in
             if i >= 0 && i < len then begin
-              let new_arr = Array.concat [
-                Array.sub !arr 0 i;
-                Array.sub !arr (i + 1) (len - i - 1)
-              ] in
-              arr := new_arr;
+              Array.blit arr.data (i + 1) arr.data i (len - i - 1);
+              arr.len <- len - 1;
+              arr.data.(len - 1) <- VUnit;
               VArray arr
             end else
               VArray arr
-        | _ -> raise (RuntimeError "Invalid arguments to array_remove"))
+        | _ -> raise (RuntimeError "Invalid arguments to array_remove")));
 
-   | "array_slice" ->
+  ["array_slice"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray arr; VInt start; VInt len] ->
             let s = Int64.to_int start in
             let l = Int64.to_int len in
-            let arr_len = Array.length !arr in
+            let arr_len = arr.len in
             let s = max 0 s in
             let l = min l (arr_len - s) in
-            if l <= 0 then VArray (ref [||])
-            else VArray (ref (Array.sub !arr s l))
-        | _ -> raise (RuntimeError "Invalid arguments to array_slice"))
+            if l <= 0 then VArray (vec_of_array [||])
+            else VArray (vec_of_array (Array.sub (vget arr) s l))
+        | _ -> raise (RuntimeError "Invalid arguments to array_slice")));
 
-   | "array_concat" ->
+  ["array_concat"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray a; VArray b] ->
-            VArray (ref (Array.append !a !b))
-        | _ -> raise (RuntimeError "Invalid arguments to array_concat"))
+            VArray (vec_of_array (Array.append (vget a) (vget b)))
+        | _ -> raise (RuntimeError "Invalid arguments to array_concat")));
 
    (* file_append *)
-   | "file_append" ->
+  ["file_append"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString path; VString content] ->
             (try
               let fd = Unix.openfile path [Unix.O_WRONLY; Unix.O_CREAT; Unix.O_APPEND] 0o644 in
-              let _ = Unix.write fd (Bytes.of_string content) 0 (String.length content) in
+              let _ = file_write_fd_substring fd content 0 (String.length content) in
               Unix.close fd;
               VBool true
             with Unix.Unix_error _ ->
               raise (RuntimeError ("Could not append to file: " ^ path)))
-        | _ -> raise (RuntimeError "Invalid arguments to file_append"))
+        | _ -> raise (RuntimeError "Invalid arguments to file_append")));
 
    (* tcp_receive with single arg - default 4096 buffer *)
-   | "tcp_tls_connect" ->
+  ["tcp_tls_connect"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString host; VInt port] ->
             Ssl.init ();
@@ -4322,10 +7010,10 @@ and eval_call env func_name args =
             Ssl.set_client_SNI_hostname ssl_sock host;
             Ssl.connect ssl_sock;
             VTlsSocket ssl_sock
-        | _ -> raise (RuntimeError "Invalid arguments to tcp_tls_connect"))
+        | _ -> raise (RuntimeError "Invalid arguments to tcp_tls_connect")));
 
    (* Type checking *)
-   | "type_of" ->
+  ["type_of"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt _] -> VString "int"
         | [VFloat _] -> VString "float"
@@ -4336,32 +7024,38 @@ and eval_call env func_name args =
         | [VMap _] -> VString "map"
         | [VUnit] -> VString "unit"
         | [VFunction _] -> VString "function"
-        | _ -> VString "unknown")
-
-   | "is_array" ->
+        | [VRegex _] -> VString "regex"
+        | [VSeq _] -> VString "seq"
+        | [VPoller _] -> VString "poller"
+        | [VSqlite _] -> VString "sqlite"
+        | [VSqliteStmt _] -> VString "sqlite_stmt"
+        | [VBuilder _] -> VString "string_builder"
+        | _ -> VString "unknown"));
+
+  ["is_array"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VArray _] -> VBool true
-        | _ -> VBool false)
+        | _ -> VBool false));
 
-   | "is_object" ->
+  ["is_object"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VMap _] -> VBool true
-        | _ -> VBool false)
+        | _ -> VBool false));
 
    (* Environment *)
-   | "getenv" ->
+  ["getenv"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString name] ->
             VString (try Sys.getenv name with Not_found -> "")
-        | _ -> raise (RuntimeError "Invalid arguments to getenv"))
+        | _ -> raise (RuntimeError "Invalid arguments to getenv")));
 
-   | "exit" ->
+  ["exit"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VInt code] -> exit (Int64.to_int code)
-        | _ -> raise (RuntimeError "Invalid arguments to exit"))
+        | _ -> raise (RuntimeError "Invalid arguments to exit")));
 
    (* WebSocket operations *)
-   | "ws_accept" ->
+  ["ws_accept"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VSocket client_fd] ->
             let transport = WsPlain client_fd in
@@ -4371,9 +7065,9 @@ and eval_call env func_name args =
             let transport = WsTls ssl_sock in
             ws_server_handshake transport;
             VWsSocket transport
-        | _ -> raise (RuntimeError "Invalid arguments to ws_accept"))
+        | _ -> raise (RuntimeError "Invalid arguments to ws_accept")));
 
-   | "ws_connect" ->
+  ["ws_connect"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VString host; VInt port; VString path] ->
             let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
@@ -4382,17 +7076,17 @@ and eval_call env func_name args =
             let transport = WsPlain sock in
             ws_client_handshake transport host path;
             VWsSocket transport
-        | _ -> raise (RuntimeError "Invalid arguments to ws_connect"))
+        | _ -> raise (RuntimeError "Invalid arguments to ws_connect")));
 
-   | "ws_send" ->
+  ["ws_send"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VWsSocket transport; VString msg] ->
             let frame = ws_encode_frame msg in
             ws_write transport frame;
             VUnit
-        | _ -> raise (RuntimeError "Invalid arguments to ws_send"))
+        | _ -> raise (RuntimeError "Invalid arguments to ws_send")));
 
-   | "ws_receive" ->
+  ["ws_receive"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VWsSocket transport] ->
             let rec read_until_text () =
@@ -4411,9 +7105,9 @@ and eval_call env func_name args =
               | _ -> read_until_text ()   (* skip unknown *)
             in
             read_until_text ()
-        | _ -> raise (RuntimeError "Invalid arguments to ws_receive"))
+        | _ -> raise (RuntimeError "Invalid arguments to ws_receive")));
 
-   | "ws_close" ->
+  ["ws_close"], (fun env func_name arg_vals ->
        (match arg_vals with
         | [VWsSocket transport] ->
             (try ws_send_close transport ~masked:false with _ -> ());
@@ -4421,78 +7115,8 @@ and eval_call env func_name args =
              | WsPlain fd -> (try Unix.close fd with _ -> ())
              | WsTls ssl -> (try Ssl.shutdown ssl with _ -> ()));
             VUnit
-        | _ -> raise (RuntimeError "Invalid arguments to ws_close"))
-
-   (* User-defined functions *)
-   | _ ->
-       (try
-         let func_val = env_get env func_name in
-         match func_val with
-         | VFunction (_name, params, _ret_type, body) ->
-             let func_env = env_create () in
-             (* Copy all functions from parent env to func_env *)
-             Hashtbl.iter (fun k v ->
-               match v with
-               | VFunction _ -> env_set func_env k v
-               | _ -> ()
-             ) env;
-             (* Add local parameters *)
-             List.iter2 (fun param arg_val ->
-               env_set func_env param.param_name arg_val
-             ) params arg_vals;
-             (try
-               let last_result = eval_block func_env body in
-               (* main: implicit (ret 0); other functions: implicit return of last expression value *)
-               if func_name = "main" then VInt 0L else last_result
-             with Return v -> v)
-          | _ -> raise (RuntimeError (func_name ^ " is not a function"))
-        with Not_found ->
-          raise (RuntimeError ("Unknown function: " ^ func_name)))
-
-(* Execute tests *)
-and execute_tests env tests =
-  let passed = ref 0 in
-  let failed = ref 0 in
-  List.iter (fun test ->
-    Printf.printf "Test: %s\n" test.test_func_name;
-    List.iter (fun case ->
-      let func_env = env_create () in
-      try
-        let func_val = env_get env test.test_func_name in
-        match func_val with
-         | VFunction (_name, params, _ret_type, body) ->
-             (* Copy all functions from parent env to func_env *)
-             Hashtbl.iter (fun k v ->
-               match v with
-               | VFunction _ -> env_set func_env k v
-               | _ -> ()
-             ) env;
-             let arg_vals = List.map (eval env) case.test_inputs in
-             List.iter2 (fun param arg_val ->
-               env_set func_env param.param_name arg_val
-             ) params arg_vals;
-            let result =
-              try eval_block func_env body
-              with Return v -> v
-            in
-             let expected = eval env case.test_expected in
-             if values_equal result expected then (
-               Printf.printf "  ✓ %s\n" case.test_description;
-               incr passed
-             ) else (
-               Printf.printf "  ✗ %s\n" case.test_description;
-               Printf.printf "    Expected: %s\n" (string_of_value expected);
-               Printf.printf "    Got: %s\n" (string_of_value result);
-               incr failed
-             )
-        | _ -> ()
-      with e ->
-        Printf.printf "  ✗ %s (Error: %s)\n" case.test_description (Printexc.to_string e);
-        incr failed
-    ) test.test_cases
-  ) tests;
-  Printf.printf "\n%d passed, %d failed\n" !passed !failed;
-  if !failed > 0 then 1 else 0
+        | _ -> raise (RuntimeError "Invalid arguments to ws_close")));
+]
 
 (* Execute module *)
 
@@ -4510,7 +7134,7 @@ let find_project_root start_dir =
   walk start_dir
 
 (* Mutable reference to the source file path, set by VM entry point *)
-let source_file_path = ref ""
+let source_file_path = Atomic.make ""
 
 (* Diagnostic flags (output_emitted, diagnose_enabled) are forward-declared
    at the top of this file so print/println and (argv) can reference them
@@ -4526,10 +7150,11 @@ let compute_stdlib_paths () =
   in
   (* Strategy 1: relative to source file *)
   let from_source =
-    if !source_file_path <> "" then
-      let source_dir = Filename.dirname (if Filename.is_relative !source_file_path
-        then Filename.concat (Sys.getcwd ()) !source_file_path
-        else !source_file_path) in
+    let source_file_path = Atomic.get source_file_path in
+    if source_file_path <> "" then
+      let source_dir = Filename.dirname (if Filename.is_relative source_file_path
+        then Filename.concat (Sys.getcwd ()) source_file_path
+        else source_file_path) in
       match find_project_root source_dir with
       | Some root -> make_paths root
       | None -> []
@@ -4558,6 +7183,83 @@ let compute_stdlib_paths () =
     else (Hashtbl.replace seen p (); true)
   ) (from_source @ from_exe @ from_cwd)
 
+(* Parsed-module cache. Stdlib modules (the prelude included) are parsed
+   once and their AST marshalled to $SIGIL_CACHE_DIR (default
+   $XDG_CACHE_HOME/sigil or ~/.cache/sigil). An entry is reused only if
+   the source path, mtime and size and the interpreter build (version
+   plus executable mtime and size, so a rebuild with a changed AST
+   layout never reads stale data) all match. Any cache failure falls
+   back to parsing the source. SIGIL_AST_CACHE=0 disables the cache. *)
+let interpreter_version = "1.0.0"
+
+let ast_cache_dir () =
+  match Sys.getenv_opt "SIGIL_AST_CACHE" with
+  | Some "0" | Some "off" | Some "false" -> None
+  | _ ->
+      match Sys.getenv_opt "SIGIL_CACHE_DIR" with
+      | Some d when d <> "" -> Some d
+      | _ ->
+          match Sys.getenv_opt "XDG_CACHE_HOME" with
+          | Some d when d <> "" -> Some (Filename.concat d "sigil")
+          | _ ->
+              match Sys.getenv_opt "HOME" with
+              | Some h when h <> "" ->
+                  Some (Filename.concat (Filename.concat h ".cache") "sigil")
+              | _ -> None
+
+let ast_cache_key file_path =
+  let stat_key path =
+    let st = Unix.stat path in
+    Printf.sprintf "%.6f:%d" st.Unix.st_mtime st.Unix.st_size
+  in
+  String.concat "|" [ interpreter_version;
+                      stat_key Sys.executable_name;
+                      file_path;
+                      stat_key file_path ]
+
+let ast_cache_path dir file_path =
+  Filename.concat dir (Digest.to_hex (Digest.string file_path) ^ ".ast")
+
+let ast_cache_read dir file_path key =
+  try
+    let ic = open_in_bin (ast_cache_path dir file_path) in
+    Fun.protect ~finally:(fun () -> close_in_noerr ic) (fun () ->
+      let (stored_key : string) = Marshal.from_channel ic in
+      if stored_key <> key then None
+      else Some (Marshal.from_channel ic : module_def))
+  with _ -> None
+
+(* Write to a temp file and rename, so a concurrent reader never sees a
+   partial entry. *)
+let ast_cache_write dir file_path key (module_def : module_def) =
+  try
+    let rec mkdir_p d =
+      if not (Sys.file_exists d) then begin
+        mkdir_p (Filename.dirname d);
+        (try Unix.mkdir d 0o755 with Unix.Unix_error (Unix.EEXIST, _, _) -> ())
+      end
+    in
+    mkdir_p dir;
+    let final = ast_cache_path dir file_path in
+    let tmp = Printf.sprintf "%s.%d.tmp" final (Unix.getpid ()) in
+    let oc = open_out_bin tmp in
+    Marshal.to_channel oc key [];
+    Marshal.to_channel oc module_def [];
+    close_out oc;
+    Unix.rename tmp final
+  with _ -> ()
+
+let parse_module_file file_path =
+  let ic = open_in file_path in
+  let content = really_input_string ic (in_channel_length ic) in
+  close_in ic;
+  Parser.parse (Lexer.tokenize content)
+
+(* Parsed modules kept in memory for the life of the process, keyed like
+   the disk cache, so a long-lived --serve process reuses them across
+   requests. *)
+let module_memo : (string, string * module_def) Hashtbl.t = Hashtbl.create 16
+
 (* Load a module from stdlib *)
 let load_module module_name =
   let search_paths = compute_stdlib_paths () in
@@ -4572,42 +7274,68 @@ let load_module module_name =
   | None -> None
   | Some file_path ->
       try
-        (* Read and parse the module file *)
-        let ic = open_in file_path in
-        let content = really_input_string ic (in_channel_length ic) in
-        close_in ic;
-        let tokens = Lexer.tokenize content in
-        let module_def = Parser.parse tokens in
-        Some module_def
+        match (try Some (ast_cache_key file_path) with _ -> None) with
+        | None -> Some (parse_module_file file_path)
+        | Some key ->
+            (match Hashtbl.find_opt module_memo file_path with
+             | Some (memo_key, module_def) when memo_key = key -> Some module_def
+             | _ ->
+                 let module_def =
+                   match ast_cache_dir () with
+                   | None -> parse_module_file file_path
+                   | Some dir ->
+                       (match ast_cache_read dir file_path key with
+                        | Some module_def -> module_def
+                        | None ->
+                            let module_def = parse_module_file file_path in
+                            ast_cache_write dir file_path key module_def;
+                            module_def)
+                 in
+                 Hashtbl.replace module_memo file_path (key, module_def);
+                 Some module_def)
       with _ -> None
 
+(* Build the runtime value for a function definition, resolving its
+   locals to frame slots. *)
+let function_value func =
+  let (body, layout) = Resolver.resolve_function ~builtin:resolve_builtin func in
+  VFunction (func.func_name, func.func_params, func.func_return_type, body, layout)
+
 (* Register all functions from a module into the environment *)
 let register_module env module_def =
   List.iter (fun func ->
-    let func_val = VFunction (
-      func.func_name,
-      func.func_params,
-      func.func_return_type,
-      func.func_body
-    ) in
-    env_set env func.func_name func_val
+    env_set env func.func_name (function_value func)
   ) module_def.module_functions
 
+(* Modules already loaded in this run. A module reached again through
+   another import path (diamond imports, the prelude's own imports, a
+   cycle) is not re-read or re-registered. *)
+let loaded_modules : (string, unit) Hashtbl.t = Hashtbl.create 16
+
 (* Load and register all imported modules *)
 let rec load_imports env imports =
   List.iter (fun module_name ->
-    match load_module module_name with
-    | Some module_def ->
-        register_module env module_def;
-        (* Also load any imports from the imported module *)
-        load_imports env module_def.module_imports
-    | None ->
-        Printf.eprintf "WARNING: Could not load import: %s\n" module_name
+    if not (Hashtbl.mem loaded_modules module_name) then begin
+      Hashtbl.replace loaded_modules module_name ();
+      match load_module module_name with
+      | Some module_def ->
+          register_module env module_def;
+          (* Also load any imports from the imported module *)
+          load_imports env module_def.module_imports
+      | None ->
+          Printf.eprintf "WARNING: Could not load import: %s\n" module_name
+    end
   ) imports
 
+(* Seconds the last execute_module spent loading the prelude, imports
+   and the module's own functions, before running anything (--stats). *)
+let load_seconds = ref 0.0
+
 (* Execute module *)
 let rec execute_module module_def =
+   let load_start = Unix.gettimeofday () in
    let global_env = env_create () in
+   Hashtbl.reset loaded_modules;
 
    (* Auto-load the core prelude so its functions (tokens, squeeze,
       split_blocks, find_all, ...) are available with zero import.
@@ -4615,6 +7343,7 @@ let rec execute_module module_def =
       builtins — anything that COULD be written in Sigil belongs there
       rather than in OCaml. User imports and user functions can still
       shadow prelude names. *)
+   Hashtbl.replace loaded_modules "prelude" ();
    (match load_module "prelude" with
     | Some prelude_def ->
         register_module global_env prelude_def;
@@ -4625,15 +7354,8 @@ let rec execute_module module_def =
    load_imports global_env module_def.module_imports;
 
    (* Register all functions from main module *)
-   List.iter (fun func ->
-     let func_val = VFunction (
-       func.func_name,
-       func.func_params,
-       func.func_return_type,
-       func.func_body
-     ) in
-     env_set global_env func.func_name func_val
-   ) module_def.module_functions;
+   register_module global_env module_def;
+   load_seconds := Unix.gettimeofday () -. load_start;
 
    (* Execute tests if present, otherwise execute main.
       In test mode we mark output_emitted=true unconditionally — the
@@ -4642,7 +7364,7 @@ let rec execute_module module_def =
       the no-output-produced diagnostic would fire on every clean test
       run, which is a false positive. *)
    if List.length module_def.module_tests > 0 then begin
-     output_emitted := true;
+     Atomic.set output_emitted true;
      execute_tests global_env module_def.module_tests
    end
    else
@@ -39,7 +39,8 @@ let rec skip_whitespace input pos =
   else pos
 
 let read_string ?(quote='"') input start_pos =
-  let rec loop pos escaped acc =
+  let buf = Buffer.create 16 in
+  let rec loop pos escaped =
     if pos >= String.length input then
       raise (LexError "Unterminated string")
     else
@@ -55,15 +56,18 @@ let read_string ?(quote='"') input start_pos =
           | '0' -> "\x00"
           | _ -> "\\" ^ String.make 1 c
         in
-        loop (pos + 1) false (acc ^ escaped_str)
+        Buffer.add_string buf escaped_str;
+        loop (pos + 1) false
       else if c = '\\' then
-        loop (pos + 1) true acc
+        loop (pos + 1) true
       else if c = quote then
-        (acc, pos + 1)
-      else
-        loop (pos + 1) false (acc ^ String.make 1 c)
+        (Buffer.contents buf, pos + 1)
+      else begin
+        Buffer.add_char buf c;
+        loop (pos + 1) false
+      end
   in
-  loop start_pos false ""
+  loop start_pos false
 
 let read_number input start_pos =
   let rec loop pos =
@@ -89,48 +93,62 @@ let read_symbol input start_pos =
   let sym = String.sub input start_pos (end_pos - start_pos) in
   (sym, end_pos)
 
+(* Tokens are appended to a growable array so the parser can peek in O(1).
+   The result always ends with EOF. *)
 let tokenize input =
-  let rec loop pos acc =
+  let toks = ref (Array.make (max 64 (String.length input / 4)) EOF) in
+  let count = ref 0 in
+  let emit tok =
+    if !count = Array.length !toks then begin
+      let grown = Array.make (2 * !count) EOF in
+      Array.blit !toks 0 grown 0 !count;
+      toks := grown
+    end;
+    (!toks).(!count) <- tok;
+    incr count
+  in
+  let rec loop pos =
     let pos = skip_whitespace input pos in
-    if pos >= String.length input then
-      List.rev (EOF :: acc)
-    else
+    if pos >= String.length input then begin
+      emit EOF;
+      Array.sub !toks 0 !count
+    end else
       let c = input.[pos] in
       match c with
-      | '(' -> loop (pos + 1) (LParen :: acc)
-      | ')' -> loop (pos + 1) (RParen :: acc)
-      | '[' -> loop (pos + 1) (LBracket :: acc)
-      | ']' -> loop (pos + 1) (RBracket :: acc)
-      | '{' -> loop (pos + 1) (LBrace :: acc)
-      | '}' -> loop (pos + 1) (RBrace :: acc)
+      | '(' -> (emit LParen; loop (pos + 1))
+      | ')' -> (emit RParen; loop (pos + 1))
+      | '[' -> (emit LBracket; loop (pos + 1))
+      | ']' -> (emit RBracket; loop (pos + 1))
+      | '{' -> (emit LBrace; loop (pos + 1))
+      | '}' -> (emit RBrace; loop (pos + 1))
       | '"' ->
           let (str, next_pos) = read_string input (pos + 1) in
-          loop next_pos (StringLit str :: acc)
+          emit (StringLit str); loop next_pos
       | '\'' ->
           (* Single-quoted strings: Python/JS-style alternative. Pragmatic
              for models that reach for 'x' instead of "x". *)
           let (str, next_pos) = read_string ~quote:'\'' input (pos + 1) in
-          loop next_pos (StringLit str :: acc)
+          emit (StringLit str); loop next_pos
       | '$' when pos + 1 < String.length input && is_digit input.[pos + 1] ->
           (* $N -> (arg_str N) *)
           let (num_str, next_pos) = read_number input (pos + 1) in
           let n = Int64.of_string num_str in
           let tokens = [LParen; Symbol "arg_str"; IntLit n; RParen] in
-          loop next_pos (List.rev_append tokens acc)
+          List.iter emit tokens; loop next_pos
       | '#' when pos + 1 < String.length input && is_digit input.[pos + 1] ->
           (* #N -> (arg_int N) *)
           let (num_str, next_pos) = read_number input (pos + 1) in
           let n = Int64.of_string num_str in
           let tokens = [LParen; Symbol "arg_int"; IntLit n; RParen] in
-          loop next_pos (List.rev_append tokens acc)
+          List.iter emit tokens; loop next_pos
       | '\\' ->
           (* Lambda marker: \ is its own token *)
-          loop (pos + 1) (Symbol "\\" :: acc)
+          emit (Symbol "\\"); loop (pos + 1)
       | '-' when pos + 1 < String.length input && is_digit input.[pos + 1] ->
            let (num_str, next_pos) = read_number input pos in
            (* Check for 'd' suffix -> decimal literal *)
            if next_pos < String.length input && input.[next_pos] = 'd' then
-             loop (next_pos + 1) (DecimalLit num_str :: acc)
+             (emit (DecimalLit num_str); loop (next_pos + 1))
            else
              let tok = 
                if String.contains num_str '.' || String.contains num_str 'e' || String.contains num_str 'E' then
@@ -138,12 +156,12 @@ let tokenize input =
                else
                  IntLit (Int64.of_string num_str)
              in
-             loop next_pos (tok :: acc)
+             emit tok; loop next_pos
        | '0'..'9' ->
            let (num_str, next_pos) = read_number input pos in
            (* Check for 'd' suffix -> decimal literal *)
            if next_pos < String.length input && input.[next_pos] = 'd' then
-             loop (next_pos + 1) (DecimalLit num_str :: acc)
+             (emit (DecimalLit num_str); loop (next_pos + 1))
            else
              let tok = 
                if String.contains num_str '.' || String.contains num_str 'e' || String.contains num_str 'E' then
@@ -151,7 +169,7 @@ let tokenize input =
                else
                  IntLit (Int64.of_string num_str)
              in
-             loop next_pos (tok :: acc)
+             emit tok; loop next_pos
       | _ when is_alpha c || is_symbol_char c ->
           let (sym, next_pos) = read_symbol input pos in
           let tok = match sym with
@@ -159,10 +177,10 @@ let tokenize input =
             | "false" -> BoolLit false
             | _ -> Symbol sym
           in
-          loop next_pos (tok :: acc)
+          emit tok; loop next_pos
       | _ -> raise (LexError ("Unexpected character: " ^ String.make 1 c))
   in
-  loop 0 []
+  loop 0
 
 let string_of_token = function
   | LParen -> "("
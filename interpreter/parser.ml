@@ -7,13 +7,19 @@ open Ast
 exception ParseError of string
 
 type parser_state = {
-  tokens : token list;
+  tokens : token array;
   pos : int;
 }
 
 let peek state =
-  if state.pos >= List.length state.tokens then EOF
-  else List.nth state.tokens state.pos
+  if state.pos >= Array.length state.tokens then EOF
+  else state.tokens.(state.pos)
+
+(* One token of lookahead past [peek]. *)
+let peek_next state =
+  if state.pos + 1 < Array.length state.tokens then
+    Some state.tokens.(state.pos + 1)
+  else None
 
 let advance state =
   { state with pos = state.pos + 1 }
@@ -76,7 +82,7 @@ let rec parse_expr state =
   match peek state with
   | IntLit n -> (LitInt n, advance state)
   | FloatLit f -> (LitFloat f, advance state)
-  | DecimalLit s -> (LitDecimal s, advance state)
+  | DecimalLit s -> (LitDecimal (decimal_of_string s), advance state)
   | StringLit s -> (LitString s, advance state)
   | BoolLit b -> (LitBool b, advance state)
   | Symbol s -> (Var s, advance state)
@@ -285,11 +291,7 @@ and parse_try state =
         raise (ParseError "try block requires a (catch ...) clause")
     | LParen ->
         (* Check if this is (catch ...) *)
-        let tok_at_pos_plus_1 =
-          if state.pos + 1 < List.length state.tokens then
-            Some (List.nth state.tokens (state.pos + 1))
-          else None
-        in
+        let tok_at_pos_plus_1 = peek_next state in
         (match tok_at_pos_plus_1 with
          | Some (Symbol "catch") ->
              (* Parse catch block *)
@@ -445,11 +447,7 @@ let parse_test_case state =
   let rec skip_mocks state =
     match peek state with
     | LParen ->
-        let tok_at_pos_plus_1 = 
-          if state.pos + 1 < List.length state.tokens then
-            Some (List.nth state.tokens (state.pos + 1))
-          else None
-        in
+        let tok_at_pos_plus_1 = peek_next state in
         (match tok_at_pos_plus_1 with
          | Some (Symbol "mock") -> skip_mocks (skip_sexp state)
          | _ -> state)
@@ -475,11 +473,7 @@ let parse_test_case state =
 let rec parse_test_cases state acc =
   match peek state with
   | LParen ->
-      let tok_at_pos_plus_1 = 
-        if state.pos + 1 < List.length state.tokens then
-          Some (List.nth state.tokens (state.pos + 1))
-        else None
-      in
+      let tok_at_pos_plus_1 = peek_next state in
       (match tok_at_pos_plus_1 with
        | Some (Symbol "case") ->
            let (test_case, state) = parse_test_case state in
@@ -515,11 +509,7 @@ let parse_module state =
           module_tests = List.rev tests;
           module_note = note }
     | LParen ->
-        let tok_at_pos_plus_1 = 
-          if state.pos + 1 < List.length state.tokens then
-            Some (List.nth state.tokens (state.pos + 1))
-          else None
-        in
+        let tok_at_pos_plus_1 = peek_next state in
         (match tok_at_pos_plus_1 with
          | Some (Symbol "import") ->
              let (imp, state) = parse_import state in
@@ -553,9 +543,7 @@ let parse_script tokens =
     match peek state with
     | EOF -> (List.rev funcs, List.rev body)
     | LParen ->
-        let tok2 = if state.pos + 1 < List.length state.tokens
-                   then Some (List.nth state.tokens (state.pos + 1))
-                   else None in
+        let tok2 = peek_next state in
         (match tok2 with
          | Some (Symbol "fn") | Some (Symbol "def") ->
              let (fn_def, state) = parse_function state in
@@ -598,9 +586,7 @@ let parse tokens =
      Otherwise, treat as a script and wrap into implicit main. *)
   match peek state with
   | LParen ->
-      let tok2 = if state.pos + 1 < List.length state.tokens
-                 then Some (List.nth state.tokens (state.pos + 1))
-                 else None in
+      let tok2 = peek_next state in
       (match tok2 with
        | Some (Symbol "module") -> parse_module state
        | _ -> parse_script tokens)
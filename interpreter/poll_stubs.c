@@ -0,0 +1,151 @@
+/* Readiness polling for the poll_* builtins: epoll on Linux, kqueue on
+   the BSDs and macOS. The kernel keeps the registered set, so a wait
+   costs O(ready fds) however many sockets are registered.
+
+   Event masks on both sides: 1 = readable, 2 = writable. Hang-ups and
+   errors are reported as readable, where the next read sees them. */
+
+#define CAML_NAME_SPACE
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SIGIL_EV_READ 1
+#define SIGIL_EV_WRITE 2
+
+#define SIGIL_OP_ADD 0
+#define SIGIL_OP_MODIFY 1
+#define SIGIL_OP_REMOVE 2
+
+#if defined(__linux__)
+#define SIGIL_EPOLL
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+   || defined(__NetBSD__) || defined(__DragonFly__)
+#define SIGIL_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+static void sigil_poll_fail(const char *what, int err)
+{
+  char msg[256];
+  snprintf(msg, sizeof msg, "%s: %s", what, strerror(err));
+  caml_failwith(msg);
+}
+
+value sigil_poller_create(value unit)
+{
+  int fd;
+  (void) unit;
+#if defined(SIGIL_EPOLL)
+  fd = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(SIGIL_KQUEUE)
+  fd = kqueue();
+#else
+  caml_failwith("poll_new: no epoll or kqueue on this platform");
+#endif
+  if (fd < 0) sigil_poll_fail("poll_new", errno);
+  return Val_int(fd);
+}
+
+value sigil_poller_ctl(value vpoller, value vop, value vfd, value vevents)
+{
+  int poller = Int_val(vpoller), op = Int_val(vop);
+  int fd = Int_val(vfd), events = Int_val(vevents);
+#if defined(SIGIL_EPOLL)
+  struct epoll_event ev;
+  int ctl = op == SIGIL_OP_ADD ? EPOLL_CTL_ADD
+          : op == SIGIL_OP_MODIFY ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  memset(&ev, 0, sizeof ev);
+  ev.events = ((events & SIGIL_EV_READ) ? EPOLLIN | EPOLLRDHUP : 0)
+            | ((events & SIGIL_EV_WRITE) ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if (epoll_ctl(poller, ctl, fd, &ev) < 0) sigil_poll_fail("poll_ctl", errno);
+#elif defined(SIGIL_KQUEUE)
+  /* One filter per direction: add the wanted ones, drop the others. A
+     filter that was never added is not an error to drop. */
+  struct kevent ch;
+  int want_read = op != SIGIL_OP_REMOVE && (events & SIGIL_EV_READ);
+  int want_write = op != SIGIL_OP_REMOVE && (events & SIGIL_EV_WRITE);
+  EV_SET(&ch, fd, EVFILT_READ, want_read ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, NULL);
+  if (kevent(poller, &ch, 1, NULL, 0, NULL) < 0 && !(errno == ENOENT && !want_read))
+    sigil_poll_fail("poll_ctl", errno);
+  EV_SET(&ch, fd, EVFILT_WRITE, want_write ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, NULL);
+  if (kevent(poller, &ch, 1, NULL, 0, NULL) < 0 && !(errno == ENOENT && !want_write))
+    sigil_poll_fail("poll_ctl", errno);
+#else
+  (void) poller; (void) op; (void) fd; (void) events;
+  caml_failwith("poll_ctl: no epoll or kqueue on this platform");
+#endif
+  return Val_unit;
+}
+
+/* Wait up to [timeout_ms] (negative: forever) for at most [max] events.
+   Returns a flat int array [| fd0; mask0; fd1; mask1; ... |]; kqueue
+   may list an fd twice, once per direction. EINTR is an empty result. */
+value sigil_poller_wait(value vpoller, value vmax, value vtimeout)
+{
+  CAMLparam3(vpoller, vmax, vtimeout);
+  CAMLlocal1(result);
+  int poller = Int_val(vpoller), max = Int_val(vmax);
+  int timeout_ms = Int_val(vtimeout);
+  if (max < 1) max = 1;
+#if defined(SIGIL_EPOLL)
+  int n, i, err;
+  struct epoll_event *evs = malloc(sizeof *evs * max);
+  if (evs == NULL) caml_raise_out_of_memory();
+  caml_enter_blocking_section();
+  n = epoll_wait(poller, evs, max, timeout_ms);
+  err = errno;
+  caml_leave_blocking_section();
+  if (n < 0 && err != EINTR) { free(evs); sigil_poll_fail("poll_wait", err); }
+  if (n < 0) n = 0;
+  result = caml_alloc(2 * n, 0);
+  for (i = 0; i < n; i++) {
+    int mask = 0;
+    if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) mask |= SIGIL_EV_READ;
+    if (evs[i].events & EPOLLOUT) mask |= SIGIL_EV_WRITE;
+    Store_field(result, 2 * i, Val_int(evs[i].data.fd));
+    Store_field(result, 2 * i + 1, Val_int(mask));
+  }
+  free(evs);
+#elif defined(SIGIL_KQUEUE)
+  int n, i, err;
+  struct timespec ts, *tsp = NULL;
+  struct kevent *evs = malloc(sizeof *evs * max);
+  if (evs == NULL) caml_raise_out_of_memory();
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000L;
+    tsp = &ts;
+  }
+  caml_enter_blocking_section();
+  n = kevent(poller, NULL, 0, evs, max, tsp);
+  err = errno;
+  caml_leave_blocking_section();
+  if (n < 0 && err != EINTR) { free(evs); sigil_poll_fail("poll_wait", err); }
+  if (n < 0) n = 0;
+  result = caml_alloc(2 * n, 0);
+  for (i = 0; i < n; i++) {
+    int mask = evs[i].filter == EVFILT_WRITE ? SIGIL_EV_WRITE : SIGIL_EV_READ;
+    if (evs[i].flags & (EV_EOF | EV_ERROR)) mask |= SIGIL_EV_READ;
+    Store_field(result, 2 * i, Val_int((int) evs[i].ident));
+    Store_field(result, 2 * i + 1, Val_int(mask));
+  }
+  free(evs);
+#else
+  (void) poller; (void) timeout_ms;
+  caml_failwith("poll_wait: no epoll or kqueue on this platform");
+#endif
+  CAMLreturn(result);
+}
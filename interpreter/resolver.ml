@@ -0,0 +1,398 @@
+(* Sigil Resolver — assigns frame slots to function-local variables.
+
+   Runs once per function at module load, before anything is evaluated.
+   Every name a function binds (its params, plus anything it (set)s, a
+   for / for-each iterator, or a catch variable) gets a fixed index into
+   the per-call slot array, and the matching Var / Set nodes in the body
+   are rewritten to Slot / SetSlot. The evaluator then reads and writes
+   locals with an array access instead of a Hashtbl lookup by name.
+
+   Names the function never binds (globals, user functions, builtins
+   referenced as values) stay as Var and are resolved by name at runtime,
+   exactly as before.
+
+   A Lambda becomes a Closure with a frame layout of its own: its params,
+   then the free names its body may look up in the enclosing scope, then
+   its other locals. Creating the closure copies just those captured
+   names into a slot array, reading them straight from the enclosing
+   frame's slots where the enclosing layout has them.
+
+   A body (function, lambda, branch or loop body) that contains labels is
+   packed into one Block: a statement array plus a label -> index table,
+   so goto is a table lookup instead of a scan of the list.
+
+   Calls to builtins (after alias normalization) are bound here too, to
+   CallBuiltin nodes carrying the builtin's table index, in function and
+   lambda bodies alike. Two-argument add / sub / mul / div / mod and the
+   comparisons become Arith nodes, which the evaluator runs inline for
+   int operands (as IntArith on native ints when they nest), and a for
+   loop's counter is bound to its slot (ForSlot).
+   A fmt call with a literal template gets the template compiled (Fmt),
+   and (set s (add s ...)) on a local becomes AppendSlot. A terminal such
+   as sum or join applied straight to a range / map_arr / filter call is
+   Fused, so the pipeline runs as one pass with no intermediate arrays,
+   as long as the map_arr / filter functions are pure lambdas.
+   Everything else stays a by-name Call. *)
+
+open Ast
+
+type layout = frame_layout = {
+  slot_names : string array;             (* slot index -> variable name *)
+  slot_index : (string, int) Hashtbl.t;  (* variable name -> slot index *)
+}
+
+(* Layout for envs that have no frame (the global env). *)
+let empty_layout = { slot_names = [||]; slot_index = Hashtbl.create 1 }
+
+let slot_count layout = Array.length layout.slot_names
+
+(* Collect every name the body binds, in first-binding order. *)
+let collect_locals params body =
+  let names = ref [] in
+  let seen = Hashtbl.create 16 in
+  let add name =
+    if not (Hashtbl.mem seen name) then begin
+      Hashtbl.replace seen name ();
+      names := name :: !names
+    end
+  in
+  List.iter add params;
+  let rec walk e =
+    match e with
+    | Set (name, _, v) -> add name; walk v
+    | Call (_, args) -> List.iter walk args
+    | If (c, t, el) ->
+        walk c; List.iter walk t;
+        (match el with Some b -> List.iter walk b | None -> ())
+    | While (c, b) -> walk c; List.iter walk b
+    | Loop b -> List.iter walk b
+    | And (a, b) | Or (a, b) -> walk a; walk b
+    | For (v, s, en, b) -> add v; walk s; walk en; List.iter walk b
+    | ForEach (v, _, c, b) -> add v; walk c; List.iter walk b
+    | Return e -> walk e
+    | IfNot (c, _) -> walk c
+    | Try (b, v, _, cb) -> List.iter walk b; add v; List.iter walk cb
+    | Cond branches -> List.iter (fun (c, b) -> walk c; List.iter walk b) branches
+    | LitArray es -> List.iter walk es
+    | LitMap pairs -> List.iter (fun (k, v) -> walk k; walk v) pairs
+    | _ -> ()  (* literals, Var, Lambda (own scope), control markers *)
+  in
+  List.iter walk body;
+  Array.of_list (List.rev !names)
+
+let make_layout slot_names =
+  let slot_index = Hashtbl.create (max 1 (Array.length slot_names)) in
+  Array.iteri (fun i name -> Hashtbl.replace slot_index name i) slot_names;
+  { slot_names; slot_index }
+
+(* Names inside fmt's {name} / {name:spec} placeholders. *)
+let template_names template =
+  let names = ref [] in
+  let len = String.length template in
+  let i = ref 0 in
+  while !i < len do
+    (if template.[!i] = '{' then
+       match String.index_from_opt template (!i + 1) '}' with
+       | Some close ->
+           let body = String.sub template (!i + 1) (close - !i - 1) in
+           let name = match String.index_opt body ':' with
+             | Some colon -> String.sub body 0 colon
+             | None -> body
+           in
+           if name <> "" then names := name :: !names;
+           i := close
+       | None -> ());
+    incr i
+  done;
+  List.rev !names
+
+(* Parse a Python-shaped format spec (the part after the colon). *)
+let parse_fmt_spec spec =
+  let n = String.length spec in
+  let p = ref 0 in
+  let fill = ref ' ' and align = ref ' ' in
+  if n >= 2 && (spec.[1] = '<' || spec.[1] = '>' || spec.[1] = '^') then begin
+    fill := spec.[0]; align := spec.[1]; p := 2
+  end else if n >= 1 && (spec.[0] = '<' || spec.[0] = '>' || spec.[0] = '^') then begin
+    align := spec.[0]; p := 1
+  end;
+  if !p < n && spec.[!p] = '0' && !align = ' ' then begin
+    fill := '0'; align := '>'; incr p
+  end;
+  let ws = !p in
+  while !p < n && spec.[!p] >= '0' && spec.[!p] <= '9' do incr p done;
+  let width = if !p > ws then int_of_string (String.sub spec ws (!p - ws)) else 0 in
+  let precision = ref (-1) in
+  if !p < n && spec.[!p] = '.' then begin
+    incr p;
+    let ps = !p in
+    while !p < n && spec.[!p] >= '0' && spec.[!p] <= '9' do incr p done;
+    if !p > ps then precision := int_of_string (String.sub spec ps (!p - ps))
+  end;
+  let ty = if !p < n then spec.[!p] else ' ' in
+  { fill = !fill; align = !align; width; precision = !precision; ty }
+
+(* Split a fmt template into pieces, once per call site. {{ }} and %%
+   are escapes; %s %d %i %f %g %x %o %b %v take the next positional arg
+   unformatted, like {}; a { with no closing } is literal text. *)
+let compile_fmt template =
+  let pieces = ref [] in
+  let text = Buffer.create (String.length template) in
+  let flush_text () =
+    if Buffer.length text > 0 then begin
+      pieces := FmtText (Buffer.contents text) :: !pieces;
+      Buffer.clear text
+    end
+  in
+  let placeholder p = flush_text (); pieces := p :: !pieces in
+  let len = String.length template in
+  let i = ref 0 in
+  while !i < len do
+    let c = template.[!i] in
+    let next = if !i + 1 < len then template.[!i + 1] else '\000' in
+    if (c = '{' && next = '{') || (c = '}' && next = '}') || (c = '%' && next = '%') then begin
+      Buffer.add_char text c;
+      i := !i + 2
+    end else if c = '%' && String.contains "sdifgxobv" next then begin
+      placeholder (FmtNext None);
+      i := !i + 2
+    end else if c = '{' then begin
+      match String.index_from_opt template (!i + 1) '}' with
+      | None -> Buffer.add_char text c; incr i
+      | Some close ->
+          let body = String.sub template (!i + 1) (close - !i - 1) in
+          let (name, spec) = match String.index_opt body ':' with
+            | Some colon ->
+                (String.sub body 0 colon,
+                 String.sub body (colon + 1) (String.length body - colon - 1))
+            | None -> (body, "")
+          in
+          let spec = if spec = "" then None else Some (parse_fmt_spec spec) in
+          placeholder (if name = "" then FmtNext spec else FmtName (name, spec));
+          i := close + 1
+    end else begin
+      Buffer.add_char text c;
+      incr i
+    end
+  done;
+  flush_text ();
+  Array.of_list (List.rev !pieces)
+
+(* Every name a lambda body might look up in its enclosing scope: variable
+   reads and writes, binders, fmt placeholders, heads of calls that are
+   not builtins (a function-valued param or local called by name), and
+   the same inside nested lambdas. A fmt whose template is not a literal
+   can name any variable at run time, so it captures every local of the
+   [enclosing] frame. Over-approximating is harmless: a name with no
+   binding at closure creation is simply not captured. *)
+let free_names ~builtin ~enclosing params body =
+  let names = ref [] in
+  let seen = Hashtbl.create 16 in
+  List.iter (fun p -> Hashtbl.replace seen p ()) params;
+  let add name =
+    if not (Hashtbl.mem seen name) then begin
+      Hashtbl.replace seen name ();
+      names := name :: !names
+    end
+  in
+  let rec walk e =
+    match e with
+    | Var name -> add name
+    | Set (name, _, v) -> add name; walk v
+    | Call (f, args) ->
+        (match f, args with
+         | "fmt", LitString t :: _ -> List.iter add (template_names t)
+         | "fmt", _ :: _ -> Array.iter add enclosing.slot_names
+         | _ -> if builtin f = None then add f);
+        List.iter walk args
+    | If (c, t, el) ->
+        walk c; List.iter walk t;
+        (match el with Some b -> List.iter walk b | None -> ())
+    | While (c, b) -> walk c; List.iter walk b
+    | Loop b -> List.iter walk b
+    | And (a, b) | Or (a, b) -> walk a; walk b
+    | For (v, s, en, b) -> add v; walk s; walk en; List.iter walk b
+    | ForEach (v, _, c, b) -> add v; walk c; List.iter walk b
+    | Return e -> walk e
+    | IfNot (c, _) -> walk c
+    | Try (b, v, _, cb) -> List.iter walk b; add v; List.iter walk cb
+    | Cond branches -> List.iter (fun (c, b) -> walk c; List.iter walk b) branches
+    | LitArray es -> List.iter walk es
+    | LitMap pairs -> List.iter (fun (k, v) -> walk k; walk v) pairs
+    | Lambda (_, b) -> List.iter walk b
+    | _ -> ()
+  in
+  List.iter walk body;
+  List.rev !names
+
+(* Pack a body holding labels into a Block; other bodies stay lists. The
+   last of two same-named labels wins, as with the linear scan. *)
+let compile_body stmts =
+  if not (List.exists (function Label _ -> true | _ -> false) stmts) then stmts
+  else begin
+    let arr = Array.of_list stmts in
+    let labels = Hashtbl.create 8 in
+    Array.iteri (fun i e ->
+      match e with
+      | Label name -> Hashtbl.replace labels name i
+      | _ -> ()
+    ) arr;
+    [Block (arr, labels)]
+  end
+
+let arith_op_of_builtin = function
+  | "add" -> Some OpAdd | "sub" -> Some OpSub | "mul" -> Some OpMul
+  | "div" -> Some OpDiv | "mod" -> Some OpMod
+  | "lt" -> Some OpLt | "le" -> Some OpLe | "gt" -> Some OpGt
+  | "ge" -> Some OpGe | "eq" -> Some OpEq | "ne" -> Some OpNe
+  | _ -> None
+
+(* Builtins a streamed map_arr / filter function may call: they don't
+   print, mutate their arguments, call back into Sigil code or touch
+   files, sockets or globals. *)
+let is_pure_builtin = function
+  | "add" | "sub" | "mul" | "div" | "mod" | "lt" | "le" | "gt" | "ge" | "eq" | "ne"
+  | "not" | "abs" | "min" | "max" | "neg" | "pow" | "sqrt" | "round" | "floor" | "ceil"
+  | "len" | "str" | "int" | "float" | "parse_int" | "cast_int_float" | "cast_float_int"
+  | "type_of" | "upper" | "lower" | "trim" | "split" | "string_concat" | "string_slice"
+  | "string_contains" | "string_starts_with" | "string_ends_with" | "string_split"
+  | "string_to_upper" | "string_to_lower" | "string_from_int" | "string_equals"
+  | "string_get" | "array_get" | "array_length" | "get" | "map_get" | "map_has" | "has"
+  | "first" | "last" -> true
+  | _ -> false
+
+(* A resolved expression with no effect beyond its value: calling it
+   element by element as a consumer pulls, instead of all up front, can
+   not be told apart. SetSlot only writes the lambda's own frame, which
+   is fresh per call. *)
+let rec is_pure_expr = function
+  | LitInt _ | LitFloat _ | LitDecimal _ | LitString _ | LitBool _ | LitUnit
+  | Var _ | Slot _ -> true
+  | Arith (_, _, _, a, b) | And (a, b) | Or (a, b) -> is_pure_expr a && is_pure_expr b
+  | If (c, t, e) ->
+      is_pure_expr c && List.for_all is_pure_expr t
+      && Option.fold ~none:true ~some:(List.for_all is_pure_expr) e
+  | Cond branches ->
+      List.for_all (fun (c, body) -> is_pure_expr c && List.for_all is_pure_expr body) branches
+  | LitArray es | Fmt (_, _, es) -> List.for_all is_pure_expr es
+  | LitMap pairs -> List.for_all (fun (k, v) -> is_pure_expr k && is_pure_expr v) pairs
+  | CallBuiltin (_, name, args) -> is_pure_builtin name && List.for_all is_pure_expr args
+  | SetSlot (_, _, _, v) | Return v | IntArith (_, _, _, v) -> is_pure_expr v
+  | _ -> false
+
+let is_pure_callback = function
+  | Closure (_, body, _, _) -> List.for_all is_pure_expr body
+  | _ -> false
+
+(* Builtins whose array result a terminal can take as a stream, and the
+   terminals that consume one in a single pass. A map_arr or filter only
+   streams when its function is a lambda with a pure body, so its calls
+   interleaving with the consumer's can't be observed. *)
+let is_stream_stage = function
+  | CallBuiltin (_, ("range" | "enumerate" | "zip"), _) -> true
+  | CallBuiltin (_, ("map_arr" | "filter"), [a; b]) -> is_pure_callback a || is_pure_callback b
+  | _ -> false
+
+let is_stream_terminal = function
+  | "sum" | "reduce" | "count" | "counter" | "max_by" | "min_by" | "join" | "len" -> true
+  | _ -> false
+
+(* An Arith whose operands nest further arithmetic on slots and int
+   literals becomes IntArith, so the inner results are never boxed. A
+   single operation gains nothing from it and stays Arith. *)
+let rec int_tree = function
+  | LitInt n when Int64.compare n (Int64.of_int min_int) >= 0
+                  && Int64.compare n (Int64.of_int max_int) <= 0 -> Some (IConst (Int64.to_int n))
+  | Slot (i, _) -> Some (ISlot i)
+  | Arith ((OpAdd | OpSub | OpMul | OpDiv | OpMod) as op, _, _, a, b) ->
+      (match int_tree a, int_tree b with
+       | Some x, Some y -> Some (IOp (op, x, y))
+       | _ -> None)
+  | IntArith ((OpAdd | OpSub | OpMul | OpDiv | OpMod) as op, x, y, _) -> Some (IOp (op, x, y))
+  | _ -> None
+
+let arith op id canonical a b =
+  let plain = Arith (op, id, canonical, a, b) in
+  let nested = function Arith _ | IntArith _ -> true | _ -> false in
+  if not (nested a || nested b) then plain
+  else match int_tree a, int_tree b with
+    | Some x, Some y -> IntArith (op, x, y, plain)
+    | _ -> plain
+
+let call_builtin id canonical args =
+  if is_stream_terminal canonical && List.exists is_stream_stage args
+  then Fused (id, canonical, args)
+  else CallBuiltin (id, canonical, args)
+
+(* Rewrite Var / Set of locals into slot accesses and builtin calls into
+   CallBuiltin, or Arith for two-argument arithmetic and comparisons.
+   [builtin] maps a call name to (index, canonical name). *)
+let rec rewrite builtin layout e =
+  let rw = rewrite builtin layout in
+  let rw_list = List.map rw in
+  let rw_body b = compile_body (rw_list b) in
+  match e with
+  | Var name ->
+      (match Hashtbl.find_opt layout.slot_index name with
+       | Some i -> Slot (i, name)
+       | None -> e)
+  | Set (name, ty, v) ->
+      let appends = match ty, v with
+        | (None | Some Types.TString), Call (f, Var x :: _ :: _) when x = name ->
+            (match builtin f with Some (_, "add") -> true | _ -> false)
+        | _ -> false
+      in
+      let v' = rw v in
+      (match Hashtbl.find_opt layout.slot_index name, v with
+       | Some i, Call (_, _ :: pieces) when appends ->
+           AppendSlot (i, name, rw_list pieces, SetSlot (i, name, ty, v'))
+       | Some i, _ -> SetSlot (i, name, ty, v')
+       | None, _ -> Set (name, ty, v'))
+  | Call ("fmt", LitString t :: args) -> Fmt (t, compile_fmt t, rw_list args)
+  | Call (f, args) ->
+      (match builtin f, args with
+       | Some (id, canonical), [a; b] ->
+           (match arith_op_of_builtin canonical with
+            | Some op -> arith op id canonical (rw a) (rw b)
+            | None -> call_builtin id canonical [rw a; rw b])
+       | Some (id, canonical), _ -> call_builtin id canonical (rw_list args)
+       | None, _ -> Call (f, rw_list args))
+  | If (c, t, el) -> If (rw c, rw_body t, Option.map rw_body el)
+  | While (c, b) -> While (rw c, rw_body b)
+  | Loop b -> Loop (rw_body b)
+  | And (a, b) -> And (rw a, rw b)
+  | Or (a, b) -> Or (rw a, rw b)
+  | For (v, s, en, b) ->
+      (match Hashtbl.find_opt layout.slot_index v with
+       | Some i -> ForSlot (i, v, rw s, rw en, rw_body b)
+       | None -> For (v, rw s, rw en, rw_body b))
+  | ForEach (v, ty, c, b) -> ForEach (v, ty, rw c, rw_body b)
+  | Return e -> Return (rw e)
+  | IfNot (c, l) -> IfNot (rw c, l)
+  | Try (b, v, ty, cb) -> Try (rw_body b, v, ty, rw_body cb)
+  | Cond branches -> Cond (List.map (fun (c, b) -> (rw c, rw_body b)) branches)
+  | LitArray es -> LitArray (rw_list es)
+  | LitMap pairs -> LitMap (List.map (fun (k, v) -> (rw k, rw v)) pairs)
+  | Lambda (params, body) -> resolve_lambda builtin layout params body
+  | _ -> e
+
+(* Give a lambda its own frame: params first, then captured names, then
+   its remaining locals. [enclosing] is the layout of the body the lambda
+   appears in. *)
+and resolve_lambda builtin enclosing params body =
+  let captured = free_names ~builtin ~enclosing params body in
+  let lambda_layout = make_layout (collect_locals (params @ captured) body) in
+  let captures = Array.of_list (List.map (fun name ->
+    (Hashtbl.find lambda_layout.slot_index name,
+     match Hashtbl.find_opt enclosing.slot_index name with
+     | Some j -> j
+     | None -> -1)
+  ) captured) in
+  Closure (params, compile_body (List.map (rewrite builtin lambda_layout) body),
+           lambda_layout, captures)
+
+(* Resolve one function: returns the rewritten body and its frame layout. *)
+let resolve_function ~builtin (func : func_def) =
+  let params = List.map (fun p -> p.param_name) func.func_params in
+  let layout = make_layout (collect_locals params func.func_body) in
+  (compile_body (List.map (rewrite builtin layout) func.func_body), layout)
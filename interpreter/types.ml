@@ -31,3 +31,63 @@ let rec string_of_type = function
   | TFunction (params, ret) ->
       let params_str = String.concat ", " (List.map string_of_type params) in
       "(" ^ params_str ^ " -> " ^ string_of_type ret ^ ")"
+
+(* Decimal values. DSmall (m, k) is m / 10^k, written with exactly k
+   fractional digits, for any value spelled [-]digits[.digits] in at most
+   decimal_small_digits digits; DBig keeps every other value as its digit
+   string, for the digit-string arithmetic in the interpreter. A string
+   maps to exactly one of the two, so both print back as they were read. *)
+type decimal =
+  | DSmall of int * int
+  | DBig of string
+
+let decimal_small_digits = 18
+
+let pow10 =
+  let a = Array.make (decimal_small_digits + 1) 1 in
+  for i = 1 to decimal_small_digits do a.(i) <- a.(i - 1) * 10 done;
+  a
+
+(* (mantissa, scale) of a [-]digits[.digits] spelling, in one pass. *)
+let decimal_small s =
+  let n = String.length s in
+  let start = if n > 0 && s.[0] = '-' then 1 else 0 in
+  let is_digit i = i < n && s.[i] >= '0' && s.[i] <= '9' in
+  let rec int_part i acc digits =
+    if is_digit i then
+      if digits >= decimal_small_digits then None
+      else int_part (i + 1) (acc * 10 + Char.code s.[i] - 48) (digits + 1)
+    else if i = start then None
+    else if i = n then Some (acc, 0)
+    else if s.[i] = '.' && is_digit (i + 1) then frac_part (i + 1) acc digits 0
+    else None
+  and frac_part i acc digits scale =
+    if i = n then Some (acc, scale)
+    else if is_digit i && digits < decimal_small_digits then
+      frac_part (i + 1) (acc * 10 + Char.code s.[i] - 48) (digits + 1) (scale + 1)
+    else None
+  in
+  match int_part start 0 0 with
+  | Some (m, k) -> Some ((if start = 1 then - m else m), k)
+  | None -> None
+
+(* m / 10^k with exactly k fractional digits. *)
+let decimal_spell m k =
+  if k = 0 then string_of_int m
+  else begin
+    let digits = string_of_int (abs m) in
+    let d = String.length digits in
+    let int_part, frac_part =
+      if d <= k then ("0", String.make (k - d) '0' ^ digits)
+      else (String.sub digits 0 (d - k), String.sub digits (d - k) k) in
+    (if m < 0 then "-" else "") ^ int_part ^ "." ^ frac_part
+  end
+
+let decimal_of_string s =
+  match decimal_small s with
+  | Some (m, k) when decimal_spell m k = s -> DSmall (m, k)
+  | _ -> DBig s
+
+let string_of_decimal = function
+  | DSmall (m, k) -> decimal_spell m k
+  | DBig s -> s
@@ -72,51 +72,115 @@ let lint_paren_balance (src : string) : (unit, int * int * string) result =
 
 
 (* --lint mode: parse-only, returns 0 on success or detailed diagnostic. *)
+let lint_source content =
+  (* Step 1: paren-balance scan with line:col reporting *)
+  match lint_paren_balance content with
+  | Error (line, col, msg) ->
+      Printf.eprintf "Lint error at line %d, col %d: %s\n" line col msg;
+      1
+  | Ok () ->
+      (* Step 2: full parse (catches non-paren syntax errors) *)
+      (try
+        let tokens = tokenize content in
+        let _ = parse tokens in
+        print_endline "OK";
+        0
+      with
+      | LexError msg -> Printf.eprintf "Lex error: %s\n" msg; 1
+      | ParseError msg -> Printf.eprintf "Parse error: %s\n" msg; 1
+      | e ->
+          Printf.eprintf "Unexpected lint error: %s\n"
+            (Printexc.to_string e);
+          1)
+
 let lint_file filename =
   try
     let ic = open_in filename in
     let content = really_input_string ic (in_channel_length ic) in
     close_in ic;
-    (* Step 1: paren-balance scan with line:col reporting *)
-    (match lint_paren_balance content with
-     | Error (line, col, msg) ->
-         Printf.eprintf "Lint error at line %d, col %d: %s\n" line col msg;
-         1
-     | Ok () ->
-         (* Step 2: full parse (catches non-paren syntax errors) *)
-         (try
-           let tokens = tokenize content in
-           let _ = parse tokens in
-           print_endline "OK";
-           0
-         with
-         | LexError msg -> Printf.eprintf "Lex error: %s\n" msg; 1
-         | ParseError msg -> Printf.eprintf "Parse error: %s\n" msg; 1
-         | e ->
-             Printf.eprintf "Unexpected lint error: %s\n"
-               (Printexc.to_string e);
-             1))
+    lint_source content
   with Sys_error msg ->
     Printf.eprintf "Error reading file: %s\n" msg;
     1
 
 
-let run_file filename =
-  try
-    (* Set source file path for stdlib resolution *)
-    Interpreter.source_file_path := filename;
+(* --stats: a per-run resource report, one JSON object.
 
-    (* Read the file *)
-    let ic = open_in filename in
-    let content = really_input_string ic (in_channel_length ic) in
-    close_in ic;
+     sigil-run --stats [--stats-fd N] <file.sigil> [args...]
+
+   It is written when the program exits, to stderr or to fd N. It holds
+   times for parse, load (prelude, imports, registration) and eval;
+   peak heap words and peak RSS; GC counts and allocated words; and file
+   and socket read / write calls and bytes (see Interpreter.io_count).
+   --serve --stats adds the same object to every response. *)
+let parse_seconds = ref 0.0
+let exec_start = ref 0.0 and exec_end = ref 0.0
+let stats_base = ref (Gc.quick_stat ())
 
+(* Start a fresh report: a forked --serve child inherits the server's
+   counters. *)
+let stats_reset () =
+  parse_seconds := 0.0;
+  exec_start := 0.0;
+  exec_end := 0.0;
+  Interpreter.load_seconds := 0.0;
+  List.iter (fun c -> Atomic.set c 0) Interpreter.[
+    io_file_reads; io_file_writes; io_socket_reads; io_socket_writes;
+    io_bytes_read; io_bytes_written ];
+  stats_base := Gc.quick_stat ()
+
+let peak_rss_kb () =
+  match open_in "/proc/self/status" with
+  | exception Sys_error _ -> -1
+  | ic ->
+      let rec scan () =
+        match input_line ic with
+        | line when String.starts_with ~prefix:"VmHWM:" line ->
+            Scanf.sscanf line "VmHWM: %d" Fun.id
+        | _ -> scan ()
+        | exception End_of_file -> -1
+      in
+      let kb = scan () in
+      close_in ic;
+      kb
+
+let stats_json () =
+  let st = Gc.quick_stat () and base = !stats_base in
+  let exec =
+    if !exec_start = 0.0 then 0.0
+    else (if !exec_end > 0.0 then !exec_end else Unix.gettimeofday ()) -. !exec_start
+  in
+  let load = min exec !Interpreter.load_seconds in
+  let allocated s = s.Gc.minor_words +. s.Gc.major_words -. s.Gc.promoted_words in
+  Printf.sprintf
+    "{\"parse_ms\": %.3f, \"load_ms\": %.3f, \"eval_ms\": %.3f, \
+     \"peak_heap_words\": %d, \"peak_rss_kb\": %d, \
+     \"minor_gcs\": %d, \"major_gcs\": %d, \"allocated_words\": %.0f, \
+     \"file_reads\": %d, \"file_writes\": %d, \
+     \"socket_reads\": %d, \"socket_writes\": %d, \
+     \"bytes_read\": %d, \"bytes_written\": %d}"
+    (!parse_seconds *. 1000.0) (load *. 1000.0) ((exec -. load) *. 1000.0)
+    st.Gc.top_heap_words (peak_rss_kb ())
+    (st.Gc.minor_collections - base.Gc.minor_collections)
+    (st.Gc.major_collections - base.Gc.major_collections)
+    (allocated st -. allocated base)
+    (Atomic.get Interpreter.io_file_reads) (Atomic.get Interpreter.io_file_writes)
+    (Atomic.get Interpreter.io_socket_reads) (Atomic.get Interpreter.io_socket_writes)
+    (Atomic.get Interpreter.io_bytes_read) (Atomic.get Interpreter.io_bytes_written)
+
+let run_source content =
+  try
     (* Lex and Parse *)
+    let t0 = Unix.gettimeofday () in
     let tokens = tokenize content in
     let module_def = parse tokens in
+    parse_seconds := Unix.gettimeofday () -. t0;
 
-    (* Execute *)
+    (* Execute. exec_end stays unset if the program leaves through (exit);
+       the report then times eval up to the moment it is written. *)
+    exec_start := Unix.gettimeofday ();
     let exit_code = execute_module module_def in
+    exec_end := Unix.gettimeofday ();
     (* Diagnostic: program completed normally without writing any output.
        Almost always a model-misuse symptom on the agent harness — the most
        common cause is (for-each x ... (argv)) where (argv) returned a
@@ -125,7 +189,7 @@ let run_file filename =
        eval_real_tooling.py and the MCP server) to keep test runs quiet. *)
     if exit_code = 0
        && Interpreter.diagnose_enabled ()
-       && not !Interpreter.output_emitted then
+       && not (Atomic.get Interpreter.output_emitted) then
       Printf.eprintf
         "Warning: program completed without writing any output. Common \
          causes: (a) (argv) returned a 1-element list when you expected \
@@ -135,31 +199,565 @@ let run_file filename =
     exit_code
   with
   | Sys_error msg ->
+      Interpreter.flush_output ();
       Printf.eprintf "Error reading file: %s\n" msg;
       1
   | LexError msg ->
+      Interpreter.flush_output ();
       Printf.eprintf "Lexer error: %s\n" msg;
       1
   | ParseError msg ->
+      Interpreter.flush_output ();
       Printf.eprintf "Parse error: %s\n" msg;
       1
   | RuntimeError msg ->
+      Interpreter.flush_output ();
       Printf.eprintf "Runtime error: %s\n" msg;
       1
   | e ->
+      Interpreter.flush_output ();
       Printf.eprintf "Unexpected error: %s\n" (Printexc.to_string e);
       Printexc.print_backtrace stderr;
       1
 
+let run_file filename =
+  try
+    (* Set source file path for stdlib resolution *)
+    Atomic.set Interpreter.source_file_path filename;
+
+    (* Read the file *)
+    let ic = open_in filename in
+    let content = really_input_string ic (in_channel_length ic) in
+    close_in ic;
+    run_source content
+  with Sys_error msg ->
+    Printf.eprintf "Error reading file: %s\n" msg;
+    1
+
+external fd_of_int : int -> Unix.file_descr = "%identity"
+
+let stats_file ~fd filename args =
+  Interpreter.script_args := args;
+  stats_reset ();
+  at_exit (fun () ->
+    Interpreter.flush_output ();
+    let report = stats_json () ^ "\n" in
+    try ignore (Unix.write_substring fd report 0 (String.length report))
+    with Unix.Unix_error (e, _, _) ->
+      Printf.eprintf "--stats: %s\n" (Unix.error_message e));
+  run_file filename
+
+(* --profile mode: run with the interpreter's counting profiler on.
+
+     sigil-run --profile [--profile-out FILE] <file.sigil> [args...]
+
+   On exit, including through (exit), a table of calls, inclusive and
+   exclusive wall time and allocated words per user function and builtin
+   goes to stderr, sorted by exclusive time. Collapsed stacks for
+   flamegraph.pl / speedscope go to FILE (default <file>.folded in the
+   current directory). *)
+let profile_file ~folded filename args =
+  Interpreter.script_args := args;
+  Interpreter.enable_profiler ();
+  at_exit (fun () ->
+    Interpreter.flush_output ();
+    Interpreter.write_profile stderr folded);
+  run_file filename
+
+(* --serve mode: a long-lived runner for harnesses that would otherwise
+   spawn sigil-run once per candidate program.
+
+     sigil-run --serve [--timeout SECONDS] [--max-heap-mb MB] [--stats]
+
+   Requests arrive on stdin and responses go to stdout, every field
+   framed as a netstring ("<len>:<bytes>,"). A request is
+
+     mode ("run" | "lint")  source  stdin  argc  arg_1 ... arg_argc
+
+   and its response is
+
+     exit_code  stdout  stderr  elapsed_ms
+
+   plus, with --stats, a fifth field holding the child's --stats JSON
+   ("" if it was killed before it could report).
+
+   The prelude is parsed once at startup. Each request then runs in a
+   forked child, so it starts from the warm parsed-module state but gets
+   its own global env and can't disturb the server. A child still running
+   at the wall-clock limit is killed (exit code 124); one whose major heap
+   grows past the heap limit stops itself (exit code 137). The server
+   exits cleanly at EOF on stdin. *)
+
+let read_netstring ic =
+  let rec read_len acc =
+    match input_char ic with
+    | ':' -> acc
+    | '0'..'9' as c -> read_len (acc * 10 + Char.code c - Char.code '0')
+    | c -> failwith (Printf.sprintf "bad netstring length byte %C" c)
+  in
+  let n = read_len 0 in
+  let s = really_input_string ic n in
+  if input_char ic <> ',' then failwith "netstring missing trailing ','";
+  s
+
+let write_netstring oc s =
+  Printf.fprintf oc "%d:%s," (String.length s) s
+
+(* Runs in the forked child; never returns. *)
+let serve_child ~server_fds ~max_heap_words mode source args stdin_fd out_w err_w stats_w =
+  List.iter Unix.close server_fds;
+  stats_reset ();
+  Unix.dup2 stdin_fd Unix.stdin;
+  Unix.dup2 out_w Unix.stdout;
+  Unix.dup2 err_w Unix.stderr;
+  List.iter Unix.close [stdin_fd; out_w; err_w];
+  ignore (Gc.create_alarm (fun () ->
+    if (Gc.quick_stat ()).Gc.heap_words > max_heap_words then begin
+      prerr_endline "Error: heap limit exceeded";
+      Unix._exit 137
+    end));
+  (* A program that calls (exit) leaves through Stdlib.exit, which skips
+     the end of this function but runs at_exit handlers, so the output
+     flush and the stats report are done from one and only once. *)
+  let finished = ref false in
+  let finish () =
+    if not !finished then begin
+      finished := true;
+      (try Interpreter.flush_output (); flush stdout; flush stderr with _ -> ());
+      match stats_w with
+      | Some fd ->
+          let report = stats_json () in
+          (try ignore (Unix.write_substring fd report 0 (String.length report))
+           with Unix.Unix_error _ -> ())
+      | None -> ()
+    end
+  in
+  at_exit finish;
+  let code =
+    try
+      match mode with
+      | "run" -> Interpreter.script_args := args; run_source source
+      | "lint" -> lint_source source
+      | m -> Printf.eprintf "Unknown request mode: %s\n" m; 2
+    with e ->
+      Printf.eprintf "Unexpected error: %s\n" (Printexc.to_string e);
+      1
+  in
+  finish ();
+  Unix._exit code
+
+(* Drain the child's stdout / stderr (and stats pipe) until all close or
+   the deadline passes; returns (stdout, stderr, stats, timed_out). *)
+let collect_output ~deadline out_r err_r stats_r =
+  let out = Buffer.create 4096 and err = Buffer.create 256 and stats = Buffer.create 512 in
+  let chunk = Bytes.create 65536 in
+  let open_fds = ref (out_r :: err_r :: Option.to_list stats_r) in
+  let timed_out = ref false in
+  while !open_fds <> [] && not !timed_out do
+    let remaining = deadline -. Unix.gettimeofday () in
+    if remaining <= 0.0 then timed_out := true
+    else begin
+      let ready =
+        try let (r, _, _) = Unix.select !open_fds [] [] remaining in r
+        with Unix.Unix_error (Unix.EINTR, _, _) -> []
+      in
+      List.iter (fun fd ->
+        let n = Unix.read fd chunk 0 (Bytes.length chunk) in
+        if n = 0 then begin
+          Unix.close fd;
+          open_fds := List.filter (fun x -> x <> fd) !open_fds
+        end else
+          Buffer.add_subbytes
+            (if fd = out_r then out else if fd = err_r then err else stats) chunk 0 n
+      ) ready
+    end
+  done;
+  List.iter Unix.close !open_fds;
+  (Buffer.contents out, Buffer.contents err, Buffer.contents stats, !timed_out)
+
+let rec waitpid_no_eintr pid =
+  try snd (Unix.waitpid [] pid)
+  with Unix.Unix_error (Unix.EINTR, _, _) -> waitpid_no_eintr pid
+
+let serve_request ~server_fds ~timeout ~max_heap_words ~stats mode source stdin_data args =
+  let stdin_path = Filename.temp_file "sigil-serve" ".stdin" in
+  let oc = open_out_bin stdin_path in
+  output_string oc stdin_data;
+  close_out oc;
+  let stdin_fd = Unix.openfile stdin_path [Unix.O_RDONLY] 0 in
+  Sys.remove stdin_path;
+  let (out_r, out_w) = Unix.pipe () and (err_r, err_w) = Unix.pipe () in
+  let stats_pipe = if stats then Some (Unix.pipe ()) else None in
+  let start = Unix.gettimeofday () in
+  flush stdout; flush stderr;
+  match Unix.fork () with
+  | 0 ->
+      Unix.close out_r; Unix.close err_r;
+      Option.iter (fun (r, _) -> Unix.close r) stats_pipe;
+      serve_child ~server_fds ~max_heap_words mode source args stdin_fd out_w err_w
+        (Option.map snd stats_pipe)
+  | pid ->
+      List.iter Unix.close [stdin_fd; out_w; err_w];
+      Option.iter (fun (_, w) -> Unix.close w) stats_pipe;
+      let (out, err, stats, timed_out) =
+        collect_output ~deadline:(start +. timeout) out_r err_r (Option.map fst stats_pipe) in
+      if timed_out then (try Unix.kill pid Sys.sigkill with Unix.Unix_error _ -> ());
+      let status = waitpid_no_eintr pid in
+      let elapsed_ms = (Unix.gettimeofday () -. start) *. 1000.0 in
+      let (code, err) =
+        if timed_out then
+          (124, err ^ Printf.sprintf "Error: timed out after %.1fs\n" timeout)
+        else match status with
+          | Unix.WEXITED n -> (n, err)
+          | Unix.WSIGNALED _ -> (1, err ^ "Error: terminated by a signal\n")
+          | Unix.WSTOPPED _ -> (1, err)
+      in
+      (code, out, err, stats, elapsed_ms)
+
+let serve ~timeout ~max_heap_mb ~stats =
+  let max_heap_words = max_heap_mb * 1024 * 1024 / (Sys.word_size / 8) in
+  (* Warm the parsed-module memo so every forked child inherits it. *)
+  ignore (Interpreter.load_module "prelude");
+  (* Talk the protocol over private copies of fds 0 / 1, and point fd 0 at
+     /dev/null, so the stdin / stdout channels a child inherits hold no
+     buffered protocol bytes. *)
+  let req_fd = Unix.dup Unix.stdin and resp_fd = Unix.dup Unix.stdout in
+  Unix.set_close_on_exec req_fd;
+  Unix.set_close_on_exec resp_fd;
+  let devnull = Unix.openfile "/dev/null" [Unix.O_RDONLY] 0 in
+  Unix.dup2 devnull Unix.stdin;
+  Unix.close devnull;
+  let server_fds = [req_fd; resp_fd] in
+  let ic = Unix.in_channel_of_descr req_fd in
+  let oc = Unix.out_channel_of_descr resp_fd in
+  set_binary_mode_in ic true;
+  set_binary_mode_out oc true;
+  let rec loop () =
+    match read_netstring ic with
+    | exception End_of_file -> 0
+    | mode ->
+        let source = read_netstring ic in
+        let stdin_data = read_netstring ic in
+        let argc = int_of_string (read_netstring ic) in
+        let args = List.init argc (fun _ -> read_netstring ic) in
+        let (code, out, err, report, elapsed_ms) =
+          serve_request ~server_fds ~timeout ~max_heap_words ~stats
+            mode source stdin_data args in
+        write_netstring oc (string_of_int code);
+        write_netstring oc out;
+        write_netstring oc err;
+        write_netstring oc (Printf.sprintf "%.3f" elapsed_ms);
+        if stats then write_netstring oc report;
+        flush oc;
+        loop ()
+  in
+  try loop ()
+  with Failure msg ->
+    Printf.eprintf "serve: malformed request: %s\n" msg;
+    2
+
+(* --test mode: run test-spec files on a pool of worker processes.
+
+     sigil-run --test [--jobs N] [--slow-ms MS] [--timeout SECONDS]
+                      [--json FILE] <dir | file.sigil>...
+
+   A directory stands for the .sigil files under it that hold a
+   test-spec. The prelude is parsed once, before any worker forks, and
+   every file then runs in a child of its own, as --serve requests do:
+   warm parsed-module state, a fresh global env, and a file that hangs
+   or crashes can't take the others down. Each case's result comes back
+   over a pipe as it finishes, with its wall time. Cases slower than MS
+   (default 500) are flagged; a file still running after SECONDS
+   (default 60) is killed. N defaults to SIGIL_THREADS or the core
+   count. A report goes to stdout as files finish, and with --json a
+   summary to FILE; the exit code is 1 if any file failed. *)
+
+type test_file = {
+  tf_path : string;
+  mutable tf_status : string;  (* "pass" | "fail" | "error" | "timeout" *)
+  mutable tf_cases : Interpreter.test_outcome list;
+  mutable tf_seconds : float;
+  mutable tf_output : string;  (* the file's stdout / stderr, kept unless it passed *)
+}
+
+type test_worker = {
+  w_file : test_file;
+  w_pid : int;
+  w_fd : Unix.file_descr;  (* read end of the results pipe *)
+  w_buf : Buffer.t;
+  w_out : string;          (* temp file holding the child's output *)
+  w_start : float;
+}
+
+(* The files a --test argument names: a file as given, a directory's
+   .sigil files that hold a test-spec, recursively, in name order. *)
+let test_files_of arg =
+  let rec under path =
+    if Sys.is_directory path then begin
+      let names = Sys.readdir path in
+      Array.sort compare names;
+      List.concat_map (fun n -> under (Filename.concat path n)) (Array.to_list names)
+    end else if Filename.check_suffix path ".sigil" then begin
+      let ic = open_in_bin path in
+      let src = really_input_string ic (in_channel_length ic) in
+      close_in ic;
+      if Interpreter.find_sub src "(test-spec" 0 >= 0 then [path] else []
+    end else []
+  in
+  if Sys.file_exists arg && Sys.is_directory arg then under arg else [arg]
+
+(* Runs in the forked child; never returns. *)
+let test_child path result_w out_fd =
+  let devnull = Unix.openfile "/dev/null" [Unix.O_RDONLY] 0 in
+  Unix.dup2 devnull Unix.stdin;
+  Unix.dup2 out_fd Unix.stdout;
+  Unix.dup2 out_fd Unix.stderr;
+  List.iter Unix.close [devnull; out_fd];
+  (* Not inherited by processes the tests start, which would hold the
+     pipe open past this child's exit. *)
+  Unix.set_close_on_exec result_w;
+  let oc = Unix.out_channel_of_descr result_w in
+  Interpreter.test_observer := (fun o ->
+    List.iter (write_netstring oc)
+      [ o.Interpreter.outcome_test; o.outcome_case;
+        (if o.outcome_passed then "1" else "0");
+        Printf.sprintf "%.6f" o.outcome_seconds; o.outcome_detail ];
+    flush oc);
+  Interpreter.script_args := [];
+  let code = run_file path in
+  Interpreter.flush_output ();
+  (try flush stdout; flush stderr; flush oc with _ -> ());
+  Unix._exit code
+
+(* The complete records in a worker's results stream; a record cut off
+   by a kill is dropped. *)
+let test_outcomes_of data =
+  let n = String.length data in
+  let field pos =
+    match String.index_from_opt data pos ':' with
+    | None -> None
+    | Some colon ->
+        (match int_of_string_opt (String.sub data pos (colon - pos)) with
+         | Some len when colon + len + 2 <= n ->
+             Some (String.sub data (colon + 1) len, colon + len + 2)
+         | _ -> None)
+  in
+  let rec records pos acc =
+    let ( let* ) = Option.bind in
+    let record =
+      let* (test, p) = field pos in
+      let* (case, p) = field p in
+      let* (ok, p) = field p in
+      let* (secs, p) = field p in
+      let* (detail, p) = field p in
+      Some ({ Interpreter.outcome_test = test; outcome_case = case;
+              outcome_passed = ok = "1";
+              outcome_seconds = Option.value (float_of_string_opt secs) ~default:0.0;
+              outcome_detail = detail }, p)
+    in
+    match record with
+    | Some (o, p) -> records p (o :: acc)
+    | None -> List.rev acc
+  in
+  records 0 []
+
+let spawn_test_worker tf =
+  let (r, w) = Unix.pipe () in
+  let out_path = Filename.temp_file "sigil-test" ".out" in
+  let out_fd = Unix.openfile out_path [Unix.O_WRONLY; Unix.O_TRUNC] 0o600 in
+  flush stdout; flush stderr;
+  match Unix.fork () with
+  | 0 -> Unix.close r; test_child tf.tf_path w out_fd
+  | pid ->
+      Unix.close w;
+      Unix.close out_fd;
+      { w_file = tf; w_pid = pid; w_fd = r; w_buf = Buffer.create 1024;
+        w_out = out_path; w_start = Unix.gettimeofday () }
+
+let read_text_file path =
+  try
+    let ic = open_in_bin path in
+    let s = really_input_string ic (in_channel_length ic) in
+    close_in ic;
+    s
+  with Sys_error _ -> ""
+
+let finish_test_worker ~timed_out w =
+  if timed_out then (try Unix.kill w.w_pid Sys.sigkill with Unix.Unix_error _ -> ());
+  Unix.close w.w_fd;
+  let status = waitpid_no_eintr w.w_pid in
+  let tf = w.w_file in
+  tf.tf_seconds <- Unix.gettimeofday () -. w.w_start;
+  tf.tf_cases <- test_outcomes_of (Buffer.contents w.w_buf);
+  tf.tf_status <-
+    if timed_out then "timeout"
+    else if List.exists (fun o -> not o.Interpreter.outcome_passed) tf.tf_cases then "fail"
+    else (match status with Unix.WEXITED 0 -> "pass" | _ -> "error");
+  if tf.tf_status <> "pass" then tf.tf_output <- read_text_file w.w_out;
+  (try Sys.remove w.w_out with Sys_error _ -> ())
+
+let print_test_file ~slow tf =
+  Printf.printf "%-7s %s  (%d cases, %.1f ms)\n" (String.uppercase_ascii tf.tf_status)
+    tf.tf_path (List.length tf.tf_cases) (tf.tf_seconds *. 1000.0);
+  List.iter (fun (o : Interpreter.test_outcome) ->
+    if not o.outcome_passed then
+      Printf.printf "    ✗ %s: %s — %s\n" o.outcome_test o.outcome_case o.outcome_detail
+    else if o.outcome_seconds > slow then
+      Printf.printf "    slow %s: %s (%.1f ms)\n" o.outcome_test o.outcome_case
+        (o.outcome_seconds *. 1000.0)
+  ) tf.tf_cases;
+  if tf.tf_status = "error" || tf.tf_status = "timeout" then begin
+    (* The last lines of its output: where a load error or a crash shows. *)
+    let lines = String.split_on_char '\n' (String.trim tf.tf_output) in
+    let keep = List.filteri (fun i _ -> i >= List.length lines - 10) lines in
+    List.iter (fun l -> if l <> "" then Printf.printf "    | %s\n" l) keep
+  end;
+  flush stdout
+
+let json_string s =
+  let b = Buffer.create (String.length s + 2) in
+  Interpreter.json_escape_into b s;
+  Buffer.contents b
+
+let write_test_json path ~slow ~jobs ~wall files =
+  let oc = open_out_bin path in
+  let cases = List.concat_map (fun tf -> tf.tf_cases) files in
+  let count p l = List.length (List.filter p l) in
+  Printf.fprintf oc
+    "{\"files\": %d, \"failed_files\": %d, \"cases\": %d, \"failed_cases\": %d, \
+     \"slow_cases\": %d, \"slow_ms\": %.1f, \"jobs\": %d, \"wall_ms\": %.3f,\n \"results\": [\n"
+    (List.length files) (count (fun tf -> tf.tf_status <> "pass") files)
+    (List.length cases) (count (fun o -> not o.Interpreter.outcome_passed) cases)
+    (count (fun o -> o.Interpreter.outcome_seconds > slow) cases)
+    (slow *. 1000.0) jobs (wall *. 1000.0);
+  List.iteri (fun i tf ->
+    Printf.fprintf oc "  {\"file\": %s, \"status\": %S, \"ms\": %.3f, \"output\": %s, \"cases\": ["
+      (json_string tf.tf_path) tf.tf_status (tf.tf_seconds *. 1000.0) (json_string tf.tf_output);
+    List.iteri (fun j (o : Interpreter.test_outcome) ->
+      Printf.fprintf oc "%s\n    {\"test\": %s, \"case\": %s, \"passed\": %b, \"ms\": %.3f, \
+                         \"slow\": %b, \"detail\": %s}"
+        (if j > 0 then "," else "")
+        (json_string o.outcome_test) (json_string o.outcome_case) o.outcome_passed
+        (o.outcome_seconds *. 1000.0) (o.outcome_seconds > slow) (json_string o.outcome_detail)
+    ) tf.tf_cases;
+    Printf.fprintf oc "]}%s\n" (if i < List.length files - 1 then "," else "")
+  ) files;
+  Printf.fprintf oc " ]}\n";
+  close_out oc
+
+let run_tests ~jobs ~slow_ms ~timeout ~json paths =
+  let files = List.map (fun path ->
+    { tf_path = path; tf_status = "pass"; tf_cases = []; tf_seconds = 0.0; tf_output = "" }
+  ) (List.concat_map test_files_of paths) in
+  let slow = slow_ms /. 1000.0 in
+  let start = Unix.gettimeofday () in
+  (* Warm the parsed-module memo so every worker inherits it. *)
+  ignore (Interpreter.load_module "prelude");
+  let pending = Queue.of_seq (List.to_seq files) in
+  let running = ref [] in
+  let chunk = Bytes.create 65536 in
+  let finish ~timed_out w =
+    running := List.filter (fun x -> x != w) !running;
+    finish_test_worker ~timed_out w;
+    print_test_file ~slow w.w_file
+  in
+  while not (Queue.is_empty pending) || !running <> [] do
+    while List.length !running < jobs && not (Queue.is_empty pending) do
+      running := spawn_test_worker (Queue.pop pending) :: !running
+    done;
+    let now = Unix.gettimeofday () in
+    List.iter (fun w -> if now -. w.w_start > timeout then finish ~timed_out:true w) !running;
+    let wait = List.fold_left (fun t w -> min t (w.w_start +. timeout -. now)) 1.0 !running in
+    let ready =
+      if !running = [] then []
+      else try let (r, _, _) = Unix.select (List.map (fun w -> w.w_fd) !running) [] [] (max 0.0 wait) in r
+      with Unix.Unix_error (Unix.EINTR, _, _) -> []
+    in
+    List.iter (fun w ->
+      if List.mem w.w_fd ready then begin
+        let n = Unix.read w.w_fd chunk 0 (Bytes.length chunk) in
+        if n = 0 then finish ~timed_out:false w
+        else Buffer.add_subbytes w.w_buf chunk 0 n
+      end
+    ) !running
+  done;
+  let wall = Unix.gettimeofday () -. start in
+  let cases = List.concat_map (fun tf -> tf.tf_cases) files in
+  let count p l = List.length (List.filter p l) in
+  let failed_files = count (fun tf -> tf.tf_status <> "pass") files in
+  Printf.printf "\n%d files (%d failed), %d cases (%d failed, %d slow over %.0f ms) \
+                 in %.2f s on %d workers\n"
+    (List.length files) failed_files (List.length cases)
+    (count (fun o -> not o.Interpreter.outcome_passed) cases)
+    (count (fun o -> o.Interpreter.outcome_seconds > slow) cases)
+    slow_ms wall jobs;
+  if json <> "" then write_test_json json ~slow ~jobs ~wall files;
+  if failed_files > 0 then 1 else 0
+
 let () =
   if Array.length Sys.argv < 2 then begin
     Printf.eprintf "Usage: %s [--lint] <file.sigil> [args...]\n" Sys.argv.(0);
     Printf.eprintf "  --lint  Parse-only check with line:col paren diagnostics\n";
+    Printf.eprintf "  --profile [--profile-out FILE] <file.sigil> [args...]\n";
+    Printf.eprintf "          Run, then report per-function time and allocation\n";
+    Printf.eprintf "  --stats [--stats-fd N] <file.sigil> [args...]\n";
+    Printf.eprintf "          Run, then write a JSON resource report to stderr or fd N\n";
+    Printf.eprintf "  --test [--jobs N] [--slow-ms MS] [--timeout SECONDS] [--json FILE] <dir|file>...\n";
+    Printf.eprintf "          Run test-spec files in parallel, with per-case timing\n";
+    Printf.eprintf "  --serve [--timeout SECONDS] [--max-heap-mb MB] [--stats]\n";
+    Printf.eprintf "          Serve netstring-framed run/lint requests on stdin\n";
     exit 1
   end;
 
   let exit_code =
-    if Sys.argv.(1) = "--lint" then begin
+    if Sys.argv.(1) = "--serve" then begin
+      let timeout = ref 10.0 and max_heap_mb = ref 1024 and stats = ref false in
+      let rec parse_opts = function
+        | "--timeout" :: v :: rest -> timeout := float_of_string v; parse_opts rest
+        | "--max-heap-mb" :: v :: rest -> max_heap_mb := int_of_string v; parse_opts rest
+        | "--stats" :: rest -> stats := true; parse_opts rest
+        | [] -> ()
+        | opt :: _ ->
+            Printf.eprintf "Unknown --serve option: %s\n" opt;
+            exit 1
+      in
+      parse_opts (List.tl (List.tl (Array.to_list Sys.argv)));
+      serve ~timeout:!timeout ~max_heap_mb:!max_heap_mb ~stats:!stats
+    end else if Sys.argv.(1) = "--test" then begin
+      let jobs = ref (Lazy.force Interpreter.worker_count) and slow_ms = ref 500.0 in
+      let timeout = ref 60.0 and json = ref "" and paths = ref [] in
+      let rec parse_opts = function
+        | "--jobs" :: v :: rest -> jobs := max 1 (int_of_string v); parse_opts rest
+        | "--slow-ms" :: v :: rest -> slow_ms := float_of_string v; parse_opts rest
+        | "--timeout" :: v :: rest -> timeout := float_of_string v; parse_opts rest
+        | "--json" :: v :: rest -> json := v; parse_opts rest
+        | path :: rest -> paths := !paths @ [path]; parse_opts rest
+        | [] -> ()
+      in
+      parse_opts (List.tl (List.tl (Array.to_list Sys.argv)));
+      if !paths = [] then begin
+        Printf.eprintf "Usage: %s --test [--jobs N] [--slow-ms MS] [--timeout SECONDS] \
+                        [--json FILE] <dir|file.sigil>...\n" Sys.argv.(0);
+        exit 1
+      end;
+      run_tests ~jobs:!jobs ~slow_ms:!slow_ms ~timeout:!timeout ~json:!json !paths
+    end else if Sys.argv.(1) = "--stats" then begin
+      match List.tl (List.tl (Array.to_list Sys.argv)) with
+      | "--stats-fd" :: n :: file :: args when int_of_string_opt n <> None ->
+          stats_file ~fd:(fd_of_int (int_of_string n)) file args
+      | file :: args when file <> "--stats-fd" -> stats_file ~fd:Unix.stderr file args
+      | _ ->
+          Printf.eprintf "Usage: %s --stats [--stats-fd N] <file.sigil> [args...]\n" Sys.argv.(0);
+          exit 1
+    end else if Sys.argv.(1) = "--profile" then begin
+      match List.tl (List.tl (Array.to_list Sys.argv)) with
+      | "--profile-out" :: folded :: file :: args -> profile_file ~folded file args
+      | file :: args when file <> "--profile-out" ->
+          profile_file ~folded:(Filename.basename file ^ ".folded") file args
+      | _ ->
+          Printf.eprintf "Usage: %s --profile [--profile-out FILE] <file.sigil> [args...]\n" Sys.argv.(0);
+          exit 1
+    end else if Sys.argv.(1) = "--lint" then begin
       if Array.length Sys.argv < 3 then begin
         Printf.eprintf "Usage: %s --lint <file.sigil>\n" Sys.argv.(0);
         exit 1